@@ -0,0 +1,538 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "p2pjs.h"
+
+// NOTE(Kevin): In-network aggregation of map-reduce results. The emitter
+// arranges the workers of a map-reduce in a forest with fan-in
+// P2PJS_AggregationFanIn, in the order they get their first chunk: the
+// first FanIn workers send to the emitter, worker p >= FanIn sends to
+// worker p / FanIn - 1, which got its first chunk earlier. An
+// aggregateJob message in front of every chunk names the parent.
+// Workers combine the results of their own chunks with the partials of
+// their children and send the combination up once nothing of the
+// map-reduce is left to run here and nothing arrived for
+// P2PJS_AggregationDelay. The emitter gets a few messages per subtree
+// instead of one per chunk.
+// Only the built-in reducers can be combined outside of wren; results of
+// Job.reduce() still go to the emitter one by one. A worker that can not
+// reach its parent sends to the emitter. If a parent fails, the emitter
+// runs the chunks below it again, their partials might be lost.
+
+#ifndef P2PJS_AggregationFanIn
+  // NOTE(Kevin): 0 turns aggregation off
+  #define P2PJS_AggregationFanIn 4
+#endif
+
+#ifndef P2PJS_AggregationDelay
+  #define P2PJS_AggregationDelay 0.05
+#endif
+
+#ifndef P2PJS_AggregationKeepTime
+  // NOTE(Kevin): Groups without anything to do are forgotten after this
+  #define P2PJS_AggregationKeepTime 60.0
+#endif
+
+// NOTE(Kevin): Emitter side, one per map-reduce
+typedef struct
+{
+    // NOTE(Kevin): Cookie of the first chunk, names the map-reduce
+    uint8 group[CookieLen];
+    int   firstIndex;
+    int   count;
+    int32 reducer;
+    // NOTE(Kevin): fds of the workers in the order they got their first
+    // chunk, -1 for workers that are gone
+    int *workerFds;
+    unsigned int workerCount;
+    unsigned int workerCapacity;
+} aggregation_tree;
+
+// NOTE(Kevin): Worker side, one per map-reduce we run chunks of or
+// receive partials for
+typedef struct
+{
+    uint8     group[CookieLen];
+    peer_info emitter;
+    // NOTE(Kevin): Empty ipaddr if we send to the emitter
+    peer_info parent;
+    int32     reducer;
+    // NOTE(Kevin): Chunks of this group that are queued or running here
+    int       pendingChunks;
+    double    lastUpdate;
+    uint32   *chunks;
+    uint32    chunkCount;
+    uint32    chunkCapacity;
+    double   *values;
+    uint32    valueCount;
+} aggregation_group;
+
+typedef struct
+{
+    uint8  cookie[CookieLen];
+    uint8  group[CookieLen];
+    uint32 chunkIndex;
+    // NOTE(Kevin): fd the chunk came from
+    int    emitterFd;
+} aggregated_chunk;
+
+global_variable aggregation_tree  *g_aggregationTrees;
+global_variable unsigned int       g_aggregationTreeCount;
+global_variable unsigned int       g_aggregationTreeCapacity;
+
+global_variable aggregation_group *g_aggregationGroups;
+global_variable unsigned int       g_aggregationGroupCount;
+global_variable unsigned int       g_aggregationGroupCapacity;
+
+global_variable aggregated_chunk  *g_aggregatedChunks;
+global_variable unsigned int       g_aggregatedChunkCount;
+global_variable unsigned int       g_aggregatedChunkCapacity;
+
+internal int FindEmittedJobIndex(uint8 cookie[CookieLen]);
+internal int StoreAggregatedResult(uint8 group[CookieLen], int32 reducer,
+                                   const uint32 *chunks, uint32 chunkCount,
+                                   const double *values, uint32 valueCount, int peerFd);
+
+internal bool32
+CanAggregate(int reducer)
+{
+    return P2PJS_AggregationFanIn > 0 &&
+           reducer >= 0 && reducer < kReducerCount && reducer != kReduceCustom;
+}
+
+internal bool32
+CombineValues(int32 reducer, double *acc, const double *values, uint32 valueCount)
+{
+    for (uint32 i = 0; i < valueCount; ++i)
+    {
+        switch (reducer)
+        {
+            case kReduceSum:
+            case kReduceCount:
+            case kReduceHistogram: acc[i] += values[i]; break;
+            case kReduceMin:       if (values[i] < acc[i]) acc[i] = values[i]; break;
+            case kReduceMax:       if (values[i] > acc[i]) acc[i] = values[i]; break;
+            default:               return 0;
+        }
+    }
+    return 1;
+}
+
+internal bool32
+IsOwnPeerInfo(const peer_info *info)
+{
+    return AreIPAddressesEqual(info->ipaddr, g_localIp) && strcmp(info->port, g_localPort) == 0;
+}
+
+//
+// Emitter side
+//
+
+internal int
+AddAggregationTree(uint8 group[CookieLen], int firstIndex, int count, int32 reducer)
+{
+    if (g_aggregationTreeCount == g_aggregationTreeCapacity)
+    {
+        unsigned int newCapacity = (g_aggregationTreeCapacity == 0) ? 8 : 2 * g_aggregationTreeCapacity;
+        aggregation_tree *t = realloc(g_aggregationTrees, sizeof(aggregation_tree) * newCapacity);
+        if (!t)
+            return kNoMemory;
+        g_aggregationTrees = t;
+        g_aggregationTreeCapacity = newCapacity;
+    }
+    aggregation_tree *tree = &g_aggregationTrees[g_aggregationTreeCount++];
+    memset(tree, 0, sizeof(*tree));
+    memcpy(tree->group, group, CookieLen);
+    tree->firstIndex = firstIndex;
+    tree->count      = count;
+    tree->reducer    = reducer;
+    return kSuccess;
+}
+
+internal aggregation_tree *
+FindAggregationTree(int jobIndex)
+{
+    for (unsigned int i = 0; i < g_aggregationTreeCount; ++i)
+    {
+        aggregation_tree *tree = &g_aggregationTrees[i];
+        if (jobIndex >= tree->firstIndex && jobIndex < tree->firstIndex + tree->count)
+            return tree;
+    }
+    return 0;
+}
+
+// NOTE(Kevin): Position of the worker in the tree, it is added if new
+internal int
+GetAggregationPosition(aggregation_tree *tree, int workerFd)
+{
+    for (unsigned int i = 0; i < tree->workerCount; ++i)
+    {
+        if (tree->workerFds[i] == workerFd)
+            return (int)i;
+    }
+    if (tree->workerCount == tree->workerCapacity)
+    {
+        unsigned int newCapacity = (tree->workerCapacity == 0) ? 8 : 2 * tree->workerCapacity;
+        int *t = realloc(tree->workerFds, sizeof(int) * newCapacity);
+        if (!t)
+            return -1;
+        tree->workerFds = t;
+        tree->workerCapacity = newCapacity;
+    }
+    tree->workerFds[tree->workerCount] = workerFd;
+    return (int)tree->workerCount++;
+}
+
+// NOTE(Kevin): Tells the worker where the result of the chunk goes. Sent
+// right before the chunk itself. Returns the fd of the parent, -1 if the
+// result comes to us.
+internal int
+AssignAggregator(int jobIndex, uint8 cookie[CookieLen], int workerFd)
+{
+    aggregation_tree *tree = FindAggregationTree(jobIndex);
+    if (!tree)
+        return -1;
+    peer_info emitter, parent;
+    memset(&emitter, 0, sizeof(emitter));
+    memset(&parent, 0, sizeof(parent));
+    snprintf(emitter.ipaddr, PeerIPLen, "%s", g_localIp);
+    snprintf(emitter.port, PeerPortLen, "%s", g_localPort);
+
+    int parentFd = -1;
+    int position = GetAggregationPosition(tree, workerFd);
+    if (position >= P2PJS_AggregationFanIn)
+    {
+        parentFd = tree->workerFds[position / P2PJS_AggregationFanIn - 1];
+        int parentId = -1;
+        for (peer_iterator peer = GetFirstPeer(); !IsBehindLastPeer(&peer); GetNextPeer(&peer))
+        {
+            if (peer.fd == parentFd)
+            {
+                parentId = peer.id;
+                break;
+            }
+        }
+        // NOTE(Kevin): Without a known port nobody can connect to it
+        if (parentId != -1 && GetPeerPort(parentId)[0] != '\0')
+        {
+            snprintf(parent.ipaddr, PeerIPLen, "%s", GetPeerIP(parentId));
+            snprintf(parent.port, PeerPortLen, "%s", GetPeerPort(parentId));
+        }
+        else
+        {
+            parentFd = -1;
+        }
+    }
+    if (SendAggregateJob(workerFd, cookie, tree->group, (uint32)(jobIndex - tree->firstIndex),
+                         tree->reducer, &parent, &emitter) != kSuccess)
+    {
+        LogWarning(kLogJobs, "Failed to send aggregateJob message for job %s.\n",
+                   CookieToTemporaryString(cookie));
+    }
+    return parentFd;
+}
+
+// NOTE(Kevin): The worker is gone, nobody gets it as a parent any more
+internal void
+ForgetAggregationWorker(int workerFd)
+{
+    for (unsigned int i = 0; i < g_aggregationTreeCount; ++i)
+    {
+        aggregation_tree *tree = &g_aggregationTrees[i];
+        for (unsigned int w = 0; w < tree->workerCount; ++w)
+        {
+            if (tree->workerFds[w] == workerFd)
+                tree->workerFds[w] = -1;
+        }
+    }
+}
+
+//
+// Worker side
+//
+
+internal aggregation_group *
+FindAggregationGroup(uint8 group[CookieLen])
+{
+    for (unsigned int i = 0; i < g_aggregationGroupCount; ++i)
+    {
+        if (memcmp(g_aggregationGroups[i].group, group, CookieLen) == 0)
+            return &g_aggregationGroups[i];
+    }
+    return 0;
+}
+
+internal aggregation_group *
+AddAggregationGroup(uint8 group[CookieLen], int32 reducer, const peer_info *emitter)
+{
+    if (g_aggregationGroupCount == g_aggregationGroupCapacity)
+    {
+        unsigned int newCapacity = (g_aggregationGroupCapacity == 0) ? 8 : 2 * g_aggregationGroupCapacity;
+        aggregation_group *t = realloc(g_aggregationGroups, sizeof(aggregation_group) * newCapacity);
+        if (!t)
+            return 0;
+        g_aggregationGroups = t;
+        g_aggregationGroupCapacity = newCapacity;
+    }
+    aggregation_group *result = &g_aggregationGroups[g_aggregationGroupCount++];
+    memset(result, 0, sizeof(*result));
+    memcpy(result->group, group, CookieLen);
+    result->reducer = reducer;
+    result->emitter = *emitter;
+    result->emitter.ipaddr[PeerIPLen - 1] = '\0';
+    result->emitter.port[PeerPortLen - 1] = '\0';
+    result->lastUpdate = GetTime();
+    return result;
+}
+
+internal void
+RemoveAggregationGroup(unsigned int idx)
+{
+    free(g_aggregationGroups[idx].chunks);
+    free(g_aggregationGroups[idx].values);
+    g_aggregationGroups[idx] = g_aggregationGroups[g_aggregationGroupCount - 1];
+    --g_aggregationGroupCount;
+}
+
+// NOTE(Kevin): Returns 0 if the values do not fit the ones we have
+internal bool32
+AddToAggregationGroup(aggregation_group *group, const uint32 *chunks, uint32 chunkCount,
+                      const double *values, uint32 valueCount)
+{
+    if (group->chunkCount == 0)
+    {
+        double *t = realloc(group->values, sizeof(double) * (valueCount > 0 ? valueCount : 1));
+        if (!t)
+            return 0;
+        group->values = t;
+        memcpy(group->values, values, sizeof(double) * valueCount);
+        group->valueCount = valueCount;
+    }
+    else if (valueCount != group->valueCount ||
+             !CombineValues(group->reducer, group->values, values, valueCount))
+    {
+        return 0;
+    }
+    if (group->chunkCount + chunkCount > group->chunkCapacity)
+    {
+        uint32 newCapacity = (group->chunkCapacity == 0) ? 8 : 2 * group->chunkCapacity;
+        while (newCapacity < group->chunkCount + chunkCount)
+            newCapacity *= 2;
+        uint32 *t = realloc(group->chunks, sizeof(uint32) * newCapacity);
+        if (!t)
+            return 0;
+        group->chunks = t;
+        group->chunkCapacity = newCapacity;
+    }
+    memcpy(group->chunks + group->chunkCount, chunks, sizeof(uint32) * chunkCount);
+    group->chunkCount += chunkCount;
+    group->lastUpdate = GetTime();
+    return 1;
+}
+
+// NOTE(Kevin): Returns the fd of the peer, connecting to it if needed
+internal int
+GetAggregationPeerFd(const peer_info *info)
+{
+    if (info->ipaddr[0] == '\0' || IsOwnPeerInfo(info))
+        return -1;
+    int id = CheckForPeer(info->ipaddr, info->port);
+    if (id == -1)
+    {
+        LogInfo(kLogPeers, "Connecting to %s %s to deliver partial results.\n",
+                info->ipaddr, info->port);
+        id = ConnectToPeer(info->ipaddr, info->port, g_localPort, 0);
+    }
+    return (id != -1) ? GetPeerFd(id) : -1;
+}
+
+// NOTE(Kevin): Sends to the parent, or to the emitter if that fails
+internal void
+SendPartialResult(aggregation_group *group, const uint32 *chunks, uint32 chunkCount,
+                  const double *values, uint32 valueCount)
+{
+    int fd = GetAggregationPeerFd(&group->parent);
+    if (fd == -1 ||
+        SendAggregatedResult(fd, group->group, &group->emitter, group->reducer,
+                             chunks, chunkCount, values, valueCount) != kSuccess)
+    {
+        if (group->parent.ipaddr[0] != '\0')
+        {
+            LogInfo(kLogJobs, "Can not reach %s %s, sending partial result to the emitter.\n",
+                    group->parent.ipaddr, group->parent.port);
+        }
+        fd = GetAggregationPeerFd(&group->emitter);
+        if (fd == -1 ||
+            SendAggregatedResult(fd, group->group, &group->emitter, group->reducer,
+                                 chunks, chunkCount, values, valueCount) != kSuccess)
+        {
+            LogWarning(kLogJobs, "Failed to deliver partial result of %u chunks.\n", chunkCount);
+        }
+    }
+}
+
+internal void
+OnAggregateJob(int fd, const message *msg)
+{
+    if (!CanAggregate(msg->aggregateJob.reducer))
+        return;
+    aggregation_group *group = FindAggregationGroup((uint8*)msg->aggregateJob.group);
+    if (!group)
+    {
+        group = AddAggregationGroup((uint8*)msg->aggregateJob.group, msg->aggregateJob.reducer,
+                                    &msg->aggregateJob.emitter);
+        if (!group)
+            return;
+    }
+    if (g_aggregatedChunkCount == g_aggregatedChunkCapacity)
+    {
+        unsigned int newCapacity = (g_aggregatedChunkCapacity == 0) ? 8 : 2 * g_aggregatedChunkCapacity;
+        aggregated_chunk *t = realloc(g_aggregatedChunks, sizeof(aggregated_chunk) * newCapacity);
+        if (!t)
+            return;
+        g_aggregatedChunks = t;
+        g_aggregatedChunkCapacity = newCapacity;
+    }
+    // NOTE(Kevin): The tree may change between chunks, the latest parent wins
+    group->parent = msg->aggregateJob.parent;
+    group->parent.ipaddr[PeerIPLen - 1] = '\0';
+    group->parent.port[PeerPortLen - 1] = '\0';
+    ++group->pendingChunks;
+    aggregated_chunk *chunk = &g_aggregatedChunks[g_aggregatedChunkCount++];
+    memcpy(chunk->cookie, msg->aggregateJob.cookie, CookieLen);
+    memcpy(chunk->group, msg->aggregateJob.group, CookieLen);
+    chunk->chunkIndex = msg->aggregateJob.chunkIndex;
+    chunk->emitterFd  = fd;
+}
+
+// NOTE(Kevin): Removes the chunk from the ones we wait for. Returns 0 if
+// its result does not get aggregated.
+internal bool32
+TakeAggregatedChunk(uint8 cookie[CookieLen], uint32 *chunkIndexOut, aggregation_group **groupOut)
+{
+    for (unsigned int i = 0; i < g_aggregatedChunkCount; ++i)
+    {
+        aggregated_chunk *chunk = &g_aggregatedChunks[i];
+        if (memcmp(chunk->cookie, cookie, CookieLen) != 0)
+            continue;
+        aggregation_group *group = FindAggregationGroup(chunk->group);
+        if (group)
+            --group->pendingChunks;
+        if (chunkIndexOut)
+            *chunkIndexOut = chunk->chunkIndex;
+        if (groupOut)
+            *groupOut = group;
+        g_aggregatedChunks[i] = g_aggregatedChunks[g_aggregatedChunkCount - 1];
+        --g_aggregatedChunkCount;
+        return group != 0;
+    }
+    return 0;
+}
+
+// NOTE(Kevin): The chunk will not run here
+internal void
+ForgetAggregatedChunk(uint8 cookie[CookieLen])
+{
+    TakeAggregatedChunk(cookie, 0, 0);
+}
+
+// NOTE(Kevin): Called by ExecuteNextJob(). Returns 0 if the result has to
+// be sent to the emitter as usual.
+internal bool32
+AggregateJobResult(uint8 cookie[CookieLen], int state, double result,
+                   const double *values, uint32 valueCount)
+{
+    uint32 chunkIndex;
+    aggregation_group *group;
+    if (!TakeAggregatedChunk(cookie, &chunkIndex, &group))
+        return 0;
+    // NOTE(Kevin): The emitter has to see errors
+    if (state != kSuccess)
+        return 0;
+    if (valueCount == 0)
+    {
+        values = &result;
+        valueCount = 1;
+    }
+    if (!AddToAggregationGroup(group, &chunkIndex, 1, values, valueCount))
+        SendPartialResult(group, &chunkIndex, 1, values, valueCount);
+    return 1;
+}
+
+internal void
+OnAggregatedResult(int fd, const message *msg)
+{
+    uint8 *groupCookie = (uint8*)msg->aggregatedResult.group;
+    if (FindEmittedJobIndex(groupCookie) != -1)
+    {
+        StoreAggregatedResult(groupCookie, msg->aggregatedResult.reducer,
+                              msg->aggregatedResult.chunks, msg->aggregatedResult.chunkCount,
+                              msg->aggregatedResult.values, msg->aggregatedResult.valueCount, fd);
+        return;
+    }
+    if (IsOwnPeerInfo(&msg->aggregatedResult.emitter) || !CanAggregate(msg->aggregatedResult.reducer))
+    {
+        LogWarning(kLogJobs, "Dropping partial result of an unknown map-reduce.\n");
+        return;
+    }
+    aggregation_group *group = FindAggregationGroup(groupCookie);
+    if (!group)
+    {
+        // NOTE(Kevin): Our own chunks are done and forgotten, or we never
+        // had one; the partial goes straight on to the emitter
+        group = AddAggregationGroup(groupCookie, msg->aggregatedResult.reducer,
+                                    &msg->aggregatedResult.emitter);
+        if (!group)
+            return;
+    }
+    if (!AddToAggregationGroup(group, msg->aggregatedResult.chunks, msg->aggregatedResult.chunkCount,
+                               msg->aggregatedResult.values, msg->aggregatedResult.valueCount))
+    {
+        SendPartialResult(group, msg->aggregatedResult.chunks, msg->aggregatedResult.chunkCount,
+                          msg->aggregatedResult.values, msg->aggregatedResult.valueCount);
+    }
+}
+
+// NOTE(Kevin): Sends what has settled up the tree and forgets idle groups
+internal void
+FlushAggregations(void)
+{
+    double now = GetTime();
+    for (unsigned int i = 0; i < g_aggregationGroupCount;)
+    {
+        aggregation_group *group = &g_aggregationGroups[i];
+        if (group->chunkCount > 0 && group->pendingChunks <= 0 &&
+            now - group->lastUpdate >= P2PJS_AggregationDelay)
+        {
+            LogDebug(kLogJobs, "Sending partial result of %u chunks of %.6s.\n",
+                     group->chunkCount, CookieToTemporaryString(group->group));
+            SendPartialResult(group, group->chunks, group->chunkCount, group->values, group->valueCount);
+            group->chunkCount = 0;
+            group->valueCount = 0;
+            group->lastUpdate = now;
+        }
+        if (group->chunkCount == 0 && group->pendingChunks <= 0 &&
+            now - group->lastUpdate >= P2PJS_AggregationKeepTime)
+        {
+            RemoveAggregationGroup(i);
+            continue;
+        }
+        ++i;
+    }
+}
+
+// NOTE(Kevin): The emitter of these chunks is gone, nobody wants the results
+internal void
+DropAggregationsOfPeer(int peerFd)
+{
+    for (unsigned int i = 0; i < g_aggregatedChunkCount;)
+    {
+        if (g_aggregatedChunks[i].emitterFd == peerFd)
+        {
+            ForgetAggregatedChunk(g_aggregatedChunks[i].cookie);
+            continue;
+        }
+        ++i;
+    }
+}
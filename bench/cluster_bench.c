@@ -0,0 +1,547 @@
+// NOTE(Kevin): End-to-end benchmark of a small cluster. Starts one emitter
+// and N workers as child processes on local ports, bootstraps the workers
+// through -f, submits a generated workload through the emitter's command
+// line and reports job throughput, end-to-end latency, messages per job
+// and the CPU time of every node. Latencies and message counts are read
+// from the metrics endpoints (-m) of the nodes.
+//
+// Usage: cluster_bench [-x p2pjs binary] [-w workers] [-j jobs] [-c jobs in flight]
+//                      [-s source bytes] [-d loop iterations per job]
+//                      [-a address] [-P first port] [-o "node options"]
+//
+// The last line of the report is meant for scripts comparing runs.
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "../p2pjs.h"
+
+#define DefaultBinary "bench/p2pjs_release"
+#define MaxWorkers    (MaxConnectedPeers - 1)
+#define MetricsBufferSize (64 * 1024)
+#define MaxNodeArgs   32
+
+// NOTE(Kevin): Give up if the cluster makes no progress for this long
+#define StallTimeout 10.0
+
+typedef struct
+{
+    pid_t  pid;
+    char   port[PeerPortLen];
+    char   dir[PATH_MAX];
+    char   socketPath[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    // NOTE(Kevin): Only for the emitter
+    int    commandFd;
+    int    outputFd;
+    double cpuTime;
+    char   metrics[MetricsBufferSize];
+} node;
+
+typedef struct
+{
+    const char  *binary;
+    const char  *address;
+    unsigned int workerCount;
+    unsigned int jobCount;
+    unsigned int window;
+    unsigned int sourceSize;
+    unsigned int iterations;
+    unsigned int firstPort;
+    // NOTE(Kevin): Passed on to every node, e.g. "-l warn"
+    char        *nodeOptions;
+} cluster_options;
+
+global_variable node g_nodes[MaxWorkers + 1];
+global_variable unsigned int g_nodeCount;
+
+internal double
+GetTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+internal void
+SleepSeconds(double seconds)
+{
+    struct timespec ts;
+    ts.tv_sec  = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - (double)ts.tv_sec) * 1e9);
+    nanosleep(&ts, 0);
+}
+
+internal int
+WriteJobSource(const char *path, const cluster_options *options)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return kCouldNotOpenFile;
+    fprintf(file,
+            "class Job {\n"
+            "  static run(x) {\n"
+            "    var sum = 0\n"
+            "    for (i in 0...%u) sum = sum + i\n"
+            "    return x * 2\n"
+            "  }\n"
+            "}\n",
+            options->iterations);
+    // NOTE(Kevin): Pad the source up to the requested size with comments
+    long size = ftell(file);
+    while (size < (long)options->sourceSize)
+    {
+        char line[80];
+        long lineLen = (long)options->sourceSize - size;
+        if (lineLen > (long)sizeof(line) - 1)
+            lineLen = (long)sizeof(line) - 1;
+        if (lineLen < 3)
+            lineLen = 3;
+        memset(line, 'x', (size_t)lineLen);
+        line[0] = '/';
+        line[1] = '/';
+        line[lineLen - 1] = '\n';
+        fwrite(line, 1, (size_t)lineLen, file);
+        size += lineLen;
+    }
+    fclose(file);
+    return kSuccess;
+}
+
+internal int
+StartNode(node *n, const char *binary, const char *firstPeer, char *nodeOptions, bool32 isEmitter)
+{
+    char *args[MaxNodeArgs + 8];
+    int argCount = 0;
+    args[argCount++] = "p2pjs";
+    args[argCount++] = "-p";
+    args[argCount++] = n->port;
+    args[argCount++] = "-m";
+    args[argCount++] = n->socketPath;
+    // NOTE(Kevin): Jobs with the same argument must run, not come from
+    // the result cache
+    args[argCount++] = "-M";
+    args[argCount++] = "0";
+    if (firstPeer)
+    {
+        args[argCount++] = "-f";
+        args[argCount++] = (char*)firstPeer;
+    }
+    char options[1024];
+    snprintf(options, sizeof(options), "%s", nodeOptions ? nodeOptions : "");
+    for (char *arg = strtok(options, " "); arg && argCount < MaxNodeArgs + 7; arg = strtok(0, " "))
+        args[argCount++] = arg;
+    args[argCount] = 0;
+
+    if (mkdir(n->dir, 0755) == -1 && errno != EEXIST)
+        return kSyscallFailed;
+    int commandPipe[2] = { -1, -1 };
+    int outputPipe[2]  = { -1, -1 };
+    if (isEmitter && (pipe(commandPipe) == -1 || pipe(outputPipe) == -1))
+        return kSyscallFailed;
+
+    pid_t pid = fork();
+    if (pid == -1)
+        return kSyscallFailed;
+    if (pid == 0)
+    {
+        // NOTE(Kevin): Workers have no stdin, so their UI thread ends right away
+        int devNull = open("/dev/null", O_RDWR);
+        dup2(isEmitter ? commandPipe[0] : devNull, STDIN_FILENO);
+        dup2(isEmitter ? outputPipe[1] : devNull, STDOUT_FILENO);
+        // NOTE(Kevin): Messages for the user, like the node's address, go to stderr
+        dup2(isEmitter ? outputPipe[1] : devNull, STDERR_FILENO);
+        if (isEmitter)
+        {
+            close(commandPipe[0]);
+            close(commandPipe[1]);
+            close(outputPipe[0]);
+            close(outputPipe[1]);
+        }
+        close(devNull);
+        // NOTE(Kevin): Log files are written to the working directory
+        if (chdir(n->dir) == -1)
+            _exit(1);
+        execv(binary, args);
+        _exit(1);
+    }
+    n->pid = pid;
+    n->commandFd = -1;
+    n->outputFd  = -1;
+    if (isEmitter)
+    {
+        close(commandPipe[0]);
+        close(outputPipe[1]);
+        n->commandFd = commandPipe[1];
+        n->outputFd  = outputPipe[0];
+    }
+    return kSuccess;
+}
+
+// NOTE(Kevin): Reads the whole metrics text of a node into n->metrics
+internal int
+ScrapeMetrics(node *n)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return kSyscallFailed;
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", n->socketPath);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        close(fd);
+        return kSyscallFailed;
+    }
+    size_t length = 0;
+    while (length < sizeof(n->metrics) - 1)
+    {
+        ssize_t did = recv(fd, n->metrics + length, sizeof(n->metrics) - 1 - length, 0);
+        if (did <= 0)
+            break;
+        length += (size_t)did;
+    }
+    n->metrics[length] = '\0';
+    close(fd);
+    return kSuccess;
+}
+
+// NOTE(Kevin): Sum of all samples whose name (including labels) starts with key
+internal double
+GetMetric(const node *n, const char *key)
+{
+    double sum = 0.0;
+    size_t keyLen = strlen(key);
+    for (const char *line = n->metrics; *line; )
+    {
+        const char *end = strchr(line, '\n');
+        if (!end)
+            end = line + strlen(line);
+        if (*line != '#' && strncmp(line, key, keyLen) == 0 &&
+            (line[keyLen] == ' ' || key[keyLen - 1] == '{'))
+        {
+            const char *value = memchr(line, ' ', (size_t)(end - line));
+            if (value)
+                sum += strtod(value + 1, 0);
+        }
+        line = (*end) ? end + 1 : end;
+    }
+    return sum;
+}
+
+// NOTE(Kevin): Waits until every node answers and the emitter knows all workers
+internal bool32
+WaitForCluster(void)
+{
+    double deadline = GetTime() + StallTimeout;
+    while (GetTime() < deadline)
+    {
+        bool32 ready = 1;
+        for (unsigned int i = 0; i < g_nodeCount && ready; ++i)
+        {
+            if (ScrapeMetrics(&g_nodes[i]) != kSuccess)
+                ready = 0;
+            else if (i > 0 && GetMetric(&g_nodes[i], "p2pjs_peers") < 1.0)
+                ready = 0;
+        }
+        if (ready && GetMetric(&g_nodes[0], "p2pjs_peers") >= (double)(g_nodeCount - 1))
+            return 1;
+        SleepSeconds(0.02);
+    }
+    return 0;
+}
+
+internal void
+SubmitJob(node *emitter, unsigned int arg)
+{
+    char command[64];
+    int len = snprintf(command, sizeof(command), "job job.wren %u\n", arg);
+    if (write(emitter->commandFd, command, (size_t)len) != len)
+        perror("write");
+}
+
+// NOTE(Kevin): Reads the next line the emitter printed; returns 0 if
+// nothing arrived for StallTimeout seconds
+internal bool32
+ReadEmitterLine(node *emitter, char *line, size_t maxLen)
+{
+    local_persist char buffer[4096];
+    local_persist size_t length;
+    for (;;)
+    {
+        char *end = memchr(buffer, '\n', length);
+        if (end)
+        {
+            size_t lineLen = (size_t)(end - buffer);
+            size_t copyLen = (lineLen < maxLen - 1) ? lineLen : maxLen - 1;
+            memcpy(line, buffer, copyLen);
+            line[copyLen] = '\0';
+            length -= lineLen + 1;
+            memmove(buffer, end + 1, length);
+            return 1;
+        }
+        if (length == sizeof(buffer))
+        {
+            // NOTE(Kevin): Overlong line, none of ours
+            length = 0;
+        }
+        struct pollfd pfd = { emitter->outputFd, POLLIN, 0 };
+        if (poll(&pfd, 1, (int)(StallTimeout * 1000.0)) <= 0)
+            return 0;
+        ssize_t did = read(emitter->outputFd, buffer + length, sizeof(buffer) - length);
+        if (did <= 0)
+            return 0;
+        length += (size_t)did;
+    }
+}
+
+internal void
+StopNodes(void)
+{
+    if (g_nodeCount > 0 && g_nodes[0].commandFd != -1)
+    {
+        if (write(g_nodes[0].commandFd, "quit\n", 5) != 5)
+            kill(g_nodes[0].pid, SIGTERM);
+        close(g_nodes[0].commandFd);
+    }
+    for (unsigned int i = 1; i < g_nodeCount; ++i)
+        kill(g_nodes[i].pid, SIGTERM);
+    for (unsigned int i = 0; i < g_nodeCount; ++i)
+    {
+        // NOTE(Kevin): wait4 gives us the CPU time of exactly this node
+        struct rusage usage;
+        int status;
+        if (wait4(g_nodes[i].pid, &status, 0, &usage) == g_nodes[i].pid)
+        {
+            g_nodes[i].cpuTime = (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec * 1e-6 +
+                                 (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec * 1e-6;
+        }
+    }
+}
+
+internal void
+PrintUsage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-x p2pjs binary] [-w workers] [-j jobs] [-c jobs in flight]\n"
+            "       [-s source bytes] [-d loop iterations per job] [-a address] [-P first port]\n"
+            "       [-o \"node options\"]\n",
+            name);
+}
+
+int
+main(int argc, char **argv)
+{
+    cluster_options options;
+    options.binary      = DefaultBinary;
+    options.address     = 0;
+    options.workerCount = 4;
+    options.jobCount    = 200;
+    options.window      = 16;
+    options.sourceSize  = 0;
+    options.iterations  = 1000;
+    options.firstPort   = 4600;
+    options.nodeOptions = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "x:w:j:c:s:d:a:P:o:")) != -1)
+    {
+        switch (option)
+        {
+            case 'x': options.binary      = optarg; break;
+            case 'w': options.workerCount = (unsigned int)atoi(optarg); break;
+            case 'j': options.jobCount    = (unsigned int)atoi(optarg); break;
+            case 'c': options.window      = (unsigned int)atoi(optarg); break;
+            case 's': options.sourceSize  = (unsigned int)atoi(optarg); break;
+            case 'd': options.iterations  = (unsigned int)atoi(optarg); break;
+            case 'a': options.address     = optarg; break;
+            case 'P': options.firstPort   = (unsigned int)atoi(optarg); break;
+            case 'o': options.nodeOptions = optarg; break;
+            default:
+            {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        }
+    }
+    if (options.workerCount < 1 || options.workerCount > MaxWorkers ||
+        options.jobCount < 1 || options.window < 1)
+    {
+        fprintf(stderr, "Need 1 to %d workers, at least one job and a window of at least one.\n",
+                MaxWorkers);
+        return 1;
+    }
+
+    char binary[PATH_MAX];
+    if (!realpath(options.binary, binary))
+    {
+        fprintf(stderr, "Can not find %s, build it with ./build.sh bench or pass -x.\n", options.binary);
+        return 1;
+    }
+    char baseDir[] = "/tmp/p2pjs_cluster_XXXXXX";
+    if (!mkdtemp(baseDir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // NOTE(Kevin): Node 0 is the emitter, all workers bootstrap through it
+    g_nodeCount = options.workerCount + 1;
+    for (unsigned int i = 0; i < g_nodeCount; ++i)
+    {
+        snprintf(g_nodes[i].port, sizeof(g_nodes[i].port), "%u", options.firstPort + i);
+        snprintf(g_nodes[i].dir, sizeof(g_nodes[i].dir), "%s/node%u", baseDir, i);
+        snprintf(g_nodes[i].socketPath, sizeof(g_nodes[i].socketPath), "%s/node%u.sock", baseDir, i);
+    }
+    int err = StartNode(&g_nodes[0], binary, 0, options.nodeOptions, 1);
+    char jobPath[PATH_MAX + 16];
+    snprintf(jobPath, sizeof(jobPath), "%s/job.wren", g_nodes[0].dir);
+    if (err == kSuccess)
+        err = WriteJobSource(jobPath, &options);
+    if (err != kSuccess)
+    {
+        fprintf(stderr, "Failed to start the emitter.\n");
+        return 1;
+    }
+    // NOTE(Kevin): Bootstrap through the address the emitter announces to
+    // its peers. Any other address of this host (e.g. 127.0.0.1) makes the
+    // workers connect to the emitter a second time when they offer.
+    char address[PeerIPLen] = "";
+    if (options.address)
+    {
+        snprintf(address, sizeof(address), "%s", options.address);
+    }
+    else
+    {
+        char line[256];
+        while (!address[0] && ReadEmitterLine(&g_nodes[0], line, sizeof(line)))
+        {
+            if (sscanf(line, "Using %39s as local ip.", address) != 1)
+                address[0] = '\0';
+        }
+        if (!address[0])
+        {
+            fprintf(stderr, "The emitter did not print its address, pass -a.\n");
+            g_nodeCount = 1;
+            StopNodes();
+            return 1;
+        }
+    }
+    char firstPeer[PeerIPLen + PeerPortLen + 1];
+    snprintf(firstPeer, sizeof(firstPeer), "%s#%s", address, g_nodes[0].port);
+
+    // NOTE(Kevin): The metrics socket is up once the emitter listens
+    double deadline = GetTime() + StallTimeout;
+    while (ScrapeMetrics(&g_nodes[0]) != kSuccess && GetTime() < deadline)
+        SleepSeconds(0.01);
+    for (unsigned int i = 1; i < g_nodeCount; ++i)
+    {
+        if (StartNode(&g_nodes[i], binary, firstPeer, options.nodeOptions, 0) != kSuccess)
+        {
+            fprintf(stderr, "Failed to start worker %u.\n", i);
+            g_nodeCount = i;
+            StopNodes();
+            return 1;
+        }
+    }
+    if (!WaitForCluster())
+    {
+        fprintf(stderr, "The cluster did not come up, see the logs in %s.\n", baseDir);
+        StopNodes();
+        return 1;
+    }
+
+    unsigned int submitted = 0;
+    unsigned int succeeded = 0;
+    unsigned int failed    = 0;
+    bool32 stalled = 0;
+    double startTime = GetTime();
+    while (succeeded + failed < options.jobCount)
+    {
+        while (submitted < options.jobCount && submitted - (succeeded + failed) < options.window)
+            SubmitJob(&g_nodes[0], submitted++);
+        char line[256];
+        if (!ReadEmitterLine(&g_nodes[0], line, sizeof(line)))
+        {
+            stalled = 1;
+            break;
+        }
+        if (strncmp(line, "Job ", 4) == 0)
+        {
+            if (strstr(line, " succeeded;"))
+                ++succeeded;
+            else if (strstr(line, " failed;"))
+                ++failed;
+        }
+    }
+    double elapsed = GetTime() - startTime;
+    unsigned int completed = succeeded + failed;
+
+    for (unsigned int i = 0; i < g_nodeCount; ++i)
+    {
+        if (ScrapeMetrics(&g_nodes[i]) != kSuccess)
+            g_nodes[i].metrics[0] = '\0';
+    }
+    StopNodes();
+
+    // NOTE(Kevin): Messages that belong to jobs, i.e. no hello/peer list/heartbeat traffic
+    local_persist const char *jobMessages[] =
+    {
+        "p2pjs_messages_sent_total{type=\"QueryJobResources\"}",
+        "p2pjs_messages_sent_total{type=\"OfferJobResources\"}",
+        "p2pjs_messages_sent_total{type=\"Job\"}",
+        "p2pjs_messages_sent_total{type=\"JobResult\"}",
+        "p2pjs_messages_sent_total{type=\"CancelJob\"}",
+    };
+    double jobMessageCount = 0.0;
+    double messageCount    = 0.0;
+    double cpuTime         = 0.0;
+    for (unsigned int i = 0; i < g_nodeCount; ++i)
+    {
+        for (unsigned int m = 0; m < SizeofArray(jobMessages); ++m)
+            jobMessageCount += GetMetric(&g_nodes[i], jobMessages[m]);
+        messageCount += GetMetric(&g_nodes[i], "p2pjs_messages_sent_total{");
+        cpuTime += g_nodes[i].cpuTime;
+    }
+    node *emitter = &g_nodes[0];
+    double p50  = GetMetric(emitter, "p2pjs_job_latency_seconds{quantile=\"0.5\"}");
+    double p99  = GetMetric(emitter, "p2pjs_job_latency_seconds{quantile=\"0.99\"}");
+    double p999 = GetMetric(emitter, "p2pjs_job_latency_seconds{quantile=\"0.999\"}");
+    double max  = GetMetric(emitter, "p2pjs_job_latency_seconds_max");
+    double perJob = (completed > 0) ? 1.0 / (double)completed : 0.0;
+
+    printf("Cluster:    1 emitter + %u workers, %u jobs, %u in flight, %u byte sources, %u iterations per job\n",
+           options.workerCount, options.jobCount, options.window, options.sourceSize, options.iterations);
+    printf("Jobs:       %u succeeded, %u failed in %.3fs (%.1f jobs/s)%s\n",
+           succeeded, failed, elapsed, (double)completed / elapsed,
+           stalled ? ", STALLED" : "");
+    printf("Latency:    p50 %.3fms  p99 %.3fms  p999 %.3fms  max %.3fms\n",
+           p50 * 1e3, p99 * 1e3, p999 * 1e3, max * 1e3);
+    printf("Messages:   %.2f per job for jobs, %.2f per job in total\n",
+           jobMessageCount * perJob, messageCount * perJob);
+    for (unsigned int i = 0; i < g_nodeCount; ++i)
+    {
+        printf("CPU:        node %u (%s) %.3fs, %.1fus per job\n", i, (i == 0) ? "emitter" : "worker",
+               g_nodes[i].cpuTime, g_nodes[i].cpuTime * perJob * 1e6);
+    }
+    printf("Logs:       %s\n", baseDir);
+    printf("RESULT jobs_per_s=%.1f p50_ms=%.3f p99_ms=%.3f p999_ms=%.3f msgs_per_job=%.2f cpu_us_per_job=%.1f failed=%u stalled=%d\n",
+           (double)completed / elapsed, p50 * 1e3, p99 * 1e3, p999 * 1e3,
+           jobMessageCount * perJob, cpuTime * perJob * 1e6, failed, stalled);
+    return (stalled || failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,108 @@
+// NOTE(Kevin): Throughput and collision check for job cookie generation.
+// Compares the cookie generator against the old scheme, which hashed a
+// single rand() value with SHA-256. Exits with 1 if the generator
+// produced a collision; the old scheme is only reported.
+//
+// Usage: cookie_bench [number of cookies]
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../p2pjs.h"
+#include "../sha-256.h"
+#include "../cookie.c"
+
+internal double
+GetTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+internal void
+GenerateRandCookie(uint8 cookie[CookieLen])
+{
+    uint32 random = (uint32)rand();
+    calc_sha_256(cookie, &random, sizeof(random));
+}
+
+internal int
+CompareCookies(const void *a, const void *b)
+{
+    return memcmp(a, b, CookieLen);
+}
+
+internal unsigned int
+CountCollisions(uint8 *cookies, unsigned int count)
+{
+    qsort(cookies, count, CookieLen, CompareCookies);
+    unsigned int collisions = 0;
+    for (unsigned int i = 1; i < count; ++i)
+    {
+        if (memcmp(&cookies[(i - 1) * CookieLen], &cookies[i * CookieLen], CookieLen) == 0)
+            ++collisions;
+    }
+    return collisions;
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned int count = (argc > 1) ? (unsigned int)atoi(argv[1]) : 4 * 1024 * 1024;
+    uint8 *cookies = malloc((size_t)count * CookieLen);
+    if (!cookies)
+    {
+        fprintf(stderr, "Not enough memory for %u cookies.\n", count);
+        return 1;
+    }
+    srand((unsigned int)time(0));
+
+    // NOTE(Kevin): Touch the pages first, so that page faults are not measured
+    memset(cookies, 0, (size_t)count * CookieLen);
+
+    // NOTE(Kevin): Throughput
+    InitCookieGenerator("127.0.0.1", "2096");
+    double start = GetTime();
+    for (unsigned int i = 0; i < count; ++i)
+        GenerateCookie(&cookies[(size_t)i * CookieLen]);
+    double generatorTime = GetTime() - start;
+
+    unsigned int generatorCollisions = 0;
+    unsigned int collisions = CountCollisions(cookies, count);
+    generatorCollisions += collisions;
+    printf("generator:      %10.2f Mcookies/s, %u collisions in %u cookies\n",
+           count / generatorTime * 1e-6, collisions, count);
+
+    // NOTE(Kevin): Two nodes emitting into the same pool
+    InitCookieGenerator("127.0.0.1", "2096");
+    for (unsigned int i = 0; i < count / 2; ++i)
+        GenerateCookie(&cookies[(size_t)i * CookieLen]);
+    InitCookieGenerator("127.0.0.1", "2097");
+    for (unsigned int i = count / 2; i < count; ++i)
+        GenerateCookie(&cookies[(size_t)i * CookieLen]);
+    collisions = CountCollisions(cookies, count);
+    generatorCollisions += collisions;
+    printf("two nodes:      %10s              %u collisions in %u cookies\n",
+           "", collisions, count);
+
+    start = GetTime();
+    for (unsigned int i = 0; i < count; ++i)
+        GenerateRandCookie(&cookies[(size_t)i * CookieLen]);
+    double randTime = GetTime() - start;
+
+    collisions = CountCollisions(cookies, count);
+    printf("sha-256(rand):  %10.2f Mcookies/s, %u collisions in %u cookies\n",
+           count / randTime * 1e-6, collisions, count);
+
+    free(cookies);
+    if (generatorCollisions > 0)
+    {
+        fprintf(stderr, "The cookie generator produced %u collisions.\n", generatorCollisions);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,512 @@
+// NOTE(Kevin): Throughput of the message decoder. Byte streams are fed
+// through the real ReceiveMessage() with different message mixes and
+// fragmentation patterns; recv(), send() and the allocator are replaced
+// for messaging.c only, so neither the kernel nor the network is measured.
+// The synthetic streams are produced by the real Send* functions.
+// A recorded stream (the raw bytes of one direction of a connection,
+// starting at a message boundary) can be added with -i.
+//
+// Usage: decoder_bench [-t seconds per case] [-s segment size] [-i stream file]
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "../p2pjs.h"
+
+internal double
+GetTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+#include "../logging.c"
+#include "../tracing.c"
+#include "../metrics.c"
+
+// NOTE(Kevin): The decoder keeps its state per fd, the number does not matter
+#define BenchFd 3
+
+// NOTE(Kevin): The stream that BenchSend() appends to and BenchRecv() reads from
+global_variable char  *g_stream;
+global_variable size_t g_streamSize;
+global_variable size_t g_streamCapacity;
+global_variable size_t g_readPos;
+
+// Fragmentation patterns
+enum
+{
+    // NOTE(Kevin): Every recv() returns a single byte
+    kFragmentByte,
+    // NOTE(Kevin): Segments of random size between 1 byte and the segment size
+    kFragmentRandom,
+    // NOTE(Kevin): The stream arrives in segments of one TCP segment
+    kFragmentSegment,
+    // NOTE(Kevin): Everything is already there, recv() returns what was asked for
+    kFragmentCoalesced,
+
+    kFragmentCount,
+};
+
+global_variable const char *g_fragmentNames[] = { "1-byte", "random", "segment", "coalesced" };
+
+global_variable int    g_fragment;
+global_variable size_t g_segmentSize = 1448;
+// NOTE(Kevin): Bytes left in the current segment
+global_variable size_t g_segmentLeft;
+global_variable uint32 g_random;
+
+global_variable uint64 g_recvCalls;
+global_variable uint64 g_allocCalls;
+global_variable uint64 g_allocBytes;
+
+internal uint32
+NextRandom(void)
+{
+    // NOTE(Kevin): xorshift32, the same sequence for every run
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 17;
+    g_random ^= g_random << 5;
+    return g_random;
+}
+
+internal ssize_t
+BenchSend(int fd, const void *buffer, size_t length, int flags)
+{
+    (void)fd;
+    (void)flags;
+    if (g_streamSize + length > g_streamCapacity)
+    {
+        size_t capacity = g_streamCapacity ? g_streamCapacity : 4096;
+        while (capacity < g_streamSize + length)
+            capacity *= 2;
+        char *t = realloc(g_stream, capacity);
+        if (!t)
+            return -1;
+        g_stream = t;
+        g_streamCapacity = capacity;
+    }
+    memcpy(g_stream + g_streamSize, buffer, length);
+    g_streamSize += length;
+    return (ssize_t)length;
+}
+
+internal ssize_t
+BenchRecv(int fd, void *buffer, size_t length, int flags)
+{
+    (void)fd;
+    (void)flags;
+    ++g_recvCalls;
+    size_t available = g_streamSize - g_readPos;
+    if (length > available)
+        length = available;
+    switch (g_fragment)
+    {
+        case kFragmentByte:
+        {
+            if (length > 1)
+                length = 1;
+        } break;
+
+        case kFragmentRandom:
+        case kFragmentSegment:
+        {
+            if (g_segmentLeft == 0)
+            {
+                g_segmentLeft = (g_fragment == kFragmentRandom) ?
+                                1 + NextRandom() % g_segmentSize : g_segmentSize;
+            }
+            if (length > g_segmentLeft)
+                length = g_segmentLeft;
+            g_segmentLeft -= length;
+        } break;
+
+        default:
+            break;
+    }
+    memcpy(buffer, g_stream + g_readPos, length);
+    g_readPos += length;
+    return (ssize_t)length;
+}
+
+internal void *
+BenchMalloc(size_t size)
+{
+    ++g_allocCalls;
+    g_allocBytes += size;
+    return malloc(size);
+}
+
+internal void *
+BenchRealloc(void *memory, size_t size)
+{
+    ++g_allocCalls;
+    g_allocBytes += size;
+    return realloc(memory, size);
+}
+
+#define send    BenchSend
+#define recv    BenchRecv
+#define malloc  BenchMalloc
+#define realloc BenchRealloc
+#include "../messaging.c"
+#undef send
+#undef recv
+#undef malloc
+#undef realloc
+
+// NOTE(Kevin): The bench only sends payloads below P2PJS_StreamThreshold
+internal int
+StartPayloadStream(int fd, uint8 cookie[CookieLen], const uint8 *head, uint32 headSize,
+                   const uint8 *bytes, uint32 size, bool32 copy)
+{
+    (void)fd; (void)cookie; (void)head; (void)headSize; (void)bytes; (void)size; (void)copy;
+    return kInvalidValue;
+}
+
+typedef struct
+{
+    const char *name;
+    char       *stream;
+    size_t      size;
+    uint64      messageCount;
+} bench_stream;
+
+global_variable uint8     g_cookie[CookieLen];
+global_variable peer_info g_peer = { "192.168.100.200", "2096" };
+global_variable job_usage g_usage = { 0.25, 0.3, 0.01, 1 << 20 };
+global_variable uint64    g_sentMessages;
+
+internal char *
+MakeSource(size_t size)
+{
+    // NOTE(Kevin): The content does not matter to the decoder
+    char *source = malloc(size + 1);
+    if (!source)
+    {
+        fprintf(stderr, "Not enough memory.\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < size; ++i)
+        source[i] = "abcdefghijklmnopqrstuvwxyz \n"[i % 28];
+    source[size] = '\0';
+    return source;
+}
+
+internal void
+NextCookie(void)
+{
+    for (int i = 0; i < CookieLen; ++i)
+        g_cookie[i] = (uint8)NextRandom();
+}
+
+internal void
+SendControlRound(void)
+{
+    NextCookie();
+    SendQueryJobResources(BenchFd, g_cookie, g_peer);
+    SendOfferJobResources(BenchFd, g_cookie);
+    SendCancelJob(BenchFd, g_cookie);
+    SendHeartbeat(BenchFd);
+    g_sentMessages += 4;
+}
+
+internal void
+SendResultRound(void)
+{
+    NextCookie();
+    SendJobResult(BenchFd, g_cookie, kSuccess, 42.0, 0, 0, 0, 0, &g_usage);
+    g_sentMessages += 1;
+}
+
+internal void
+SendJobRound(size_t sourceSize)
+{
+    local_persist char  *source;
+    local_persist size_t size;
+    if (size != sourceSize)
+    {
+        free(source);
+        source = MakeSource(sourceSize);
+        size = sourceSize;
+    }
+    NextCookie();
+    job job = { source, 1.0, 0, 0, kJobKindRun };
+    SendJob(BenchFd, g_cookie, &job);
+    g_sentMessages += 1;
+}
+
+internal void
+SendSmallJobRound(void) { SendJobRound(256); }
+
+internal void
+SendLargeJobRound(void) { SendJobRound(60 * 1024); }
+
+internal void
+SendPeerListRound(void)
+{
+    peer_info peers[32];
+    for (int i = 0; i < (int)SizeofArray(peers); ++i)
+    {
+        snprintf(peers[i].ipaddr, PeerIPLen, "10.0.%d.%d", i / 8, i % 8);
+        snprintf(peers[i].port, PeerPortLen, "2096");
+    }
+    SendPeerList(BenchFd, SizeofArray(peers), peers);
+    SendGetPeers(BenchFd);
+    g_sentMessages += 2;
+}
+
+internal void
+SendEmitterRound(void)
+{
+    // NOTE(Kevin): What an emitter receives for one job: offers from
+    // two workers, the result and now and then a heartbeat
+    local_persist int round;
+    NextCookie();
+    SendOfferJobResources(BenchFd, g_cookie);
+    SendOfferJobResources(BenchFd, g_cookie);
+    SendJobResult(BenchFd, g_cookie, kSuccess, 42.0, 0, 0, 0, 0, &g_usage);
+    g_sentMessages += 3;
+    if ((++round % 8) == 0)
+    {
+        SendHeartbeat(BenchFd);
+        g_sentMessages += 1;
+    }
+}
+
+internal void
+SendWorkerRound(void)
+{
+    // NOTE(Kevin): What a worker receives: gossiped queries, some of
+    // them answered with a job of a few KB
+    local_persist int round;
+    for (int i = 0; i < 3; ++i)
+    {
+        NextCookie();
+        SendQueryJobResources(BenchFd, g_cookie, g_peer);
+    }
+    SendJobRound(2048);
+    g_sentMessages += 3;
+    if ((++round % 8) == 0)
+    {
+        SendHeartbeat(BenchFd);
+        g_sentMessages += 1;
+    }
+}
+
+typedef struct
+{
+    const char *name;
+    void (*sendRound)(void);
+} bench_mix;
+
+global_variable bench_mix g_mixes[] =
+{
+    { "control",   SendControlRound },
+    { "results",   SendResultRound },
+    { "jobs-256",  SendSmallJobRound },
+    { "jobs-60k",  SendLargeJobRound },
+    { "peerlists", SendPeerListRound },
+    { "emitter",   SendEmitterRound },
+    { "worker",    SendWorkerRound },
+};
+
+internal bench_stream
+BuildStream(const bench_mix *mix)
+{
+    g_stream = 0;
+    g_streamSize = 0;
+    g_streamCapacity = 0;
+    g_sentMessages = 0;
+    g_random = 0x2096;
+    // NOTE(Kevin): Large enough to not fit into the L2 cache
+    while (g_streamSize < 4 * 1024 * 1024 || g_sentMessages < 10000)
+        mix->sendRound();
+    bench_stream stream = { mix->name, g_stream, g_streamSize, g_sentMessages };
+    g_stream = 0;
+    return stream;
+}
+
+internal int
+LoadStream(const char *path, bench_stream *stream)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return kCouldNotOpenFile;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size <= 0)
+    {
+        fclose(file);
+        return kInvalidValue;
+    }
+    stream->stream = malloc((size_t)size);
+    if (!stream->stream)
+    {
+        fclose(file);
+        return kNoMemory;
+    }
+    if (fread(stream->stream, 1, (size_t)size, file) != (size_t)size)
+    {
+        fclose(file);
+        free(stream->stream);
+        return kCouldNotOpenFile;
+    }
+    fclose(file);
+    stream->name = "recorded";
+    stream->size = (size_t)size;
+    stream->messageCount = 0;
+    return kSuccess;
+}
+
+// NOTE(Kevin): Decodes the whole stream once, returns the number of
+// messages or -1 if the decoder failed. With check set, the wire sizes
+// of the decoded messages have to add up to the stream size.
+internal int64
+DecodeStream(bench_stream *stream, int fragment, bool32 check)
+{
+    g_stream     = stream->stream;
+    g_streamSize = stream->size;
+    g_readPos    = 0;
+    g_fragment   = fragment;
+    g_segmentLeft = 0;
+    g_random     = 0x2096;
+    int64 messageCount = 0;
+    uint64 decodedBytes = 0;
+    while (g_readPos < g_streamSize)
+    {
+        message *msg;
+        int err = ReceiveMessage(BenchFd, &msg);
+        if (err == kSuccess)
+        {
+            if (check)
+                decodedBytes += GetMessageWireSize(msg);
+            FreeMessage(msg);
+            ++messageCount;
+        }
+        else if (err != kWouldBlock)
+        {
+            fprintf(stderr, "%s, %s: decoder failed after %zu bytes (%s)\n",
+                    stream->name, g_fragmentNames[fragment], g_readPos,
+                    (err == kUnknownMessageType) ? "unknown message type" : "no more data");
+            return -1;
+        }
+    }
+    if (check && decodedBytes != stream->size)
+    {
+        fprintf(stderr, "%s, %s: decoded %llu of %zu bytes\n",
+                stream->name, g_fragmentNames[fragment], decodedBytes, stream->size);
+        return -1;
+    }
+    return messageCount;
+}
+
+internal void
+RunCase(bench_stream *stream, int fragment, double minTime)
+{
+    // NOTE(Kevin): A partially received message from a failed run must
+    // not leak into this one
+    DropMessageBuffer(BenchFd);
+    int64 messageCount = DecodeStream(stream, fragment, 1);
+    if (messageCount < 0)
+    {
+        DropMessageBuffer(BenchFd);
+        return;
+    }
+    if (stream->messageCount != 0 && (uint64)messageCount != stream->messageCount)
+    {
+        fprintf(stderr, "%s, %s: decoded %lld of %llu messages\n", stream->name,
+                g_fragmentNames[fragment], messageCount, stream->messageCount);
+        return;
+    }
+
+    g_recvCalls  = 0;
+    g_allocCalls = 0;
+    g_allocBytes = 0;
+    uint64 runs = 0;
+    double start = GetTime();
+    double elapsed;
+    do
+    {
+        DecodeStream(stream, fragment, 0);
+        ++runs;
+        elapsed = GetTime() - start;
+    } while (elapsed < minTime);
+
+    double messages = (double)messageCount * (double)runs;
+    printf("%-10s %-10s %10.3f %10.1f %10.2f %10.2f %12.1f %9.0f\n",
+           stream->name, g_fragmentNames[fragment],
+           messages / elapsed * 1e-6,
+           (double)stream->size * (double)runs / elapsed / (1024.0 * 1024.0),
+           (double)g_recvCalls / messages,
+           (double)g_allocCalls / messages,
+           (double)g_allocBytes / messages,
+           elapsed / messages * 1e9);
+}
+
+int
+main(int argc, char **argv)
+{
+    double minTime = 0.5;
+    const char *recordedPath = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:i:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                minTime = atof(optarg);
+                break;
+            case 's':
+                g_segmentSize = (size_t)atoi(optarg);
+                break;
+            case 'i':
+                recordedPath = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t seconds per case] [-s segment size] [-i stream file]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (g_segmentSize == 0)
+        g_segmentSize = 1;
+
+    int streamCount = (int)SizeofArray(g_mixes) + (recordedPath ? 1 : 0);
+    bench_stream *streams = calloc((size_t)streamCount, sizeof(bench_stream));
+    if (!streams)
+    {
+        fprintf(stderr, "Not enough memory.\n");
+        return 1;
+    }
+    for (int i = 0; i < (int)SizeofArray(g_mixes); ++i)
+        streams[i] = BuildStream(&g_mixes[i]);
+    if (recordedPath)
+    {
+        int err = LoadStream(recordedPath, &streams[streamCount - 1]);
+        if (err != kSuccess)
+        {
+            fprintf(stderr, "Can not read %s.\n", recordedPath);
+            return 1;
+        }
+    }
+
+    printf("segment size %zu bytes, %.2f s per case\n", g_segmentSize, minTime);
+    printf("%-10s %-10s %10s %10s %10s %10s %12s %9s\n",
+           "mix", "pattern", "Mmsg/s", "MB/s", "recv/msg", "allocs/msg", "alloc B/msg", "ns/msg");
+    for (int i = 0; i < streamCount; ++i)
+    {
+        for (int fragment = 0; fragment < kFragmentCount; ++fragment)
+            RunCase(&streams[i], fragment, minTime);
+        free(streams[i].stream);
+    }
+    free(streams);
+    return 0;
+}
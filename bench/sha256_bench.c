@@ -0,0 +1,168 @@
+// NOTE(Kevin): Throughput of the SHA-256 engines over different message
+// sizes. "reference" is the byte-at-a-time implementation p2pjs used
+// before; the other columns are the engines in sha-256.c. The batch
+// columns hash many independent buffers of the same size at once; that
+// is the only place where the AVX2 multi-buffer kernel is used.
+//
+// Usage: sha256_bench [megabytes per measurement]
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../p2pjs.h"
+#include "../sha-256.h"
+#include "sha256_reference.c"
+
+#define BatchSize 64
+
+internal double
+GetTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// NOTE(Kevin): Keeps the compiler from dropping the hash computations
+global_variable uint8 g_sink;
+
+// NOTE(Kevin): Returns MB/s, or 0 if the engine is not available
+internal double
+MeasureSingle(int engine, const uint8 *data, size_t len, size_t totalBytes)
+{
+    uint8 hash[32];
+    size_t iterations = totalBytes / len + 1;
+    if (engine != -1 && !sha_256_set_engine((enum sha_256_engine)engine))
+        return 0.0;
+    double start = GetTime();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        if (engine == -1)
+            calc_sha_256_reference(hash, data, len);
+        else
+            calc_sha_256(hash, data, len);
+        g_sink ^= hash[0];
+    }
+    double elapsed = GetTime() - start;
+    return (double)(iterations * len) / elapsed * 1e-6;
+}
+
+internal double
+MeasureBatch(int engine, const uint8 *data, size_t len, size_t totalBytes)
+{
+    uint8 hashes[BatchSize][32];
+    const void *inputs[BatchSize];
+    size_t lens[BatchSize];
+    for (int i = 0; i < BatchSize; ++i)
+    {
+        inputs[i] = data + (size_t)i * len;
+        lens[i] = len;
+    }
+    if (!sha_256_set_engine((enum sha_256_engine)engine))
+        return 0.0;
+    size_t iterations = totalBytes / (len * BatchSize) + 1;
+    double start = GetTime();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        calc_sha_256_batch(hashes, inputs, lens, BatchSize);
+        g_sink ^= hashes[BatchSize - 1][0];
+    }
+    double elapsed = GetTime() - start;
+    return (double)(iterations * len * BatchSize) / elapsed * 1e-6;
+}
+
+// NOTE(Kevin): Every engine, streaming and batching must agree with the
+// reference implementation, including all the padding corner cases.
+internal int
+CheckEngines(const uint8 *data)
+{
+    int mismatches = 0;
+    const int engines[] = { SHA_256_ENGINE_PORTABLE, SHA_256_ENGINE_SHANI, SHA_256_ENGINE_AVX2 };
+    for (unsigned int e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e)
+    {
+        if (!sha_256_set_engine((enum sha_256_engine)engines[e]))
+            continue;
+        for (size_t len = 0; len <= 300; ++len)
+        {
+            uint8 expected[32], hash[32];
+            calc_sha_256_reference(expected, data, len);
+            calc_sha_256(hash, data, len);
+            if (memcmp(hash, expected, 32) != 0)
+                ++mismatches;
+
+            struct Sha_256 sha;
+            sha_256_init(&sha);
+            size_t split = len / 3;
+            sha_256_update(&sha, data, split);
+            sha_256_update(&sha, data + split, len - split);
+            sha_256_final(&sha, hash);
+            if (memcmp(hash, expected, 32) != 0)
+                ++mismatches;
+        }
+
+        // NOTE(Kevin): Buffers of different lengths in one batch
+        uint8 hashes[BatchSize][32];
+        const void *inputs[BatchSize];
+        size_t lens[BatchSize];
+        for (int i = 0; i < BatchSize; ++i)
+        {
+            inputs[i] = data + i;
+            lens[i] = (size_t)(i * 37) % 300;
+        }
+        calc_sha_256_batch(hashes, inputs, lens, BatchSize);
+        for (int i = 0; i < BatchSize; ++i)
+        {
+            uint8 expected[32];
+            calc_sha_256_reference(expected, inputs[i], lens[i]);
+            if (memcmp(hashes[i], expected, 32) != 0)
+                ++mismatches;
+        }
+        printf("%-8s ok? %s\n", sha_256_engine_name(), mismatches ? "NO" : "yes");
+    }
+    sha_256_set_engine(SHA_256_ENGINE_AUTO);
+    return mismatches;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t totalBytes = (size_t)((argc > 1) ? atoi(argv[1]) : 64) * 1024 * 1024;
+    const size_t sizes[] = { 16, 64, 256, 1024, 4096, 65536, 1024 * 1024 };
+    const size_t maxSize = 1024 * 1024;
+    uint8 *data = malloc(maxSize * BatchSize);
+    if (!data)
+    {
+        fprintf(stderr, "Not enough memory.\n");
+        return 1;
+    }
+    srand((unsigned int)time(0));
+    for (size_t i = 0; i < maxSize * BatchSize; ++i)
+        data[i] = (uint8)rand();
+
+    if (CheckEngines(data) != 0)
+    {
+        fprintf(stderr, "SHA-256 engines disagree with the reference implementation.\n");
+        free(data);
+        return 1;
+    }
+    printf("auto engine: %s\n\n", sha_256_engine_name());
+
+    printf("%9s %11s %11s %11s %11s %11s   (MB/s)\n",
+           "size", "reference", "portable", "sha-ni", "avx2 batch", "auto batch");
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        size_t len = sizes[s];
+        double reference = MeasureSingle(-1, data, len, totalBytes);
+        double portable  = MeasureSingle(SHA_256_ENGINE_PORTABLE, data, len, totalBytes);
+        double shani     = MeasureSingle(SHA_256_ENGINE_SHANI, data, len, totalBytes);
+        double avx2      = MeasureBatch(SHA_256_ENGINE_AVX2, data, len, totalBytes);
+        double batch     = MeasureBatch(SHA_256_ENGINE_AUTO, data, len, totalBytes);
+        printf("%9zu %11.1f %11.1f %11.1f %11.1f %11.1f\n",
+               len, reference, portable, shani, avx2, batch);
+    }
+    free(data);
+    return 0;
+}
@@ -0,0 +1,446 @@
+// NOTE(Kevin): Cost of the job execution path in vm.c. Measures creating
+// and freeing a job VM, compiling sources of different sizes, the
+// overhead of wrenCall for run(_), and a few typical kernels at
+// different args, split into VM setup, compile, run and teardown.
+// The VMs use the same configuration (and allocator) as real jobs.
+//
+// Usage: vm_bench [-t seconds per case]
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../p2pjs.h"
+
+internal double
+GetTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+internal const char *g_localIp = "127.0.0.1";
+internal const char *g_localPort = "2096";
+internal int g_serverFd = -1;
+
+#include "../logging.c"
+#include "../tracing.c"
+#include "../metrics.c"
+#include "../vm.c"
+
+// NOTE(Kevin): Jobs can not use the p2pjs module, so the functions
+// behind it are never called
+internal int
+EmitCSourceJob(const char *sourcePath, double arg, const char *myIp, const char *myPort,
+               uint32 flags, uint8 cookieOut[CookieLen])
+{
+    Unused(sourcePath); Unused(arg); Unused(myIp); Unused(myPort); Unused(flags);
+    (void)cookieOut;
+    return kInvalidValue;
+}
+
+internal int
+EmitCSourceJobs(const char *sourcePath, const double *args, int count, const char *myIp,
+                const char *myPort, uint32 flags, int *firstIndexOut)
+{
+    Unused(sourcePath); Unused(args); Unused(count); Unused(myIp); Unused(myPort); Unused(flags);
+    (void)firstIndexOut;
+    return kInvalidValue;
+}
+
+internal int
+EmitMapReduceJobs(const char *sourcePath, const map_reduce *mapReduce, const char *myIp,
+                  const char *myPort, int *firstIndexOut, int *chunkCountOut)
+{
+    Unused(sourcePath); Unused(mapReduce); Unused(myIp); Unused(myPort);
+    (void)firstIndexOut;
+    (void)chunkCountOut;
+    return kInvalidValue;
+}
+
+internal int
+EmitDependentJob(const char *sourcePath, const int *upstream, int upstreamCount, bool32 asList,
+                 uint8 cookieOut[CookieLen])
+{
+    Unused(sourcePath); Unused(upstream); Unused(upstreamCount); Unused(asList);
+    (void)cookieOut;
+    return kInvalidValue;
+}
+
+internal const job_input *
+GetJobInputs(uint8 cookie[CookieLen], uint32 *countOut, bool32 *asListOut)
+{
+    (void)cookie;
+    Unused(countOut); Unused(asListOut);
+    return 0;
+}
+
+internal const uint8 *
+GetReceivedJobPayload(uint8 cookie[CookieLen], uint32 *sizeOut)
+{
+    (void)cookie;
+    *sizeOut = 0;
+    return 0;
+}
+
+internal int AttachJobPayload(int index, uint8 *payload, uint32 payloadSize) { (void)index; (void)payloadSize; free(payload); return kInvalidValue; }
+internal const uint8 *GetJobPayload(int index, uint32 *sizeOut) { (void)index; *sizeOut = 0; return 0; }
+internal int GetRangeLength(double start, double end, double step) { (void)start; (void)end; (void)step; return -1; }
+internal int FindReducer(const char *name) { (void)name; return -1; }
+internal int FindEmittedJobIndex(uint8 cookie[CookieLen]) { (void)cookie; return -1; }
+internal int IsJobFinished(int index) { (void)index; return 1; }
+internal bool32 IsJobResultMerged(int index) { (void)index; return 0; }
+internal double GetJobResult(int index) { (void)index; return 0.0; }
+internal const double *GetJobValues(int index, uint32 *countOut) { (void)index; *countOut = 0; return 0; }
+internal double GetJobArgument(int index) { (void)index; return 0.0; }
+internal int CountFinishedJobs(int firstIndex, int count) { (void)firstIndex; return count; }
+internal uint64 GetFinishedJobCount(void) { return 0; }
+internal void WaitForPeerActivity(int serverFd, double timeout) { (void)serverFd; (void)timeout; }
+internal int GetNumberOfOutstandingJobs(void) { return 0; }
+internal void Frame(void) {}
+internal bool32 IsResultStoreOpen(void) { return 0; }
+internal uint32 GetStoredResultCount(void) { return 0; }
+internal const result_record *LookupStoredResult(const char *sourcePath, double arg) { (void)sourcePath; (void)arg; return 0; }
+internal const double *GetStoredValues(const result_record *record) { (void)record; return 0; }
+internal const uint8 *GetStoredPayload(const result_record *record) { (void)record; return 0; }
+
+internal const char*
+CookieToTemporaryString(uint8 cookie[CookieLen])
+{
+    local_persist char cookieString[2 * CookieLen + 1];
+    for (int i = 0; i < CookieLen; ++i)
+        snprintf(&cookieString[2 * i], 3, "%02x", cookie[i]);
+    return cookieString;
+}
+
+global_variable uint8 g_benchCookie[CookieLen] = { 0x20, 0x96 };
+
+typedef struct
+{
+    double newTime;
+    double interpretTime;
+    double runTime;
+    double freeTime;
+    // NOTE(Kevin): Heap of a fresh VM, that is the core module
+    uint64 heapAfterNew;
+    uint64 peakHeap;
+    double result;
+    uint64 runs;
+} job_phases;
+
+// NOTE(Kevin): Does what RunCodeInVM() does, with a clock between the steps.
+// The times are averages over all runs.
+internal int
+MeasureJobPhases(const char *source, double arg, double minTime, job_phases *phases)
+{
+    memset(phases, 0, sizeof(*phases));
+    WrenConfiguration config;
+    InitJobVMConfiguration(&config);
+    memcpy(g_currentCookie, g_benchCookie, CookieLen);
+    char module[2 * CookieLen + 1];
+    strcpy(module, CookieToTemporaryString(g_benchCookie));
+
+    double benchStart = GetTime();
+    do
+    {
+        g_vmHeapSize = 0;
+        g_vmHeapPeak = 0;
+        double t0 = GetTime();
+        WrenVM *vm = wrenNewVM(&config);
+        double t1 = GetTime();
+        uint64 heapAfterNew = g_vmHeapSize;
+        WrenInterpretResult result = wrenInterpret(vm, module, source);
+        if (result != WREN_RESULT_SUCCESS)
+        {
+            wrenFreeVM(vm);
+            return (result == WREN_RESULT_COMPILE_ERROR) ? kCompileError : kRuntimeError;
+        }
+        double t2 = GetTime();
+        WrenHandle *runSignature = wrenMakeCallHandle(vm, "run(_)");
+        wrenEnsureSlots(vm, 2);
+        wrenGetVariable(vm, module, "Job", 0);
+        WrenHandle *jobClass = wrenGetSlotHandle(vm, 0);
+        wrenSetSlotHandle(vm, 0, jobClass);
+        wrenSetSlotDouble(vm, 1, arg);
+        result = wrenCall(vm, runSignature);
+        phases->result = wrenGetSlotDouble(vm, 0);
+        wrenReleaseHandle(vm, jobClass);
+        wrenReleaseHandle(vm, runSignature);
+        double t3 = GetTime();
+        wrenFreeVM(vm);
+        double t4 = GetTime();
+        if (result != WREN_RESULT_SUCCESS)
+            return kRuntimeError;
+
+        phases->newTime       += t1 - t0;
+        phases->interpretTime += t2 - t1;
+        phases->runTime       += t3 - t2;
+        phases->freeTime      += t4 - t3;
+        phases->heapAfterNew   = heapAfterNew;
+        if (g_vmHeapPeak > phases->peakHeap)
+            phases->peakHeap = g_vmHeapPeak;
+        ++phases->runs;
+    } while (phases->runs < 3 || GetTime() - benchStart < minTime);
+
+    phases->newTime       /= (double)phases->runs;
+    phases->interpretTime /= (double)phases->runs;
+    phases->runTime       /= (double)phases->runs;
+    phases->freeTime      /= (double)phases->runs;
+    return kSuccess;
+}
+
+global_variable const char *g_minimalJob =
+    "class Job {\n"
+    "    static run(n) { n }\n"
+    "}\n";
+
+// NOTE(Kevin): A job of roughly the given size: the minimal job plus
+// classes with small methods, which are compiled but never called
+internal char *
+MakeFillerSource(size_t size)
+{
+    size_t capacity = size + 4096;
+    char *source = malloc(capacity);
+    if (!source)
+    {
+        fprintf(stderr, "Not enough memory.\n");
+        exit(1);
+    }
+    size_t length = (size_t)snprintf(source, capacity, "%s", g_minimalJob);
+    for (int c = 0; length < size; ++c)
+    {
+        length += (size_t)snprintf(source + length, capacity - length, "class Filler%d {\n", c);
+        for (int m = 0; m < 16 && length < size; ++m)
+        {
+            length += (size_t)snprintf(source + length, capacity - length,
+                                       "    static f%d(x) {\n"
+                                       "        var y = x * %d + 1\n"
+                                       "        if (y > 100) y = y / 2\n"
+                                       "        return y\n"
+                                       "    }\n", m, c * 16 + m);
+        }
+        length += (size_t)snprintf(source + length, capacity - length, "}\n");
+    }
+    return source;
+}
+
+typedef struct
+{
+    const char *name;
+    const char *source;
+    double      args[3];
+} vm_kernel;
+
+global_variable vm_kernel g_kernels[] =
+{
+    {
+        "numeric",
+        "class Job {\n"
+        "    static run(n) {\n"
+        "        var s = 0\n"
+        "        for (i in 0...n) s = s + i * i\n"
+        "        return s\n"
+        "    }\n"
+        "}\n",
+        { 100, 10000, 1000000 },
+    },
+    {
+        "fib",
+        "class Job {\n"
+        "    static fib(n) { n < 2 ? n : Job.fib(n - 1) + Job.fib(n - 2) }\n"
+        "    static run(n) { Job.fib(n) }\n"
+        "}\n",
+        { 5, 15, 25 },
+    },
+    {
+        "list",
+        "class Job {\n"
+        "    static run(n) {\n"
+        "        var list = []\n"
+        "        for (i in 0...n) list.add(i)\n"
+        "        var s = 0\n"
+        "        for (x in list) s = s + x\n"
+        "        return s\n"
+        "    }\n"
+        "}\n",
+        { 100, 10000, 1000000 },
+    },
+    {
+        "map",
+        "class Job {\n"
+        "    static run(n) {\n"
+        "        var map = {}\n"
+        "        for (i in 0...n) map[i] = i * 2\n"
+        "        return map.count\n"
+        "    }\n"
+        "}\n",
+        { 100, 10000, 100000 },
+    },
+    {
+        "string",
+        "class Job {\n"
+        "    static run(n) {\n"
+        "        var parts = []\n"
+        "        for (i in 0...n) parts.add(i.toString)\n"
+        "        return parts.join(\",\").count\n"
+        "    }\n"
+        "}\n",
+        { 100, 10000, 100000 },
+    },
+};
+
+internal void
+BenchLifecycle(double minTime)
+{
+    job_phases phases;
+    if (MeasureJobPhases(g_minimalJob, 1.0, minTime, &phases) != kSuccess)
+    {
+        fprintf(stderr, "The minimal job failed.\n");
+        exit(1);
+    }
+    printf("VM lifecycle (minimal job, %llu runs)\n", phases.runs);
+    printf("  wrenNewVM   %10.1f us (%llu KB heap for the core module)\n",
+           phases.newTime * 1e6, phases.heapAfterNew / 1024);
+    printf("  interpret   %10.1f us\n", phases.interpretTime * 1e6);
+    printf("  run(_)      %10.1f us\n", phases.runTime * 1e6);
+    printf("  wrenFreeVM  %10.1f us\n", phases.freeTime * 1e6);
+
+    // NOTE(Kevin): The full path, as a worker runs a job
+    job_usage usage = {0};
+    uint64 runs = 0;
+    double start = GetTime();
+    double elapsed;
+    do
+    {
+        RunCode(g_benchCookie, 1.0, kJobKindRun, g_minimalJob, &usage);
+        ++runs;
+        elapsed = GetTime() - start;
+    } while (elapsed < minTime);
+    printf("  RunCode     %10.1f us per job, %.0f jobs/s\n\n",
+           elapsed / (double)runs * 1e6, (double)runs / elapsed);
+}
+
+internal void
+BenchCompile(double minTime)
+{
+    printf("Compile by source size\n");
+    printf("  %10s %14s %10s %12s\n", "bytes", "interpret us", "us/KB", "heap KB");
+    size_t sizes[] = { 0, 1024, 4096, 16 * 1024, 64 * 1024, 256 * 1024 };
+    for (int i = 0; i < (int)SizeofArray(sizes); ++i)
+    {
+        char *source = MakeFillerSource(sizes[i]);
+        size_t length = strlen(source);
+        job_phases phases;
+        if (MeasureJobPhases(source, 1.0, minTime, &phases) != kSuccess)
+        {
+            fprintf(stderr, "The %zu byte job failed.\n", length);
+            free(source);
+            continue;
+        }
+        printf("  %10zu %14.1f %10.2f %12llu\n", length, phases.interpretTime * 1e6,
+               phases.interpretTime * 1e6 / ((double)length / 1024.0),
+               phases.peakHeap / 1024);
+        free(source);
+    }
+    printf("\n");
+}
+
+internal void
+BenchCall(double minTime)
+{
+    WrenConfiguration config;
+    InitJobVMConfiguration(&config);
+    const char *module = CookieToTemporaryString(g_benchCookie);
+    WrenVM *vm = wrenNewVM(&config);
+    if (wrenInterpret(vm, module, g_minimalJob) != WREN_RESULT_SUCCESS)
+    {
+        fprintf(stderr, "The minimal job failed.\n");
+        exit(1);
+    }
+    WrenHandle *runSignature = wrenMakeCallHandle(vm, "run(_)");
+    wrenEnsureSlots(vm, 2);
+    wrenGetVariable(vm, module, "Job", 0);
+    WrenHandle *jobClass = wrenGetSlotHandle(vm, 0);
+
+    uint64 calls = 0;
+    double start = GetTime();
+    double elapsed;
+    do
+    {
+        for (int i = 0; i < 1000; ++i)
+        {
+            wrenSetSlotHandle(vm, 0, jobClass);
+            wrenSetSlotDouble(vm, 1, (double)i);
+            wrenCall(vm, runSignature);
+        }
+        calls += 1000;
+        elapsed = GetTime() - start;
+    } while (elapsed < minTime);
+
+    wrenReleaseHandle(vm, jobClass);
+    wrenReleaseHandle(vm, runSignature);
+    wrenFreeVM(vm);
+    printf("wrenCall overhead\n");
+    printf("  run(_) returning its arg: %.1f ns per call\n\n", elapsed / (double)calls * 1e9);
+}
+
+internal void
+BenchKernels(double minTime)
+{
+    printf("Kernels (times per job)\n");
+    printf("  %-8s %9s %9s %12s %12s %9s %12s %7s %10s\n", "kernel", "arg", "new us",
+           "interpret us", "run us", "free us", "total us", "setup", "heap KB");
+    for (int k = 0; k < (int)SizeofArray(g_kernels); ++k)
+    {
+        vm_kernel *kernel = &g_kernels[k];
+        for (int a = 0; a < (int)SizeofArray(kernel->args); ++a)
+        {
+            job_phases phases;
+            int err = MeasureJobPhases(kernel->source, kernel->args[a], minTime, &phases);
+            if (err != kSuccess)
+            {
+                fprintf(stderr, "Kernel %s failed (%s).\n", kernel->name,
+                        (err == kCompileError) ? "compile error" : "runtime error");
+                break;
+            }
+            double setup = phases.newTime + phases.interpretTime + phases.freeTime;
+            double total = setup + phases.runTime;
+            printf("  %-8s %9.0f %9.1f %12.1f %12.1f %9.1f %12.1f %6.1f%% %10llu\n",
+                   kernel->name, kernel->args[a], phases.newTime * 1e6,
+                   phases.interpretTime * 1e6, phases.runTime * 1e6,
+                   phases.freeTime * 1e6, total * 1e6, 100.0 * setup / total,
+                   phases.peakHeap / 1024);
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    double minTime = 0.25;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                minTime = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t seconds per case]\n", argv[0]);
+                return 1;
+        }
+    }
+    // NOTE(Kevin): Job output and errors would only disturb the timing
+    g_logLevel = kLogError;
+
+    BenchLifecycle(minTime);
+    BenchCompile(minTime);
+    BenchCall(minTime);
+    BenchKernels(minTime);
+    return 0;
+}
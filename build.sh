@@ -17,5 +17,32 @@ else
     echo "Make sure that you have the wren submodule!.";
 fi
 
+if [ "$1" = "bench" ];
+then
+    # Benchmarks are built with optimizations and without sanitizers
+    BENCH_CFLAGS="-O2 -g -Wall -Wextra -Wpedantic -std=c11 -pthread -Iwren/src/include -L."
+    cc -o bench/cookie_bench bench/cookie_bench.c sha-256.c $BENCH_CFLAGS -lm
+    cc -o bench/sha256_bench bench/sha256_bench.c sha-256.c $BENCH_CFLAGS -lm
+    # The decoder benchmark includes only a part of p2pjs
+    cc -o bench/decoder_bench bench/decoder_bench.c $BENCH_CFLAGS -DNDEBUG -Wno-unused-function -lm
+    cc -o bench/vm_bench bench/vm_bench.c $BENCH_CFLAGS -DNDEBUG -Wno-unused-function -lwren -lm
+    # The cluster benchmark starts this build of p2pjs
+    cc -o bench/p2pjs_release p2pjs.c sha-256.c $BENCH_CFLAGS -DNDEBUG $OPTS -lwren -lm
+    cc -o bench/cluster_bench bench/cluster_bench.c $BENCH_CFLAGS
+    exit 0
+fi
+
+if [ "$1" = "tools" ];
+then
+    TOOLS_CFLAGS="-O2 -g -Wall -Wextra -Wpedantic -std=c11"
+    cc -o tools/trace2json tools/trace2json.c $TOOLS_CFLAGS
+    cc -o tools/loadgen tools/loadgen.c $TOOLS_CFLAGS -lm
+    # The replay tool is a node without sockets, it includes p2pjs.c
+    cc -o tools/replay tools/replay.c sha-256.c $TOOLS_CFLAGS -Wno-unused-function -pthread -Iwren/src/include -L. $OPTS -lwren -lm
+    # The simulator runs many nodes of this code in one process, without wren
+    cc -o tools/sim tools/sim.c sha-256.c $TOOLS_CFLAGS -Wno-unused-function -pthread -lm
+    exit 0
+fi
+
 cc -o p2pjs p2pjs.c sha-256.c $CFLAGS $OPTS -lwren -lm
 
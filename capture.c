@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "p2pjs.h"
+
+// NOTE(Kevin): Wire capture. With -r every message a node receives is
+// appended to a capture file, together with the time and the fd it
+// arrived on. tools/replay feeds the file back into HandleMessageFromPeer,
+// so traffic of a real cluster can be reproduced (and profiled) offline.
+// Records go through a large stdio buffer that is flushed every second;
+// everything runs on the main thread.
+
+#define CaptureBufferSize (256 * 1024)
+// NOTE(Kevin): A crashed node loses at most the last second
+#define CaptureFlushInterval 1000000000ull
+
+typedef struct
+{
+    int       fd;
+    peer_info info;
+} captured_peer;
+
+global_variable FILE          *g_captureFile;
+global_variable char          *g_captureBuffer;
+global_variable uint64         g_captureStartTime;
+global_variable uint64         g_captureLastFlush;
+// NOTE(Kevin): The peer_info last written for every fd
+global_variable captured_peer *g_capturedPeers;
+global_variable unsigned int   g_capturedPeerCount;
+global_variable unsigned int   g_capturedPeerCapacity;
+
+internal uint64
+GetCaptureTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000000ull + (uint64)ts.tv_nsec;
+}
+
+internal int
+OpenCapture(const char *path, const char *ip, const char *port)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return kCouldNotOpenFile;
+    g_captureBuffer = malloc(CaptureBufferSize);
+    if (g_captureBuffer)
+        setvbuf(file, g_captureBuffer, _IOFBF, CaptureBufferSize);
+
+    capture_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CaptureMagic, sizeof(header.magic));
+    header.version    = CaptureVersion;
+    header.recordSize = sizeof(capture_record);
+    snprintf(header.ipaddr, PeerIPLen, "%s", ip);
+    snprintf(header.port, PeerPortLen, "%s", port);
+    struct timespec wallClock;
+    clock_gettime(CLOCK_REALTIME, &wallClock);
+    header.startTime   = (uint64)wallClock.tv_sec * 1000000000ull + (uint64)wallClock.tv_nsec;
+    g_captureStartTime = GetCaptureTime();
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        fclose(file);
+        free(g_captureBuffer);
+        g_captureBuffer = 0;
+        return kSyscallFailed;
+    }
+    g_captureFile = file;
+    return kSuccess;
+}
+
+internal void
+CloseCapture(void)
+{
+    if (!g_captureFile)
+        return;
+    fclose(g_captureFile);
+    g_captureFile = 0;
+    free(g_captureBuffer);
+    g_captureBuffer = 0;
+    free(g_capturedPeers);
+    g_capturedPeers = 0;
+    g_capturedPeerCount = 0;
+    g_capturedPeerCapacity = 0;
+}
+
+internal void
+WriteCaptureRecord(uint64 time, int fd, uint16 kind, uint16 messageType,
+                   const void *data, uint32 size, const void *moreData, uint32 moreSize)
+{
+    capture_record record;
+    record.time        = time;
+    record.peer        = fd;
+    record.kind        = kind;
+    record.messageType = messageType;
+    record.size        = size + moreSize;
+    record.reserved    = 0;
+    fwrite(&record, sizeof(record), 1, g_captureFile);
+    if (size > 0)
+        fwrite(data, size, 1, g_captureFile);
+    if (moreSize > 0)
+        fwrite(moreData, moreSize, 1, g_captureFile);
+}
+
+// NOTE(Kevin): Writes a peer record if fd is new or its peer changed
+internal void
+CapturePeer(uint64 time, int fd, const peer_info *info)
+{
+    captured_peer *peer = 0;
+    for (unsigned int i = 0; i < g_capturedPeerCount; ++i)
+    {
+        if (g_capturedPeers[i].fd == fd)
+        {
+            peer = &g_capturedPeers[i];
+            break;
+        }
+    }
+    if (peer && memcmp(&peer->info, info, sizeof(peer_info)) == 0)
+        return;
+    if (!peer)
+    {
+        if (g_capturedPeerCount == g_capturedPeerCapacity)
+        {
+            unsigned int newCapacity = g_capturedPeerCapacity > 0 ? g_capturedPeerCapacity * 2 : 8;
+            captured_peer *t = realloc(g_capturedPeers, sizeof(captured_peer) * newCapacity);
+            if (!t)
+                return;
+            g_capturedPeers = t;
+            g_capturedPeerCapacity = newCapacity;
+        }
+        peer = &g_capturedPeers[g_capturedPeerCount++];
+        peer->fd = fd;
+    }
+    peer->info = *info;
+    WriteCaptureRecord(time, fd, kCapturePeer, 0, info, sizeof(peer_info), 0, 0);
+}
+
+// NOTE(Kevin): payload is the message without its type, as it was received
+internal void
+CaptureFrame(int fd, const peer_info *peer, uint16 messageType, const void *payload, uint32 payloadSize)
+{
+    if (!g_captureFile)
+        return;
+    uint64 time = GetCaptureTime() - g_captureStartTime;
+    // NOTE(Kevin): Only the meaningful part, the rest of the strings is garbage
+    peer_info info;
+    memset(&info, 0, sizeof(info));
+    snprintf(info.ipaddr, PeerIPLen, "%s", peer->ipaddr);
+    snprintf(info.port, PeerPortLen, "%s", peer->port);
+    CapturePeer(time, fd, &info);
+    WriteCaptureRecord(time, fd, kCaptureFrame, messageType,
+                       &messageType, sizeof(messageType), payload, payloadSize);
+    if (time - g_captureLastFlush >= CaptureFlushInterval)
+    {
+        fflush(g_captureFile);
+        g_captureLastFlush = time;
+    }
+}
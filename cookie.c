@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "p2pjs.h"
+#include "sha-256.h"
+
+// NOTE(Kevin): Job cookies are
+//   [ 16 byte ChaCha12 keystream | 8 byte counter | 8 byte node id ]
+// The node id and the counter make every cookie unique (as long as the node
+// ids differ), the keystream makes them unpredictable for other peers.
+// One ChaCha block yields the random part of four cookies. We use the
+// 12 round variant; it has a comfortable security margin for cookies
+// and is almost twice as fast as ChaCha20.
+// The random part comes first, because only the first bytes of a cookie
+// are shown to the user.
+
+#define CookieNodeIdLen  8
+#define CookieCounterLen 8
+#define CookieTagLen     (CookieLen - CookieNodeIdLen - CookieCounterLen)
+#define CookiesPerBlock  (64 / CookieTagLen)
+
+typedef struct
+{
+    uint8  nodeId[CookieNodeIdLen];
+    uint32 key[8];
+    uint64 counter;
+    uint32 block[16];
+} cookie_generator;
+
+global_variable cookie_generator g_cookieGenerator;
+
+#define ChaChaDoubleRounds 6
+
+#define ChaChaRotate(V, N) (((V) << (N)) | ((V) >> (32 - (N))))
+#define ChaChaQuarterRound(A, B, C, D)                    \
+    A += B; D ^= A; D = ChaChaRotate(D, 16);              \
+    C += D; B ^= C; B = ChaChaRotate(B, 12);              \
+    A += B; D ^= A; D = ChaChaRotate(D, 8);               \
+    C += D; B ^= C; B = ChaChaRotate(B, 7);
+
+internal void
+ChaChaBlock(const uint32 key[8], uint64 blockCounter, const uint8 nonce[8], uint32 out[16])
+{
+    uint32 x[16];
+    x[0]  = 0x61707865;
+    x[1]  = 0x3320646e;
+    x[2]  = 0x79622d32;
+    x[3]  = 0x6b206574;
+    for (int i = 0; i < 8; ++i)
+        x[4 + i] = key[i];
+    x[12] = (uint32)blockCounter;
+    x[13] = (uint32)(blockCounter >> 32);
+    x[14] = (uint32)nonce[0] | (uint32)nonce[1] << 8 | (uint32)nonce[2] << 16 | (uint32)nonce[3] << 24;
+    x[15] = (uint32)nonce[4] | (uint32)nonce[5] << 8 | (uint32)nonce[6] << 16 | (uint32)nonce[7] << 24;
+    uint32 s[16];
+    memcpy(s, x, sizeof(x));
+    for (int round = 0; round < ChaChaDoubleRounds; ++round)
+    {
+        ChaChaQuarterRound(x[0], x[4], x[8],  x[12]);
+        ChaChaQuarterRound(x[1], x[5], x[9],  x[13]);
+        ChaChaQuarterRound(x[2], x[6], x[10], x[14]);
+        ChaChaQuarterRound(x[3], x[7], x[11], x[15]);
+        ChaChaQuarterRound(x[0], x[5], x[10], x[15]);
+        ChaChaQuarterRound(x[1], x[6], x[11], x[12]);
+        ChaChaQuarterRound(x[2], x[7], x[8],  x[13]);
+        ChaChaQuarterRound(x[3], x[4], x[9],  x[14]);
+    }
+    for (int i = 0; i < 16; ++i)
+        out[i] = x[i] + s[i];
+}
+
+// NOTE(Kevin): Seeds node id and key from /dev/urandom. If that is not
+// available, falls back to hashing everything we know about this node.
+internal int
+InitCookieGenerator(const char *ip, const char *port)
+{
+    uint8 seed[CookieNodeIdLen + sizeof(g_cookieGenerator.key)];
+    FILE *urandom = fopen("/dev/urandom", "rb");
+    bool32 seeded = 0;
+    if (urandom)
+    {
+        seeded = fread(seed, sizeof(seed), 1, urandom) == 1;
+        fclose(urandom);
+    }
+    if (!seeded)
+    {
+        struct
+        {
+            char   ip[PeerIPLen];
+            char   port[PeerPortLen];
+            long   pid;
+            time_t time;
+            clock_t clock;
+            int    random;
+        } fallback;
+        memset(&fallback, 0, sizeof(fallback));
+        snprintf(fallback.ip, PeerIPLen, "%s", ip);
+        snprintf(fallback.port, PeerPortLen, "%s", port);
+        fallback.pid    = (long)getpid();
+        fallback.time   = time(0);
+        fallback.clock  = clock();
+        fallback.random = rand();
+        uint8 hash[32];
+        calc_sha_256(hash, &fallback, sizeof(fallback));
+        memcpy(seed, hash, CookieNodeIdLen);
+        fallback.random = rand();
+        calc_sha_256(hash, &fallback, sizeof(fallback));
+        memcpy(seed + CookieNodeIdLen, hash, sizeof(hash));
+    }
+    memcpy(g_cookieGenerator.nodeId, seed, CookieNodeIdLen);
+    memcpy(g_cookieGenerator.key, seed + CookieNodeIdLen, sizeof(g_cookieGenerator.key));
+    g_cookieGenerator.counter = 0;
+    return seeded ? kSuccess : kSyscallFailed;
+}
+
+internal void
+GenerateCookie(uint8 cookie[CookieLen])
+{
+    cookie_generator *gen = &g_cookieGenerator;
+    uint64 counter = gen->counter++;
+    unsigned int slot = (unsigned int)(counter % CookiesPerBlock);
+    if (slot == 0)
+        ChaChaBlock(gen->key, counter / CookiesPerBlock, gen->nodeId, gen->block);
+
+    memcpy(cookie, (uint8*)gen->block + slot * CookieTagLen, CookieTagLen);
+    // NOTE(Kevin): Host byte order, like everything else on the wire
+    memcpy(cookie + CookieTagLen, &counter, CookieCounterLen);
+    memcpy(cookie + CookieTagLen + CookieCounterLen, gen->nodeId, CookieNodeIdLen);
+}
@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "p2pjs.h"
+
+// NOTE(Kevin): Per-emitter accounting on the worker side.
+// Every emitter (identified by the peer_info it puts into its queries) gets
+// a weight. Both the decision whether to offer resources and the decision
+// which received job runs next are made by deficit round-robin over the
+// emitters, so an emitter that floods queries can not starve the others.
+
+#ifndef P2PJS_OfferTimeout
+  // NOTE(Kevin): Seconds after which an offer that got neither a job nor a
+  // declineOffer no longer holds a slot
+  #define P2PJS_OfferTimeout 2.0
+#endif
+
+#ifndef P2PJS_QueryTimeout
+  // NOTE(Kevin): Seconds we remember the queries of an emitter that we
+  // could not serve right away, counted from its latest query
+  #define P2PJS_QueryTimeout 5.0
+#endif
+
+typedef struct
+{
+    peer_info source;
+    double    weight;
+
+    // NOTE(Kevin): DRR state for handing out offers and for running jobs
+    double    offerDeficit;
+    double    runDeficit;
+
+    // NOTE(Kevin): Slots held by this emitter
+    int       queuedJobs;
+    int       pendingOffers;
+    // NOTE(Kevin): Jobs of a job graph waiting for their inputs; they hold
+    // a slot, but can not run yet
+    int       blockedJobs;
+
+    // NOTE(Kevin): Number of queries that arrived while we had no free
+    // slot for them. An offer is for a slot, not for a particular job: the
+    // emitter sends whichever job is still unassigned, and declines once
+    // it has none left. The latest query's cookie goes into the offers.
+    int       waitingCount;
+    uint8     lastQueryCookie[CookieLen];
+    double    lastQueryTime;
+
+    uint64    servedJobs;
+} emitter_account;
+
+global_variable emitter_account *g_emitterAccounts;
+global_variable unsigned int g_emitterAccountCount;
+global_variable unsigned int g_emitterAccountCapacity;
+
+// NOTE(Kevin): An offer holds a slot until a job arrives on the
+// connection it went out on, the emitter declines it or it times out
+typedef struct
+{
+    uint8  cookie[CookieLen];
+    int    accountIdx;
+    int    fd;
+    double time;
+} pending_offer;
+
+global_variable pending_offer *g_pendingOffers;
+global_variable unsigned int   g_pendingOfferCount;
+global_variable unsigned int   g_pendingOfferCapacity;
+
+// NOTE(Kevin): Round-robin cursors
+global_variable unsigned int g_offerCursor;
+global_variable unsigned int g_runCursor;
+
+internal int AreIPAddressesEqual(const char *a, const char *b);
+
+internal int
+FindEmitterAccount(const char *ip, const char *port)
+{
+    for (unsigned int i = 0; i < g_emitterAccountCount; ++i)
+    {
+        if (AreIPAddressesEqual(g_emitterAccounts[i].source.ipaddr, ip) &&
+            strcmp(g_emitterAccounts[i].source.port, port) == 0)
+        {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+internal int
+GetEmitterAccount(const char *ip, const char *port)
+{
+    int idx = FindEmitterAccount(ip, port);
+    if (idx != -1)
+        return idx;
+    if (g_emitterAccountCount == g_emitterAccountCapacity)
+    {
+        unsigned int newCapacity = (g_emitterAccountCapacity == 0) ? 8 : 2 * g_emitterAccountCapacity;
+        emitter_account *t = realloc(g_emitterAccounts, sizeof(emitter_account) * newCapacity);
+        if (!t)
+            return -1;
+        g_emitterAccounts = t;
+        g_emitterAccountCapacity = newCapacity;
+    }
+    emitter_account *account = &g_emitterAccounts[g_emitterAccountCount];
+    memset(account, 0, sizeof(*account));
+    snprintf(account->source.ipaddr, PeerIPLen, "%s", ip);
+    snprintf(account->source.port, PeerPortLen, "%s", port);
+    account->weight = 1.0;
+    return (int)g_emitterAccountCount++;
+}
+
+internal int
+SetEmitterWeight(const char *ip, const char *port, double weight)
+{
+    if (weight <= 0.0)
+        return kInvalidValue;
+    int idx = GetEmitterAccount(ip, port);
+    if (idx == -1)
+        return kNoMemory;
+    g_emitterAccounts[idx].weight = weight;
+    return kSuccess;
+}
+
+internal int
+GetUsedSlotCount(void)
+{
+    int count = 0;
+    for (unsigned int i = 0; i < g_emitterAccountCount; ++i)
+    {
+        count += g_emitterAccounts[i].queuedJobs + g_emitterAccounts[i].blockedJobs +
+                 g_emitterAccounts[i].pendingOffers;
+    }
+    return count;
+}
+
+internal void
+RemovePendingOffer(unsigned int index)
+{
+    emitter_account *account = &g_emitterAccounts[g_pendingOffers[index].accountIdx];
+    if (account->pendingOffers > 0)
+        --account->pendingOffers;
+    g_pendingOffers[index] = g_pendingOffers[--g_pendingOfferCount];
+}
+
+// NOTE(Kevin): Records the connection a granted offer went out on
+internal void
+SetPendingOfferFd(uint8 cookie[CookieLen], int fd)
+{
+    for (unsigned int i = 0; i < g_pendingOfferCount; ++i)
+    {
+        if (g_pendingOffers[i].fd == -1 &&
+            memcmp(g_pendingOffers[i].cookie, cookie, CookieLen) == 0)
+        {
+            g_pendingOffers[i].fd = fd;
+            return;
+        }
+    }
+}
+
+// NOTE(Kevin): The offer with the cookie, or else the oldest offer that
+// went out on fd, if fd is not -1. Returns its index, -1 if there is none.
+internal int
+FindPendingOffer(uint8 cookie[CookieLen], int fd)
+{
+    int found = -1;
+    for (unsigned int i = 0; i < g_pendingOfferCount; ++i)
+    {
+        if (memcmp(g_pendingOffers[i].cookie, cookie, CookieLen) == 0)
+        {
+            found = (int)i;
+            break;
+        }
+        if (fd != -1 && g_pendingOffers[i].fd == fd &&
+            (found == -1 || g_pendingOffers[i].time < g_pendingOffers[found].time))
+        {
+            found = (int)i;
+        }
+    }
+    return found;
+}
+
+// NOTE(Kevin): Frees the slot of the offer FindPendingOffer() finds.
+// Returns the account the offer was made for, -1 if there is no such offer.
+internal int
+TakePendingOffer(uint8 cookie[CookieLen], int fd, double *offerTimeOut)
+{
+    int found = FindPendingOffer(cookie, fd);
+    if (found == -1)
+        return -1;
+    int accountIdx = g_pendingOffers[found].accountIdx;
+    if (offerTimeOut)
+        *offerTimeOut = g_pendingOffers[found].time;
+    RemovePendingOffer((unsigned int)found);
+    return accountIdx;
+}
+
+internal void
+ExpireOffersAndQueries(double now)
+{
+    for (unsigned int i = 0; i < g_pendingOfferCount;)
+    {
+        // NOTE(Kevin): The emitter neither sent the job nor declined, e.g.
+        // because the connection broke
+        if (now - g_pendingOffers[i].time > P2PJS_OfferTimeout)
+            RemovePendingOffer(i);
+        else
+            ++i;
+    }
+    for (unsigned int i = 0; i < g_emitterAccountCount; ++i)
+    {
+        emitter_account *account = &g_emitterAccounts[i];
+        if (now - account->lastQueryTime > P2PJS_QueryTimeout)
+            account->waitingCount = 0;
+    }
+}
+
+// NOTE(Kevin): A query that reaches us twice, e.g. spread by two peers,
+// counts twice. The surplus offers get declined.
+internal void
+RememberQuery(int accountIdx, uint8 cookie[CookieLen], double now)
+{
+    emitter_account *account = &g_emitterAccounts[accountIdx];
+    ++account->waitingCount;
+    memcpy(account->lastQueryCookie, cookie, CookieLen);
+    account->lastQueryTime = now;
+}
+
+// NOTE(Kevin): The emitter declined an offer, so it has no unassigned job left
+internal void
+ForgetWaitingQueries(int accountIdx)
+{
+    g_emitterAccounts[accountIdx].waitingCount = 0;
+}
+
+// NOTE(Kevin): One step of deficit round-robin over all emitters that
+// have demand. Returns the index of the emitter that gets the next unit
+// of service, or -1 if nobody has demand.
+internal int
+PickEmitterDRR(unsigned int *cursor, bool32 forRunning)
+{
+    if (g_emitterAccountCount == 0)
+        return -1;
+    bool32 anyDemand = 0;
+    for (unsigned int i = 0; i < g_emitterAccountCount; ++i)
+    {
+        emitter_account *account = &g_emitterAccounts[i];
+        bool32 hasDemand = forRunning ? (account->queuedJobs > 0) : (account->waitingCount > 0);
+        if (hasDemand)
+            anyDemand = 1;
+        else if (forRunning)
+            account->runDeficit = 0.0;
+        else
+            account->offerDeficit = 0.0;
+    }
+    if (!anyDemand)
+        return -1;
+    // NOTE(Kevin): Every emitter with demand collects its weight as quantum
+    // per round, until one of them can pay for one unit of service.
+    for (;;)
+    {
+        for (unsigned int n = 0; n < g_emitterAccountCount; ++n)
+        {
+            unsigned int i = (*cursor + n) % g_emitterAccountCount;
+            emitter_account *account = &g_emitterAccounts[i];
+            bool32 hasDemand = forRunning ? (account->queuedJobs > 0) : (account->waitingCount > 0);
+            if (!hasDemand)
+                continue;
+            double *deficit = forRunning ? &account->runDeficit : &account->offerDeficit;
+            if (*deficit >= 1.0)
+            {
+                *deficit -= 1.0;
+                // NOTE(Kevin): Stay on this emitter while it has deficit left
+                *cursor = i;
+                return (int)i;
+            }
+        }
+        for (unsigned int i = 0; i < g_emitterAccountCount; ++i)
+        {
+            emitter_account *account = &g_emitterAccounts[i];
+            bool32 hasDemand = forRunning ? (account->queuedJobs > 0) : (account->waitingCount > 0);
+            if (!hasDemand)
+                continue;
+            if (forRunning)
+                account->runDeficit += account->weight;
+            else
+                account->offerDeficit += account->weight;
+        }
+        *cursor = (*cursor + 1) % g_emitterAccountCount;
+    }
+}
+
+typedef struct
+{
+    int   accountIdx;
+    uint8 cookie[CookieLen];
+} granted_offer;
+
+// NOTE(Kevin): Hands out free slots to waiting queries in fair order.
+// Returns the number of offers written to offersOut.
+internal int
+GrantOffers(granted_offer *offersOut, int maxOffers)
+{
+    double now = GetTime();
+    ExpireOffersAndQueries(now);
+    int count = 0;
+    while (count < maxOffers && GetUsedSlotCount() < P2PJS_MaxRunningJobs)
+    {
+        if (g_pendingOfferCount == g_pendingOfferCapacity)
+        {
+            unsigned int newCapacity = (g_pendingOfferCapacity == 0) ? 8 : 2 * g_pendingOfferCapacity;
+            pending_offer *t = realloc(g_pendingOffers, sizeof(pending_offer) * newCapacity);
+            if (!t)
+                break;
+            g_pendingOffers = t;
+            g_pendingOfferCapacity = newCapacity;
+        }
+        int idx = PickEmitterDRR(&g_offerCursor, 0);
+        if (idx == -1)
+            break;
+        emitter_account *account = &g_emitterAccounts[idx];
+        offersOut[count].accountIdx = idx;
+        memcpy(offersOut[count].cookie, account->lastQueryCookie, CookieLen);
+        --account->waitingCount;
+        ++account->pendingOffers;
+        pending_offer *offer = &g_pendingOffers[g_pendingOfferCount++];
+        memcpy(offer->cookie, offersOut[count].cookie, CookieLen);
+        offer->accountIdx = idx;
+        offer->fd         = -1;
+        offer->time       = now;
+        ++count;
+    }
+    return count;
+}
+
+// NOTE(Kevin): The offer for the job was taken over by TakePendingOffer()
+internal void
+OnJobTakenFromEmitter(int accountIdx)
+{
+    ++g_emitterAccounts[accountIdx].queuedJobs;
+}
+
+internal void
+OnJobBlockedForEmitter(int accountIdx)
+{
+    emitter_account *account = &g_emitterAccounts[accountIdx];
+    if (account->queuedJobs > 0)
+        --account->queuedJobs;
+    ++account->blockedJobs;
+}
+
+internal void
+OnJobUnblockedForEmitter(int accountIdx)
+{
+    emitter_account *account = &g_emitterAccounts[accountIdx];
+    if (account->blockedJobs > 0)
+        --account->blockedJobs;
+    ++account->queuedJobs;
+}
+
+internal void
+OnJobFinishedForEmitter(int accountIdx)
+{
+    emitter_account *account = &g_emitterAccounts[accountIdx];
+    if (account->queuedJobs > 0)
+        --account->queuedJobs;
+    ++account->servedJobs;
+}
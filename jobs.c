@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
 
 #include "p2pjs.h"
 #include "sha-256.h"
@@ -12,21 +13,138 @@ enum
     kStateRunning,
 
     kStateFinished,
+
+    // NOTE(Kevin): A latency-sensitive job ran for too long on its first
+    // peer; we asked for a second peer to run a copy.
+    kStateHedgeQuerySent,
+
+    // NOTE(Kevin): Running on two peers, the first result wins
+    kStateHedged,
+
+    // NOTE(Kevin): A job of a job graph. Emitted jobs are not queried
+    // before all their upstream jobs run; received jobs do not run before
+    // all their inputs arrived.
+    kStateWaiting,
+
+    // NOTE(Kevin): An identical emitted job is in flight, its result is
+    // taken over, see memo.c
+    kStateFollowing,
 };
 
+#ifndef P2PJS_HedgePercentile
+  // NOTE(Kevin): Hedge once a job ran longer than this percentile of
+  // the runtimes observed for its source
+  #define P2PJS_HedgePercentile 95
+#endif
+
+#ifndef P2PJS_QueryRetryInterval
+  // NOTE(Kevin): Seconds without an offer after which a job is queried
+  // again. Workers only remember a few queries per emitter and drop the
+  // oldest, so a burst of jobs can leave some without any offer.
+  #define P2PJS_QueryRetryInterval 2.0
+#endif
+
+#ifndef P2PJS_QueryRetryMaxInterval
+  // NOTE(Kevin): The retry interval doubles with every unanswered retry
+  // of a job up to this many seconds
+  #define P2PJS_QueryRetryMaxInterval 60.0
+#endif
+
+// NOTE(Kevin): Peers that offered for a job since it was last queried
+#define MaxOfferingPeers 8
+
+#ifndef P2PJS_HedgeMinSamples
+  #define P2PJS_HedgeMinSamples 8
+#endif
+
+#ifndef P2PJS_OverdueRuntimeFactor
+  // NOTE(Kevin): A job on a peer that stopped sending heartbeats is only
+  // re-dispatched once it ran this many times longer than the longest run
+  // of its source we have seen. Workers are silent while they run a job,
+  // so silence alone says nothing.
+  #define P2PJS_OverdueRuntimeFactor 4.0
+#endif
+
+#define MaxAssignees 2
+#define RuntimeSampleCount 64
+
+typedef struct
+{
+    // NOTE(Kevin): fd of the peer that runs the job
+    int    fd;
+    double dispatchTime;
+} assignee;
+
+typedef struct
+{
+    uint8  sourceHash[CookieLen];
+    double samples[RuntimeSampleCount];
+    unsigned int sampleCount;
+    unsigned int nextSample;
+    // NOTE(Kevin): P2PJS_HedgePercentile of the samples, updated when one is
+    // added. Negative while there are too few.
+    double hedgeThreshold;
+    double maxRuntime;
+    // NOTE(Kevin): Sums of the usage the workers reported for this source
+    unsigned int usageCount;
+    double cpuTime;
+    double wallTime;
+    double queueTime;
+    uint64 maxPeakHeap;
+} runtime_stats;
+
 typedef struct
 {
     uint8       cookie[CookieLen];
-    int         source; 
+    // NOTE(Kevin): fd of the emitter; peer ids change when peers are removed
+    int         sourceFd;
+    int         account;
     int         state;
+    double      receiveTime;
     job         job;
+    payload_region payload;
 } received_job;
 
 typedef struct
 {
     uint8       cookie[CookieLen];
     int         state; 
+    uint32      flags;
+    uint8       sourceHash[CookieLen];
+    assignee    assignees[MaxAssignees];
+    int         assigneeCount;
+    double      emitTime;
+    // NOTE(Kevin): When we last asked for resources
+    double      queryTime;
+    // NOTE(Kevin): Retries since the job was last queried from all peers
+    int         queryRetries;
+    int         offeringFds[MaxOfferingPeers];
+    int         offeringFdCount;
     double      result;
+    // NOTE(Kevin): Set if the job returned a list of numbers
+    double     *values;
+    uint32      valueCount;
+    // NOTE(Kevin): Set if the job returned a ByteBuffer
+    payload_region resultPayload;
+    // NOTE(Kevin): Map-reduce chunks whose result goes up an aggregation
+    // tree: fd of the worker it goes to, -1 if it comes to us directly
+    int         aggregatorFd;
+    // NOTE(Kevin): Finished, but the result is part of another chunk's
+    bool32      merged;
+    // NOTE(Kevin): Number of chunks of the map-reduce, only set on its first
+    uint32      groupChunkCount;
+    int         resultState;
+    // NOTE(Kevin): Key in the result cache, if the job can be cached
+    uint8       memoKey[CookieLen];
+    bool32      hasMemoKey;
+    // NOTE(Kevin): Index of the job a following job waits for, and the
+    // next job that waits for the same one
+    int         leader;
+    int         nextFollower;
+    // NOTE(Kevin): First of the jobs that follow this one, -1 if none
+    int         firstFollower;
+    // NOTE(Kevin): Index into g_runtimeStats, -1 until it is looked up
+    int         runtimeStats;
     job         job;
 } emitted_job;
 
@@ -37,6 +155,35 @@ global_variable unsigned int g_receivedJobCount;
 global_variable unsigned int g_receivedJobCapacity;
 global_variable unsigned int g_emittedJobCount;
 global_variable unsigned int g_emittedJobCapacity;
+global_variable uint64       g_finishedJobCount;
+// NOTE(Kevin): Emitted jobs below this index are finished, and no
+// unanswered query is due before this time
+global_variable unsigned int g_firstOpenEmittedJob;
+global_variable double       g_nextQueryRetryTime;
+// NOTE(Kevin): No job below this index waits for offers
+global_variable unsigned int g_firstQueriedEmittedJob;
+
+internal void PrepareDependentJob(int index, int peerFd);
+internal void OnGraphJobDispatched(int index, int peerFd);
+internal void OnUpstreamJobFinished(int index);
+internal bool32 AreJobInputsMissing(uint8 cookie[CookieLen]);
+internal bool32 HasJobInputs(uint8 cookie[CookieLen]);
+internal void ReleaseJobInputs(uint8 cookie[CookieLen]);
+internal void ForwardJobResult(uint8 cookie[CookieLen], int state, double result,
+                               const double *values, uint32 valueCount);
+
+internal const uint8 *
+GetLeaderMemoKey(uint32 element)
+{
+    return g_emittedJobs[element].memoKey;
+}
+
+// NOTE(Kevin): Unfinished jobs that identical jobs follow, by memo key
+global_variable key_index g_leaderIndex = { 0, 0, 0, GetLeaderMemoKey };
+
+global_variable runtime_stats *g_runtimeStats;
+global_variable unsigned int g_runtimeStatCount;
+global_variable unsigned int g_runtimeStatCapacity;
 
 #define HexDigitToChar(D) (((D) >= 10) ? 'a' + ((D) - 10) : '0' + (D))
 internal const char*
@@ -52,200 +199,1338 @@ CookieToTemporaryString(uint8 cookie[CookieLen])
     return cookieString;
 }
 
-internal int 
-EmitCSourceJob(const char *sourcePath,
-               double arg,
-               const char *myIp, const char *myPort,
-               uint8 cookieOut[CookieLen])
+// NOTE(Kevin): Reads the whole file into a zero-terminated buffer
+internal int
+LoadJobSource(const char *sourcePath, char **sourceOut, unsigned int *lengthOut)
 {
-    FILE *file = fopen(sourcePath, "r");
+    FILE *file = fopen(sourcePath, "rb");
     if (!file)
     {
         return kCouldNotOpenFile;
     }
 
-    char *source = malloc(100);
-    unsigned int sourceCapacity = 100;
+    unsigned int sourceCapacity = 4096;
     unsigned int sourceLength   = 0;
+    char *source = malloc(sourceCapacity);
     if (!source)
     {
+        fclose(file);
         return kNoMemory;
     }
-    while (!feof(file))
+    for (;;)
     {
-        int c = fgetc(file);
-        if (c != EOF)
+        size_t wanted = sourceCapacity - sourceLength - 1;
+        size_t did    = fread(source + sourceLength, 1, wanted, file);
+        sourceLength += (unsigned int)did;
+        if (did < wanted)
+            break;
+        char *t = realloc(source, sourceCapacity * 2);
+        if (!t)
         {
-            source[sourceLength++] = (char)c; 
-            if (sourceLength == sourceCapacity)
-            {
-                char *t = realloc(source, sourceCapacity * 2);
-                if (!t)
-                {
-                    free(source);
-                    fclose(file);
-                    return kNoMemory;
-                }
-                source = t;
-                memset(&t[sourceCapacity], 0, sourceCapacity);
-                sourceCapacity *= 2;
-            }
+            free(source);
+            fclose(file);
+            return kNoMemory;
         }
+        source = t;
+        sourceCapacity *= 2;
     }
-    source[sourceLength] = '\0';
+    bool32 failed = ferror(file);
     fclose(file);
+    if (failed)
+    {
+        free(source);
+        return kSyscallFailed;
+    }
+    source[sourceLength] = '\0';
+    *sourceOut = source;
+    *lengthOut = sourceLength;
+    return kSuccess;
+}
 
-    // NOTE(Kevin): Generate a random cookie
-    uint32 random = (uint32)rand();
-    uint8  cookie[CookieLen];
-    calc_sha_256(cookie, &random, sizeof(random));
+internal bool32
+ReserveEmittedJobs(unsigned int count)
+{
+    if (g_emittedJobCount + count <= g_emittedJobCapacity)
+        return 1;
+    unsigned int newCapacity = (g_emittedJobCapacity == 0) ? 8 : 2 * g_emittedJobCapacity;
+    while (newCapacity < g_emittedJobCount + count)
+        newCapacity *= 2;
+    emitted_job *t = realloc(g_emittedJobs, sizeof(emitted_job) * newCapacity);
+    if (!t)
+        return 0;
+    g_emittedJobs = t;
+    g_emittedJobCapacity = newCapacity;
+    return 1;
+}
+
+// NOTE(Kevin): Called whenever a job is (again) waiting for offers
+internal void
+ScheduleQueryRetry(emitted_job *job, double time)
+{
+    unsigned int index = (unsigned int)(job - g_emittedJobs);
+    if (index < g_firstQueriedEmittedJob)
+        g_firstQueriedEmittedJob = index;
+    if (g_nextQueryRetryTime == 0.0 || time < g_nextQueryRetryTime)
+        g_nextQueryRetryTime = time;
+}
+
+internal unsigned int
+GetFirstOpenEmittedJob(void)
+{
+    while (g_firstOpenEmittedJob < g_emittedJobCount &&
+           g_emittedJobs[g_firstOpenEmittedJob].state == kStateFinished)
+        ++g_firstOpenEmittedJob;
+    return g_firstOpenEmittedJob;
+}
+
+// NOTE(Kevin): The oldest job that still waits for offers, 0 if there is none
+internal emitted_job*
+FindUnassignedJob(void)
+{
+    while (g_firstQueriedEmittedJob < g_emittedJobCount &&
+           g_emittedJobs[g_firstQueriedEmittedJob].state != kStateQuerySent)
+        ++g_firstQueriedEmittedJob;
+    if (g_firstQueriedEmittedJob == g_emittedJobCount)
+        return 0;
+    return &g_emittedJobs[g_firstQueriedEmittedJob];
+}
+
+// NOTE(Kevin): Space has to be reserved. Emitted jobs never give their
+// source back, so jobs of one launch can share it.
+internal emitted_job*
+AddEmittedJob(const char *source, uint8 sourceHash[CookieLen], double arg, uint32 flags, double now)
+{
+    emitted_job *job = &g_emittedJobs[g_emittedJobCount++];
+    GenerateCookie(job->cookie);
+    job->state = kStateQuerySent;
+    job->flags = flags;
+    memcpy(job->sourceHash, sourceHash, CookieLen);
+    job->assigneeCount = 0;
+    job->emitTime   = now;
+    job->queryTime  = now;
+    job->queryRetries = 0;
+    job->offeringFdCount = 0;
+    ScheduleQueryRetry(job, now + P2PJS_QueryRetryInterval);
+    job->values     = 0;
+    job->valueCount = 0;
+    memset(&job->resultPayload, 0, sizeof(job->resultPayload));
+    job->aggregatorFd = -1;
+    job->merged     = 0;
+    job->groupChunkCount = 0;
+    job->resultState = kSuccess;
+    job->hasMemoKey = 0;
+    job->leader     = -1;
+    job->nextFollower  = -1;
+    job->firstFollower = -1;
+    job->runtimeStats = -1;
+    job->job.source = source;
+    job->job.arg    = arg;
+    job->job.kind   = (flags & kJobFlagReduce) ? kJobKindReduce : kJobKindRun;
+    job->job.payload     = 0;
+    job->job.payloadSize = 0;
+    TraceJob(kTraceJobQueried, job->cookie, -1, 0);
+    MetricAdd(&g_metricJobsEmitted, 1);
+    MetricAdd(&g_metricJobsOutstanding, 1);
+    return job;
+}
+
+internal void FinishEmittedJob(emitted_job *job, double result, const double *values, uint32 valueCount,
+                              payload_region *payload, int state, int peerFd);
+internal const uint8 *GetJobPayload(int index, uint32 *sizeOut);
+
+// NOTE(Kevin): Jobs of a graph, map-reduce chunks, and jobs with a
+// payload, depend on more than their source and argument, so they can
+// not be looked up by those when they are emitted
+internal bool32
+IsJobKeyedAtEmit(uint32 flags)
+{
+    return !(flags & (kJobFlagAggregated | kJobFlagDependent | kJobFlagHasPayload | kJobFlagReduce));
+}
+
+internal bool32
+IsJobMemoizable(const char *source, uint32 flags)
+{
+    return IsJobKeyedAtEmit(flags) && IsSourceMemoizable(source);
+}
+
+internal bool32
+IsJobResolvableFromStore(const char *source, uint32 flags)
+{
+    return g_resolveFromResultStore && IsResultStoreOpen() &&
+           IsJobKeyedAtEmit(flags) && IsSourcePure(source);
+}
+
+// NOTE(Kevin): Returns 1 if the job was finished from the result store,
+// that is from an earlier run of the emitter. Independent of the result
+// cache, -R works no matter whether -M is given.
+internal bool32
+ResolveJobFromStore(emitted_job *job)
+{
+    uint8 key[CookieLen];
+    ComputeMemoKey(job->sourceHash, job->job.arg, 0, 0, key);
+    const result_record *record = LookupResultByKey(key);
+    if (!record || record->state != kSuccess)
+        return 0;
+    payload_region payload;
+    if (AllocatePayloadRegion(&payload, record->payloadSize) != kSuccess)
+        return 0;
+    MetricAddLabeled(&g_metricMemoEmitterLookups, kMemoStored, 1);
+    if (record->payloadSize > 0)
+        memcpy(payload.bytes, GetStoredPayload(record), record->payloadSize);
+    LogInfo(kLogJobs, "Job %s finished from the result store\n", CookieToTemporaryString(job->cookie));
+    FinishEmittedJob(job, record->result, GetStoredValues(record), record->valueCount,
+                     &payload, kSuccess, -1);
+    FreePayloadRegion(&payload);
+    return 1;
+}
+
+// NOTE(Kevin): Returns 1 if no query has to go out for the job: it was
+// finished from the result cache, or it follows an identical job that is
+// in flight and gets that one's result.
+internal bool32
+ResolveJobFromMemo(emitted_job *job)
+{
+    ComputeMemoKey(job->sourceHash, job->job.arg, 0, 0, job->memoKey);
+    job->hasMemoKey = 1;
+    const memo_entry *entry = LookupMemo(job->memoKey);
+    if (entry)
+    {
+        payload_region payload;
+        if (AllocatePayloadRegion(&payload, entry->payloadSize) == kSuccess)
+        {
+            MetricAddLabeled(&g_metricMemoEmitterLookups, kMemoHit, 1);
+            if (entry->payloadSize > 0)
+                memcpy(payload.bytes, entry->payload, entry->payloadSize);
+            LogInfo(kLogJobs, "Job %s finished from the result cache\n", CookieToTemporaryString(job->cookie));
+            FinishEmittedJob(job, entry->result, entry->values, entry->valueCount, &payload, kSuccess, -1);
+            FreePayloadRegion(&payload);
+            return 1;
+        }
+    }
+    int index = (int)(job - g_emittedJobs);
+    uint32 *slot = ReserveKeyIndex(&g_leaderIndex, g_leaderIndex.count + 1) ?
+        FindKeySlot(&g_leaderIndex, job->memoKey) : 0;
+    if (slot && *slot != 0)
+    {
+        emitted_job *leader = &g_emittedJobs[*slot - 1];
+        MetricAddLabeled(&g_metricMemoEmitterLookups, kMemoJoined, 1);
+        LogInfo(kLogJobs, "Job %s follows identical job %s\n", CookieToTemporaryString(job->cookie),
+                CookieToTemporaryString(leader->cookie));
+        job->state  = kStateFollowing;
+        job->leader = (int)*slot - 1;
+        job->nextFollower = leader->firstFollower;
+        leader->firstFollower = index;
+        return 1;
+    }
+    MetricAddLabeled(&g_metricMemoEmitterLookups, kMemoMiss, 1);
+    if (slot)
+    {
+        // NOTE(Kevin): Identical jobs emitted until this one finishes follow it
+        *slot = (uint32)index + 1;
+        ++g_leaderIndex.count;
+    }
+    return 0;
+}
+
+internal int 
+EmitCSourceJob(const char *sourcePath,
+               double arg,
+               const char *myIp, const char *myPort,
+               uint32 flags,
+               uint8 cookieOut[CookieLen])
+{
+    char *source;
+    unsigned int sourceLength;
+    int err = LoadJobSource(sourcePath, &source, &sourceLength);
+    if (err != kSuccess)
+        return err;
+    if (!ReserveEmittedJobs(1))
+    {
+        free(source);
+        return kNoMemory;
+    }
+    uint8 sourceHash[CookieLen];
+    calc_sha_256(sourceHash, source, sourceLength);
+    emitted_job *job = AddEmittedJob(source, sourceHash, arg, flags, GetTime());
 
     peer_info info;
-    strncpy(info.ipaddr, myIp, PeerIPLen);
-    strncpy(info.port, myPort, PeerPortLen);
+    snprintf(info.ipaddr, PeerIPLen, "%s", myIp);
+    snprintf(info.port, PeerPortLen, "%s", myPort);
 
-    WriteToLog("Created job %s\n", CookieToTemporaryString(cookie));
-    printf("Created new job %.6s\n", CookieToTemporaryString(cookie));
+    LogInfo(kLogJobs, "Created job %s\n", CookieToTemporaryString(job->cookie));
+    printf("Created new job %.6s\n", CookieToTemporaryString(job->cookie));
+
+    // NOTE(Kevin): Results of earlier runs first, then of this one
+    if ((IsJobResolvableFromStore(source, flags) && ResolveJobFromStore(job)) ||
+        (IsJobMemoizable(source, flags) && ResolveJobFromMemo(job)))
+    {
+        if (cookieOut)
+            memcpy(cookieOut, job->cookie, CookieLen);
+        return kSuccess;
+    }
 
     // NOTE(Kevin): Send a message asking for compute resources
     for (peer_iterator peer = GetFirstPeer(); !IsBehindLastPeer(&peer); GetNextPeer(&peer))
     {
-        WriteToLog("Sending queryJobResources message to peer %d [%s].\n",
-                   peer.id,
-                   GetPeerIP(peer.id));
-        if (SendQueryJobResources(peer.fd, cookie, info) != kSuccess)
+        LogDebug(kLogJobs, "Sending queryJobResources message to peer %d [%s].\n",
+                 peer.id,
+                 GetPeerIP(peer.id));
+        if (SendQueryJobResources(peer.fd, job->cookie, info) != kSuccess)
         {
-            WriteToLog(" * Failed!\n");
+            LogWarning(kLogJobs, "Failed to send queryJobResources message to peer %d [%s].\n",
+                       peer.id, GetPeerIP(peer.id));
         }
     }
 
-    if (g_emittedJobCount == g_emittedJobCapacity)
+    if (cookieOut)
+        memcpy(cookieOut, job->cookie, CookieLen);
+    return kSuccess;
+}
+
+// NOTE(Kevin): Launches one job per argument, source is taken over. The
+// source is hashed once, and every peer gets all queries in as few
+// send()s as possible. The jobs are emitted back to back, the first one's
+// index is returned in firstIndexOut.
+internal int
+EmitSourceJobs(char *source, unsigned int sourceLength,
+               const double *args, int count,
+               const char *myIp, const char *myPort,
+               uint32 flags,
+               int *firstIndexOut)
+{
+    uint8 *cookies = malloc((size_t)count * CookieLen);
+    if (!cookies || !ReserveEmittedJobs((unsigned int)count))
     {
-        unsigned int newCapacity = (g_emittedJobCapacity == 0) ? 8 : 2 * g_emittedJobCapacity;
-        emitted_job *t = realloc(g_emittedJobs, sizeof(emitted_job) * newCapacity);
-        if (!t)
+        free(cookies);
+        free(source);
+        return kNoMemory;
+    }
+    uint8 sourceHash[CookieLen];
+    calc_sha_256(sourceHash, source, sourceLength);
+
+    int firstIndex = (int)g_emittedJobCount;
+    double now = GetTime();
+    bool32 isStored = IsJobResolvableFromStore(source, flags);
+    bool32 isMemoizable = IsJobMemoizable(source, flags);
+    int queryCount = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        emitted_job *job = AddEmittedJob(source, sourceHash, args[i], flags, now);
+        if ((isStored && ResolveJobFromStore(job)) ||
+            (isMemoizable && ResolveJobFromMemo(job)))
+            continue;
+        memcpy(cookies + (size_t)queryCount * CookieLen, job->cookie, CookieLen);
+        ++queryCount;
+    }
+
+    peer_info info;
+    snprintf(info.ipaddr, PeerIPLen, "%s", myIp);
+    snprintf(info.port, PeerPortLen, "%s", myPort);
+
+    LogInfo(kLogJobs, "Created %d jobs from source %.6s\n", count, CookieToTemporaryString(sourceHash));
+    printf("Created %d new jobs\n", count);
+
+    for (peer_iterator peer = GetFirstPeer(); queryCount > 0 && !IsBehindLastPeer(&peer); GetNextPeer(&peer))
+    {
+        LogDebug(kLogJobs, "Sending %d queryJobResources messages to peer %d [%s].\n",
+                 queryCount, peer.id, GetPeerIP(peer.id));
+        if (SendQueryJobResourcesBatch(peer.fd, cookies, queryCount, info) != kSuccess)
         {
-            free(source);
-            return kNoMemory;
+            LogWarning(kLogJobs, "Failed to send queryJobResources messages to peer %d [%s].\n",
+                       peer.id, GetPeerIP(peer.id));
         }
-        g_emittedJobs = t;
-        g_emittedJobCapacity = newCapacity;
-    }
-    memcpy(g_emittedJobs[g_emittedJobCount].cookie, cookie, CookieLen);
-    g_emittedJobs[g_emittedJobCount].state = kStateQuerySent;
-    g_emittedJobs[g_emittedJobCount].job.source = source;
-    g_emittedJobs[g_emittedJobCount].job.arg    = arg;
-    ++g_emittedJobCount;
-    if (cookieOut)
-        memcpy(cookieOut, cookie, CookieLen);
+    }
+    free(cookies);
+
+    *firstIndexOut = firstIndex;
     return kSuccess;
 }
 
 internal int
-SendJobToPeer(uint8 cookie[CookieLen], int peerFd)
+EmitCSourceJobs(const char *sourcePath,
+                const double *args, int count,
+                const char *myIp, const char *myPort,
+                uint32 flags,
+                int *firstIndexOut)
+{
+    if (count <= 0)
+        return kInvalidValue;
+    char *source;
+    unsigned int sourceLength;
+    int err = LoadJobSource(sourcePath, &source, &sourceLength);
+    if (err != kSuccess)
+        return err;
+    return EmitSourceJobs(source, sourceLength, args, count, myIp, myPort, flags, firstIndexOut);
+}
+
+// NOTE(Kevin): Number of values start, start + step, ... below end
+// (above end for a negative step), -1 if there are too many
+internal int
+GetRangeLength(double start, double end, double step)
+{
+    if (step == 0.0)
+        return -1;
+    double steps = (end - start) / step;
+    if (steps <= 0.0)
+        return 0;
+    if (steps >= (double)INT_MAX)
+        return -1;
+    int count = (int)steps;
+    if (start + count * step != end)
+        ++count;
+    return count;
+}
+
+#ifndef P2PJS_ChunksPerSlot
+  // NOTE(Kevin): A map-reduce is split into this many chunks per job slot
+  // of the cluster, so a slow worker does not hold up the whole result
+  #define P2PJS_ChunksPerSlot 4
+#endif
+
+global_variable const char *g_reducerNames[kReducerCount] =
+{
+    [kReduceSum]       = "sum",
+    [kReduceMin]       = "min",
+    [kReduceMax]       = "max",
+    [kReduceCount]     = "count",
+    [kReduceHistogram] = "histogram",
+    [kReduceCustom]    = "reduce",
+};
+
+internal int
+FindReducer(const char *name)
+{
+    for (int i = 0; i < kReducerCount; ++i)
+    {
+        if (strcmp(g_reducerNames[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// NOTE(Kevin): The class workers run for a chunk. It evaluates Job.run()
+// of the user's source for the elements of the chunk and reduces them.
+// Numbers go through Num.fromString(), wren has no literals for all doubles.
+internal int
+WriteReduceDriver(char *buffer, size_t size, const map_reduce *mapReduce,
+                  int elementCount, int chunkLength)
+{
+    char init[256];
+    char step[256];
+    switch (mapReduce->reducer)
+    {
+        case kReduceSum:
+        {
+            snprintf(init, sizeof(init), "var acc = 0");
+            snprintf(step, sizeof(step), "acc = acc + v");
+        } break;
+        case kReduceMin:
+        {
+            snprintf(init, sizeof(init), "var acc = Num.infinity");
+            snprintf(step, sizeof(step), "if (v < acc) acc = v");
+        } break;
+        case kReduceMax:
+        {
+            snprintf(init, sizeof(init), "var acc = -Num.infinity");
+            snprintf(step, sizeof(step), "if (v > acc) acc = v");
+        } break;
+        case kReduceCount:
+        {
+            snprintf(init, sizeof(init), "var acc = 0");
+            snprintf(step, sizeof(step), "if (v != false && v != null && v != 0) acc = acc + 1");
+        } break;
+        case kReduceHistogram:
+        {
+            snprintf(init, sizeof(init),
+                     "var low = Num.fromString(\"%.17g\")\n"
+                     "        var width = Num.fromString(\"%.17g\")\n"
+                     "        var acc = List.filled(%d, 0)",
+                     mapReduce->low, (mapReduce->high - mapReduce->low) / mapReduce->bins,
+                     mapReduce->bins);
+            snprintf(step, sizeof(step),
+                     "var b = ((v - low) / width).floor\n"
+                     "            if (b >= 0 && b < %d) acc[b] = acc[b] + 1",
+                     mapReduce->bins);
+        } break;
+        case kReduceCustom:
+        {
+            snprintf(init, sizeof(init), "var acc = null");
+            snprintf(step, sizeof(step), "acc = (acc == null) ? v : Job.reduce(acc, v)");
+        } break;
+        default:
+            return -1;
+    }
+    return snprintf(buffer, size,
+                    "\n"
+                    "class Reduce_ {\n"
+                    "    static run(chunk) {\n"
+                    "        var start = Num.fromString(\"%.17g\")\n"
+                    "        var step = Num.fromString(\"%.17g\")\n"
+                    "        var first = chunk * %d\n"
+                    "        var last = first + %d\n"
+                    "        if (last > %d) last = %d\n"
+                    "        %s\n"
+                    "        for (i in first...last) {\n"
+                    "            var v = Job.run(start + i * step)\n"
+                    "            %s\n"
+                    "        }\n"
+                    "        return acc\n"
+                    "    }\n"
+                    "}\n",
+                    mapReduce->start, mapReduce->step,
+                    chunkLength, chunkLength, elementCount, elementCount,
+                    init, step);
+}
+
+// NOTE(Kevin): Splits the range into chunks and emits one job per chunk,
+// whose argument is the chunk number. We do not know how many slots the
+// other peers have, so we assume they have as many as we do: the chunk
+// count comes from our own P2PJS_MaxRunningJobs times the number of
+// peers, not from what the peers offer.
+internal int
+EmitMapReduceJobs(const char *sourcePath, const map_reduce *mapReduce,
+                  const char *myIp, const char *myPort,
+                  int *firstIndexOut, int *chunkCountOut)
+{
+    int elementCount = GetRangeLength(mapReduce->start, mapReduce->end, mapReduce->step);
+    if (elementCount < 0 || mapReduce->reducer < 0 || mapReduce->reducer >= kReducerCount)
+        return kInvalidValue;
+    if (mapReduce->reducer == kReduceHistogram &&
+        (mapReduce->bins < 1 || !(mapReduce->high > mapReduce->low)))
+        return kInvalidValue;
+    *chunkCountOut = 0;
+    if (elementCount == 0)
+        return kSuccess;
+
+    int peerCount = 0;
+    for (peer_iterator peer = GetFirstPeer(); !IsBehindLastPeer(&peer); GetNextPeer(&peer))
+        ++peerCount;
+    int64 slotCount   = (int64)(peerCount > 0 ? peerCount : 1) * P2PJS_MaxRunningJobs;
+    int64 chunkCount  = slotCount * P2PJS_ChunksPerSlot;
+    if (chunkCount > elementCount)
+        chunkCount = elementCount;
+    int chunkLength = (int)((elementCount + chunkCount - 1) / chunkCount);
+    chunkCount = (elementCount + chunkLength - 1) / chunkLength;
+
+    char *userSource;
+    unsigned int userSourceLength;
+    int err = LoadJobSource(sourcePath, &userSource, &userSourceLength);
+    if (err != kSuccess)
+        return err;
+    char driver[2048];
+    int driverLength = WriteReduceDriver(driver, sizeof(driver), mapReduce, elementCount, chunkLength);
+    if (driverLength < 0 || driverLength >= (int)sizeof(driver))
+    {
+        free(userSource);
+        return kInvalidValue;
+    }
+    unsigned int sourceLength = userSourceLength + (unsigned int)driverLength;
+    char *source = malloc(sourceLength + 1);
+    double *args = malloc(sizeof(double) * chunkCount);
+    if (!source || !args)
+    {
+        free(source);
+        free(args);
+        free(userSource);
+        return kNoMemory;
+    }
+    memcpy(source, userSource, userSourceLength);
+    memcpy(source + userSourceLength, driver, (size_t)driverLength + 1);
+    free(userSource);
+    for (int i = 0; i < (int)chunkCount; ++i)
+        args[i] = (double)i;
+
+    LogInfo(kLogJobs, "Map-reduce over %d values of %s in %d chunks of %d\n",
+            elementCount, sourcePath, (int)chunkCount, chunkLength);
+    uint32 flags = kJobFlagReduce | (CanAggregate(mapReduce->reducer) ? kJobFlagAggregated : 0);
+    err = EmitSourceJobs(source, sourceLength, args, (int)chunkCount, myIp, myPort, flags, firstIndexOut);
+    free(args);
+    if (err == kSuccess)
+    {
+        *chunkCountOut = (int)chunkCount;
+        g_emittedJobs[*firstIndexOut].groupChunkCount = (uint32)chunkCount;
+        // NOTE(Kevin): Without a tree the workers send their results directly
+        if ((flags & kJobFlagAggregated) && AddAggregationTree(g_emittedJobs[*firstIndexOut].cookie, *firstIndexOut,
+                                        (int)chunkCount, mapReduce->reducer) != kSuccess)
+            LogWarning(kLogJobs, "Out of memory, map-reduce results are not aggregated.\n");
+    }
+    return err;
+}
+
+internal emitted_job*
+FindEmittedJob(uint8 cookie[CookieLen])
 {
     for (unsigned int i = 0; i < g_emittedJobCount; ++i)
     {
         if (memcmp(g_emittedJobs[i].cookie, cookie, CookieLen) == 0)
+            return &g_emittedJobs[i];
+    }
+    return 0;
+}
+
+internal runtime_stats*
+GetRuntimeStats(uint8 sourceHash[CookieLen])
+{
+    for (unsigned int i = 0; i < g_runtimeStatCount; ++i)
+    {
+        if (memcmp(g_runtimeStats[i].sourceHash, sourceHash, CookieLen) == 0)
+            return &g_runtimeStats[i];
+    }
+    if (g_runtimeStatCount == g_runtimeStatCapacity)
+    {
+        unsigned int newCapacity = (g_runtimeStatCapacity == 0) ? 8 : 2 * g_runtimeStatCapacity;
+        runtime_stats *t = realloc(g_runtimeStats, sizeof(runtime_stats) * newCapacity);
+        if (!t)
+            return 0;
+        g_runtimeStats = t;
+        g_runtimeStatCapacity = newCapacity;
+    }
+    runtime_stats *stats = &g_runtimeStats[g_runtimeStatCount++];
+    memset(stats, 0, sizeof(*stats));
+    memcpy(stats->sourceHash, sourceHash, CookieLen);
+    stats->hedgeThreshold = -1.0;
+    return stats;
+}
+
+internal runtime_stats*
+GetRuntimeStatsOfJob(emitted_job *job)
+{
+    if (job->runtimeStats >= 0)
+        return &g_runtimeStats[job->runtimeStats];
+    runtime_stats *stats = GetRuntimeStats(job->sourceHash);
+    if (stats)
+        job->runtimeStats = (int)(stats - g_runtimeStats);
+    return stats;
+}
+
+internal int
+CompareDoubles(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// NOTE(Kevin): Returns a negative value if there are not enough samples
+internal double
+GetRuntimePercentile(runtime_stats *stats, int percentile)
+{
+    if (stats->sampleCount < P2PJS_HedgeMinSamples)
+        return -1.0;
+    double sorted[RuntimeSampleCount];
+    memcpy(sorted, stats->samples, sizeof(double) * stats->sampleCount);
+    qsort(sorted, stats->sampleCount, sizeof(double), CompareDoubles);
+    unsigned int idx = (stats->sampleCount * (unsigned int)percentile) / 100;
+    if (idx >= stats->sampleCount)
+        idx = stats->sampleCount - 1;
+    return sorted[idx];
+}
+
+internal void
+AddRuntimeSample(runtime_stats *stats, double runtime)
+{
+    stats->samples[stats->nextSample] = runtime;
+    stats->nextSample = (stats->nextSample + 1) % RuntimeSampleCount;
+    if (stats->sampleCount < RuntimeSampleCount)
+        ++stats->sampleCount;
+    if (runtime > stats->maxRuntime)
+        stats->maxRuntime = runtime;
+    stats->hedgeThreshold = GetRuntimePercentile(stats, P2PJS_HedgePercentile);
+}
+
+internal void
+QueryResourcesForJob(emitted_job *job, int excludeFd)
+{
+    peer_info info;
+    snprintf(info.ipaddr, PeerIPLen, "%s", g_localIp);
+    snprintf(info.port, PeerPortLen, "%s", g_localPort);
+    TraceJob(kTraceJobQueried, job->cookie, -1, 0);
+    job->queryTime = GetTime();
+    job->queryRetries = 0;
+    job->offeringFdCount = 0;
+    ScheduleQueryRetry(job, job->queryTime + P2PJS_QueryRetryInterval);
+    for (peer_iterator peer = GetFirstPeer(); !IsBehindLastPeer(&peer); GetNextPeer(&peer))
+    {
+        if (peer.fd == excludeFd)
+            continue;
+        if (SendQueryJobResources(peer.fd, job->cookie, info) != kSuccess)
         {
-            // NOTE(Kevin): Only send the job out if it's not already running
-            if (g_emittedJobs[i].state == kStateQuerySent)
-            {
-                g_emittedJobs[i].state = kStateRunning;
-                int err = SendJob(peerFd, cookie, &g_emittedJobs[i].job); 
-                if (err != kSuccess)
-                {
-                    WriteToLog("SendJob: %d\n", ErrorToString(err));
-                }
-                return err;
-            }
+            LogWarning(kLogJobs, "Failed to send queryJobResources message to peer %d [%s].\n",
+                       peer.id, GetPeerIP(peer.id));
         }
     }
-    return kJobNotFound;
+}
+
+internal bool32
+HasPeerOfferedForJob(emitted_job *job, int peerFd)
+{
+    for (int i = 0; i < job->offeringFdCount; ++i)
+    {
+        if (job->offeringFds[i] == peerFd)
+            return 1;
+    }
+    return 0;
+}
+
+internal double
+GetQueryRetryInterval(emitted_job *job)
+{
+    double interval = P2PJS_QueryRetryInterval;
+    for (int i = 0; i < job->queryRetries && interval < P2PJS_QueryRetryMaxInterval; ++i)
+        interval *= 2.0;
+    return (interval < P2PJS_QueryRetryMaxInterval) ? interval : P2PJS_QueryRetryMaxInterval;
+}
+
+internal void
+RemoveAssignee(emitted_job *job, int idx)
+{
+    job->assignees[idx] = job->assignees[job->assigneeCount - 1];
+    --job->assigneeCount;
+}
+
+internal int
+SendJobToPeer(uint8 cookie[CookieLen], int peerFd)
+{
+    emitted_job *job = FindEmittedJob(cookie);
+    if (job && job->offeringFdCount < MaxOfferingPeers && !HasPeerOfferedForJob(job, peerFd))
+        job->offeringFds[job->offeringFdCount++] = peerFd;
+    // NOTE(Kevin): Only send the job out if it's not already running,
+    // or if we are looking for a second peer that is not the first one.
+    // An offer is for a slot of the peer, so if the job it names is
+    // taken, the oldest job without a peer goes into that slot.
+    if (!job || !(job->state == kStateQuerySent ||
+                  (job->state == kStateHedgeQuerySent && job->assignees[0].fd != peerFd)))
+    {
+        job = FindUnassignedJob();
+        if (!job)
+            return kJobNotFound;
+        cookie = job->cookie;
+    }
+    job->state = (job->state == kStateQuerySent) ? kStateRunning : kStateHedged;
+    job->assignees[job->assigneeCount].fd = peerFd;
+    job->assignees[job->assigneeCount].dispatchTime = GetTime();
+    ++job->assigneeCount;
+    int index = (int)(job - g_emittedJobs);
+    if (job->flags & kJobFlagAggregated)
+        job->aggregatorFd = AssignAggregator(index, cookie, peerFd);
+    if (job->flags & kJobFlagDependent)
+        PrepareDependentJob(index, peerFd);
+    int err = SendJob(peerFd, cookie, &job->job); 
+    if (err != kSuccess)
+    {
+        LogWarning(kLogJobs, "SendJob: %s\n", ErrorToString(err));
+    }
+    else
+    {
+        TraceJob(kTraceJobDispatched, cookie, peerFd, 0);
+        MetricObserve(&g_metricQueryToOffer, GetTime() - job->queryTime);
+        if (job->flags & (kJobFlagDependent | kJobFlagUpstream))
+            OnGraphJobDispatched(index, peerFd);
+    }
+    return err;
+}
+
+internal void
+AddJobUsage(runtime_stats *stats, const job_usage *usage)
+{
+    ++stats->usageCount;
+    stats->cpuTime   += usage->cpuTime;
+    stats->wallTime  += usage->wallTime;
+    stats->queueTime += usage->queueTime;
+    if (usage->peakHeap > stats->maxPeakHeap)
+        stats->maxPeakHeap = usage->peakHeap;
+}
+
+// NOTE(Kevin): The jobs that waited for the identical job at index get its result
+internal void
+FinishFollowingJobs(int index)
+{
+    int next = g_emittedJobs[index].firstFollower;
+    g_emittedJobs[index].firstFollower = -1;
+    while (next != -1)
+    {
+        emitted_job *follower = &g_emittedJobs[next];
+        next = follower->nextFollower;
+        const emitted_job *leader = &g_emittedJobs[index];
+        uint32 payloadSize;
+        const uint8 *leaderPayload = GetJobPayload(index, &payloadSize);
+        payload_region payload;
+        if (AllocatePayloadRegion(&payload, payloadSize) == kSuccess && payloadSize > 0)
+            memcpy(payload.bytes, leaderPayload, payloadSize);
+        FinishEmittedJob(follower, leader->result, leader->values, leader->valueCount,
+                         &payload, leader->resultState, -1);
+        FreePayloadRegion(&payload);
+    }
+}
+
+internal void
+FinishEmittedJob(emitted_job *job, double result, const double *values, uint32 valueCount,
+                 payload_region *payload, int state, int peerFd)
+{
+    job->state = kStateFinished;
+    job->assigneeCount = 0;
+    job->result = result;
+    job->resultState = state;
+    if (valueCount > 0)
+    {
+        job->values = malloc(sizeof(double) * valueCount);
+        if (job->values)
+        {
+            memcpy(job->values, values, sizeof(double) * valueCount);
+            job->valueCount = valueCount;
+        }
+    }
+    if (payload && payload->bytes)
+        MovePayloadRegion(&job->resultPayload, payload);
+    ++g_finishedJobCount;
+    MetricAdd(&g_metricJobsOutstanding, -1);
+    MetricObserve(&g_metricJobLatency, GetTime() - job->emitTime);
+    TraceJob(kTraceJobResultDelivered, job->cookie, peerFd, state);
+    if (job->flags & kJobFlagUpstream)
+        OnUpstreamJobFinished((int)(job - g_emittedJobs));
+    if (job->hasMemoKey && g_leaderIndex.count > 0)
+    {
+        uint32 *slot = FindKeySlot(&g_leaderIndex, job->memoKey);
+        if (*slot == (uint32)(job - g_emittedJobs) + 1)
+            RemoveKeySlot(&g_leaderIndex, slot);
+    }
+    if (job->firstFollower != -1)
+        FinishFollowingJobs((int)(job - g_emittedJobs));
+}
+
+// NOTE(Kevin): Returns whether the result went into the result store.
+// Chunks of a map-reduce and jobs of a graph get their argument elsewhere,
+// only their cookie finds them.
+internal bool32
+StoreResultOfJob(const emitted_job *job, int state, double result,
+                 const double *values, uint32 valueCount, const payload_region *payload)
+{
+    uint8 key[CookieLen];
+    const uint8 *keyOrNull = 0;
+    if (job->hasMemoKey)
+    {
+        keyOrNull = job->memoKey;
+    }
+    else if (!(job->flags & (kJobFlagAggregated | kJobFlagDependent | kJobFlagReduce)))
+    {
+        ComputeMemoKey(job->sourceHash, job->job.arg, job->job.payload, job->job.payloadSize, key);
+        keyOrNull = key;
+    }
+    return AppendResult(job->cookie, keyOrNull, job->job.arg, state, result, values, valueCount,
+                        payload ? payload->bytes : 0, payload ? payload->size : 0) == kSuccess;
 }
 
 internal int 
-StoreJobResult(uint8 cookie[CookieLen], int state, double result)
+StoreJobResult(uint8 cookie[CookieLen], int state, double result,
+               const double *values, uint32 valueCount, payload_region *payload,
+               const job_usage *usage, int peerFd)
 {
-    for (unsigned int i = 0; i < g_emittedJobCount; ++i)
+    emitted_job *job = FindEmittedJob(cookie);
+    if (!job)
+        return kJobNotFound;
+    LogInfo(kLogJobs, "Job %s used %.6fs cpu, %.6fs wall, waited %.6fs, peak heap %llu bytes\n",
+            CookieToTemporaryString(cookie),
+            usage->cpuTime, usage->wallTime, usage->queueTime, usage->peakHeap);
+    // NOTE(Kevin): Duplicate results cost the worker just as much
+    runtime_stats *stats = GetRuntimeStatsOfJob(job);
+    if (stats)
+        AddJobUsage(stats, usage);
+    // NOTE(Kevin): A job that was re-queued after its peer failed, or that
+    // ran on two peers, might get more than one result. The first result wins.
+    if (job->state == kStateFinished)
     {
-        if (memcmp(g_emittedJobs[i].cookie, cookie, CookieLen) == 0)
+        LogInfo(kLogJobs, "Discarding duplicate result for job %s\n",
+                CookieToTemporaryString(cookie));
+        return kSuccess;
+    }
+    for (int a = 0; a < job->assigneeCount; ++a)
+    {
+        if (job->assignees[a].fd == peerFd)
         {
-            if (g_emittedJobs[i].state == kStateRunning)
+            double runtime = GetTime() - job->assignees[a].dispatchTime;
+            // NOTE(Kevin): A result from the worker's cache says nothing
+            // about how long the source runs
+            if (stats && state == kSuccess && usage->wallTime > 0.0)
+                AddRuntimeSample(stats, runtime);
+            MetricObserve(&g_metricDispatchToResult, runtime);
+        }
+        else
+        {
+            // NOTE(Kevin): Cancel the copy that lost the race
+            LogInfo(kLogJobs, "Cancelling hedged copy of job %s\n", CookieToTemporaryString(cookie));
+            SendCancelJob(job->assignees[a].fd, cookie);
+            StopPayloadStream(job->assignees[a].fd, cookie);
+        }
+    }
+    if (job->hasMemoKey && state == kSuccess)
+        StoreMemo(job->memoKey, result, values, valueCount,
+                  payload ? payload->bytes : 0, payload ? payload->size : 0);
+    if (IsResultStoreOpen() && StoreResultOfJob(job, state, result, values, valueCount, payload))
+    {
+        // NOTE(Kevin): The payload is read from the store's mapping from
+        // now on, see GetJobPayload()
+        payload = 0;
+    }
+    FinishEmittedJob(job, result, values, valueCount, payload, state, peerFd);
+    // NOTE(Kevin): Results are kept in the result store if there is one (-o);
+    // either way they are printed
+    if (state == kSuccess)
+    {
+        printf("Job %.6s succeeded; Result is %lf\n",
+               CookieToTemporaryString(cookie), result);
+    }
+    else
+    {
+        printf("Job %.6s failed; Error was a %s\n",
+               CookieToTemporaryString(cookie),
+               (state == kCompileError) ? "Compile Error" : "Runtime Error");
+    }
+    return kSuccess;
+}
+
+// NOTE(Kevin): Combined results of several chunks of a map-reduce. The
+// first chunk carries the combination, the others are only marked done.
+internal int
+StoreAggregatedResult(uint8 group[CookieLen], int32 reducer,
+                      const uint32 *chunks, uint32 chunkCount,
+                      const double *values, uint32 valueCount, int peerFd)
+{
+    int firstIndex = FindEmittedJobIndex(group);
+    if (firstIndex == -1)
+        return kJobNotFound;
+    uint32 groupChunkCount = g_emittedJobs[firstIndex].groupChunkCount;
+    if (chunkCount == 0 || valueCount == 0 || chunkCount > groupChunkCount)
+        return kInvalidValue;
+    // NOTE(Kevin): Check every chunk before finishing any, a chunk named
+    // twice would be finished twice.
+    uint8 *named = calloc(groupChunkCount, 1);
+    if (!named)
+        return kNoMemory;
+    bool32 hasDuplicate = 0;
+    for (uint32 i = 0; i < chunkCount; ++i)
+    {
+        if (chunks[i] >= groupChunkCount || named[chunks[i]])
+        {
+            LogWarning(kLogJobs, "Partial result names chunk %u, which is not ours or named twice.\n", chunks[i]);
+            free(named);
+            return kInvalidValue;
+        }
+        named[chunks[i]] = 1;
+        if (g_emittedJobs[firstIndex + chunks[i]].state == kStateFinished)
+            hasDuplicate = 1;
+    }
+    free(named);
+    if (hasDuplicate)
+    {
+        // NOTE(Kevin): A chunk ran twice. We can not take its result back out
+        // of the combination, so the other chunks have to run again.
+        LogInfo(kLogJobs, "Discarding partial result of %u chunks with a duplicate.\n", chunkCount);
+        for (uint32 i = 0; i < chunkCount; ++i)
+        {
+            emitted_job *job = &g_emittedJobs[firstIndex + chunks[i]];
+            if (job->state == kStateFinished || job->state == kStateQuerySent)
+                continue;
+            job->state = kStateQuerySent;
+            job->assigneeCount = 0;
+            MetricAdd(&g_metricJobsRedispatched, 1);
+            QueryResourcesForJob(job, -1);
+        }
+        return kSuccess;
+    }
+    for (uint32 i = 0; i < chunkCount; ++i)
+    {
+        emitted_job *job = &g_emittedJobs[firstIndex + chunks[i]];
+        if (i > 0)
+        {
+            job->merged = 1;
+            FinishEmittedJob(job, 0.0, 0, 0, 0, kSuccess, peerFd);
+        }
+        else if (reducer == kReduceHistogram)
+        {
+            FinishEmittedJob(job, (double)valueCount, values, valueCount, 0, kSuccess, peerFd);
+        }
+        else
+        {
+            FinishEmittedJob(job, values[0], 0, 0, 0, kSuccess, peerFd);
+        }
+    }
+    LogInfo(kLogJobs, "Got partial result of %u chunks of %.6s.\n",
+            chunkCount, CookieToTemporaryString(group));
+    return kSuccess;
+}
+
+internal void
+PrintJobStats(void)
+{
+    printf("Source  Results  CPU (avg)  Wall (avg)  Queue (avg)  Peak heap (max)\n");
+    for (unsigned int i = 0; i < g_runtimeStatCount; ++i)
+    {
+        runtime_stats *stats = &g_runtimeStats[i];
+        if (stats->usageCount == 0)
+            continue;
+        double n = (double)stats->usageCount;
+        printf("%.6s  %7u  %8.6fs  %9.6fs  %10.6fs  %15llu\n",
+               CookieToTemporaryString(stats->sourceHash),
+               stats->usageCount,
+               stats->cpuTime / n,
+               stats->wallTime / n,
+               stats->queueTime / n,
+               stats->maxPeakHeap);
+    }
+}
+
+// NOTE(Kevin): Asks the peers that did not offer for a job yet again,
+// backing off per job
+internal void
+RetryUnansweredQueries(void)
+{
+    double now = GetTime();
+    if (g_nextQueryRetryTime == 0.0 || now < g_nextQueryRetryTime)
+        return;
+    g_nextQueryRetryTime = 0.0;
+    peer_info info;
+    snprintf(info.ipaddr, PeerIPLen, "%s", g_localIp);
+    snprintf(info.port, PeerPortLen, "%s", g_localPort);
+    for (unsigned int i = GetFirstOpenEmittedJob(); i < g_emittedJobCount; ++i)
+    {
+        emitted_job *job = &g_emittedJobs[i];
+        if (job->state != kStateQuerySent)
+            continue;
+        double retryTime = job->queryTime + GetQueryRetryInterval(job);
+        if (now >= retryTime)
+        {
+            LogInfo(kLogJobs, "No offers for job %s, querying again.\n", CookieToTemporaryString(job->cookie));
+            MetricAdd(&g_metricJobsRequeried, 1);
+            job->queryTime = now;
+            ++job->queryRetries;
+            for (peer_iterator peer = GetFirstPeer(); !IsBehindLastPeer(&peer); GetNextPeer(&peer))
             {
-                g_emittedJobs[i].state = kStateFinished;
-                g_emittedJobs[i].result = result;
-                // TODO(Kevin): In a real system, we would now do something with the result
-                // Here, we just print it out
-                if (state == kSuccess)
-                {
-                    printf("Job %.6s succeeded; Result is %lf\n",
-                           CookieToTemporaryString(cookie), result);
-                }
-                else
+                if (HasPeerOfferedForJob(job, peer.fd))
+                    continue;
+                if (SendQueryJobResources(peer.fd, job->cookie, info) != kSuccess)
                 {
-                    printf("Job %.6s failed; Error was a %s\n",
-                           CookieToTemporaryString(cookie),
-                           (state == kCompileError) ? "Compile Error" : "Runtime Error");
+                    LogWarning(kLogJobs, "Failed to send queryJobResources message to peer %d [%s].\n",
+                               peer.id, GetPeerIP(peer.id));
                 }
             }
+            retryTime = now + GetQueryRetryInterval(job);
         }
+        ScheduleQueryRetry(job, retryTime);
     }
-    return kJobNotFound;
 }
 
-internal int
-GetNumberOfOutstandingJobs(void)
+// NOTE(Kevin): Sends a second copy of latency-sensitive jobs that run
+// longer than usual for their source.
+internal void
+CheckHedgedJobs(void)
 {
-    int count = 0;
-    for (unsigned int i = 0; i < g_emittedJobCount; ++i)
+    double now = GetTime();
+    for (unsigned int i = GetFirstOpenEmittedJob(); i < g_emittedJobCount; ++i)
     {
-        if (g_emittedJobs[i].state != kStateFinished)
-            ++count;
+        emitted_job *job = &g_emittedJobs[i];
+        if (!(job->flags & kJobFlagLatencySensitive) || job->state != kStateRunning)
+            continue;
+        runtime_stats *stats = GetRuntimeStatsOfJob(job);
+        if (!stats)
+            continue;
+        double threshold = stats->hedgeThreshold;
+        if (threshold < 0.0 || now - job->assignees[0].dispatchTime <= threshold)
+            continue;
+        LogInfo(kLogJobs, "Job %s is a straggler, hedging.\n", CookieToTemporaryString(job->cookie));
+        job->state = kStateHedgeQuerySent;
+        MetricAdd(&g_metricJobsHedged, 1);
+        QueryResourcesForJob(job, job->assignees[0].fd);
     }
-    return count;
 }
 
-internal bool32
-IsJobFinished(uint8 cookie[CookieLen])
+// NOTE(Kevin): The copy of the job on the peer is lost. Ask for resources
+// again, keeping the original cookie.
+internal void
+RequeueJobFromPeer(emitted_job *job, int peerFd)
 {
-    for (unsigned int i = 0; i < g_emittedJobCount; ++i)
+    for (int a = 0; a < job->assigneeCount; ++a)
     {
-        if (memcmp(g_emittedJobs[i].cookie, cookie, CookieLen) == 0)
+        if (job->assignees[a].fd == peerFd)
         {
-            return g_emittedJobs[i].state == kStateFinished;
+            RemoveAssignee(job, a);
+            break;
         }
     }
+    // NOTE(Kevin): The result would have gone up the tree through the
+    // failed peer
+    if (job->aggregatorFd == peerFd)
+    {
+        job->aggregatorFd  = -1;
+        job->assigneeCount = 0;
+    }
+    if (job->assigneeCount > 0)
+    {
+        // NOTE(Kevin): The other copy is still running
+        if (job->state == kStateHedged)
+            job->state = kStateRunning;
+        return;
+    }
+    if (job->state == kStateHedgeQuerySent)
+    {
+        // NOTE(Kevin): Already asking for resources
+        job->state = kStateQuerySent;
+        ScheduleQueryRetry(job, job->queryTime + GetQueryRetryInterval(job));
+        return;
+    }
+    LogUser(kLogJobs, "Re-dispatching job %.6s\n", CookieToTemporaryString(job->cookie));
+    job->state = kStateQuerySent;
+    MetricAdd(&g_metricJobsRedispatched, 1);
+    QueryResourcesForJob(job, peerFd);
+}
+
+internal bool32
+IsJobAssignedTo(const emitted_job *job, int peerFd)
+{
+    if (job->state == kStateFinished || job->state == kStateQuerySent ||
+        job->state == kStateWaiting || job->state == kStateFollowing)
+        return 0;
+    if (job->aggregatorFd == peerFd)
+        return 1;
+    for (int a = 0; a < job->assigneeCount; ++a)
+    {
+        if (job->assignees[a].fd == peerFd)
+            return 1;
+    }
     return 0;
 }
 
-internal double 
-GetJobResult(uint8 cookie[CookieLen])
+// NOTE(Kevin): The peer running these jobs closed the connection
+internal void
+RequeueJobsOfPeer(int peerFd)
 {
-    for (unsigned int i = 0; i < g_emittedJobCount; ++i)
+    for (unsigned int i = GetFirstOpenEmittedJob(); i < g_emittedJobCount; ++i)
     {
-        if (memcmp(g_emittedJobs[i].cookie, cookie, CookieLen) == 0)
+        if (IsJobAssignedTo(&g_emittedJobs[i], peerFd))
+            RequeueJobFromPeer(&g_emittedJobs[i], peerFd);
+    }
+    ForgetAggregationWorker(peerFd);
+}
+
+// NOTE(Kevin): The peer stopped sending heartbeats. It might just be busy
+// with a long job, so only the jobs that ran far longer on it than their
+// source ever did are given up on; see P2PJS_OverdueRuntimeFactor. If the
+// result arrives after all, the first result wins.
+internal void
+RequeueOverdueJobsOfPeer(int peerFd)
+{
+    double now = GetTime();
+    for (unsigned int i = GetFirstOpenEmittedJob(); i < g_emittedJobCount; ++i)
+    {
+        emitted_job *job = &g_emittedJobs[i];
+        if (!IsJobAssignedTo(job, peerFd))
+            continue;
+        runtime_stats *stats = GetRuntimeStatsOfJob(job);
+        if (!stats || stats->sampleCount < P2PJS_HedgeMinSamples)
+            continue;
+        for (int a = 0; a < job->assigneeCount; ++a)
+        {
+            if (job->assignees[a].fd == peerFd &&
+                now - job->assignees[a].dispatchTime > P2PJS_OverdueRuntimeFactor * stats->maxRuntime)
+            {
+                LogInfo(kLogJobs, "Job %s is overdue on a silent peer.\n", CookieToTemporaryString(job->cookie));
+                RequeueJobFromPeer(job, peerFd);
+                break;
+            }
+        }
+    }
+}
+
+// NOTE(Kevin): The emitter of these jobs is gone, nobody would get the results.
+internal void
+DropJobsFromPeer(int peerFd)
+{
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < g_receivedJobCount; ++i)
+    {
+        if (g_receivedJobs[i].sourceFd == peerFd)
+        {
+            LogInfo(kLogJobs, "Dropping job %s\n", CookieToTemporaryString(g_receivedJobs[i].cookie));
+            if (g_receivedJobs[i].state == kStateWaiting)
+                OnJobUnblockedForEmitter(g_receivedJobs[i].account);
+            OnJobFinishedForEmitter(g_receivedJobs[i].account);
+            ReleaseJobInputs(g_receivedJobs[i].cookie);
+            free((char*)g_receivedJobs[i].job.source);
+            FreePayloadRegion(&g_receivedJobs[i].payload);
+        }
+        else
         {
-            return g_emittedJobs[i].result;
+            g_receivedJobs[kept++] = g_receivedJobs[i];
         }
     }
-    return 0;
+    g_receivedJobCount = kept;
+    DropAggregationsOfPeer(peerFd);
+    DropPayloadStreamsOfPeer(peerFd);
+}
+
+// NOTE(Kevin): Kept up to date by EmitCSourceJob and StoreJobResult
+internal int
+GetNumberOfOutstandingJobs(void)
+{
+    return (int)MetricGet(&g_metricJobsOutstanding);
+}
+
+// NOTE(Kevin): Emitted jobs are never removed, so the index of a job stays
+// valid. Searches from the back, a job that was just emitted is found at once.
+internal int
+FindEmittedJobIndex(uint8 cookie[CookieLen])
+{
+    for (int i = (int)g_emittedJobCount - 1; i >= 0; --i)
+    {
+        if (memcmp(g_emittedJobs[i].cookie, cookie, CookieLen) == 0)
+            return i;
+    }
+    return -1;
+}
+
+internal bool32
+IsJobFinished(int index)
+{
+    return g_emittedJobs[index].state == kStateFinished;
+}
+
+// NOTE(Kevin): The result of an aggregated chunk that got merged into
+// another chunk's
+internal bool32
+IsJobResultMerged(int index)
+{
+    return g_emittedJobs[index].merged;
+}
+
+internal double 
+GetJobResult(int index)
+{
+    return g_emittedJobs[index].result;
+}
+
+// NOTE(Kevin): 0 if the job returned a number
+internal const double *
+GetJobValues(int index, uint32 *countOut)
+{
+    *countOut = g_emittedJobs[index].valueCount;
+    return g_emittedJobs[index].values;
+}
+
+// NOTE(Kevin): 0 if the job did not return a ByteBuffer
+internal const uint8 *
+GetJobPayload(int index, uint32 *sizeOut)
+{
+    const emitted_job *job = &g_emittedJobs[index];
+    if (!job->resultPayload.bytes && job->state == kStateFinished && IsResultStoreOpen())
+        return GetStoredPayloadOfJob(job->cookie, sizeOut);
+    *sizeOut = job->resultPayload.size;
+    return job->resultPayload.bytes;
+}
+
+// NOTE(Kevin): The latest stored result of the source at sourcePath for
+// arg, of a run without payload. 0 if there is none.
+internal const result_record *
+LookupStoredResult(const char *sourcePath, double arg)
+{
+    if (!IsResultStoreOpen())
+        return 0;
+    char *source;
+    unsigned int sourceLength;
+    if (LoadJobSource(sourcePath, &source, &sourceLength) != kSuccess)
+        return 0;
+    uint8 sourceHash[CookieLen];
+    calc_sha_256(sourceHash, source, sourceLength);
+    free(source);
+    uint8 key[CookieLen];
+    ComputeMemoKey(sourceHash, arg, 0, 0, key);
+    return LookupResultByKey(key);
+}
+
+internal double
+GetJobArgument(int index)
+{
+    return g_emittedJobs[index].job.arg;
+}
+
+// NOTE(Kevin): Takes the bytes over. Has to happen right after the job was
+// emitted, before a peer offered to run it.
+internal int
+AttachJobPayload(int index, uint8 *payload, uint32 payloadSize)
+{
+    emitted_job *job = &g_emittedJobs[index];
+    if (payloadSize > P2PJS_MaxPayloadSize)
+    {
+        free(payload);
+        return kInvalidValue;
+    }
+    assert(job->state == kStateQuerySent && job->assigneeCount == 0);
+    free((uint8*)job->job.payload);
+    job->job.payload     = payload;
+    job->job.payloadSize = payloadSize;
+    return kSuccess;
 }
 
 internal int
-GetNumberOfRunningJobs(void)
+CountFinishedJobs(int firstIndex, int count)
+{
+    int finished = 0;
+    for (int i = firstIndex; i < firstIndex + count; ++i)
+    {
+        if (g_emittedJobs[i].state == kStateFinished)
+            ++finished;
+    }
+    return finished;
+}
+
+// NOTE(Kevin): Goes up with every first result, waiting scripts only look
+// at their jobs when it changed
+internal uint64
+GetFinishedJobCount(void)
+{
+    return g_finishedJobCount;
+}
+
+// NOTE(Kevin): The emitter got a result from somewhere else. Jobs run to
+// completion once started, so only queued jobs can be cancelled.
+internal int
+CancelJob(uint8 cookie[CookieLen], int peerFd)
 {
-    int count = 0;
     for (unsigned int i = 0; i < g_receivedJobCount; ++i)
     {
-        if (g_receivedJobs[i].state == kStateRunning)
-            ++count;
+        if (g_receivedJobs[i].sourceFd == peerFd &&
+            memcmp(g_receivedJobs[i].cookie, cookie, CookieLen) == 0)
+        {
+            if (g_receivedJobs[i].state == kStateWaiting)
+                OnJobUnblockedForEmitter(g_receivedJobs[i].account);
+            OnJobFinishedForEmitter(g_receivedJobs[i].account);
+            ReleaseJobInputs(cookie);
+            free((char*)g_receivedJobs[i].job.source);
+            FreePayloadRegion(&g_receivedJobs[i].payload);
+            memmove(&g_receivedJobs[i], &g_receivedJobs[i + 1],
+                    sizeof(received_job) * (g_receivedJobCount - i - 1));
+            --g_receivedJobCount;
+            return kSuccess;
+        }
+    }
+    return kJobNotFound;
+}
+
+// NOTE(Kevin): The last input of a waiting job arrived
+internal void
+UnblockReceivedJob(uint8 cookie[CookieLen])
+{
+    for (unsigned int i = 0; i < g_receivedJobCount; ++i)
+    {
+        if (g_receivedJobs[i].state == kStateWaiting &&
+            memcmp(g_receivedJobs[i].cookie, cookie, CookieLen) == 0)
+        {
+            g_receivedJobs[i].state = kStateRunning;
+            OnJobUnblockedForEmitter(g_receivedJobs[i].account);
+            return;
+        }
     }
-    return count;
 }
 
 internal int 
-TakeJob(uint8 cookie[CookieLen], job theJob, int sourceId)
+TakeJob(uint8 cookie[CookieLen], job theJob, int sourceId, payload_region *payload)
 {
     if (g_receivedJobCount == g_receivedJobCapacity)
     {
@@ -256,41 +1541,180 @@ TakeJob(uint8 cookie[CookieLen], job theJob, int sourceId)
         g_receivedJobs = t;
         g_receivedJobCapacity = newCapacity;
     }
-    memcpy(g_receivedJobs[g_receivedJobCount].cookie, cookie, CookieLen);
-    g_receivedJobs[g_receivedJobCount].source = sourceId;
-    g_receivedJobs[g_receivedJobCount].state  = kStateRunning;
-    g_receivedJobs[g_receivedJobCount].job    = theJob;
     char *source = malloc(strlen(theJob.source) + 1);
     if (!source)
+        return kNoMemory;
+    // NOTE(Kevin): The job is charged to the account its offer was made
+    // for, the emitter named in the query. The emitter may fill the offer
+    // with another job than the one it named, so the offer is also found
+    // by the connection. A job whose offer timed out goes to the account
+    // of the last offer on the connection. Only an emitter we never made
+    // an offer to is known by nothing but the peer it came from.
+    int offer = FindPendingOffer(cookie, GetPeerFd(sourceId));
+    int account = (offer != -1) ? g_pendingOffers[offer].accountIdx : GetPeerOfferAccount(sourceId);
+    if (account == -1)
+        account = GetEmitterAccount(GetPeerIP(sourceId), GetPeerPort(sourceId));
+    if (account == -1)
     {
+        free(source);
         return kNoMemory;
-    } 
+    }
+    // NOTE(Kevin): Nothing can fail from here on, the offer's slot is the job's
+    if (offer != -1)
+    {
+        MetricObserve(&g_metricOfferToDispatch, GetTime() - g_pendingOffers[offer].time);
+        RemovePendingOffer((unsigned int)offer);
+    }
+    memcpy(g_receivedJobs[g_receivedJobCount].cookie, cookie, CookieLen);
+    g_receivedJobs[g_receivedJobCount].sourceFd = GetPeerFd(sourceId);
+    g_receivedJobs[g_receivedJobCount].account = account;
+    g_receivedJobs[g_receivedJobCount].state  = kStateRunning;
+    g_receivedJobs[g_receivedJobCount].receiveTime = GetTime();
+    g_receivedJobs[g_receivedJobCount].job    = theJob;
     strcpy(source, theJob.source);
     g_receivedJobs[g_receivedJobCount].job.source = source;
+    // NOTE(Kevin): The payload is taken over
+    memset(&g_receivedJobs[g_receivedJobCount].payload, 0, sizeof(payload_region));
+    if (payload)
+        MovePayloadRegion(&g_receivedJobs[g_receivedJobCount].payload, payload);
+    g_receivedJobs[g_receivedJobCount].job.payload     = g_receivedJobs[g_receivedJobCount].payload.bytes;
+    g_receivedJobs[g_receivedJobCount].job.payloadSize = g_receivedJobs[g_receivedJobCount].payload.size;
     ++g_receivedJobCount;
+    MetricAdd(&g_metricJobsReceived, 1);
+    OnJobTakenFromEmitter(account);
+    if (AreJobInputsMissing(cookie))
+    {
+        g_receivedJobs[g_receivedJobCount - 1].state = kStateWaiting;
+        OnJobBlockedForEmitter(account);
+    }
     return kSuccess;
 }
 
+// NOTE(Kevin): The payload a received job came with, for the VM running it
+internal const uint8 *
+GetReceivedJobPayload(uint8 cookie[CookieLen], uint32 *sizeOut)
+{
+    for (unsigned int i = 0; i < g_receivedJobCount; ++i)
+    {
+        if (memcmp(g_receivedJobs[i].cookie, cookie, CookieLen) == 0)
+        {
+            *sizeOut = g_receivedJobs[i].job.payloadSize;
+            return g_receivedJobs[i].job.payload;
+        }
+    }
+    *sizeOut = 0;
+    return 0;
+}
+
+// NOTE(Kevin): Jobs that got inputs from other jobs depend on more than
+// their source, arg and payload
+internal bool32
+GetReceivedJobMemoKey(const received_job *job, uint8 keyOut[CookieLen])
+{
+    if (job->job.kind != kJobKindRun || !IsSourceMemoizable(job->job.source) ||
+        HasJobInputs((uint8*)job->cookie))
+        return 0;
+    uint8 sourceHash[CookieLen];
+    calc_sha_256(sourceHash, job->job.source, strlen(job->job.source));
+    ComputeMemoKey(sourceHash, job->job.arg, job->job.payload, job->job.payloadSize, keyOut);
+    return 1;
+}
+
 internal void
 ExecuteNextJob(void)
 {
-    int idx = (int)g_receivedJobCount - 1;
+    // NOTE(Kevin): Pick the emitter whose turn it is, then run its oldest job
+    int account = PickEmitterDRR(&g_runCursor, 1);
+    if (account == -1)
+        return;
+    int idx = -1;
+    for (unsigned int i = 0; i < g_receivedJobCount; ++i)
+    {
+        if (g_receivedJobs[i].account == account && g_receivedJobs[i].state != kStateWaiting)
+        {
+            idx = (int)i;
+            break;
+        }
+    }
     if (idx >= 0)
     {
-        WriteToUser("Running job: %.6s\n", CookieToTemporaryString(g_receivedJobs[idx].cookie));
+        LogUser(kLogJobs, "Running job: %.6s\n", CookieToTemporaryString(g_receivedJobs[idx].cookie));
 
-        WriteToUser("Argument is %lf\n", g_receivedJobs[idx].job.arg);
-        int result = RunCode(g_receivedJobs[idx].cookie,
+        LogUser(kLogJobs, "Argument is %lf\n", g_receivedJobs[idx].job.arg);
+        TraceJob(kTraceJobStarted, g_receivedJobs[idx].cookie, g_receivedJobs[idx].sourceFd, 0);
+        job_usage usage;
+        usage.queueTime = GetTime() - g_receivedJobs[idx].receiveTime;
+        uint8 memoKey[CookieLen];
+        bool32 isMemoizable = GetReceivedJobMemoKey(&g_receivedJobs[idx], memoKey);
+        const memo_entry *memo = isMemoizable ? LookupMemo(memoKey) : 0;
+        int result;
+        double value;
+        uint32 valueCount;
+        const double *values;
+        uint32 payloadSize;
+        const uint8 *payload;
+        if (memo)
+        {
+            LogUser(kLogJobs, "Taking the result from the result cache\n");
+            MetricAddLabeled(&g_metricMemoWorkerLookups, kMemoHit, 1);
+            usage.cpuTime  = 0.0;
+            usage.wallTime = 0.0;
+            usage.peakHeap = 0;
+            result      = kSuccess;
+            value       = memo->result;
+            values      = memo->values;
+            valueCount  = memo->valueCount;
+            payload     = memo->payload;
+            payloadSize = memo->payloadSize;
+        }
+        else
+        {
+            if (isMemoizable)
+                MetricAddLabeled(&g_metricMemoWorkerLookups, kMemoMiss, 1);
+            result = RunCode(g_receivedJobs[idx].cookie,
                              g_receivedJobs[idx].job.arg,
-                             g_receivedJobs[idx].job.source);
-        WriteToUser("Result: %lf [%s]\n", GetLastResult(), ErrorToString(result));
+                             g_receivedJobs[idx].job.kind,
+                             g_receivedJobs[idx].job.source,
+                             &usage);
+            MetricObserve(&g_metricJobRun, usage.wallTime);
+            MetricAdd(&g_metricJobsExecuted, 1);
+            value   = GetLastResult();
+            values  = GetLastValues(&valueCount);
+            payload = GetLastPayload(&payloadSize);
+            if (isMemoizable && result == kSuccess)
+                StoreMemo(memoKey, value, values, valueCount, payload, payloadSize);
+        }
+        TraceJob(kTraceJobFinished, g_receivedJobs[idx].cookie, g_receivedJobs[idx].sourceFd, result);
+        LogUser(kLogJobs, "Result: %lf [%s]\n", value, ErrorToString(result));
 
-        SendJobResult(GetPeerFd(g_receivedJobs[idx].source),
-                      g_receivedJobs[idx].cookie,
-                      result,
-                      GetLastResult());
+        if (!AggregateJobResult(g_receivedJobs[idx].cookie, result, value, values, valueCount))
+        {
+            SendJobResult(g_receivedJobs[idx].sourceFd,
+                          g_receivedJobs[idx].cookie,
+                          result,
+                          value,
+                          values,
+                          valueCount,
+                          payload,
+                          payloadSize,
+                          &usage);
+        }
+        ForwardJobResult(g_receivedJobs[idx].cookie, result, value, values, valueCount);
+        ReleaseJobInputs(g_receivedJobs[idx].cookie);
 
         g_receivedJobs[idx].state = kStateFinished;
+        free((char*)g_receivedJobs[idx].job.source);
+        FreePayloadRegion(&g_receivedJobs[idx].payload);
+        OnJobFinishedForEmitter(account);
+        memmove(&g_receivedJobs[idx], &g_receivedJobs[idx + 1],
+                sizeof(received_job) * (g_receivedJobCount - idx - 1));
         --g_receivedJobCount;
     }
+    else
+    {
+        // NOTE(Kevin): queuedJobs counts the runnable jobs of the account,
+        // so PickEmitterDRR() only picks accounts that have one
+        LogError(kLogJobs, "Emitter account %d has queued jobs, but none is runnable.\n", account);
+        assert(!"Accounting is out of sync with the job list");
+    }
 }
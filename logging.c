@@ -3,9 +3,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
 
 #include "p2pjs.h"
 
+// NOTE(Kevin): Logging is asynchronous. A call site only copies its
+// arguments into a binary record
+//   [ header: size, level, subsystem, timestamp, format string | arguments ]
+// and appends it to a lock-free ring that belongs to the calling thread.
+// The log thread parses the format string a second time to find the
+// arguments again, formats the records and writes them in batches.
+// The format string itself is the format id: call sites pass literals,
+// so the pointer stays valid. Strings are copied into the record,
+// because most of ours (CookieToTemporaryString, GetPeerIP) are temporary.
+
 #define LogFilenamePrefix "p2pjs_"
 #define LogFilenameSuffix ".log"
 
@@ -13,94 +29,716 @@
   #define P2PJS_LOGTOSTDERR 1
 #endif
 
+#ifndef P2PJS_MaxLogLevel
+  // NOTE(Kevin): Log calls above this level are not compiled in at all.
+  // 0 = errors, 1 = warnings, 2 = info, 3 = debug
+  #ifdef NDEBUG
+    #define P2PJS_MaxLogLevel 2
+  #else
+    #define P2PJS_MaxLogLevel 3
+  #endif
+#endif
+
+#ifndef P2PJS_LogSubsystems
+  // NOTE(Kevin): Bit mask of the subsystems that are compiled in, bit n is
+  // the subsystem with value n (kLogMain = bit 0, ... kLogVM = bit 4).
+  // Error, warning, info and debug calls of the others are dropped at
+  // compile time; LogUser is never dropped.
+  #define P2PJS_LogSubsystems (~0u)
+#endif
+
+#ifndef P2PJS_LogRingSize
+  // NOTE(Kevin): Bytes per thread, must be a power of two
+  #define P2PJS_LogRingSize (64 * 1024)
+#endif
+
+// Log levels
+enum
+{
+    kLogError,
+    kLogWarning,
+    kLogInfo,
+    kLogDebug,
+};
+
+// Log subsystems
+enum
+{
+    kLogMain,
+    kLogNet,
+    kLogPeers,
+    kLogJobs,
+    kLogVM,
+
+    kLogSubsystemCount,
+};
+
+global_variable const char *g_logLevelNames[] = { "error", "warn", "info", "debug" };
+global_variable const char *g_logSubsystemNames[] = { "main", "net", "peers", "jobs", "vm" };
+
+// NOTE(Kevin): Runtime filter, see SetLogFilter()
+global_variable int    g_logLevel      = kLogInfo;
+global_variable uint32 g_logSubsystems = ~0u;
+
+#define LogMaxRecordSize 1024
+#define LogOutputSize    (64 * 1024)
+
+enum
+{
+    kLogRecordToUser    = 0x1,
+    kLogRecordTruncated = 0x2,
+};
+
+typedef struct
+{
+    // NOTE(Kevin): Including the arguments, a multiple of 8.
+    // 0 marks the unused end of the ring.
+    uint32      size;
+    uint8       level;
+    uint8       subsystem;
+    uint8       flags;
+    uint8       pad;
+    uint64      timestamp;
+    const char *fmt;
+} log_record;
+
+typedef struct log_ring
+{
+    // NOTE(Kevin): head is only written by the owning thread, tail only by
+    // the log thread. Both count bytes and never wrap.
+    _Alignas(64) _Atomic uint64 head;
+    _Alignas(64) _Atomic uint64 tail;
+    _Atomic uint64   dropped;
+    struct log_ring *next;
+    _Alignas(64) uint8 data[P2PJS_LogRingSize];
+} log_ring;
+
+global_variable _Atomic(log_ring *) g_logRings;
+global_variable _Thread_local log_ring *t_logRing;
+global_variable _Atomic uint64 g_logRecordsWithoutRing;
+
 global_variable FILE *g_logFile;
+global_variable pthread_t g_logThread;
+global_variable bool32 g_logThreadRunning;
+global_variable sem_t g_logWakeup;
+global_variable _Atomic int g_logThreadSleeping;
+global_variable _Atomic int g_logShouldStop;
 
-internal bool32 
-OpenLog(void)
+// NOTE(Kevin): Only touched by the log thread
+global_variable char   g_logOutput[LogOutputSize];
+global_variable size_t g_logOutputLen;
+global_variable time_t g_logCachedSecond = -1;
+global_variable char   g_logCachedTime[32];
+
+// NOTE(Kevin): Length modifiers of a conversion specification
+enum
 {
-#if !P2PJS_LOGTOSTDERR
-    time_t startTime = time(0);
-    char *startTimeString = ctime(&startTime);
-    char *fileName = malloc(strlen(LogFilenamePrefix) +
-                            strlen(startTimeString) +
-                            strlen(LogFilenameSuffix) + 1);
-    if (!fileName)
-        return 0;
-    strcpy(fileName, LogFilenamePrefix);
-    if (startTimeString[strlen(startTimeString)] < ' ')
-        strncat(fileName, startTimeString, strlen(startTimeString) - 1);
-    else
-        strncat(fileName, startTimeString, strlen(startTimeString));
-    strcat(fileName, LogFilenameSuffix);
-    g_logFile = fopen(fileName, "w");
-    if (!g_logFile) {
-        fprintf(stderr, "Can not open log file %s\n", fileName);
+    kLogLenNone,
+    kLogLenHH,
+    kLogLenH,
+    kLogLenL,
+    kLogLenLL,
+    kLogLenJ,
+    kLogLenZ,
+    kLogLenT,
+    kLogLenBigL,
+};
+
+typedef struct
+{
+    int  starCount;
+    int  length;
+    char conversion;
+} log_spec;
+
+// NOTE(Kevin): p points behind the '%'. Returns the first character
+// behind the conversion specification.
+internal const char *
+ParseLogSpec(const char *p, log_spec *spec)
+{
+    spec->starCount = 0;
+    spec->length = kLogLenNone;
+    while (*p && strchr("-+ #0'", *p))
+        ++p;
+    if (*p == '*')
+    {
+        ++spec->starCount;
+        ++p;
+    }
+    while (*p >= '0' && *p <= '9')
+        ++p;
+    if (*p == '.')
+    {
+        ++p;
+        if (*p == '*')
+        {
+            ++spec->starCount;
+            ++p;
+        }
+        while (*p >= '0' && *p <= '9')
+            ++p;
+    }
+    switch (*p)
+    {
+        case 'h': spec->length = (p[1] == 'h') ? kLogLenHH : kLogLenH; p += (p[1] == 'h') ? 2 : 1; break;
+        case 'l': spec->length = (p[1] == 'l') ? kLogLenLL : kLogLenL; p += (p[1] == 'l') ? 2 : 1; break;
+        case 'j': spec->length = kLogLenJ; ++p; break;
+        case 'z': spec->length = kLogLenZ; ++p; break;
+        case 't': spec->length = kLogLenT; ++p; break;
+        case 'L': spec->length = kLogLenBigL; ++p; break;
+        default: break;
+    }
+    spec->conversion = *p;
+    return (*p) ? p + 1 : p;
+}
+
+internal bool32
+PutLogBytes(uint8 *record, uint32 *size, const void *data, uint32 len)
+{
+    uint32 aligned = (len + 7) & ~7u;
+    if (*size + aligned > LogMaxRecordSize)
         return 0;
+    memcpy(record + *size, data, len);
+    *size += aligned;
+    return 1;
+}
+
+// NOTE(Kevin): Copies the arguments described by fmt into the record.
+// Returns 0 if they did not fit.
+internal bool32
+SerializeLogArgs(uint8 *record, uint32 *size, const char *fmt, va_list ap)
+{
+    for (const char *p = fmt; *p; )
+    {
+        if (*p++ != '%')
+            continue;
+        log_spec spec;
+        p = ParseLogSpec(p, &spec);
+        for (int i = 0; i < spec.starCount; ++i)
+        {
+            int64 value = va_arg(ap, int);
+            if (!PutLogBytes(record, size, &value, sizeof(value)))
+                return 0;
+        }
+        switch (spec.conversion)
+        {
+            case '%':
+                break;
+            case 'd': case 'i':
+            case 'u': case 'o': case 'x': case 'X': case 'c':
+            {
+                int64 value;
+                switch (spec.length)
+                {
+                    case kLogLenL:  value = (int64)va_arg(ap, long); break;
+                    case kLogLenLL: value = (int64)va_arg(ap, long long); break;
+                    case kLogLenJ:  value = (int64)va_arg(ap, intmax_t); break;
+                    case kLogLenZ:  value = (int64)va_arg(ap, size_t); break;
+                    case kLogLenT:  value = (int64)va_arg(ap, ptrdiff_t); break;
+                    default:        value = (int64)va_arg(ap, int); break;
+                }
+                if (!PutLogBytes(record, size, &value, sizeof(value)))
+                    return 0;
+            } break;
+            case 'f': case 'F': case 'e': case 'E':
+            case 'g': case 'G': case 'a': case 'A':
+            {
+                double value = (spec.length == kLogLenBigL) ?
+                    (double)va_arg(ap, long double) : va_arg(ap, double);
+                if (!PutLogBytes(record, size, &value, sizeof(value)))
+                    return 0;
+            } break;
+            case 'p':
+            {
+                uint64 value = (uint64)(uintptr_t)va_arg(ap, void *);
+                if (!PutLogBytes(record, size, &value, sizeof(value)))
+                    return 0;
+            } break;
+            case 's':
+            {
+                const char *string = va_arg(ap, const char *);
+                if (!string)
+                    string = "(null)";
+                // NOTE(Kevin): Long strings (script output) get cut, leaving
+                // some room for the arguments behind them
+                uint32 reserved = sizeof(uint64) + 64;
+                if (*size + reserved > LogMaxRecordSize)
+                    return 0;
+                uint32 len = (uint32)strlen(string);
+                if (len > LogMaxRecordSize - *size - reserved)
+                    len = LogMaxRecordSize - *size - reserved;
+                uint64 header = len;
+                if (!PutLogBytes(record, size, &header, sizeof(header)) ||
+                    !PutLogBytes(record, size, string, len))
+                    return 0;
+            } break;
+            default:
+            {
+                // NOTE(Kevin): %n and unknown conversions are not supported
+                return 0;
+            } break;
+        }
     }
-    free(fileName);
-#endif
     return 1;
 }
 
+internal log_ring *
+GetLogRing(void)
+{
+    if (!t_logRing)
+    {
+        void *memory = 0;
+        if (posix_memalign(&memory, 64, sizeof(log_ring)) != 0)
+            return 0;
+        log_ring *ring = memory;
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->dropped, 0);
+        ring->next = atomic_load(&g_logRings);
+        while (!atomic_compare_exchange_weak(&g_logRings, &ring->next, ring))
+            ;
+        t_logRing = ring;
+    }
+    return t_logRing;
+}
+
 internal void
-WriteToLog_(bool32 toUser, const char *fmt, ...)
+PushLogRecord(uint8 *record, uint32 size)
+{
+    log_ring *ring = GetLogRing();
+    if (!ring)
+    {
+        atomic_fetch_add_explicit(&g_logRecordsWithoutRing, 1, memory_order_relaxed);
+        return;
+    }
+    uint64 head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64 tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32 pos  = (uint32)(head & (P2PJS_LogRingSize - 1));
+    uint32 toEnd = P2PJS_LogRingSize - pos;
+    uint32 needed = (toEnd < size) ? toEnd + size : size;
+    if (P2PJS_LogRingSize - (head - tail) < needed)
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    if (toEnd < size)
+    {
+        uint32 endMarker = 0;
+        memcpy(ring->data + pos, &endMarker, sizeof(endMarker));
+        head += toEnd;
+        pos = 0;
+    }
+    memcpy(ring->data + pos, record, size);
+    atomic_store_explicit(&ring->head, head + size, memory_order_release);
+
+    // NOTE(Kevin): Pairs with the fence in LogThread; either we see that it
+    // is going to sleep or it sees our record.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&g_logThreadSleeping, memory_order_relaxed) &&
+        atomic_exchange(&g_logThreadSleeping, 0))
+    {
+        sem_post(&g_logWakeup);
+    }
+}
+
+internal void
+Log_(int level, int subsystem, bool32 toUser, const char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
-    time_t currentTime = time(0);
-    char *timeString = ctime(&currentTime);
-    char *messageFormat = malloc(strlen(timeString) + strlen(fmt) + 3);
-    if (!messageFormat)
+    bool32 record = level <= g_logLevel && (g_logSubsystems & (1u << subsystem));
+    if (toUser)
+    {
+        va_list userAp;
+        va_copy(userAp, ap);
+        vfprintf(stderr, fmt, userAp);
+        va_end(userAp);
+        // NOTE(Kevin): When logging to stderr the user has seen it already
+        record = record && !P2PJS_LOGTOSTDERR;
+    }
+    if (record)
     {
-        if (g_logFile)
+        _Alignas(8) uint8 buffer[LogMaxRecordSize];
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        log_record header;
+        header.size      = sizeof(log_record);
+        header.level     = (uint8)level;
+        header.subsystem = (uint8)subsystem;
+        header.flags     = toUser ? kLogRecordToUser : 0;
+        header.pad       = 0;
+        header.timestamp = (uint64)ts.tv_sec * 1000000000ull + (uint64)ts.tv_nsec;
+        header.fmt       = fmt;
+        if (!SerializeLogArgs(buffer, &header.size, fmt, ap))
+            header.flags |= kLogRecordTruncated;
+        memcpy(buffer, &header, sizeof(header));
+        PushLogRecord(buffer, header.size);
+    }
+    va_end(ap);
+}
+
+#define LogEnabled(L, S) ((L) <= g_logLevel && (g_logSubsystems & (1u << (S))))
+// NOTE(Kevin): S is always one of the enum constants, so for a subsystem
+// that is not in P2PJS_LogSubsystems the condition is a constant 0 and the
+// call compiles away like LogNever_.
+#define LogCompiledIn_(S) ((P2PJS_LogSubsystems) & (1u << (S)))
+#define LogAt_(L, S, ...) do { if (LogCompiledIn_(S) && LogEnabled(L, S)) Log_(L, S, 0, __VA_ARGS__); } while (0)
+// NOTE(Kevin): The arguments are still type checked, but never evaluated
+#define LogNever_(L, S, ...) do { if (0) Log_(L, S, 0, __VA_ARGS__); } while (0)
+
+#define LogError(S, ...) LogAt_(kLogError, S, __VA_ARGS__)
+#if P2PJS_MaxLogLevel >= 1
+  #define LogWarning(S, ...) LogAt_(kLogWarning, S, __VA_ARGS__)
+#else
+  #define LogWarning(S, ...) LogNever_(kLogWarning, S, __VA_ARGS__)
+#endif
+#if P2PJS_MaxLogLevel >= 2
+  #define LogInfo(S, ...) LogAt_(kLogInfo, S, __VA_ARGS__)
+#else
+  #define LogInfo(S, ...) LogNever_(kLogInfo, S, __VA_ARGS__)
+#endif
+#if P2PJS_MaxLogLevel >= 3
+  #define LogDebug(S, ...) LogAt_(kLogDebug, S, __VA_ARGS__)
+#else
+  #define LogDebug(S, ...) LogNever_(kLogDebug, S, __VA_ARGS__)
+#endif
+
+// NOTE(Kevin): Always shown to the user, and logged at info level
+#define LogUser(S, ...) Log_(kLogInfo, S, 1, __VA_ARGS__)
+
+// NOTE(Kevin): Parses "level" or "level:subsystem,subsystem,..."
+internal int
+SetLogFilter(const char *filter)
+{
+    int level = -1;
+    size_t levelLen = strcspn(filter, ":");
+    for (unsigned int i = 0; i < SizeofArray(g_logLevelNames); ++i)
+    {
+        if (strlen(g_logLevelNames[i]) == levelLen &&
+            strncmp(filter, g_logLevelNames[i], levelLen) == 0)
+        {
+            level = (int)i;
+        }
+    }
+    if (level == -1)
+        return kInvalidValue;
+    uint32 subsystems = ~0u;
+    if (filter[levelLen] == ':')
+    {
+        subsystems = 0;
+        const char *name = filter + levelLen + 1;
+        while (*name)
         {
-            if (toUser)
+            size_t nameLen = strcspn(name, ",");
+            int subsystem = -1;
+            for (unsigned int i = 0; i < SizeofArray(g_logSubsystemNames); ++i)
             {
-                vfprintf(stderr, fmt, ap);
-                va_start(ap, fmt);
+                if (strlen(g_logSubsystemNames[i]) == nameLen &&
+                    strncmp(name, g_logSubsystemNames[i], nameLen) == 0)
+                {
+                    subsystem = (int)i;
+                }
             }
-            fprintf(g_logFile, "%s ", timeString);
-            vfprintf(g_logFile, fmt, ap);
-            fflush(g_logFile);
+            if (subsystem == -1)
+                return kInvalidValue;
+            subsystems |= 1u << subsystem;
+            name += nameLen;
+            if (*name == ',')
+                ++name;
         }
-        else
+    }
+    g_logLevel = level;
+    g_logSubsystems = subsystems;
+    return kSuccess;
+}
+
+internal void
+FlushLogOutput(void)
+{
+    if (g_logOutputLen == 0)
+        return;
+    FILE *out = g_logFile ? g_logFile : stderr;
+    fwrite(g_logOutput, 1, g_logOutputLen, out);
+    fflush(out);
+    g_logOutputLen = 0;
+}
+
+internal void
+AppendLogOutput(const char *fmt, ...)
+{
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        size_t room = LogOutputSize - g_logOutputLen;
+        va_list ap;
+        va_start(ap, fmt);
+        int len = vsnprintf(g_logOutput + g_logOutputLen, room, fmt, ap);
+        va_end(ap);
+        if (len < 0)
+            return;
+        if ((size_t)len < room)
         {
-            fprintf(stderr, "%s ", timeString);
-            vfprintf(stderr, fmt, ap);
+            g_logOutputLen += (size_t)len;
+            return;
         }
+        // NOTE(Kevin): Did not fit, make room and try again
+        FlushLogOutput();
+    }
+}
+
+// NOTE(Kevin): Formats one record into g_logOutput
+internal void
+FormatLogRecord(const uint8 *data)
+{
+    log_record header;
+    memcpy(&header, data, sizeof(header));
+
+    time_t second = (time_t)(header.timestamp / 1000000000ull);
+    if (second != g_logCachedSecond)
+    {
+        struct tm tm;
+        localtime_r(&second, &tm);
+        strftime(g_logCachedTime, sizeof(g_logCachedTime), "%Y-%m-%d %H:%M:%S", &tm);
+        g_logCachedSecond = second;
     }
-    else
+    AppendLogOutput("%s.%03u %-5s %-5s ", g_logCachedTime,
+                    (unsigned int)((header.timestamp / 1000000ull) % 1000),
+                    g_logLevelNames[header.level], g_logSubsystemNames[header.subsystem]);
+
+    uint32 offset = sizeof(log_record);
+    const char *p = header.fmt;
+    while (*p)
     {
-        strcpy(messageFormat, timeString); 
-        if (timeString[strlen(timeString)] < ' ')
-            messageFormat[strlen(timeString) - 1] = '\0';
-        strcat(messageFormat, " ");
-        strcat(messageFormat, fmt);
-        if (g_logFile)
+        const char *literal = p;
+        while (*p && *p != '%')
+            ++p;
+        if (p != literal)
+            AppendLogOutput("%.*s", (int)(p - literal), literal);
+        if (!*p)
+            break;
+
+        const char *specStart = p++;
+        log_spec spec;
+        p = ParseLogSpec(p, &spec);
+        if (spec.conversion == '%')
+        {
+            AppendLogOutput("%%");
+            continue;
+        }
+
+        // NOTE(Kevin): Rebuild the specification with the '*' values filled in
+        char specString[64];
+        size_t specLen = 0;
+        for (const char *s = specStart; s < p && specLen < sizeof(specString) - 24; ++s)
         {
-            if (toUser)
+            if (*s == '*')
+            {
+                int64 value = 0;
+                if (offset + sizeof(value) > header.size)
+                    goto truncated;
+                memcpy(&value, data + offset, sizeof(value));
+                offset += sizeof(value);
+                specLen += (size_t)snprintf(specString + specLen, sizeof(specString) - specLen,
+                                            "%d", (int)value);
+            }
+            else if (*s != 'L')
             {
-                vfprintf(stderr, fmt, ap);
-                va_start(ap, fmt);
+                specString[specLen++] = *s;
             }
-            vfprintf(g_logFile, messageFormat, ap);
-            fflush(g_logFile);
         }
-        else
+        specString[specLen] = '\0';
+
+        if (offset + sizeof(uint64) > header.size)
+            goto truncated;
+        switch (spec.conversion)
         {
-            vfprintf(stderr, messageFormat, ap);
+            case 'd': case 'i':
+            case 'u': case 'o': case 'x': case 'X': case 'c':
+            {
+                int64 value;
+                memcpy(&value, data + offset, sizeof(value));
+                offset += sizeof(value);
+                switch (spec.length)
+                {
+                    case kLogLenL:  AppendLogOutput(specString, (long)value); break;
+                    case kLogLenLL: AppendLogOutput(specString, (long long)value); break;
+                    case kLogLenJ:  AppendLogOutput(specString, (intmax_t)value); break;
+                    case kLogLenZ:  AppendLogOutput(specString, (size_t)value); break;
+                    case kLogLenT:  AppendLogOutput(specString, (ptrdiff_t)value); break;
+                    default:        AppendLogOutput(specString, (int)value); break;
+                }
+            } break;
+            case 'f': case 'F': case 'e': case 'E':
+            case 'g': case 'G': case 'a': case 'A':
+            {
+                double value;
+                memcpy(&value, data + offset, sizeof(value));
+                offset += sizeof(value);
+                AppendLogOutput(specString, value);
+            } break;
+            case 'p':
+            {
+                uint64 value;
+                memcpy(&value, data + offset, sizeof(value));
+                offset += sizeof(value);
+                AppendLogOutput(specString, (void *)(uintptr_t)value);
+            } break;
+            case 's':
+            {
+                uint64 len;
+                memcpy(&len, data + offset, sizeof(len));
+                offset += sizeof(len);
+                if (offset + len > header.size)
+                    goto truncated;
+                char string[LogMaxRecordSize];
+                memcpy(string, data + offset, (size_t)len);
+                string[len] = '\0';
+                offset += ((uint32)len + 7) & ~7u;
+                AppendLogOutput(specString, string);
+            } break;
+            default:
+                goto truncated;
         }
-        free(messageFormat);
     }
-    va_end(ap);
+    return;
+
+truncated:
+    AppendLogOutput(" [truncated]\n");
+}
+
+// NOTE(Kevin): Formats everything that is in the rings right now.
+// Returns the number of records.
+internal unsigned int
+DrainLogRings(void)
+{
+    unsigned int count = 0;
+    for (log_ring *ring = atomic_load(&g_logRings); ring; ring = ring->next)
+    {
+        uint64 tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64 head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head)
+        {
+            uint32 pos = (uint32)(tail & (P2PJS_LogRingSize - 1));
+            uint32 size;
+            memcpy(&size, ring->data + pos, sizeof(size));
+            if (size == 0)
+            {
+                tail += P2PJS_LogRingSize - pos;
+            }
+            else
+            {
+                FormatLogRecord(ring->data + pos);
+                tail += size;
+                ++count;
+            }
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+        uint64 dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped > 0)
+            AppendLogOutput("[%llu log records dropped, ring was full]\n", dropped);
+    }
+    uint64 dropped = atomic_exchange_explicit(&g_logRecordsWithoutRing, 0, memory_order_relaxed);
+    if (dropped > 0)
+        AppendLogOutput("[%llu log records dropped, no memory for a ring]\n", dropped);
+    return count;
+}
+
+internal bool32
+AreLogRingsEmpty(void)
+{
+    for (log_ring *ring = atomic_load(&g_logRings); ring; ring = ring->next)
+    {
+        if (atomic_load(&ring->head) != atomic_load(&ring->tail))
+            return 0;
+    }
+    return 1;
 }
 
-#define WriteToLog(...) WriteToLog_(0, __VA_ARGS__)
-#define WriteToUser(...) WriteToLog_(1, __VA_ARGS__)
+internal void *
+LogThread(void *_threadParam)
+{
+    Unused(_threadParam);
+    for (;;)
+    {
+        bool32 shouldStop = atomic_load(&g_logShouldStop);
+        unsigned int count = DrainLogRings();
+        FlushLogOutput();
+        if (shouldStop)
+            break;
+        if (count > 0)
+            continue;
+
+        atomic_store(&g_logThreadSleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!AreLogRingsEmpty())
+        {
+            atomic_store(&g_logThreadSleeping, 0);
+            continue;
+        }
+        // NOTE(Kevin): The timeout only matters if a wakeup got lost
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100 * 1000 * 1000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_nsec -= 1000000000;
+            ++deadline.tv_sec;
+        }
+        while (sem_timedwait(&g_logWakeup, &deadline) == -1 && errno == EINTR)
+            ;
+        atomic_store(&g_logThreadSleeping, 0);
+    }
+    return 0;
+}
+
+// NOTE(Kevin): Records logged before OpenLog stay in the ring and are
+// written once the log thread runs.
+internal bool32
+OpenLog(void)
+{
+#if !P2PJS_LOGTOSTDERR
+    time_t startTime = time(0);
+    char *startTimeString = ctime(&startTime);
+    char *fileName = malloc(strlen(LogFilenamePrefix) +
+                            strlen(startTimeString) +
+                            strlen(LogFilenameSuffix) + 1);
+    if (!fileName)
+        return 0;
+    // NOTE(Kevin): ctime() ends the string with a newline, which doesn't
+    // belong into the file name.
+    int timeLength = (int)strcspn(startTimeString, "\r\n");
+    sprintf(fileName, "%s%.*s%s", LogFilenamePrefix, timeLength, startTimeString, LogFilenameSuffix);
+    g_logFile = fopen(fileName, "w");
+    if (!g_logFile) {
+        fprintf(stderr, "Can not open log file %s\n", fileName);
+        free(fileName);
+        return 0;
+    }
+    free(fileName);
+#endif
+    if (sem_init(&g_logWakeup, 0, 0) != 0)
+        return 0;
+    if (pthread_create(&g_logThread, 0, LogThread, 0) != 0)
+    {
+        fprintf(stderr, "Can not start the log thread\n");
+        sem_destroy(&g_logWakeup);
+        return 0;
+    }
+    g_logThreadRunning = 1;
+    return 1;
+}
 
 internal void
 CloseLog(void)
 {
+    if (g_logThreadRunning)
+    {
+        atomic_store(&g_logShouldStop, 1);
+        sem_post(&g_logWakeup);
+        pthread_join(g_logThread, 0);
+        sem_destroy(&g_logWakeup);
+        g_logThreadRunning = 0;
+    }
     if (g_logFile)
         fclose(g_logFile);
+    g_logFile = 0;
 }
@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "p2pjs.h"
+#include "sha-256.h"
+
+// NOTE(Kevin): Result cache. Sweeps often launch the same source with the
+// same argument more than once: retries, overlapping parameter grids. A
+// job's result is kept under the hash of its source, its argument and its
+// payload for P2PJS_MemoTTL seconds, at most g_memoCapacity results;
+// the least recently used one makes room. The cache is off unless the
+// node is started with -M, because a job that is not a pure function of
+// these would silently get a stale result.
+// The emitter looks a job up before querying for it, and a job that is
+// still in flight takes later copies along instead of running twice (see
+// ResolveJobFromMemo() in jobs.c). Workers look a job up before running
+// it. Both sides share one cache per node.
+// Jobs whose result depends on more than that do not take part: jobs of a
+// job graph or a map-reduce tree, and sources that use Random or read
+// System.clock. That check only looks at the text of the source, so it
+// catches the obvious cases, not a job that reads a file or gets its
+// randomness from a module it imports.
+
+#ifndef P2PJS_MemoCapacity
+  // NOTE(Kevin): Default for -M; 0 turns the cache off
+  #define P2PJS_MemoCapacity 0
+#endif
+
+#ifndef P2PJS_MemoTTL
+  #define P2PJS_MemoTTL 300.0
+#endif
+
+#ifndef P2PJS_MemoMaxResultSize
+  // NOTE(Kevin): Bytes of values and payload; larger results are not kept
+  #define P2PJS_MemoMaxResultSize (1 << 20)
+#endif
+
+typedef struct
+{
+    uint8   key[CookieLen];
+    double  result;
+    double *values;
+    uint32  valueCount;
+    uint8  *payload;
+    uint32  payloadSize;
+    double  storeTime;
+    // NOTE(Kevin): Neighbours in the list from least to most recently used,
+    // indexes into g_memoEntries, -1 at the ends
+    int32   older;
+    int32   newer;
+} memo_entry;
+
+// NOTE(Kevin): Hash index over an array of elements that each carry a key
+// (a memo key or a cookie). Open addressing; a slot holds the element's
+// index + 1, 0 is free. Kept at most half full.
+typedef const uint8 *key_getter(uint32 element);
+
+typedef struct
+{
+    uint32     *slots;
+    uint32      capacity;
+    uint32      count;
+    key_getter *getKey;
+} key_index;
+
+internal const uint8 *GetMemoEntryKey(uint32 element);
+
+global_variable unsigned int g_memoCapacity = P2PJS_MemoCapacity;
+global_variable memo_entry  *g_memoEntries;
+global_variable unsigned int g_memoEntryCount;
+global_variable unsigned int g_memoEntryCapacity;
+global_variable key_index    g_memoIndex = { 0, 0, 0, GetMemoEntryKey };
+global_variable int32        g_oldestMemoEntry = -1;
+global_variable int32        g_newestMemoEntry = -1;
+
+// NOTE(Kevin): Keys are hashes, their first bytes are as good as any hash
+// of them
+internal uint32
+GetKeyIndexHome(const key_index *index, const uint8 key[CookieLen])
+{
+    uint64 h;
+    memcpy(&h, key, sizeof(h));
+    return (uint32)(h ^ (h >> 32)) & (index->capacity - 1);
+}
+
+// NOTE(Kevin): The slot that holds key, or the free slot it would go to.
+// Needs a capacity > 0, see ReserveKeyIndex().
+internal uint32 *
+FindKeySlot(key_index *index, const uint8 key[CookieLen])
+{
+    uint32 slot = GetKeyIndexHome(index, key);
+    while (index->slots[slot] != 0 &&
+           memcmp(index->getKey(index->slots[slot] - 1), key, CookieLen) != 0)
+        slot = (slot + 1) & (index->capacity - 1);
+    return &index->slots[slot];
+}
+
+internal bool32
+ReserveKeyIndex(key_index *index, uint32 count)
+{
+    if (2 * (uint64)count <= index->capacity)
+        return 1;
+    uint32 newCapacity = (index->capacity == 0) ? 64 : 2 * index->capacity;
+    while (2 * (uint64)count > newCapacity)
+        newCapacity *= 2;
+    uint32 *slots = calloc(newCapacity, sizeof(uint32));
+    if (!slots)
+        return 0;
+    uint32 *oldSlots   = index->slots;
+    uint32 oldCapacity = index->capacity;
+    index->slots    = slots;
+    index->capacity = newCapacity;
+    for (uint32 i = 0; i < oldCapacity; ++i)
+    {
+        if (oldSlots[i] != 0)
+            *FindKeySlot(index, index->getKey(oldSlots[i] - 1)) = oldSlots[i];
+    }
+    free(oldSlots);
+    return 1;
+}
+
+// NOTE(Kevin): Moves later slots of the same run back into the gap, so
+// lookups never stop early at it
+internal void
+RemoveKeySlot(key_index *index, uint32 *slot)
+{
+    uint32 mask = index->capacity - 1;
+    uint32 hole = (uint32)(slot - index->slots);
+    for (uint32 next = (hole + 1) & mask; index->slots[next] != 0; next = (next + 1) & mask)
+    {
+        uint32 home = GetKeyIndexHome(index, index->getKey(index->slots[next] - 1));
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            index->slots[hole] = index->slots[next];
+            hole = next;
+        }
+    }
+    index->slots[hole] = 0;
+    --index->count;
+}
+
+internal const uint8 *
+GetMemoEntryKey(uint32 element)
+{
+    return g_memoEntries[element].key;
+}
+
+internal void
+UnlinkMemoEntry(int32 index)
+{
+    memo_entry *entry = &g_memoEntries[index];
+    if (entry->older != -1)
+        g_memoEntries[entry->older].newer = entry->newer;
+    else
+        g_oldestMemoEntry = entry->newer;
+    if (entry->newer != -1)
+        g_memoEntries[entry->newer].older = entry->older;
+    else
+        g_newestMemoEntry = entry->older;
+}
+
+internal void
+LinkNewestMemoEntry(int32 index)
+{
+    memo_entry *entry = &g_memoEntries[index];
+    entry->older = g_newestMemoEntry;
+    entry->newer = -1;
+    if (g_newestMemoEntry != -1)
+        g_memoEntries[g_newestMemoEntry].newer = index;
+    else
+        g_oldestMemoEntry = index;
+    g_newestMemoEntry = index;
+}
+
+// NOTE(Kevin): Whether a job's result could depend on more than its source,
+// argument and payload. The result store uses the same check.
+internal bool32
+IsSourcePure(const char *source)
+{
+    return !strstr(source, "random") &&
+           !strstr(source, "Random") &&
+           !strstr(source, "System.clock");
+}
+
+internal bool32
+IsSourceMemoizable(const char *source)
+{
+    return g_memoCapacity > 0 && IsSourcePure(source);
+}
+
+internal void
+ComputeMemoKey(const uint8 sourceHash[CookieLen], double arg,
+               const uint8 *payload, uint32 payloadSize, uint8 keyOut[CookieLen])
+{
+    struct Sha_256 sha;
+    sha_256_init(&sha);
+    sha_256_update(&sha, sourceHash, CookieLen);
+    sha_256_update(&sha, &arg, sizeof(arg));
+    sha_256_update(&sha, &payloadSize, sizeof(payloadSize));
+    if (payloadSize > 0)
+        sha_256_update(&sha, payload, payloadSize);
+    sha_256_final(&sha, keyOut);
+}
+
+internal void
+RemoveMemoEntry(int32 index)
+{
+    free(g_memoEntries[index].values);
+    free(g_memoEntries[index].payload);
+    UnlinkMemoEntry(index);
+    RemoveKeySlot(&g_memoIndex, FindKeySlot(&g_memoIndex, g_memoEntries[index].key));
+    int32 last = (int32)--g_memoEntryCount;
+    if (index != last)
+    {
+        // NOTE(Kevin): The last entry fills the gap
+        memo_entry *entry = &g_memoEntries[index];
+        *entry = g_memoEntries[last];
+        *FindKeySlot(&g_memoIndex, entry->key) = (uint32)index + 1;
+        if (entry->older != -1)
+            g_memoEntries[entry->older].newer = index;
+        else
+            g_oldestMemoEntry = index;
+        if (entry->newer != -1)
+            g_memoEntries[entry->newer].older = index;
+        else
+            g_newestMemoEntry = index;
+    }
+    MetricSet(&g_metricMemoEntries, g_memoEntryCount);
+}
+
+// NOTE(Kevin): Valid until the next StoreMemo()
+internal const memo_entry *
+LookupMemo(const uint8 key[CookieLen])
+{
+    if (g_memoEntryCount == 0)
+        return 0;
+    uint32 *slot = FindKeySlot(&g_memoIndex, key);
+    if (*slot == 0)
+        return 0;
+    int32 index = (int32)*slot - 1;
+    if (GetTime() - g_memoEntries[index].storeTime > P2PJS_MemoTTL)
+    {
+        RemoveMemoEntry(index);
+        return 0;
+    }
+    UnlinkMemoEntry(index);
+    LinkNewestMemoEntry(index);
+    return &g_memoEntries[index];
+}
+
+internal void
+StoreMemo(const uint8 key[CookieLen], double result, const double *values, uint32 valueCount,
+          const uint8 *payload, uint32 payloadSize)
+{
+    if (g_memoCapacity == 0 ||
+        sizeof(double) * (uint64)valueCount + payloadSize > P2PJS_MemoMaxResultSize)
+        return;
+    if (!ReserveKeyIndex(&g_memoIndex, g_memoEntryCount + 1))
+        return;
+    double now = GetTime();
+    uint32 *slot = FindKeySlot(&g_memoIndex, key);
+    if (*slot != 0)
+    {
+        // NOTE(Kevin): The same result again, e.g. of a hedged copy
+        g_memoEntries[*slot - 1].storeTime = now;
+        return;
+    }
+    if (g_memoEntryCount >= g_memoCapacity)
+    {
+        RemoveMemoEntry(g_oldestMemoEntry);
+        slot = FindKeySlot(&g_memoIndex, key);
+    }
+    if (g_memoEntryCount == g_memoEntryCapacity)
+    {
+        unsigned int newCapacity = (g_memoEntryCapacity == 0) ? 8 : 2 * g_memoEntryCapacity;
+        if (newCapacity > g_memoCapacity)
+            newCapacity = g_memoCapacity;
+        memo_entry *t = realloc(g_memoEntries, sizeof(memo_entry) * newCapacity);
+        if (!t)
+            return;
+        g_memoEntries = t;
+        g_memoEntryCapacity = newCapacity;
+    }
+    memo_entry *entry = &g_memoEntries[g_memoEntryCount];
+    entry->values  = 0;
+    entry->payload = 0;
+    if (valueCount > 0)
+    {
+        entry->values = malloc(sizeof(double) * valueCount);
+        if (!entry->values)
+            return;
+        memcpy(entry->values, values, sizeof(double) * valueCount);
+    }
+    if (payloadSize > 0)
+    {
+        entry->payload = malloc(payloadSize);
+        if (!entry->payload)
+        {
+            free(entry->values);
+            return;
+        }
+        memcpy(entry->payload, payload, payloadSize);
+    }
+    memcpy(entry->key, key, CookieLen);
+    entry->result      = result;
+    entry->valueCount  = valueCount;
+    entry->payloadSize = payloadSize;
+    entry->storeTime   = now;
+    *slot = g_memoEntryCount + 1;
+    ++g_memoIndex.count;
+    LinkNewestMemoEntry((int32)g_memoEntryCount);
+    ++g_memoEntryCount;
+    MetricSet(&g_metricMemoEntries, g_memoEntryCount);
+}
@@ -4,6 +4,39 @@
 #include <stdlib.h>
 #include <assert.h>
 
+// NOTE(Kevin): Bookkeeping for every message that went out completely
+internal void
+OnMessageSent(int fd, uint16 type, uint32 size, const uint8 *cookie)
+{
+    TraceMessageSent(fd, type, size, cookie);
+    MetricAddLabeled(&g_metricMessagesSent, type, 1);
+    MetricAddLabeled(&g_metricBytesSent, type, size);
+}
+
+// NOTE(Kevin): Everything of a jobResult message before its values and payload
+#define JobResultFixedSize (CookieLen + sizeof(int) + sizeof(double) + sizeof(job_usage) + 2 * sizeof(uint32))
+
+#define AggregateJobSize (2 * CookieLen + sizeof(uint32) + sizeof(int32) + 2 * sizeof(peer_info))
+// NOTE(Kevin): Everything of an aggregatedResult message before its chunks and values
+#define AggregatedResultFixedSize (CookieLen + sizeof(peer_info) + sizeof(int32) + 2 * sizeof(uint32))
+#define AwaitInputsSize (CookieLen + 2 * sizeof(uint32))
+// NOTE(Kevin): Everything of a jobInput message before its values
+#define JobInputFixedSize (CookieLen + 2 * sizeof(uint32) + sizeof(double))
+#define ForwardResultSize (2 * CookieLen + sizeof(uint32) + sizeof(peer_info))
+// NOTE(Kevin): Everything of a payloadChunk message before its bytes
+#define PayloadChunkFixedSize (CookieLen + 2 * sizeof(uint32))
+#define PayloadAckSize (CookieLen + sizeof(uint32))
+#ifndef P2PJS_MaxAggregatedChunks
+  #define P2PJS_MaxAggregatedChunks (1 << 20)
+#endif
+#ifndef P2PJS_ControlMessageLimit
+  // NOTE(Kevin): Larger messages count as bulk on the receiving side
+  #define P2PJS_ControlMessageLimit (4 << 10)
+#endif
+
+internal int StartPayloadStream(int fd, uint8 cookie[CookieLen], const uint8 *head, uint32 headSize,
+                               const uint8 *bytes, uint32 size, bool32 copy);
+
 internal int
 SendBytes(int fd, int byteCount, const char *buffer)
 {
@@ -32,6 +65,7 @@ SendHello(int fd, const char *port)
         return kSyscallFailed;
     if (SendBytes(fd, SizeofArray(portBuffer), portBuffer) != kSuccess)
         return kSyscallFailed;
+    OnMessageSent(fd, kHello, sizeof(messageType) + SizeofArray(portBuffer), 0);
     return kSuccess;
 }
 
@@ -45,8 +79,11 @@ SendPeerList(int fd, uint16 numberOfPeers, const peer_info *peers)
         return kSyscallFailed;
     if (numberOfPeers > 0)
     {
-        return SendBytes(fd, sizeof(peer_info) * numberOfPeers, (const char*)peers);
+        if (SendBytes(fd, sizeof(peer_info) * numberOfPeers, (const char*)peers) != kSuccess)
+            return kSyscallFailed;
     }
+    OnMessageSent(fd, kPeerList,
+                     sizeof(messageType) + sizeof(numberOfPeers) + sizeof(peer_info) * numberOfPeers, 0);
     return kSuccess;
 } 
 
@@ -54,7 +91,10 @@ internal int
 SendGetPeers(int fd)
 {
     uint16 messageType = kGetPeers;
-    return SendBytes(fd, sizeof(messageType), (const char*)&messageType);
+    if (SendBytes(fd, sizeof(messageType), (const char*)&messageType) != kSuccess)
+        return kSyscallFailed;
+    OnMessageSent(fd, kGetPeers, sizeof(messageType), 0);
+    return kSuccess;
 }
 
 internal int
@@ -65,7 +105,42 @@ SendQueryJobResources(int fd, uint8 cookie[CookieLen], peer_info info)
         return kSyscallFailed;
     if (SendBytes(fd, CookieLen, (const char*)cookie) != kSuccess)
         return kSyscallFailed;
-    return SendBytes(fd, sizeof(info), (const char*)&info);
+    if (SendBytes(fd, sizeof(info), (const char*)&info) != kSuccess)
+        return kSyscallFailed;
+    OnMessageSent(fd, kQueryJobResources, sizeof(messageType) + CookieLen + sizeof(info), cookie);
+    return kSuccess;
+}
+
+#define QueryBatchSize 64
+
+// NOTE(Kevin): The same messages as count calls to SendQueryJobResources,
+// packed into one send() per QueryBatchSize queries
+internal int
+SendQueryJobResourcesBatch(int fd, const uint8 *cookies, int count, peer_info info)
+{
+    uint16 messageType = kQueryJobResources;
+    const int messageSize = sizeof(messageType) + CookieLen + sizeof(info);
+    char buffer[QueryBatchSize * (sizeof(messageType) + CookieLen + sizeof(peer_info))];
+    for (int first = 0; first < count; first += QueryBatchSize)
+    {
+        int batchCount = (count - first < QueryBatchSize) ? count - first : QueryBatchSize;
+        char *at = buffer;
+        for (int i = 0; i < batchCount; ++i)
+        {
+            memcpy(at, &messageType, sizeof(messageType));
+            memcpy(at + sizeof(messageType), cookies + (size_t)(first + i) * CookieLen, CookieLen);
+            memcpy(at + sizeof(messageType) + CookieLen, &info, sizeof(info));
+            at += messageSize;
+        }
+        if (SendBytes(fd, batchCount * messageSize, buffer) != kSuccess)
+            return kSyscallFailed;
+        for (int i = 0; i < batchCount; ++i)
+        {
+            OnMessageSent(fd, kQueryJobResources, messageSize,
+                          cookies + (size_t)(first + i) * CookieLen);
+        }
+    }
+    return kSuccess;
 }
 
 internal int
@@ -74,7 +149,22 @@ SendOfferJobResources(int fd, uint8 cookie[CookieLen])
     uint16 messageType = kOfferJobResources;
     if (SendBytes(fd, sizeof(messageType), (const char*)&messageType) != kSuccess)
         return kSyscallFailed;
-    return SendBytes(fd, CookieLen, (const char*)cookie);
+    if (SendBytes(fd, CookieLen, (const char*)cookie) != kSuccess)
+        return kSyscallFailed;
+    OnMessageSent(fd, kOfferJobResources, sizeof(messageType) + CookieLen, cookie);
+    return kSuccess;
+}
+
+internal int
+SendDeclineOffer(int fd, uint8 cookie[CookieLen])
+{
+    uint16 messageType = kDeclineOffer;
+    if (SendBytes(fd, sizeof(messageType), (const char*)&messageType) != kSuccess)
+        return kSyscallFailed;
+    if (SendBytes(fd, CookieLen, (const char*)cookie) != kSuccess)
+        return kSyscallFailed;
+    OnMessageSent(fd, kDeclineOffer, sizeof(messageType) + CookieLen, cookie);
+    return kSuccess;
 }
 
 internal int
@@ -92,6 +182,16 @@ SendJob(int fd, uint8 cookie[CookieLen], const job *job)
         perror("sourceLen");
         return kSyscallFailed;
     }
+    uint32 payloadSize = job->payload ? job->payloadSize : 0;
+    // NOTE(Kevin): A large source or payload follows in chunks, between
+    // other messages, instead of holding them up
+    bool32 isStreamed = sourceLen + payloadSize > P2PJS_StreamThreshold;
+    uint32 wirePayloadSize = isStreamed ? (payloadSize | PayloadStreamed) : payloadSize;
+    if (SendBytes(fd, sizeof(wirePayloadSize), (const char*)&wirePayloadSize) != kSuccess)
+    {
+        perror("payloadSize");
+        return kSyscallFailed;
+    }
     if (SendBytes(fd, CookieLen, (const char*)cookie) != kSuccess)
     {
         perror("cookie");
@@ -102,16 +202,59 @@ SendJob(int fd, uint8 cookie[CookieLen], const job *job)
         perror("arg");
         return kSyscallFailed;
     }
-    if (SendBytes(fd, sourceLen, job->source) != kSuccess)
+    if (SendBytes(fd, sizeof(job->kind), (const char*)&job->kind) != kSuccess)
+    {
+        perror("kind");
+        return kSyscallFailed;
+    }
+    if (!isStreamed && SendBytes(fd, sourceLen, job->source) != kSuccess)
     {
         perror("source");
         return kSyscallFailed;
     }
+    if (payloadSize > 0 && !isStreamed &&
+        SendBytes(fd, payloadSize, (const char*)job->payload) != kSuccess)
+    {
+        perror("payload");
+        return kSyscallFailed;
+    }
+    OnMessageSent(fd, kJob,
+                     sizeof(messageType) + 3 * sizeof(uint32) + CookieLen + sizeof(double) +
+                     (isStreamed ? 0 : sourceLen + payloadSize),
+                     cookie);
+    // NOTE(Kevin): The emitter keeps job sources and payloads, no need to copy
+    if (isStreamed)
+        return StartPayloadStream(fd, cookie, (const uint8*)job->source, sourceLen,
+                                  job->payload, payloadSize, 0);
+    return kSuccess;
+}
+
+internal int
+SendHeartbeat(int fd)
+{
+    uint16 messageType = kHeartbeat;
+    if (SendBytes(fd, sizeof(messageType), (const char*)&messageType) != kSuccess)
+        return kSyscallFailed;
+    OnMessageSent(fd, kHeartbeat, sizeof(messageType), 0);
     return kSuccess;
 }
 
 internal int
-SendJobResult(int fd, uint8 cookie[CookieLen], int state, double result)
+SendCancelJob(int fd, uint8 cookie[CookieLen])
+{
+    uint16 messageType = kCancelJob;
+    if (SendBytes(fd, sizeof(messageType), (const char*)&messageType) != kSuccess)
+        return kSyscallFailed;
+    if (SendBytes(fd, CookieLen, (const char*)cookie) != kSuccess)
+        return kSyscallFailed;
+    OnMessageSent(fd, kCancelJob, sizeof(messageType) + CookieLen, cookie);
+    return kSuccess;
+}
+
+internal int
+SendJobResult(int fd, uint8 cookie[CookieLen], int state, double result,
+              const double *values, uint32 valueCount,
+              const uint8 *payload, uint32 payloadSize, const job_usage *usage)
 {
     uint16 messageType = kJobResult; 
     if (SendBytes(fd, sizeof(messageType), (const char*)&messageType) != kSuccess)
@@ -134,6 +277,178 @@ SendJobResult(int fd, uint8 cookie[CookieLen], int state, double result)
         perror("result");
         return kSyscallFailed;
     }
+    if (SendBytes(fd, sizeof(job_usage), (const char*)usage) != kSuccess)
+    {
+        perror("usage");
+        return kSyscallFailed;
+    }
+    if (SendBytes(fd, sizeof(uint32), (const char*)&valueCount) != kSuccess)
+    {
+        perror("valueCount");
+        return kSyscallFailed;
+    }
+    bool32 isStreamed = payloadSize > P2PJS_StreamThreshold;
+    uint32 wirePayloadSize = isStreamed ? (payloadSize | PayloadStreamed) : payloadSize;
+    if (SendBytes(fd, sizeof(uint32), (const char*)&wirePayloadSize) != kSuccess)
+    {
+        perror("payloadSize");
+        return kSyscallFailed;
+    }
+    if (valueCount > 0 &&
+        SendBytes(fd, sizeof(double) * valueCount, (const char*)values) != kSuccess)
+    {
+        perror("values");
+        return kSyscallFailed;
+    }
+    if (payloadSize > 0 && !isStreamed &&
+        SendBytes(fd, payloadSize, (const char*)payload) != kSuccess)
+    {
+        perror("payload");
+        return kSyscallFailed;
+    }
+    OnMessageSent(fd, kJobResult,
+                     sizeof(messageType) + JobResultFixedSize + sizeof(double) * valueCount +
+                     (isStreamed ? 0 : payloadSize),
+                     cookie);
+    // NOTE(Kevin): The payload of the last job is gone with the next one
+    if (isStreamed)
+        return StartPayloadStream(fd, cookie, 0, 0, payload, payloadSize, 1);
+    return kSuccess;
+}
+
+internal int
+SendAggregateJob(int fd, uint8 cookie[CookieLen], uint8 group[CookieLen], uint32 chunkIndex,
+                 int32 reducer, const peer_info *parent, const peer_info *emitter)
+{
+    char buffer[sizeof(uint16) + AggregateJobSize];
+    uint16 messageType = kAggregateJob;
+    char *at = buffer;
+    memcpy(at, &messageType, sizeof(messageType)); at += sizeof(messageType);
+    memcpy(at, cookie, CookieLen);                 at += CookieLen;
+    memcpy(at, group, CookieLen);                  at += CookieLen;
+    memcpy(at, &chunkIndex, sizeof(chunkIndex));   at += sizeof(chunkIndex);
+    memcpy(at, &reducer, sizeof(reducer));         at += sizeof(reducer);
+    memcpy(at, parent, sizeof(peer_info));         at += sizeof(peer_info);
+    memcpy(at, emitter, sizeof(peer_info));
+    if (SendBytes(fd, sizeof(buffer), buffer) != kSuccess)
+        return kSyscallFailed;
+    OnMessageSent(fd, kAggregateJob, sizeof(buffer), cookie);
+    return kSuccess;
+}
+
+internal int
+SendAggregatedResult(int fd, uint8 group[CookieLen], const peer_info *emitter, int32 reducer,
+                     const uint32 *chunks, uint32 chunkCount, const double *values, uint32 valueCount)
+{
+    char header[sizeof(uint16) + AggregatedResultFixedSize];
+    uint16 messageType = kAggregatedResult;
+    char *at = header;
+    memcpy(at, &messageType, sizeof(messageType)); at += sizeof(messageType);
+    memcpy(at, group, CookieLen);                  at += CookieLen;
+    memcpy(at, emitter, sizeof(peer_info));        at += sizeof(peer_info);
+    memcpy(at, &reducer, sizeof(reducer));         at += sizeof(reducer);
+    memcpy(at, &chunkCount, sizeof(chunkCount));   at += sizeof(chunkCount);
+    memcpy(at, &valueCount, sizeof(valueCount));
+    if (SendBytes(fd, sizeof(header), header) != kSuccess)
+        return kSyscallFailed;
+    if (chunkCount > 0 &&
+        SendBytes(fd, sizeof(uint32) * chunkCount, (const char*)chunks) != kSuccess)
+        return kSyscallFailed;
+    if (valueCount > 0 &&
+        SendBytes(fd, sizeof(double) * valueCount, (const char*)values) != kSuccess)
+        return kSyscallFailed;
+    OnMessageSent(fd, kAggregatedResult,
+                  sizeof(header) + sizeof(uint32) * chunkCount + sizeof(double) * valueCount,
+                  group);
+    return kSuccess;
+}
+
+internal int
+SendAwaitInputs(int fd, uint8 cookie[CookieLen], uint32 inputCount, bool32 asList)
+{
+    char buffer[sizeof(uint16) + AwaitInputsSize];
+    uint16 messageType = kAwaitInputs;
+    uint32 list = asList ? 1 : 0;
+    char *at = buffer;
+    memcpy(at, &messageType, sizeof(messageType)); at += sizeof(messageType);
+    memcpy(at, cookie, CookieLen);                 at += CookieLen;
+    memcpy(at, &inputCount, sizeof(inputCount));   at += sizeof(inputCount);
+    memcpy(at, &list, sizeof(list));
+    if (SendBytes(fd, sizeof(buffer), buffer) != kSuccess)
+        return kSyscallFailed;
+    OnMessageSent(fd, kAwaitInputs, sizeof(buffer), cookie);
+    return kSuccess;
+}
+
+internal int
+SendJobInput(int fd, uint8 cookie[CookieLen], uint32 slot, double result,
+             const double *values, uint32 valueCount)
+{
+    char header[sizeof(uint16) + JobInputFixedSize];
+    uint16 messageType = kJobInput;
+    char *at = header;
+    memcpy(at, &messageType, sizeof(messageType)); at += sizeof(messageType);
+    memcpy(at, cookie, CookieLen);                 at += CookieLen;
+    memcpy(at, &slot, sizeof(slot));               at += sizeof(slot);
+    memcpy(at, &valueCount, sizeof(valueCount));   at += sizeof(valueCount);
+    memcpy(at, &result, sizeof(result));
+    if (SendBytes(fd, sizeof(header), header) != kSuccess)
+        return kSyscallFailed;
+    if (valueCount > 0 &&
+        SendBytes(fd, sizeof(double) * valueCount, (const char*)values) != kSuccess)
+        return kSyscallFailed;
+    OnMessageSent(fd, kJobInput, sizeof(header) + sizeof(double) * valueCount, cookie);
+    return kSuccess;
+}
+
+internal int
+SendForwardResult(int fd, uint8 cookie[CookieLen], uint8 dependent[CookieLen], uint32 slot,
+                  const peer_info *target)
+{
+    char buffer[sizeof(uint16) + ForwardResultSize];
+    uint16 messageType = kForwardResult;
+    char *at = buffer;
+    memcpy(at, &messageType, sizeof(messageType)); at += sizeof(messageType);
+    memcpy(at, cookie, CookieLen);                 at += CookieLen;
+    memcpy(at, dependent, CookieLen);              at += CookieLen;
+    memcpy(at, &slot, sizeof(slot));               at += sizeof(slot);
+    memcpy(at, target, sizeof(peer_info));
+    if (SendBytes(fd, sizeof(buffer), buffer) != kSuccess)
+        return kSyscallFailed;
+    OnMessageSent(fd, kForwardResult, sizeof(buffer), cookie);
+    return kSuccess;
+}
+
+internal int
+SendPayloadChunk(int fd, uint8 cookie[CookieLen], uint32 offset, const uint8 *bytes, uint32 size)
+{
+    char header[sizeof(uint16) + PayloadChunkFixedSize];
+    uint16 messageType = kPayloadChunk;
+    char *at = header;
+    memcpy(at, &messageType, sizeof(messageType)); at += sizeof(messageType);
+    memcpy(at, cookie, CookieLen);                 at += CookieLen;
+    memcpy(at, &offset, sizeof(offset));           at += sizeof(offset);
+    memcpy(at, &size, sizeof(size));
+    if (SendBytes(fd, sizeof(header), header) != kSuccess)
+        return kSyscallFailed;
+    if (SendBytes(fd, size, (const char*)bytes) != kSuccess)
+        return kSyscallFailed;
+    OnMessageSent(fd, kPayloadChunk, sizeof(header) + size, cookie);
+    return kSuccess;
+}
+
+internal int
+SendPayloadAck(int fd, uint8 cookie[CookieLen], uint32 received)
+{
+    char buffer[sizeof(uint16) + PayloadAckSize];
+    uint16 messageType = kPayloadAck;
+    char *at = buffer;
+    memcpy(at, &messageType, sizeof(messageType)); at += sizeof(messageType);
+    memcpy(at, cookie, CookieLen);                 at += CookieLen;
+    memcpy(at, &received, sizeof(received));
+    if (SendBytes(fd, sizeof(buffer), buffer) != kSuccess)
+        return kSyscallFailed;
+    OnMessageSent(fd, kPayloadAck, sizeof(buffer), cookie);
     return kSuccess;
 }
 
@@ -165,6 +480,10 @@ ReceiveBytes(int fd, int byteCount, void *_buffer)
         {
             return kSyscallFailed;
         }
+        else if (did == 0)
+        {
+            return kConnectionClosed;
+        }
         outstanding -= did;
         buffer += did;
     }
@@ -178,12 +497,118 @@ ReceiveSomeBytes(int fd, int maxCount, void *_buffer)
     return recv(fd, buffer, maxCount, 0);
 }
 
+// NOTE(Kevin): Forget a partially received message, because the fd
+// was closed and might get reused for a different peer.
+internal void
+DropMessageBuffer(int fd)
+{
+    for (int i = 0; i < g_messageBufferCount; ++i)
+    {
+        if (g_messageBuffers[i].fd == fd)
+        {
+            free(g_messageBuffers[i].buffer);
+            g_messageBuffers[i] = g_messageBuffers[g_messageBufferCount - 1];
+            --g_messageBufferCount;
+            return;
+        }
+    }
+}
+
 internal void
 FreeMessage(message *message)
 {
     free(message);
 }
 
+// NOTE(Kevin): Number of bytes the message took on the wire
+internal uint32
+GetMessageWireSize(const message *message)
+{
+    uint32 size = sizeof(uint16);
+    switch (message->type)
+    {
+        case kHello:             size += PeerPortLen; break;
+        case kPeerList:          size += sizeof(uint16) + sizeof(peer_info) * message->peerList.numberOfPeers; break;
+        case kQueryJobResources: size += CookieLen + sizeof(peer_info); break;
+        case kOfferJobResources: size += CookieLen; break;
+        case kJob:               size += 3 * sizeof(uint32) + CookieLen + sizeof(double) +
+                                         (message->job.isPayloadStreamed ? 0 : message->job.sourceLen +
+                                                                               message->job.payloadSize); break;
+        case kJobResult:         size += JobResultFixedSize + sizeof(double) * message->jobResult.valueCount +
+                                         (message->jobResult.isPayloadStreamed ? 0 : message->jobResult.payloadSize); break;
+        case kCancelJob:         size += CookieLen; break;
+        case kAggregateJob:      size += AggregateJobSize; break;
+        case kAggregatedResult:  size += AggregatedResultFixedSize +
+                                         sizeof(uint32) * message->aggregatedResult.chunkCount +
+                                         sizeof(double) * message->aggregatedResult.valueCount; break;
+        case kAwaitInputs:       size += AwaitInputsSize; break;
+        case kJobInput:          size += JobInputFixedSize + sizeof(double) * message->jobInput.valueCount; break;
+        case kForwardResult:     size += ForwardResultSize; break;
+        case kPayloadChunk:      size += PayloadChunkFixedSize + message->payloadChunk.size; break;
+        case kPayloadAck:        size += PayloadAckSize; break;
+        case kDeclineOffer:      size += CookieLen; break;
+        default: break;
+    }
+    return size;
+}
+
+// NOTE(Kevin): Payload chunks and everything too large to slip in between
+// control messages
+internal bool32
+IsBulkMessage(const message *message)
+{
+    return message->type == kPayloadChunk || GetMessageWireSize(message) > P2PJS_ControlMessageLimit;
+}
+
+// NOTE(Kevin): The job a message is about, or 0
+internal const uint8 *
+GetMessageCookie(const message *message)
+{
+    switch (message->type)
+    {
+        case kQueryJobResources: return message->queryJobResources.cookie;
+        case kOfferJobResources: return message->offerJobResources.cookie;
+        case kJob:               return message->job.cookie;
+        case kJobResult:         return message->jobResult.cookie;
+        case kCancelJob:         return message->cancelJob.cookie;
+        case kAggregateJob:      return message->aggregateJob.cookie;
+        case kAggregatedResult:  return message->aggregatedResult.group;
+        case kAwaitInputs:       return message->awaitInputs.cookie;
+        case kJobInput:          return message->jobInput.cookie;
+        case kForwardResult:     return message->forwardResult.cookie;
+        case kPayloadChunk:      return message->payloadChunk.cookie;
+        case kPayloadAck:        return message->payloadAck.cookie;
+        case kDeclineOffer:      return message->declineOffer.cookie;
+        default:                 return 0;
+    }
+}
+
+internal void
+OnMessageReceived(int fd, const message *message)
+{
+    uint32 size = GetMessageWireSize(message);
+    TraceMessageReceived(fd, message->type, size, GetMessageCookie(message));
+    MetricAddLabeled(&g_metricMessagesReceived, message->type, 1);
+    MetricAddLabeled(&g_metricBytesReceived, message->type, size);
+}
+
+// NOTE(Kevin): The payload of the message that was just received on fd,
+// as it came over the wire. Valid until the next ReceiveMessage() on fd.
+internal uint32
+GetReceivedPayload(int fd, const char **payloadOut)
+{
+    for (int i = 0; i < g_messageBufferCount; ++i)
+    {
+        if (g_messageBuffers[i].fd == fd)
+        {
+            *payloadOut = g_messageBuffers[i].buffer;
+            return (g_messageBuffers[i].targetLength > 0) ? (uint32)g_messageBuffers[i].targetLength : 0;
+        }
+    }
+    *payloadOut = 0;
+    return 0;
+}
+
 internal int 
 ReceiveMessage(int fd, message **messageOut)
 {
@@ -200,19 +625,21 @@ ReceiveMessage(int fd, message **messageOut)
     if (buffer && (buffer->targetLength != buffer->receivedByteCount))
     {
         // NOTE(Kevin): message in progress
-        WriteToLog("Message in progress on fd %d\n", fd);
+        LogDebug(kLogNet, "Message in progress on fd %d\n", fd);
         int outstandingBytes = buffer->targetLength - buffer->receivedByteCount;
         switch (buffer->messageType)
         {
             case kHello:
             {
-                WriteToLog(" - Hello\n");
+                LogDebug(kLogNet, " - Hello\n");
                 assert(outstandingBytes > 0);
                 int byteCount = ReceiveSomeBytes(fd,
                                                  outstandingBytes,
                                                  GetBufferPtr(buffer));
                 if (byteCount == -1)
                     return kSyscallFailed;
+                if (byteCount == 0)
+                    return kConnectionClosed;
                 buffer->receivedByteCount += byteCount;
                 if (buffer->receivedByteCount == buffer->targetLength)
                 {
@@ -225,16 +652,17 @@ ReceiveMessage(int fd, message **messageOut)
             } break;
 
             case kGetPeers:
+            case kHeartbeat:
             {
                 assert(!"Unreachable");
             } break;
 
             case kPeerList:
             { 
-                WriteToLog(" - PeerList\n");
+                LogDebug(kLogNet, " - PeerList\n");
                 if (buffer->targetLength == -1)
                 {
-                    WriteToLog(" * List length\n");
+                    LogDebug(kLogNet, " * List length\n");
                     // NOTE(Kevin): Have not received list length, yet
                     if (buffer->bufferCapacity < sizeof(uint16))
                     {
@@ -247,6 +675,8 @@ ReceiveMessage(int fd, message **messageOut)
                                                      GetBufferPtr(buffer)); 
                     if (byteCount == -1)
                         return kSyscallFailed;
+                    if (byteCount == 0)
+                        return kConnectionClosed;
                     buffer->receivedByteCount += byteCount;
                     if (buffer->receivedByteCount == sizeof(uint16))
                     {
@@ -254,17 +684,28 @@ ReceiveMessage(int fd, message **messageOut)
                         uint16 listLength = *(uint16*)buffer->buffer;
                         buffer->targetLength = sizeof(uint16) + sizeof(peer_info) * listLength;
                         buffer->buffer = realloc(buffer->buffer, buffer->targetLength);
+                        if (listLength == 0)
+                        {
+                            // NOTE(Kevin): Empty list, we are done
+                            message *msg = malloc(sizeof(message));
+                            msg->type = kPeerList;
+                            msg->peerList.numberOfPeers = 0;
+                            *messageOut = msg;
+                            return kSuccess;
+                        }
                     }
                     return kWouldBlock;
                 }
                 else
                 {
-                    WriteToLog(" * List\n");
+                    LogDebug(kLogNet, " * List\n");
                     // NOTE(Kevin): Receive bytes until we have the complete list
                     assert(outstandingBytes > 0);
                     int byteCount = ReceiveSomeBytes(fd, outstandingBytes, GetBufferPtr(buffer));
                     if (byteCount == -1)
                         return kSyscallFailed;
+                    if (byteCount == 0)
+                        return kConnectionClosed;
                     buffer->receivedByteCount += byteCount;
                     if (buffer->receivedByteCount == buffer->targetLength)
                     {
@@ -286,13 +727,15 @@ ReceiveMessage(int fd, message **messageOut)
 
             case kQueryJobResources:
             {
-                WriteToLog(" - QueryJobResources\n");
+                LogDebug(kLogNet, " - QueryJobResources\n");
                 assert(outstandingBytes > 0);
                 int byteCount = ReceiveSomeBytes(fd,
                                                  outstandingBytes,
                                                  GetBufferPtr(buffer));
                 if (byteCount == -1)
                     return kSyscallFailed;
+                if (byteCount == 0)
+                    return kConnectionClosed;
                 buffer->receivedByteCount += byteCount;
                 if (buffer->receivedByteCount == buffer->targetLength)
                 {
@@ -307,13 +750,15 @@ ReceiveMessage(int fd, message **messageOut)
 
             case kOfferJobResources:
             {
-                WriteToLog(" - OfferJobResources\n");
+                LogDebug(kLogNet, " - OfferJobResources\n");
                 assert(outstandingBytes > 0);
                 int byteCount = ReceiveSomeBytes(fd,
                                                  outstandingBytes,
                                                  GetBufferPtr(buffer));
                 if (byteCount == -1)
                     return kSyscallFailed;
+                if (byteCount == 0)
+                    return kConnectionClosed;
                 buffer->receivedByteCount += byteCount;
                 if (buffer->receivedByteCount == buffer->targetLength)
                 {
@@ -327,55 +772,95 @@ ReceiveMessage(int fd, message **messageOut)
 
             case kJob:
             {
-                WriteToLog(" - Job\n");
+                LogDebug(kLogNet, " - Job\n");
                 if (buffer->targetLength == -1)
                 {
-                    WriteToLog(" * sourceLen\n");
-                    // NOTE(Kevin): Have not received source length, yet
-                    if (buffer->bufferCapacity < sizeof(uint32))
+                    LogDebug(kLogNet, " * sourceLen, payloadSize\n");
+                    // NOTE(Kevin): Have not received source length and payload size, yet
+                    if (buffer->bufferCapacity < 2 * sizeof(uint32))
                     {
                         assert(buffer->bufferCapacity == 0);
-                        buffer->buffer = malloc(sizeof(uint32));
-                        buffer->bufferCapacity = sizeof(uint32);
+                        buffer->buffer = malloc(2 * sizeof(uint32));
+                        buffer->bufferCapacity = 2 * sizeof(uint32);
                     }
                     int byteCount = ReceiveSomeBytes(fd,
-                                                     sizeof(uint32) - buffer->receivedByteCount,
+                                                     2 * sizeof(uint32) - buffer->receivedByteCount,
                                                      GetBufferPtr(buffer));
                     if (byteCount == -1)
                         return kSyscallFailed;
+                    if (byteCount == 0)
+                        return kConnectionClosed;
                     buffer->receivedByteCount += byteCount;
-                    if (buffer->receivedByteCount == sizeof(uint32))
+                    if (buffer->receivedByteCount == 2 * sizeof(uint32))
                     {
                         // NOTE(Kevin): now we know the source lenght
                         uint32 sourceLength = *(uint32*)buffer->buffer;
-                        buffer->targetLength = sizeof(uint32) + // NOTE(Kevin): Source length
+                        uint32 payloadSize = *((uint32*)buffer->buffer + 1);
+                        if ((payloadSize & ~PayloadStreamed) > P2PJS_MaxPayloadSize ||
+                            sourceLength > P2PJS_MaxPayloadSize)
+                            return kInvalidValue;
+                        if (payloadSize & PayloadStreamed)
+                        {
+                            // NOTE(Kevin): Source and payload come in chunks
+                            sourceLength = 0;
+                            payloadSize = 0;
+                        }
+                        buffer->targetLength = 2 * sizeof(uint32) + // NOTE(Kevin): Source length, payload size
                                                CookieLen + // NOTE(Kevin): Cookie
                                                sizeof(double) + // NOTE(Kevin): Arg
-                                               sourceLength;
+                                               sizeof(uint32) + // NOTE(Kevin): Kind
+                                               sourceLength +
+                                               payloadSize;
                         buffer->buffer = realloc(buffer->buffer, buffer->targetLength);
+                        buffer->bufferCapacity = buffer->targetLength;
                     }
                     return kWouldBlock;
                 } 
                 else
                 {
-                    WriteToLog(" * details\n");
+                    LogDebug(kLogNet, " * details\n");
                     // NOTE(Kevin): Receive bytes until we have the complete job 
                     assert(outstandingBytes > 0);
                     int byteCount = ReceiveSomeBytes(fd, outstandingBytes, GetBufferPtr(buffer));
                     if (byteCount == -1)
                         return kSyscallFailed;
+                    if (byteCount == 0)
+                        return kConnectionClosed;
                     buffer->receivedByteCount += byteCount;
                     if (buffer->receivedByteCount == buffer->targetLength)
                     {
                         uint32 sourceLength = *(uint32*)buffer->buffer;
-                        message *msg = malloc(sizeof(message) + sourceLength); 
+                        uint32 payloadSize = *((uint32*)buffer->buffer + 1);
+                        bool32 isStreamed = (payloadSize & PayloadStreamed) != 0;
+                        payloadSize &= ~PayloadStreamed;
+                        char *at = (char*)buffer->buffer + 2 * sizeof(uint32);
+                        message *msg = malloc(sizeof(message) + sourceLength + (isStreamed ? 0 : payloadSize));
                         msg->type = kJob;
                         msg->job.sourceLen = sourceLength;
-                        memcpy(msg->job.cookie, (char*)buffer->buffer + sizeof(uint32), CookieLen);
-                        msg->job.arg = *(double*)((char*)buffer->buffer + sizeof(uint32) + CookieLen);
-                        memcpy(msg->job.source,
-                               (char*)buffer->buffer + sizeof(uint32) + CookieLen + sizeof(double),
-                               sourceLength);
+                        memcpy(msg->job.cookie, at, CookieLen);
+                        msg->job.arg = *(double*)(at + CookieLen);
+                        msg->job.kind = *(uint32*)(at + CookieLen + sizeof(double));
+                        if (msg->job.kind >= kJobKindCount)
+                        {
+                            free(msg);
+                            return kInvalidValue;
+                        }
+                        // NOTE(Kevin): A streamed source is filled in as its chunks arrive
+                        if (!isStreamed)
+                            memcpy(msg->job.source, at + CookieLen + sizeof(double) + sizeof(uint32), sourceLength);
+                        else
+                            memset(msg->job.source, 0, sourceLength + 1);
+                        // NOTE(Kevin): The payload lives behind the source
+                        msg->job.payloadSize = payloadSize;
+                        msg->job.isPayloadStreamed = isStreamed;
+                        msg->job.payload = 0;
+                        if (payloadSize > 0 && !isStreamed)
+                        {
+                            msg->job.payload = (uint8*)msg->job.source + sourceLength;
+                            memcpy(msg->job.payload,
+                                   at + CookieLen + sizeof(double) + sizeof(uint32) + sourceLength,
+                                   payloadSize);
+                        }
                         *messageOut = msg;
                         return kSuccess;
                     }
@@ -388,21 +873,352 @@ ReceiveMessage(int fd, message **messageOut)
 
             case kJobResult:
             {
-                WriteToLog(" - JobResult\n");
+                LogDebug(kLogNet, " - JobResult\n");
                 assert(outstandingBytes > 0);
                 int byteCount = ReceiveSomeBytes(fd,
                                                  outstandingBytes,
                                                  GetBufferPtr(buffer));
                 if (byteCount == -1)
                     return kSyscallFailed;
+                if (byteCount == 0)
+                    return kConnectionClosed;
                 buffer->receivedByteCount += byteCount;
                 if (buffer->receivedByteCount == buffer->targetLength)
                 {
-                    message *msg = malloc(sizeof(message));
+                    uint32 valueCount = *(uint32*)((char*)buffer->buffer + JobResultFixedSize - 2 * sizeof(uint32));
+                    uint32 payloadSize = *(uint32*)((char*)buffer->buffer + JobResultFixedSize - sizeof(uint32));
+                    bool32 isStreamed = (payloadSize & PayloadStreamed) != 0;
+                    payloadSize &= ~PayloadStreamed;
+                    if (valueCount > P2PJS_MaxResultValues || payloadSize > P2PJS_MaxPayloadSize)
+                        return kInvalidValue;
+                    uint32 inlineSize = isStreamed ? 0 : payloadSize;
+                    int fullLength = (int)(JobResultFixedSize + sizeof(double) * valueCount + inlineSize);
+                    if (buffer->targetLength < fullLength)
+                    {
+                        // NOTE(Kevin): now we know how many values follow
+                        char *t = realloc(buffer->buffer, fullLength);
+                        if (!t)
+                            return kNoMemory;
+                        buffer->buffer = t;
+                        buffer->bufferCapacity = fullLength;
+                        buffer->targetLength = fullLength;
+                        return kWouldBlock;
+                    }
+                    message *msg = malloc(sizeof(message) + sizeof(double) * valueCount + inlineSize);
                     msg->type = kJobResult;
                     memcpy(msg->jobResult.cookie, buffer->buffer, CookieLen);
                     msg->jobResult.state  = *(int*)((char*)buffer->buffer + CookieLen); 
                     msg->jobResult.result = *(double*)((char*)buffer->buffer + CookieLen + sizeof(int));
+                    memcpy(&msg->jobResult.usage,
+                           (char*)buffer->buffer + CookieLen + sizeof(int) + sizeof(double),
+                           sizeof(job_usage));
+                    msg->jobResult.valueCount = valueCount;
+                    memcpy(msg->jobResult.values,
+                           (char*)buffer->buffer + JobResultFixedSize,
+                           sizeof(double) * valueCount);
+                    // NOTE(Kevin): The payload lives behind the values
+                    msg->jobResult.payloadSize = payloadSize;
+                    msg->jobResult.isPayloadStreamed = isStreamed;
+                    msg->jobResult.payload = 0;
+                    if (inlineSize > 0)
+                    {
+                        msg->jobResult.payload = (uint8*)(msg->jobResult.values + valueCount);
+                        memcpy(msg->jobResult.payload,
+                               (char*)buffer->buffer + JobResultFixedSize + sizeof(double) * valueCount,
+                               payloadSize);
+                    }
+                    *messageOut = msg;
+                    return kSuccess;
+                }
+            } break;
+
+            case kCancelJob:
+            {
+                LogDebug(kLogNet, " - CancelJob\n");
+                assert(outstandingBytes > 0);
+                int byteCount = ReceiveSomeBytes(fd,
+                                                 outstandingBytes,
+                                                 GetBufferPtr(buffer));
+                if (byteCount == -1)
+                    return kSyscallFailed;
+                if (byteCount == 0)
+                    return kConnectionClosed;
+                buffer->receivedByteCount += byteCount;
+                if (buffer->receivedByteCount == buffer->targetLength)
+                {
+                    message *msg = malloc(sizeof(message));
+                    msg->type = kCancelJob;
+                    memcpy(msg->cancelJob.cookie, buffer->buffer, CookieLen);
+                    *messageOut = msg;
+                    return kSuccess;
+                }
+            } break;
+
+            case kDeclineOffer:
+            {
+                LogDebug(kLogNet, " - DeclineOffer\n");
+                assert(outstandingBytes > 0);
+                int byteCount = ReceiveSomeBytes(fd,
+                                                 outstandingBytes,
+                                                 GetBufferPtr(buffer));
+                if (byteCount == -1)
+                    return kSyscallFailed;
+                if (byteCount == 0)
+                    return kConnectionClosed;
+                buffer->receivedByteCount += byteCount;
+                if (buffer->receivedByteCount == buffer->targetLength)
+                {
+                    message *msg = malloc(sizeof(message));
+                    msg->type = kDeclineOffer;
+                    memcpy(msg->declineOffer.cookie, buffer->buffer, CookieLen);
+                    *messageOut = msg;
+                    return kSuccess;
+                }
+            } break;
+
+            case kAggregateJob:
+            {
+                LogDebug(kLogNet, " - AggregateJob\n");
+                assert(outstandingBytes > 0);
+                int byteCount = ReceiveSomeBytes(fd,
+                                                 outstandingBytes,
+                                                 GetBufferPtr(buffer));
+                if (byteCount == -1)
+                    return kSyscallFailed;
+                if (byteCount == 0)
+                    return kConnectionClosed;
+                buffer->receivedByteCount += byteCount;
+                if (buffer->receivedByteCount == buffer->targetLength)
+                {
+                    message *msg = malloc(sizeof(message));
+                    msg->type = kAggregateJob;
+                    const char *at = buffer->buffer;
+                    memcpy(msg->aggregateJob.cookie, at, CookieLen);                at += CookieLen;
+                    memcpy(msg->aggregateJob.group, at, CookieLen);                 at += CookieLen;
+                    memcpy(&msg->aggregateJob.chunkIndex, at, sizeof(uint32));      at += sizeof(uint32);
+                    memcpy(&msg->aggregateJob.reducer, at, sizeof(int32));          at += sizeof(int32);
+                    memcpy(&msg->aggregateJob.parent, at, sizeof(peer_info));       at += sizeof(peer_info);
+                    memcpy(&msg->aggregateJob.emitter, at, sizeof(peer_info));
+                    *messageOut = msg;
+                    return kSuccess;
+                }
+            } break;
+
+            case kAggregatedResult:
+            {
+                LogDebug(kLogNet, " - AggregatedResult\n");
+                assert(outstandingBytes > 0);
+                int byteCount = ReceiveSomeBytes(fd,
+                                                 outstandingBytes,
+                                                 GetBufferPtr(buffer));
+                if (byteCount == -1)
+                    return kSyscallFailed;
+                if (byteCount == 0)
+                    return kConnectionClosed;
+                buffer->receivedByteCount += byteCount;
+                if (buffer->receivedByteCount == buffer->targetLength)
+                {
+                    const char *counts = buffer->buffer + AggregatedResultFixedSize - 2 * sizeof(uint32);
+                    uint32 chunkCount, valueCount;
+                    memcpy(&chunkCount, counts, sizeof(uint32));
+                    memcpy(&valueCount, counts + sizeof(uint32), sizeof(uint32));
+                    if (chunkCount > P2PJS_MaxAggregatedChunks || valueCount > P2PJS_MaxResultValues)
+                        return kInvalidValue;
+                    int fullLength = (int)(AggregatedResultFixedSize + sizeof(uint32) * chunkCount +
+                                           sizeof(double) * valueCount);
+                    if (buffer->targetLength < fullLength)
+                    {
+                        // NOTE(Kevin): now we know how many chunks and values follow
+                        char *t = realloc(buffer->buffer, fullLength);
+                        if (!t)
+                            return kNoMemory;
+                        buffer->buffer = t;
+                        buffer->bufferCapacity = fullLength;
+                        buffer->targetLength = fullLength;
+                        return kWouldBlock;
+                    }
+                    // NOTE(Kevin): Chunks and values live behind the message,
+                    // the values 8 byte aligned
+                    size_t chunkBytes = (sizeof(uint32) * chunkCount + 7) & ~(size_t)7;
+                    message *msg = malloc(sizeof(message) + chunkBytes + sizeof(double) * valueCount);
+                    msg->type = kAggregatedResult;
+                    const char *at = buffer->buffer;
+                    memcpy(msg->aggregatedResult.group, at, CookieLen);             at += CookieLen;
+                    memcpy(&msg->aggregatedResult.emitter, at, sizeof(peer_info));  at += sizeof(peer_info);
+                    memcpy(&msg->aggregatedResult.reducer, at, sizeof(int32));
+                    msg->aggregatedResult.chunkCount = chunkCount;
+                    msg->aggregatedResult.valueCount = valueCount;
+                    msg->aggregatedResult.chunks = (uint32*)(msg + 1);
+                    msg->aggregatedResult.values = (double*)((char*)(msg + 1) + chunkBytes);
+                    memcpy(msg->aggregatedResult.chunks, buffer->buffer + AggregatedResultFixedSize,
+                           sizeof(uint32) * chunkCount);
+                    memcpy(msg->aggregatedResult.values,
+                           buffer->buffer + AggregatedResultFixedSize + sizeof(uint32) * chunkCount,
+                           sizeof(double) * valueCount);
+                    *messageOut = msg;
+                    return kSuccess;
+                }
+            } break;
+
+            case kAwaitInputs:
+            {
+                LogDebug(kLogNet, " - AwaitInputs\n");
+                assert(outstandingBytes > 0);
+                int byteCount = ReceiveSomeBytes(fd,
+                                                 outstandingBytes,
+                                                 GetBufferPtr(buffer));
+                if (byteCount == -1)
+                    return kSyscallFailed;
+                if (byteCount == 0)
+                    return kConnectionClosed;
+                buffer->receivedByteCount += byteCount;
+                if (buffer->receivedByteCount == buffer->targetLength)
+                {
+                    message *msg = malloc(sizeof(message));
+                    msg->type = kAwaitInputs;
+                    const char *at = buffer->buffer;
+                    memcpy(msg->awaitInputs.cookie, at, CookieLen);                 at += CookieLen;
+                    memcpy(&msg->awaitInputs.inputCount, at, sizeof(uint32));      at += sizeof(uint32);
+                    memcpy(&msg->awaitInputs.asList, at, sizeof(uint32));
+                    *messageOut = msg;
+                    return kSuccess;
+                }
+            } break;
+
+            case kJobInput:
+            {
+                LogDebug(kLogNet, " - JobInput\n");
+                assert(outstandingBytes > 0);
+                int byteCount = ReceiveSomeBytes(fd,
+                                                 outstandingBytes,
+                                                 GetBufferPtr(buffer));
+                if (byteCount == -1)
+                    return kSyscallFailed;
+                if (byteCount == 0)
+                    return kConnectionClosed;
+                buffer->receivedByteCount += byteCount;
+                if (buffer->receivedByteCount == buffer->targetLength)
+                {
+                    uint32 valueCount;
+                    memcpy(&valueCount, buffer->buffer + CookieLen + sizeof(uint32), sizeof(uint32));
+                    if (valueCount > P2PJS_MaxResultValues)
+                        return kInvalidValue;
+                    int fullLength = (int)(JobInputFixedSize + sizeof(double) * valueCount);
+                    if (buffer->targetLength < fullLength)
+                    {
+                        // NOTE(Kevin): now we know how many values follow
+                        char *t = realloc(buffer->buffer, fullLength);
+                        if (!t)
+                            return kNoMemory;
+                        buffer->buffer = t;
+                        buffer->bufferCapacity = fullLength;
+                        buffer->targetLength = fullLength;
+                        return kWouldBlock;
+                    }
+                    message *msg = malloc(sizeof(message) + sizeof(double) * valueCount);
+                    msg->type = kJobInput;
+                    const char *at = buffer->buffer;
+                    memcpy(msg->jobInput.cookie, at, CookieLen);                    at += CookieLen;
+                    memcpy(&msg->jobInput.slot, at, sizeof(uint32));               at += sizeof(uint32);
+                    at += sizeof(uint32);
+                    memcpy(&msg->jobInput.result, at, sizeof(double));
+                    msg->jobInput.valueCount = valueCount;
+                    msg->jobInput.values = (double*)(msg + 1);
+                    memcpy(msg->jobInput.values, buffer->buffer + JobInputFixedSize,
+                           sizeof(double) * valueCount);
+                    *messageOut = msg;
+                    return kSuccess;
+                }
+            } break;
+
+            case kForwardResult:
+            {
+                LogDebug(kLogNet, " - ForwardResult\n");
+                assert(outstandingBytes > 0);
+                int byteCount = ReceiveSomeBytes(fd,
+                                                 outstandingBytes,
+                                                 GetBufferPtr(buffer));
+                if (byteCount == -1)
+                    return kSyscallFailed;
+                if (byteCount == 0)
+                    return kConnectionClosed;
+                buffer->receivedByteCount += byteCount;
+                if (buffer->receivedByteCount == buffer->targetLength)
+                {
+                    message *msg = malloc(sizeof(message));
+                    msg->type = kForwardResult;
+                    const char *at = buffer->buffer;
+                    memcpy(msg->forwardResult.cookie, at, CookieLen);               at += CookieLen;
+                    memcpy(msg->forwardResult.dependent, at, CookieLen);            at += CookieLen;
+                    memcpy(&msg->forwardResult.slot, at, sizeof(uint32));          at += sizeof(uint32);
+                    memcpy(&msg->forwardResult.target, at, sizeof(peer_info));
+                    *messageOut = msg;
+                    return kSuccess;
+                }
+            } break;
+
+            case kPayloadChunk:
+            {
+                LogDebug(kLogNet, " - PayloadChunk\n");
+                assert(outstandingBytes > 0);
+                int byteCount = ReceiveSomeBytes(fd,
+                                                 outstandingBytes,
+                                                 GetBufferPtr(buffer));
+                if (byteCount == -1)
+                    return kSyscallFailed;
+                if (byteCount == 0)
+                    return kConnectionClosed;
+                buffer->receivedByteCount += byteCount;
+                if (buffer->receivedByteCount == buffer->targetLength)
+                {
+                    uint32 size;
+                    memcpy(&size, buffer->buffer + CookieLen + sizeof(uint32), sizeof(uint32));
+                    if (size > P2PJS_MaxPayloadSize)
+                        return kInvalidValue;
+                    int fullLength = (int)(PayloadChunkFixedSize + size);
+                    if (buffer->targetLength < fullLength)
+                    {
+                        // NOTE(Kevin): now we know how many bytes follow
+                        char *t = realloc(buffer->buffer, fullLength);
+                        if (!t)
+                            return kNoMemory;
+                        buffer->buffer = t;
+                        buffer->bufferCapacity = fullLength;
+                        buffer->targetLength = fullLength;
+                        return kWouldBlock;
+                    }
+                    message *msg = malloc(sizeof(message) + size);
+                    msg->type = kPayloadChunk;
+                    const char *at = buffer->buffer;
+                    memcpy(msg->payloadChunk.cookie, at, CookieLen);                at += CookieLen;
+                    memcpy(&msg->payloadChunk.offset, at, sizeof(uint32));         at += sizeof(uint32);
+                    msg->payloadChunk.size = size;
+                    msg->payloadChunk.bytes = (uint8*)(msg + 1);
+                    memcpy(msg->payloadChunk.bytes, buffer->buffer + PayloadChunkFixedSize, size);
+                    *messageOut = msg;
+                    return kSuccess;
+                }
+            } break;
+
+            case kPayloadAck:
+            {
+                LogDebug(kLogNet, " - PayloadAck\n");
+                assert(outstandingBytes > 0);
+                int byteCount = ReceiveSomeBytes(fd,
+                                                 outstandingBytes,
+                                                 GetBufferPtr(buffer));
+                if (byteCount == -1)
+                    return kSyscallFailed;
+                if (byteCount == 0)
+                    return kConnectionClosed;
+                buffer->receivedByteCount += byteCount;
+                if (buffer->receivedByteCount == buffer->targetLength)
+                {
+                    message *msg = malloc(sizeof(message));
+                    msg->type = kPayloadAck;
+                    const char *at = buffer->buffer;
+                    memcpy(msg->payloadAck.cookie, at, CookieLen);                  at += CookieLen;
+                    memcpy(&msg->payloadAck.received, at, sizeof(uint32));
                     *messageOut = msg;
                     return kSuccess;
                 }
@@ -417,7 +1233,7 @@ ReceiveMessage(int fd, message **messageOut)
     else
     {
         // NOTE(Kevin): New message
-        WriteToLog("Receiving new message on fd %d\n", fd);
+        LogDebug(kLogNet, "Receiving new message on fd %d\n", fd);
         if (!buffer)
         {
             // NOTE(Kevin): Grow the message buffer array
@@ -439,9 +1255,10 @@ ReceiveMessage(int fd, message **messageOut)
         buffer->buffer = 0;
         buffer->bufferCapacity = 0;
 
-        if (ReceiveBytes(fd, sizeof(uint16), &buffer->messageType) != kSuccess)
+        int err = ReceiveBytes(fd, sizeof(uint16), &buffer->messageType);
+        if (err != kSuccess)
         {
-            return kSyscallFailed;
+            return err;
         }
 
         switch (buffer->messageType)
@@ -452,6 +1269,7 @@ ReceiveMessage(int fd, message **messageOut)
             } break;
 
             case kGetPeers:
+            case kHeartbeat:
             {
                 buffer->targetLength = 0; // NOTE(Kevin): No content
             } break;
@@ -463,22 +1281,64 @@ ReceiveMessage(int fd, message **messageOut)
             } break;
 
             case kOfferJobResources:
+            case kCancelJob:
+            case kDeclineOffer:
             {
                 buffer->targetLength = CookieLen; // NOTE(Kevin): Cookie
             } break;
 
             case kJobResult:
             {
-                buffer->targetLength = CookieLen + // NOTE(Kevin): Cookie
-                                       sizeof(int) + // NOTE(Kevin): State
-                                       sizeof(double); // NOTE(Kevin): Result
+                // NOTE(Kevin): Cookie, state, result, usage, the number
+                // of values and the payload size; values and payload are
+                // received once that is known
+                buffer->targetLength = JobResultFixedSize;
+            } break;
+
+            case kAggregateJob:
+            {
+                buffer->targetLength = AggregateJobSize;
+            } break;
+
+            case kAggregatedResult:
+            {
+                // NOTE(Kevin): Like jobResult, chunks and values come later
+                buffer->targetLength = AggregatedResultFixedSize;
+            } break;
+
+            case kAwaitInputs:
+            {
+                buffer->targetLength = AwaitInputsSize;
+            } break;
+
+            case kJobInput:
+            {
+                // NOTE(Kevin): Like jobResult, the values come later
+                buffer->targetLength = JobInputFixedSize;
+            } break;
+
+            case kForwardResult:
+            {
+                buffer->targetLength = ForwardResultSize;
+            } break;
+
+            case kPayloadChunk:
+            {
+                // NOTE(Kevin): Like jobResult, the bytes come later
+                buffer->targetLength = PayloadChunkFixedSize;
+            } break;
+
+            case kPayloadAck:
+            {
+                buffer->targetLength = PayloadAckSize;
             } break;
         };
 
         if (buffer->targetLength == buffer->receivedByteCount)
         {
             // NOTE(Kevin): Done
-            assert(buffer->messageType == kGetPeers);
+            assert(buffer->messageType == kGetPeers ||
+                   buffer->messageType == kHeartbeat);
             message *msg = malloc(sizeof(message));
             msg->type = buffer->messageType;
             *messageOut = msg;
@@ -655,5 +1515,6 @@ ReceiveMessage(int fd, message **messageOut)
         }
 #endif
     }
-    return kSuccess;
+    // NOTE(Kevin): The message is not complete, yet
+    return kWouldBlock;
 }
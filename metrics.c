@@ -0,0 +1,393 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "p2pjs.h"
+
+// NOTE(Kevin): Metrics registry. Counters, gauges and histograms are
+// statically allocated and only touched with atomics, so the endpoint
+// thread can read them while the main loop updates them.
+// The text format is the Prometheus exposition format; histograms are
+// exported as summaries with a few quantiles.
+
+#define MaxMetricLabels 32
+
+// NOTE(Kevin): HDR-style log-linear histogram over nanoseconds.
+// Values below 16 are exact, above that every power of two is split into
+// 16 sub-buckets, so the relative error is below 6.25%. Values above
+// 2^40 ns (18 minutes) end up in the last bucket.
+#define HistogramSubBucketBits 4
+#define HistogramSubBuckets    (1 << HistogramSubBucketBits)
+#define HistogramMaxExponent   40
+#define HistogramBucketCount   (HistogramSubBuckets * (HistogramMaxExponent - HistogramSubBucketBits + 2))
+
+typedef struct
+{
+    _Atomic uint64 buckets[HistogramBucketCount];
+    _Atomic uint64 sum;
+    _Atomic uint64 max;
+} histogram;
+
+// Metric kinds
+enum
+{
+    kMetricCounter,
+    kMetricGauge,
+    kMetricHistogram,
+};
+
+typedef struct
+{
+    const char         *name;
+    const char         *help;
+    int                 kind;
+    // NOTE(Kevin): Labeled metrics have one value per label value
+    const char         *labelName;
+    const char *const  *labelValues;
+    int                 labelCount;
+    _Atomic int64       values[MaxMetricLabels];
+    histogram          *histogram;
+} metric;
+
+global_variable const char *const g_messageTypeNames[kMessageTypeCount] =
+{
+    "Hello", "GetPeers", "PeerList", "QueryJobResources", "OfferJobResources",
+    "Job", "JobResult", "Heartbeat", "CancelJob", "AggregateJob",
+    "AggregatedResult", "AwaitInputs", "JobInput", "ForwardResult", "PayloadChunk",
+    "PayloadAck", "DeclineOffer",
+};
+
+global_variable const char *const g_memoOutcomeNames[kMemoOutcomeCount] =
+{
+    "hit", "miss", "joined", "stored",
+};
+
+#define DefineMetric(Var, Kind, Name, Help) \
+    global_variable metric Var = { .name = Name, .help = Help, .kind = Kind }
+#define DefineMessageMetric(Var, Name, Help) \
+    global_variable metric Var = { .name = Name, .help = Help, .kind = kMetricCounter, \
+                                   .labelName = "type", .labelValues = g_messageTypeNames, \
+                                   .labelCount = kMessageTypeCount }
+#define DefineMemoMetric(Var, Name, Help) \
+    global_variable metric Var = { .name = Name, .help = Help, .kind = kMetricCounter, \
+                                   .labelName = "outcome", .labelValues = g_memoOutcomeNames, \
+                                   .labelCount = kMemoOutcomeCount }
+#define DefineHistogram(Var, Name, Help) \
+    global_variable histogram Var##Histogram; \
+    global_variable metric Var = { .name = Name, .help = Help, .kind = kMetricHistogram, \
+                                   .histogram = &Var##Histogram }
+
+DefineMessageMetric(g_metricMessagesSent, "p2pjs_messages_sent_total", "Messages sent, by type");
+DefineMessageMetric(g_metricBytesSent, "p2pjs_message_bytes_sent_total", "Bytes sent, by message type");
+DefineMessageMetric(g_metricMessagesReceived, "p2pjs_messages_received_total", "Messages received, by type");
+DefineMessageMetric(g_metricBytesReceived, "p2pjs_message_bytes_received_total", "Bytes received, by message type");
+
+DefineMetric(g_metricPeers, kMetricGauge, "p2pjs_peers", "Connected peers");
+DefineMetric(g_metricJobsEmitted, kMetricCounter, "p2pjs_jobs_emitted_total", "Jobs created on this node");
+DefineMetric(g_metricJobsOutstanding, kMetricGauge, "p2pjs_jobs_outstanding", "Emitted jobs without a result");
+DefineMetric(g_metricJobsRedispatched, kMetricCounter, "p2pjs_jobs_redispatched_total", "Jobs queried again because their peer failed");
+DefineMetric(g_metricJobsRequeried, kMetricCounter, "p2pjs_jobs_requeried_total", "Jobs queried again because no peer offered to run them");
+DefineMetric(g_metricJobsHedged, kMetricCounter, "p2pjs_jobs_hedged_total", "Straggling jobs that got a second copy");
+DefineMetric(g_metricJobsReceived, kMetricCounter, "p2pjs_jobs_received_total", "Jobs taken from other nodes");
+DefineMetric(g_metricJobsExecuted, kMetricCounter, "p2pjs_jobs_executed_total", "Jobs run on this node");
+DefineMetric(g_metricJobsQueued, kMetricGauge, "p2pjs_jobs_queued", "Received jobs waiting to run");
+DefineMetric(g_metricOffersPending, kMetricGauge, "p2pjs_offers_pending", "Offers that hold a job slot");
+DefineMetric(g_metricQueriesWaiting, kMetricGauge, "p2pjs_queries_waiting", "Queries waiting for a free job slot");
+DefineMetric(g_metricMessagesInProgress, kMetricGauge, "p2pjs_messages_in_progress", "Partially received messages");
+DefineMetric(g_metricVMsCreated, kMetricCounter, "p2pjs_vms_created_total", "Wren VMs created for jobs");
+DefineMetric(g_metricMemoEntries, kMetricGauge, "p2pjs_memo_entries", "Results in the result cache");
+DefineMemoMetric(g_metricMemoEmitterLookups, "p2pjs_memo_emitter_lookups_total", "Emitter: result cache lookups of new jobs, by outcome");
+DefineMemoMetric(g_metricMemoWorkerLookups, "p2pjs_memo_worker_lookups_total", "Worker: result cache lookups of received jobs, by outcome");
+DefineMetric(g_metricResultStoreRecords, kMetricGauge, "p2pjs_result_store_records", "Results in the result store");
+DefineMetric(g_metricResultStoreBytes, kMetricGauge, "p2pjs_result_store_bytes", "Size of the result store file");
+
+DefineHistogram(g_metricQueryToOffer, "p2pjs_job_query_to_offer_seconds", "Emitter: query sent until the first offer arrived");
+DefineHistogram(g_metricOfferToDispatch, "p2pjs_job_offer_to_dispatch_seconds", "Worker: offer sent until the job arrived");
+DefineHistogram(g_metricJobRun, "p2pjs_job_run_seconds", "Worker: time spent running a job");
+DefineHistogram(g_metricDispatchToResult, "p2pjs_job_dispatch_to_result_seconds", "Emitter: job sent until its result arrived");
+DefineHistogram(g_metricJobLatency, "p2pjs_job_latency_seconds", "Emitter: job created until its first result arrived");
+DefineHistogram(g_metricResultStoreFlush, "p2pjs_result_store_flush_seconds", "Writing (and syncing) buffered results to the result store");
+DefineHistogram(g_metricLoopIteration, "p2pjs_loop_iteration_seconds", "Duration of one main loop iteration");
+
+global_variable metric *const g_metrics[] =
+{
+    &g_metricMessagesSent, &g_metricBytesSent, &g_metricMessagesReceived, &g_metricBytesReceived,
+    &g_metricPeers,
+    &g_metricJobsEmitted, &g_metricJobsOutstanding, &g_metricJobsRedispatched, &g_metricJobsRequeried, &g_metricJobsHedged,
+    &g_metricJobsReceived, &g_metricJobsExecuted, &g_metricJobsQueued,
+    &g_metricOffersPending, &g_metricQueriesWaiting, &g_metricMessagesInProgress,
+    &g_metricVMsCreated,
+    &g_metricMemoEntries, &g_metricMemoEmitterLookups, &g_metricMemoWorkerLookups,
+    &g_metricResultStoreRecords, &g_metricResultStoreBytes,
+    &g_metricQueryToOffer, &g_metricOfferToDispatch, &g_metricJobRun,
+    &g_metricDispatchToResult, &g_metricJobLatency, &g_metricResultStoreFlush, &g_metricLoopIteration,
+};
+
+internal void
+MetricAdd(metric *m, int64 delta)
+{
+    atomic_fetch_add_explicit(&m->values[0], delta, memory_order_relaxed);
+}
+
+internal void
+MetricAddLabeled(metric *m, int label, int64 delta)
+{
+    if (label >= 0 && label < m->labelCount)
+        atomic_fetch_add_explicit(&m->values[label], delta, memory_order_relaxed);
+}
+
+internal void
+MetricSet(metric *m, int64 value)
+{
+    atomic_store_explicit(&m->values[0], value, memory_order_relaxed);
+}
+
+internal int64
+MetricGet(metric *m)
+{
+    return atomic_load_explicit(&m->values[0], memory_order_relaxed);
+}
+
+internal int
+GetHistogramBucket(uint64 value)
+{
+    if (value < HistogramSubBuckets)
+        return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > HistogramMaxExponent)
+        return HistogramBucketCount - 1;
+    int shift = exponent - HistogramSubBucketBits;
+    int subBucket = (int)((value >> shift) - HistogramSubBuckets);
+    return HistogramSubBuckets * (shift + 1) + subBucket;
+}
+
+// NOTE(Kevin): Largest value that ends up in the bucket
+internal uint64
+GetHistogramBucketLimit(int bucket)
+{
+    if (bucket < HistogramSubBuckets)
+        return (uint64)bucket;
+    int shift = bucket / HistogramSubBuckets - 1;
+    uint64 subBucket = (uint64)(bucket % HistogramSubBuckets);
+    return ((HistogramSubBuckets + subBucket + 1) << shift) - 1;
+}
+
+// NOTE(Kevin): Value of the given quantile of the count values in buckets.
+// The values are assumed to be spread evenly over their bucket, and the
+// largest value observed caps the result.
+internal uint64
+GetHistogramQuantile(const uint64 *buckets, uint64 count, uint64 max, double quantile)
+{
+    if (count == 0)
+        return 0;
+    uint64 rank = (uint64)(quantile * (double)count + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64 seen = 0;
+    for (int b = 0; b < HistogramBucketCount; ++b)
+    {
+        if (seen + buckets[b] >= rank)
+        {
+            uint64 low  = (b > 0) ? GetHistogramBucketLimit(b - 1) + 1 : 0;
+            uint64 high = GetHistogramBucketLimit(b);
+            double fraction = (double)(rank - seen) / (double)buckets[b];
+            uint64 value = low + (uint64)((double)(high - low) * fraction);
+            return (value < max) ? value : max;
+        }
+        seen += buckets[b];
+    }
+    return max;
+}
+
+internal void
+MetricObserve(metric *m, double seconds)
+{
+    histogram *h = m->histogram;
+    uint64 ns = (seconds > 0.0) ? (uint64)(seconds * 1e9) : 0;
+    atomic_fetch_add_explicit(&h->buckets[GetHistogramBucket(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+    uint64 max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (ns > max &&
+           !atomic_compare_exchange_weak_explicit(&h->max, &max, ns,
+                                                  memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+// NOTE(Kevin): Growing text buffer for the exposition format
+typedef struct
+{
+    char  *text;
+    size_t length;
+    size_t capacity;
+} metrics_text;
+
+internal void
+AppendMetricsText(metrics_text *out, const char *fmt, ...)
+{
+    for (;;)
+    {
+        size_t room = out->capacity - out->length;
+        va_list ap;
+        va_start(ap, fmt);
+        int len = out->text ? vsnprintf(out->text + out->length, room, fmt, ap) : -1;
+        va_end(ap);
+        if (len >= 0 && (size_t)len < room)
+        {
+            out->length += (size_t)len;
+            return;
+        }
+        size_t newCapacity = (out->capacity == 0) ? 4096 : 2 * out->capacity;
+        char *t = realloc(out->text, newCapacity);
+        if (!t)
+            return;
+        out->text = t;
+        out->capacity = newCapacity;
+    }
+}
+
+internal void
+FormatMetrics(metrics_text *out)
+{
+    local_persist const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    for (unsigned int i = 0; i < SizeofArray(g_metrics); ++i)
+    {
+        metric *m = g_metrics[i];
+        const char *type = (m->kind == kMetricCounter) ? "counter" :
+                           (m->kind == kMetricGauge)   ? "gauge" : "summary";
+        AppendMetricsText(out, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, type);
+        if (m->kind != kMetricHistogram)
+        {
+            if (m->labelName)
+            {
+                for (int l = 0; l < m->labelCount; ++l)
+                {
+                    AppendMetricsText(out, "%s{%s=\"%s\"} %lld\n", m->name, m->labelName,
+                                      m->labelValues[l], atomic_load(&m->values[l]));
+                }
+            }
+            else
+            {
+                AppendMetricsText(out, "%s %lld\n", m->name, atomic_load(&m->values[0]));
+            }
+            continue;
+        }
+
+        // NOTE(Kevin): Take a snapshot first, the main loop keeps adding
+        histogram *h = m->histogram;
+        uint64 buckets[HistogramBucketCount];
+        uint64 count = 0;
+        for (int b = 0; b < HistogramBucketCount; ++b)
+        {
+            buckets[b] = atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+            count += buckets[b];
+        }
+        uint64 max = atomic_load_explicit(&h->max, memory_order_relaxed);
+        for (unsigned int q = 0; q < SizeofArray(quantiles); ++q)
+        {
+            uint64 value = GetHistogramQuantile(buckets, count, max, quantiles[q]);
+            AppendMetricsText(out, "%s{quantile=\"%g\"} %.9f\n", m->name, quantiles[q], (double)value * 1e-9);
+        }
+        AppendMetricsText(out, "%s_sum %.9f\n%s_count %llu\n",
+                          m->name, (double)atomic_load(&h->sum) * 1e-9, m->name, count);
+        AppendMetricsText(out, "# TYPE %s_max gauge\n%s_max %.9f\n",
+                          m->name, m->name, (double)max * 1e-9);
+    }
+}
+
+// NOTE(Kevin): Called from the main loop after SIGUSR1
+internal void
+DumpMetrics(FILE *file)
+{
+    metrics_text out = { 0, 0, 0 };
+    FormatMetrics(&out);
+    if (out.text)
+        fwrite(out.text, 1, out.length, file);
+    fflush(file);
+    free(out.text);
+}
+
+global_variable int       g_metricsFd = -1;
+global_variable pthread_t g_metricsThread;
+global_variable char      g_metricsPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+// NOTE(Kevin): Every connection gets one dump, e.g.  nc -U p2pjs.sock
+internal void *
+MetricsThread(void *_threadParam)
+{
+    Unused(_threadParam);
+    for (;;)
+    {
+        int clientFd = accept(g_metricsFd, 0, 0);
+        if (clientFd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // NOTE(Kevin): StopMetricsEndpoint shut the socket down
+            break;
+        }
+        metrics_text out = { 0, 0, 0 };
+        FormatMetrics(&out);
+        size_t sent = 0;
+        while (out.text && sent < out.length)
+        {
+            ssize_t did = send(clientFd, out.text + sent, out.length - sent, MSG_NOSIGNAL);
+            if (did <= 0)
+                break;
+            sent += (size_t)did;
+        }
+        free(out.text);
+        close(clientFd);
+    }
+    return 0;
+}
+
+internal int
+StartMetricsEndpoint(const char *path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+        return kInvalidValue;
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return kSyscallFailed;
+    // NOTE(Kevin): A stale socket file from an earlier run
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(fd, 4) == -1)
+    {
+        close(fd);
+        return kSyscallFailed;
+    }
+    g_metricsFd = fd;
+    strcpy(g_metricsPath, path);
+    if (pthread_create(&g_metricsThread, 0, MetricsThread, 0) != 0)
+    {
+        close(fd);
+        unlink(path);
+        g_metricsFd = -1;
+        return kSyscallFailed;
+    }
+    return kSuccess;
+}
+
+internal void
+StopMetricsEndpoint(void)
+{
+    if (g_metricsFd == -1)
+        return;
+    shutdown(g_metricsFd, SHUT_RDWR);
+    pthread_join(g_metricsThread, 0);
+    close(g_metricsFd);
+    unlink(g_metricsPath);
+    g_metricsFd = -1;
+}
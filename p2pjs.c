@@ -29,20 +29,57 @@ ErrorToString(int error)
         "CompileError",
         "RuntimeError",
         "UnknownMessageType",
+        "ConnectionClosed",
     }; 
     return strings[error];
 }
 
-internal const char *g_localIp;
-internal const char *g_localPort;
-internal int g_serverFd;
+// NOTE(Kevin): tools/sim brings a virtual clock
+#ifndef P2PJS_Simulation
+internal double
+GetTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+#endif
 
 #include "getlocalip.c"
 #include "logging.c"
+#include "tracing.c"
+#include "capture.c"
+#include "metrics.c"
+
+// NOTE(Kevin): Everything below is the state of one node. tools/sim runs
+// many nodes in one process; it puts these variables into a section of
+// their own and swaps its contents when it switches to another node.
+// Logging, tracing and metrics above are shared by all simulated nodes.
+#ifdef P2PJS_Simulation
+  #undef global_variable
+  #undef local_persist
+  #define global_variable static __attribute__((section("p2pjs_node")))
+  #define local_persist static __attribute__((section("p2pjs_node")))
+#endif
+
+global_variable const char *g_localIp;
+global_variable const char *g_localPort;
+global_variable int g_serverFd;
+
+#include "cookie.c"
+// NOTE(Kevin): Simulated nodes do not run wren, the simulator provides RunCode()
+#ifndef P2PJS_Simulation
 #include "vm.c"
+#endif
 #include "messaging.c"
+#include "streaming.c"
+#include "fairshare.c"
 #include "peer_handling.c"
+#include "aggregation.c"
+#include "memo.c"
+#include "resultstore.c"
 #include "jobs.c"
+#include "pipeline.c"
 #include "ui.c"
 
 #define DefaultPort "2096"
@@ -90,13 +127,21 @@ OpenServerSocket(const char *port)
         fprintf(stderr, "Failed to open server socket.\n");
         return -1;
     }
-    bind(serverFd, addr->ai_addr, addr->ai_addrlen);
-    // NOTE(Kevin): Make that socket reusable
+    // NOTE(Kevin): Make that socket reusable. This has to happen before bind(),
+    // otherwise a restarted node can not get its port back while old
+    // connections are in TIME_WAIT.
     int yes = 1;
     if (setsockopt(serverFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1)
     {
         fprintf(stderr, "Failed to make server socket reusable.\n");
     }
+    if (bind(serverFd, addr->ai_addr, addr->ai_addrlen) == -1)
+    {
+        fprintf(stderr, "Failed to bind server socket to port %s.\n", port);
+        close(serverFd);
+        freeaddrinfo(addr);
+        return -1;
+    }
 
     // NOTE(Kevin): Make the socket non-blocking
     if (fcntl(serverFd, F_SETFL, fcntl(serverFd, F_GETFL, 0) | O_NONBLOCK) == -1)
@@ -109,15 +154,46 @@ OpenServerSocket(const char *port)
 }
 
 global_variable bool32 g_shouldExit;
+global_variable volatile sig_atomic_t g_shouldDumpMetrics;
 
 void
 OnExit(int s)
 {
     Unused(s);
-    WriteToLog("Exiting!\n");
+    // NOTE(Kevin): No logging here, the log rings are not signal safe
     g_shouldExit = 1;
 }
 
+void
+OnDumpMetrics(int s)
+{
+    Unused(s);
+    g_shouldDumpMetrics = 1;
+}
+
+internal int
+CompareClosedPeers(const void *a, const void *b)
+{
+    return ((const closed_peer*)a)->id - ((const closed_peer*)b)->id;
+}
+
+internal void
+UpdateQueueMetrics(void)
+{
+    int pendingOffers = 0;
+    int waitingQueries = 0;
+    for (unsigned int i = 0; i < g_emitterAccountCount; ++i)
+    {
+        pendingOffers  += g_emitterAccounts[i].pendingOffers;
+        waitingQueries += g_emitterAccounts[i].waitingCount;
+    }
+    MetricSet(&g_metricPeers, g_peerCount);
+    MetricSet(&g_metricJobsQueued, g_receivedJobCount);
+    MetricSet(&g_metricOffersPending, pendingOffers);
+    MetricSet(&g_metricQueriesWaiting, waitingQueries);
+    MetricSet(&g_metricMessagesInProgress, g_messageBufferCount);
+}
+
 internal void
 Frame(void)
 {
@@ -129,17 +205,17 @@ Frame(void)
         GetIPAddressString((struct sockaddr*)&clientAddress,
                 ipAddressString,
                 SizeofArray(ipAddressString));
-        WriteToUser("Got incoming connection from %s.\n", ipAddressString);
+        LogUser(kLogMain, "Got incoming connection from %s.\n", ipAddressString);
 
         // NOTE(Kevin): Add to list of known peers 
         int id = AddPeer(clientFd, ipAddressString);
         if (id > -1)
         {
-            WriteToLog("Peer with ip %s got id %d.\n", ipAddressString, id);
+            LogInfo(kLogPeers, "Peer with ip %s got id %d.\n", ipAddressString, id);
         }
         else
         {
-            WriteToLog("Failed to add to list of known peers.\n");
+            LogError(kLogPeers, "Failed to add to list of known peers.\n");
         }
     }
 
@@ -151,19 +227,39 @@ Frame(void)
     {
         for (unsigned int i = 0; i < readyPeerCount; ++i)
         {
-            WriteToLog("Incoming data from peer %d [%s].\n",
+            LogDebug(kLogNet, "Incoming data from peer %d [%s].\n",
                     readyPeers[i].id,
                     GetPeerIP(readyPeers[i].id));
-            HandleMessageFromPeer(readyPeers[i].fd, readyPeers[i].id, g_localPort);
+            TouchPeer(readyPeers[i].id);
+            int err = HandleMessagesFromPeer(readyPeers[i].fd, readyPeers[i].id, g_localPort);
+            if (err == kConnectionClosed || err == kSyscallFailed)
+            {
+                // NOTE(Kevin): recv() told us that the peer is gone
+                closed_peer *t = realloc(closedPeers,
+                                         sizeof(closed_peer) * (closedPeerCount + 1));
+                if (t)
+                {
+                    closedPeers = t;
+                    closedPeers[closedPeerCount].fd = readyPeers[i].fd;
+                    closedPeers[closedPeerCount].id = readyPeers[i].id;
+                    closedPeers[closedPeerCount].hasIncomingData = 0;
+                    ++closedPeerCount;
+                }
+            }
         } 
+        // NOTE(Kevin): RemovePeers() expects the list to be sorted by id
+        qsort(closedPeers, closedPeerCount, sizeof(closed_peer), CompareClosedPeers);
         for (unsigned int i = 0; i < closedPeerCount; ++i)
         {
-            WriteToUser("Peer %d [%s] has closed the connection.\n",
+            LogUser(kLogMain, "Peer %d [%s] has closed the connection.\n",
                     closedPeers[i].id,
                     GetPeerIP(closedPeers[i].id));
             // TODO(Kevin): Handle outstanding messages
             // We need a way to TRY to handle messages, because
             // the message might be incomplete
+            DropMessageBuffer(closedPeers[i].fd);
+            RequeueJobsOfPeer(closedPeers[i].fd);
+            DropJobsFromPeer(closedPeers[i].fd);
             close(closedPeers[i].fd);
         }
         RemovePeers(closedPeers, closedPeerCount);
@@ -172,21 +268,41 @@ Frame(void)
     }
     else
     {
-        WriteToLog("CheckPeerStatus() failed.\n"); 
+        LogError(kLogPeers, "CheckPeerStatus() failed.\n"); 
     }
+
+    CheckHeartbeats();
+    CheckHedgedJobs();
+    RetryUnansweredQueries();
+    FlushAggregations();
+    ExpireJobInputs();
+    PumpPayloadStreams();
+    FlushResultStore(0);
+    UpdateQueueMetrics();
 }
 
+// NOTE(Kevin): tools/replay includes this file and brings its own main()
+#ifndef P2PJS_NoMain
 int
 main(int argc, char **argv)
 {
+    // NOTE(Kevin): Job results are printed to stdout; keep them line by
+    // line when a program reads them through a pipe
+    setvbuf(stdout, 0, _IOLBF, 0);
+
     const char *port = DefaultPort;
     bool32 forkToBackground = 0;
     char *firstPeer = 0;
     // NOTE(Kevin): Parse command line arguments
     int option = '?';
     char *scriptPath  = 0;
+    bool32 trace = 0;
+    char *metricsPath = 0;
+    char *capturePath = 0;
+    char *resultStorePath = 0;
+    int resultStoreSync = kResultStoreSyncNone;
 
-    while ((option = getopt(argc, argv, "p:f:bs:")) != -1)
+    while ((option = getopt(argc, argv, "p:f:bs:w:l:tm:r:o:RM:")) != -1)
     {
         switch (option)
         {
@@ -213,16 +329,94 @@ main(int argc, char **argv)
                 scriptPath = malloc(strlen(optarg) + 1);
                 strcpy(scriptPath, optarg);
             } break;
+            case 'w':
+            {
+                // NOTE(Kevin): Emitter weight, ip#port=weight
+                char *ip = optarg;
+                char *sep = strchr(optarg, '#');
+                char *eq  = sep ? strchr(sep, '=') : 0;
+                if (!sep || !eq || sep == ip || eq == sep + 1)
+                {
+                    printf("Expected ip#port=weight\n");
+                    return 1;
+                }
+                *sep = '\0';
+                *eq  = '\0';
+                if (SetEmitterWeight(ip, sep + 1, atof(eq + 1)) != kSuccess)
+                {
+                    printf("Invalid weight %s\n", eq + 1);
+                    return 1;
+                }
+            } break;
+            case 'l':
+            {
+                // NOTE(Kevin): Log filter, level[:subsystem,...]
+                if (SetLogFilter(optarg) != kSuccess)
+                {
+                    printf("Expected level[:subsystem,...], level is one of error, warn, info, debug; "
+                           "subsystems are main, net, peers, jobs, vm\n");
+                    return 1;
+                }
+            } break;
+            case 't':
+            {
+                // NOTE(Kevin): Write a trace file
+                trace = 1;
+            } break;
+            case 'm':
+            {
+                // NOTE(Kevin): Unix socket for the metrics endpoint
+                metricsPath = optarg;
+            } break;
+            case 'r':
+            {
+                // NOTE(Kevin): Record received messages for tools/replay
+                capturePath = optarg;
+            } break;
+            case 'o':
+            {
+                // NOTE(Kevin): Result store, path[:none|flush|result]
+                char *colon = strrchr(optarg, ':');
+                if (colon)
+                {
+                    *colon = '\0';
+                    if (ParseResultStoreSync(colon + 1, &resultStoreSync) != kSuccess)
+                    {
+                        printf("Expected path[:sync], sync is one of none, flush, result\n");
+                        return 1;
+                    }
+                }
+                resultStorePath = optarg;
+            } break;
+            case 'R':
+            {
+                // NOTE(Kevin): Finish jobs from the result store instead of
+                // running them again
+                g_resolveFromResultStore = 1;
+            } break;
+            case 'M':
+            {
+                // NOTE(Kevin): Result cache entries, for jobs that are
+                // pure functions of their source, argument and data
+                char *end;
+                long entries = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || entries < 0 || entries > (1 << 24))
+                {
+                    printf("Expected the number of cached results, 0 turns the cache off\n");
+                    return 1;
+                }
+                g_memoCapacity = (unsigned int)entries;
+            } break;
             case '?':
             default:
             {
-                printf("Usage: %s [-p port] [-f ip#port] [-s path] [-b]\n", argv[0]);
+                printf("Usage: %s [-p port] [-f ip#port] [-s path] [-b] [-w ip#port=weight] [-l level[:subsystem,...]] [-t] [-m socket] [-r capture] [-o path[:sync]] [-R] [-M entries]\n", argv[0]);
                 return 1;
             } break;
         }
     }
 
-    WriteToUser("Started with options: Port %s; First Peer: %s; Fork to Background: %s\n",
+    LogUser(kLogMain, "Started with options: Port %s; First Peer: %s; Fork to Background: %s\n",
                port, (firstPeer) ? firstPeer : "<none>", (forkToBackground) ? "yes" : "no");
     
     if (forkToBackground)
@@ -246,6 +440,8 @@ main(int argc, char **argv)
     act.sa_handler = OnExit;
     sigaction(SIGTERM, &act, 0);
     sigaction(SIGINT, &act, 0);
+    act.sa_handler = OnDumpMetrics;
+    sigaction(SIGUSR1, &act, 0);
 
     if (!OpenLog()) {
         fprintf(stderr, "Failed to open log file.\n");
@@ -259,26 +455,70 @@ main(int argc, char **argv)
     char localIp[PeerIPLen];
     if (GetLocalIPAddress(localIp, SizeofArray(localIp)) != kSuccess)
     {
-        WriteToUser("Failed to determine local ip address.\n");
+        LogUser(kLogMain, "Failed to determine local ip address.\n");
         CloseLog();
         return 1;
     }
 
-    WriteToUser("Using %s as local ip.\n", localIp);
+    LogUser(kLogMain, "Using %s as local ip.\n", localIp);
     
     g_localPort = port; 
     g_localIp = localIp;
 
+    if (InitCookieGenerator(localIp, port) != kSuccess)
+    {
+        LogWarning(kLogMain, "No /dev/urandom, job cookies are less unpredictable.\n");
+    }
+
+    if (trace)
+    {
+        int err = OpenTrace(localIp, port);
+        if (err != kSuccess)
+            LogUser(kLogMain, "Failed to open trace file: %s\n", ErrorToString(err));
+    }
+
+    if (capturePath)
+    {
+        int err = OpenCapture(capturePath, localIp, port);
+        if (err != kSuccess)
+            LogUser(kLogMain, "Failed to open capture file %s: %s\n", capturePath, ErrorToString(err));
+    }
+
+    if (resultStorePath)
+    {
+        int err = OpenResultStore(resultStorePath, resultStoreSync);
+        if (err != kSuccess)
+            LogUser(kLogMain, "Failed to open result store %s: %s\n", resultStorePath, ErrorToString(err));
+    }
+    else if (g_resolveFromResultStore)
+    {
+        LogUser(kLogMain, "-R has no effect without -o.\n");
+    }
+
     int serverFd = OpenServerSocket(port);
-    WriteToLog("Listening on %s\n", port);
+    if (serverFd == -1)
+    {
+        CloseLog();
+        return 1;
+    }
+    LogInfo(kLogMain, "Listening on %s\n", port);
     if (listen(serverFd, 5) == -1) {
-        WriteToLog("Can not listen on server socket.\n");
+        LogError(kLogMain, "Can not listen on server socket.\n");
         close(serverFd);
         CloseLog();
         return 1;
     }
     g_serverFd = serverFd;
 
+    // NOTE(Kevin): Started after listen(), so a node that answers on its
+    // metrics socket also accepts peers
+    if (metricsPath)
+    {
+        int err = StartMetricsEndpoint(metricsPath);
+        if (err != kSuccess)
+            LogUser(kLogMain, "Failed to open metrics socket %s: %s\n", metricsPath, ErrorToString(err));
+    }
+
     if (firstPeer)
     {
         // NOTE(Kevin): Attempt to connect
@@ -318,16 +558,16 @@ main(int argc, char **argv)
 
     if (scriptPath)
     {
-        WriteToUser("Executing script %s\n", scriptPath);
+        LogUser(kLogVM, "Executing script %s\n", scriptPath);
         int result = RunScript(scriptPath); 
-        WriteToUser("Result: %s\n", ErrorToString(result));
+        LogUser(kLogVM, "Result: %s\n", ErrorToString(result));
     }
     else
     {
         if (!forkToBackground) {
             if (StartUIThread() != kSuccess)
             {
-                WriteToLog("Failed to start ui thread.\n");
+                LogError(kLogMain, "Failed to start ui thread.\n");
                 close(serverFd);
                 CloseLog();
                 return 1;
@@ -336,6 +576,7 @@ main(int argc, char **argv)
 
         while (!g_shouldExit)
         {
+            double iterationStart = GetTime();
             Frame();
 
             if (!forkToBackground)
@@ -346,11 +587,14 @@ main(int argc, char **argv)
                     switch (cmd->type)
                     {
                         case kCmdJobCSource:
+                        case kCmdHedgedJobCSource:
                         {
-                            WriteToLog("CSOURCE COMMAND %s\n", cmd->cSource.path);
+                            LogInfo(kLogJobs, "CSOURCE COMMAND %s\n", cmd->cSource.path);
+                            uint32 flags = (cmd->type == kCmdHedgedJobCSource) ?
+                                kJobFlagLatencySensitive : 0;
                             int result = EmitCSourceJob(cmd->cSource.path,
                                         cmd->cSource.arg,
-                                        localIp, port, 0);
+                                        localIp, port, flags, 0);
                             if (result == kCouldNotOpenFile)
                             {
                                 printf("Could not read file %s\n", cmd->cSource.path);
@@ -361,6 +605,11 @@ main(int argc, char **argv)
                             }
                         } break;
 
+                        case kCmdPrintJobStats:
+                        {
+                            PrintJobStats();
+                        } break;
+
                         case kCmdQuit:
                         {
                             g_shouldExit = 1;
@@ -368,7 +617,7 @@ main(int argc, char **argv)
 
                         default:
                         {
-                            WriteToUser("Unknown command %d\n", cmd->type);
+                            LogUser(kLogMain, "Unknown command %d\n", cmd->type);
                         } break;
                     }
                     FreeCommand(cmd);
@@ -376,6 +625,16 @@ main(int argc, char **argv)
             } 
             
             ExecuteNextJob();
+
+            // NOTE(Kevin): A slot might have become free
+            OfferFreeSlots(0, port);
+
+            MetricObserve(&g_metricLoopIteration, GetTime() - iterationStart);
+            if (g_shouldDumpMetrics)
+            {
+                g_shouldDumpMetrics = 0;
+                DumpMetrics(stderr);
+            }
         }
 
         if (!forkToBackground)
@@ -386,8 +645,13 @@ main(int argc, char **argv)
 
     close(serverFd);
 
-
+    LogInfo(kLogMain, "Exiting!\n");
+    StopMetricsEndpoint();
+    CloseResultStore();
+    CloseCapture();
+    CloseTrace();
     CloseLog();
 
     return 0;
 }
+#endif
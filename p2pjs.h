@@ -14,6 +14,22 @@
   #define P2PJS_MaxRunningJobs 1 
 #endif
 
+#ifndef P2PJS_MaxResultValues
+  // NOTE(Kevin): Longest list of numbers a job may return
+  #define P2PJS_MaxResultValues 65536
+#endif
+
+#ifndef P2PJS_MaxPayloadSize
+  // NOTE(Kevin): Largest binary payload of a job or a job result
+  #define P2PJS_MaxPayloadSize (64 << 20)
+#endif
+
+#ifndef P2PJS_StreamThreshold
+  // NOTE(Kevin): Larger payloads, and jobs whose source and payload
+  // together are larger, are sent in chunks, see streaming.c
+  #define P2PJS_StreamThreshold (64 << 10)
+#endif
+
 // NOTE(Kevin): LLP64; should be fine under Windows and most *nix
 typedef unsigned char       uint8;
 typedef unsigned short      uint16;
@@ -65,6 +81,47 @@ enum
 
     // NOTE(Kevin): Transmit a job result
     kJobResult,
+
+    // NOTE(Kevin): Sent periodically to every peer, has no data
+    kHeartbeat,
+
+    // NOTE(Kevin): The job is no longer needed, because another peer
+    // delivered its result first
+    kCancelJob,
+
+    // NOTE(Kevin): Sent right before a map-reduce chunk; says where its
+    // result goes, see aggregation.c
+    kAggregateJob,
+
+    // NOTE(Kevin): Combined results of map-reduce chunks, sent up the
+    // aggregation tree
+    kAggregatedResult,
+
+    // NOTE(Kevin): Sent right before a job of a job graph; the job waits
+    // for the results of its upstream jobs, see pipeline.c
+    kAwaitInputs,
+
+    // NOTE(Kevin): Result of an upstream job, from the emitter or
+    // directly from the peer that ran it
+    kJobInput,
+
+    // NOTE(Kevin): Asks the peer running a job to also send its result
+    // to the peer running a job that depends on it
+    kForwardResult,
+
+    // NOTE(Kevin): Part of a large job or result payload, sent after the
+    // job or jobResult message it belongs to, see streaming.c
+    kPayloadChunk,
+
+    // NOTE(Kevin): How much of a payload arrived; the sender keeps at most
+    // a window of unacknowledged bytes in flight
+    kPayloadAck,
+
+    // NOTE(Kevin): Reply to offerJobResources when the job went to another
+    // peer or needs none anymore; frees the slot the offer holds
+    kDeclineOffer,
+
+    kMessageTypeCount,
 };
 
 // Commands
@@ -72,12 +129,30 @@ enum
 {
     kCmdJobCSource,
 
+    // NOTE(Kevin): Like kCmdJobCSource, but the job is latency-sensitive
+    kCmdHedgedJobCSource,
+
+    // NOTE(Kevin): Print the resource usage of emitted jobs per source
+    kCmdPrintJobStats,
+
     kCmdQuit,
 };
 
 // NOTE(Kevin): SHA-256 Hashes are 32 byte
 #define CookieLen 32
 
+// NOTE(Kevin): What a job cost on the worker, sent back with its result
+typedef struct
+{
+    // NOTE(Kevin): CPU time of the thread running the VM, in seconds
+    double cpuTime;
+    double wallTime;
+    // NOTE(Kevin): Time between arriving at the worker and starting to run
+    double queueTime;
+    // NOTE(Kevin): Largest heap of the job's VM, in bytes
+    uint64 peakHeap;
+} job_usage;
+
 typedef struct 
 {
     uint16 type; 
@@ -111,6 +186,13 @@ typedef struct
         {
             uint8 cookie[CookieLen];
             double arg;
+            uint32 kind;
+            // NOTE(Kevin): Binary data next to arg, points behind the source.
+            // Streamed payloads come in payloadChunk messages instead,
+            // after the source, which is then streamed as well.
+            uint32 payloadSize;
+            bool32 isPayloadStreamed;
+            uint8 *payload;
             uint32 sourceLen;
             char   source[1];
         } job;
@@ -120,7 +202,92 @@ typedef struct
             uint8 cookie[CookieLen];
             int   state;
             double result;
+            job_usage usage;
+            // NOTE(Kevin): Jobs that return a list of numbers send it
+            // here, result is then the number of values
+            uint32 valueCount;
+            // NOTE(Kevin): Jobs that return a ByteBuffer send it here,
+            // result is then its size; points behind the values
+            uint32 payloadSize;
+            bool32 isPayloadStreamed;
+            uint8 *payload;
+            double values[1];
         } jobResult;
+
+        struct
+        {
+            uint8 cookie[CookieLen];
+        } cancelJob;
+
+        struct
+        {
+            uint8 cookie[CookieLen];
+        } declineOffer;
+
+        struct
+        {
+            uint8     cookie[CookieLen];
+            // NOTE(Kevin): Cookie of the first chunk of the map-reduce
+            uint8     group[CookieLen];
+            uint32    chunkIndex;
+            int32     reducer;
+            // NOTE(Kevin): Empty ipaddr if the result goes to the emitter
+            peer_info parent;
+            peer_info emitter;
+        } aggregateJob;
+
+        struct
+        {
+            uint8     group[CookieLen];
+            peer_info emitter;
+            int32     reducer;
+            uint32    chunkCount;
+            uint32    valueCount;
+            // NOTE(Kevin): Point behind the message
+            uint32   *chunks;
+            double   *values;
+        } aggregatedResult;
+
+        struct
+        {
+            uint8     cookie[CookieLen];
+            uint32    inputCount;
+            // NOTE(Kevin): Whether the job gets a list of inputs
+            uint32    asList;
+        } awaitInputs;
+
+        struct
+        {
+            uint8     cookie[CookieLen];
+            uint32    slot;
+            uint32    valueCount;
+            double    result;
+            // NOTE(Kevin): Points behind the message
+            double   *values;
+        } jobInput;
+
+        struct
+        {
+            uint8     cookie[CookieLen];
+            uint8     dependent[CookieLen];
+            uint32    slot;
+            peer_info target;
+        } forwardResult;
+
+        struct
+        {
+            uint8   cookie[CookieLen];
+            uint32  offset;
+            uint32  size;
+            uint8  *bytes;
+        } payloadChunk;
+
+        struct
+        {
+            uint8   cookie[CookieLen];
+            // NOTE(Kevin): PayloadAckAbort if the receiver dropped the payload
+            uint32  received;
+        } payloadAck;
     }; 
 } message;
 
@@ -152,6 +319,9 @@ enum
     kRuntimeError,
 
     kUnknownMessageType,
+
+    // NOTE(Kevin): The peer closed the connection
+    kConnectionClosed,
 };
 
 
@@ -165,6 +335,258 @@ typedef struct
 {
     const char *source;
     double arg;
+    // NOTE(Kevin): Optional binary data
+    const uint8 *payload;
+    uint32 payloadSize;
+    // NOTE(Kevin): kJobKind*, what the worker calls in the source
+    uint32 kind;
 } job;
 
+// NOTE(Kevin): Bytes of a payload a node keeps. Large ones live in an
+// unlinked temp file mapped into memory, see streaming.c
+typedef struct
+{
+    uint8  *bytes;
+    uint32  size;
+    bool32  isMapped;
+} payload_region;
+
+// NOTE(Kevin): Set in the payloadSize of job and jobResult messages on
+// the wire when the payload (and the source of a job) follows in
+// payloadChunk messages
+#define PayloadStreamed 0x80000000u
+#define PayloadAckAbort 0xffffffffu
+
+// NOTE(Kevin): Job flags, only known to the emitter
+enum
+{
+    // NOTE(Kevin): Send a second copy if the job runs unusually long
+    kJobFlagLatencySensitive = 0x1,
+
+    // NOTE(Kevin): A map-reduce chunk whose result is combined on the way
+    kJobFlagAggregated = 0x2,
+
+    // NOTE(Kevin): The argument of the job are results of other jobs
+    kJobFlagDependent = 0x4,
+
+    // NOTE(Kevin): Other jobs depend on the result of the job
+    kJobFlagUpstream = 0x8,
+
+    // NOTE(Kevin): The job gets a payload after it was emitted, so the
+    // result cache can not know it beforehand
+    kJobFlagHasPayload = 0x10,
+
+    // NOTE(Kevin): A chunk of a map-reduce, sent as kJobKindReduce
+    kJobFlagReduce = 0x20,
+};
+
+// NOTE(Kevin): Outcomes of a result cache lookup, see memo.c
+enum
+{
+    kMemoHit,
+    kMemoMiss,
+    // NOTE(Kevin): An identical job was in flight, the job waits for it
+    kMemoJoined,
+    // NOTE(Kevin): Found in the result store, see resultstore.c
+    kMemoStored,
+
+    kMemoOutcomeCount
+};
+
+#ifndef P2PJS_MaxJobInputs
+  #define P2PJS_MaxJobInputs 64
+#endif
+
+// NOTE(Kevin): Result of an upstream job, as a dependent job receives it
+typedef struct
+{
+    bool32  isSet;
+    double  result;
+    // NOTE(Kevin): 0 if the upstream job returned a number
+    uint32  valueCount;
+    double *values;
+} job_input;
+
+// Reducers of a map-reduce
+enum
+{
+    kReduceSum,
+    kReduceMin,
+    kReduceMax,
+
+    // NOTE(Kevin): Number of values that are not false, null or 0
+    kReduceCount,
+
+    // NOTE(Kevin): Counts per bin of [low, high), other values are dropped
+    kReduceHistogram,
+
+    // NOTE(Kevin): Job.reduce(a, b) of the job's source
+    kReduceCustom,
+
+    kReducerCount,
+};
+
+// NOTE(Kevin): Evaluate Job.run(x) for x = start, start + step, ... below end
+// and reduce the results
+typedef struct
+{
+    double start;
+    double end;
+    double step;
+    int    reducer;
+    double low;
+    double high;
+    int    bins;
+} map_reduce;
+
+// Job kinds, sent along with every job
+enum
+{
+    // NOTE(Kevin): Job.run(arg)
+    kJobKindRun,
+    // NOTE(Kevin): A chunk of a map-reduce, Reduce_.run(chunk) of the
+    // driver the emitter appended to the source
+    kJobKindReduce,
+
+    kJobKindCount,
+};
+
+// NOTE(Kevin): Trace files, written by tracing.c and read by tools/trace2json.c.
+// A trace_header followed by up to capacity trace_events, all in host byte order.
+#define TraceMagic   "P2PJSTRC"
+#define TraceVersion 1
+
+// Trace event types
+enum
+{
+    kTraceMessageSent,
+    kTraceMessageReceived,
+
+    // NOTE(Kevin): Emitter side
+    kTraceJobQueried,
+    kTraceJobDispatched,
+    kTraceJobResultDelivered,
+
+    // NOTE(Kevin): Worker side
+    kTraceJobOffered,
+    kTraceJobStarted,
+    kTraceJobFinished,
+
+    kTraceVMCreate,
+    kTraceVMDestroy,
+
+    kTraceEventTypeCount,
+};
+
+typedef struct
+{
+    char   magic[8];
+    uint32 version;
+    uint32 eventSize;
+    uint64 capacity;
+    // NOTE(Kevin): Updated after every event, so a crashed node leaves
+    // a readable trace behind
+    uint64 count;
+    uint64 dropped;
+    // NOTE(Kevin): Wall clock time of event time 0, in ns since the epoch
+    uint64 startTime;
+    char   ipaddr[PeerIPLen];
+    char   port[PeerPortLen];
+} trace_header;
+
+typedef struct
+{
+    // NOTE(Kevin): ns since startTime (monotonic clock)
+    uint64 time;
+    uint16 type;
+    uint16 messageType;
+    // NOTE(Kevin): Bytes on the wire for messages
+    uint32 size;
+    // NOTE(Kevin): fd of the other peer, -1 if there is none
+    int32  peer;
+    // NOTE(Kevin): Job state (kSuccess, kRuntimeError, ...) for finished/delivered jobs
+    int32  state;
+    uint8  cookie[CookieLen];
+} trace_event;
+
+// NOTE(Kevin): Wire captures, written by capture.c (p2pjs -r) and replayed
+// by tools/replay.c. A capture_header followed by capture_records, each
+// followed by size bytes, all in host byte order.
+#define CaptureMagic   "P2PJSCAP"
+#define CaptureVersion 4
+
+// Capture record kinds
+enum
+{
+    // NOTE(Kevin): A received message, exactly as it was on the wire
+    kCaptureFrame,
+    // NOTE(Kevin): The peer_info of an fd, written before its first frame
+    // and whenever it changes
+    kCapturePeer,
+};
+
+typedef struct
+{
+    char   magic[8];
+    uint32 version;
+    uint32 recordSize;
+    // NOTE(Kevin): Wall clock time of record time 0, in ns since the epoch
+    uint64 startTime;
+    char   ipaddr[PeerIPLen];
+    char   port[PeerPortLen];
+} capture_header;
+
+typedef struct
+{
+    // NOTE(Kevin): ns since startTime (monotonic clock)
+    uint64 time;
+    // NOTE(Kevin): fd the frame arrived on
+    int32  peer;
+    uint16 kind;
+    uint16 messageType;
+    uint32 size;
+    uint32 reserved;
+} capture_record;
+
+// NOTE(Kevin): Result store, written by resultstore.c (p2pjs -o). A
+// result_store_header followed by result_records, each followed by its
+// values and payload and padded to a multiple of 8 bytes, all in host byte
+// order. Records are only ever appended.
+#define ResultStoreMagic   "P2PJSRES"
+#define ResultStoreVersion 1
+
+// Result record flags
+enum
+{
+    // NOTE(Kevin): key is set; jobs of a graph or a map-reduce tree only
+    // have their cookie
+    kResultRecordHasKey = 0x1,
+};
+
+typedef struct
+{
+    char   magic[8];
+    uint32 version;
+    uint32 recordSize;
+} result_store_header;
+
+typedef struct
+{
+    // NOTE(Kevin): Of the whole record, padding included
+    uint32 size;
+    // NOTE(Kevin): FNV-1a of the record behind this field
+    uint32 checksum;
+    uint8  cookie[CookieLen];
+    // NOTE(Kevin): Hash of source, argument and payload, see ComputeMemoKey()
+    uint8  key[CookieLen];
+    double arg;
+    double result;
+    // NOTE(Kevin): Wall clock time, in s since the epoch
+    double storeTime;
+    int32  state;
+    uint32 flags;
+    uint32 valueCount;
+    uint32 payloadSize;
+} result_record;
+
 #endif
@@ -22,10 +22,71 @@ typedef struct
     bool32 hasIncomingData;
 } closed_peer;
 
+#ifndef P2PJS_HeartbeatInterval
+  // NOTE(Kevin): Seconds between two heartbeats to every peer
+  #define P2PJS_HeartbeatInterval 5.0
+#endif
+
+#ifndef P2PJS_HeartbeatTimeout
+  // NOTE(Kevin): Seconds of silence after which a peer is considered unresponsive.
+  // Jobs run in the main loop, so a busy worker is silent while it runs a job;
+  // its jobs are only re-dispatched once they are overdue, see
+  // RequeueOverdueJobsOfPeer().
+  #define P2PJS_HeartbeatTimeout 30.0
+#endif
+
+#ifndef P2PJS_ReceiveBulkBudget
+  // NOTE(Kevin): Bytes of bulk messages taken from one peer per Frame()
+  #define P2PJS_ReceiveBulkBudget (256 << 10)
+#endif
+
+#ifndef P2PJS_ReceiveStepLimit
+  // NOTE(Kevin): Most decoder calls for one peer per Frame()
+  #define P2PJS_ReceiveStepLimit 64
+#endif
+
+typedef struct
+{
+    double lastSeen;
+    bool32 isUnresponsive;
+    // NOTE(Kevin): Emitter account of the last offer we sent on this
+    // connection, -1 if we sent none
+    int    offerAccount;
+} peer_status;
+
 global_variable struct pollfd *g_peerFds;
 global_variable peer_info *g_peerInfo;
+global_variable peer_status *g_peerStatus;
+global_variable double g_lastHeartbeatTime;
+
+// NOTE(Kevin): Queries we spread recently. Without this, a query that
+// nobody can serve circles between busy peers forever. All of them have to
+// be remembered: a launch of many jobs floods more queries at once than
+// any fixed number, and a forgotten one starts circling again.
+#ifndef P2PJS_SpreadSuppressTime
+  #define P2PJS_SpreadSuppressTime 1.0
+#endif
+
+typedef struct
+{
+    uint8  cookie[CookieLen];
+    double time;
+} spread_query;
+
+// NOTE(Kevin): Wire size of the bulk messages HandleMessageFromPeer() took
+global_variable uint32 g_bulkBytesReceived;
+
+// NOTE(Kevin): Open addressing by cookie. Slots of expired queries are
+// reused, but only emptied when the table is rebuilt, so a lookup can not
+// stop early. Kept at most half full.
+global_variable spread_query *g_spreadQueries;
+global_variable unsigned int  g_spreadQueryCapacity;
+global_variable unsigned int  g_spreadQuerySlotsUsed;
 global_variable unsigned int g_peerCount;
 global_variable unsigned int g_peerCapacity;
+// NOTE(Kevin): Server socket and peers, for WaitForPeerActivity()
+global_variable struct pollfd *g_waitFds;
+global_variable unsigned int g_waitFdCapacity;
 
 internal peer_iterator
 GetFirstPeer(void)
@@ -79,6 +140,10 @@ AddPeer(int fd, const char *ipAddress)
         if (!i)
             return -1;
         g_peerInfo = i;
+        peer_status *st = realloc(g_peerStatus, sizeof(peer_status) * newCapacity);
+        if (!st)
+            return -1;
+        g_peerStatus = st;
         g_peerCapacity = newCapacity;
     }
     g_peerCount = newCount;
@@ -87,8 +152,11 @@ AddPeer(int fd, const char *ipAddress)
     g_peerFds[newCount - 1].events  = POLLIN;
     g_peerFds[newCount - 1].revents = 0;
     // NOTE(Kevin): We don't know the port, yet; but we know the ip address
-    strncpy(g_peerInfo[newCount - 1].ipaddr, ipAddress, PeerIPLen);
+    snprintf(g_peerInfo[newCount - 1].ipaddr, PeerIPLen, "%s", ipAddress);
     g_peerInfo[newCount - 1].port[0] = '\0';
+    g_peerStatus[newCount - 1].lastSeen = GetTime();
+    g_peerStatus[newCount - 1].isUnresponsive = 0;
+    g_peerStatus[newCount - 1].offerAccount = -1;
 
     return newCount - 1;
 }
@@ -110,6 +178,7 @@ RemovePeers(closed_peer *closedPeers, unsigned int closedPeerCount)
             unsigned int myId   = closedPeers[i].id;
             g_peerFds[myId]     = g_peerFds[g_peerCount - 1];
             g_peerInfo[myId]    = g_peerInfo[g_peerCount - 1];
+            g_peerStatus[myId]  = g_peerStatus[g_peerCount - 1];
             --g_peerCount;
         }
     }
@@ -119,7 +188,7 @@ internal void
 UpdatePeerPort(int peerId, const char *port)
 {
     assert(peerId < (int)g_peerCount);
-    strncpy(g_peerInfo[peerId].port, port, PeerPortLen);
+    snprintf(g_peerInfo[peerId].port, PeerPortLen, "%s", port);
 }
 
 internal const char*
@@ -130,6 +199,22 @@ GetPeerIP(int peerId)
     return 0;
 }
 
+internal const char*
+GetPeerPort(int peerId)
+{
+    if (peerId < (int)g_peerCount)
+        return g_peerInfo[peerId].port;
+    return 0;
+}
+
+internal int
+GetPeerOfferAccount(int peerId)
+{
+    if (peerId < (int)g_peerCount)
+        return g_peerStatus[peerId].offerAccount;
+    return -1;
+}
+
 internal int
 GetPeerFd(int id)
 {
@@ -138,6 +223,87 @@ GetPeerFd(int id)
     return -1;
 }
 
+// NOTE(Kevin): Cookies are random, their first bytes are as good as any hash
+internal unsigned int
+GetSpreadQuerySlot(const uint8 cookie[CookieLen], unsigned int capacity)
+{
+    uint64 h;
+    memcpy(&h, cookie, sizeof(h));
+    return (unsigned int)(h ^ (h >> 32)) & (capacity - 1);
+}
+
+// NOTE(Kevin): Drops the expired queries, and grows the table if most of
+// it is still in use
+internal bool32
+RebuildSpreadQueries(double now)
+{
+    unsigned int liveCount = 0;
+    for (unsigned int i = 0; i < g_spreadQueryCapacity; ++i)
+    {
+        if (g_spreadQueries[i].time > 0.0 && now - g_spreadQueries[i].time < P2PJS_SpreadSuppressTime)
+            ++liveCount;
+    }
+    unsigned int newCapacity = 64;
+    while (newCapacity < 4 * liveCount)
+        newCapacity *= 2;
+    spread_query *queries = calloc(newCapacity, sizeof(spread_query));
+    if (!queries)
+        return 0;
+    for (unsigned int i = 0; i < g_spreadQueryCapacity; ++i)
+    {
+        spread_query *query = &g_spreadQueries[i];
+        if (query->time == 0.0 || now - query->time >= P2PJS_SpreadSuppressTime)
+            continue;
+        unsigned int slot = GetSpreadQuerySlot(query->cookie, newCapacity);
+        while (queries[slot].time != 0.0)
+            slot = (slot + 1) & (newCapacity - 1);
+        queries[slot] = *query;
+    }
+    free(g_spreadQueries);
+    g_spreadQueries        = queries;
+    g_spreadQueryCapacity  = newCapacity;
+    g_spreadQuerySlotsUsed = liveCount;
+    return 1;
+}
+
+// NOTE(Kevin): Returns whether the query should be spread, and remembers it
+internal bool32
+ShouldSpreadQuery(uint8 cookie[CookieLen])
+{
+    double now = GetTime();
+    if (2 * (g_spreadQuerySlotsUsed + 1) > g_spreadQueryCapacity && !RebuildSpreadQueries(now))
+        return 0;
+    spread_query *reusable = 0;
+    unsigned int slot = GetSpreadQuerySlot(cookie, g_spreadQueryCapacity);
+    for (; g_spreadQueries[slot].time != 0.0; slot = (slot + 1) & (g_spreadQueryCapacity - 1))
+    {
+        spread_query *query = &g_spreadQueries[slot];
+        bool32 isExpired = now - query->time >= P2PJS_SpreadSuppressTime;
+        if (!isExpired && memcmp(query->cookie, cookie, CookieLen) == 0)
+            return 0;
+        if (isExpired && !reusable)
+            reusable = query;
+    }
+    if (!reusable)
+    {
+        reusable = &g_spreadQueries[slot];
+        ++g_spreadQuerySlotsUsed;
+    }
+    memcpy(reusable->cookie, cookie, CookieLen);
+    reusable->time = now;
+    return 1;
+}
+
+internal void
+TouchPeer(int peerId)
+{
+    if (peerId < (int)g_peerCount)
+    {
+        g_peerStatus[peerId].lastSeen = GetTime();
+        g_peerStatus[peerId].isUnresponsive = 0;
+    }
+}
+
 internal int
 AreIPAddressesEqual(const char *a, const char *b)
 {
@@ -197,7 +363,8 @@ CheckPeerStatus(ready_peer **readyPeersOut,
         // NOTE(Kevin): At least one descriptor is ready
         for (unsigned int i = 0; i < g_peerCount; ++i)
         {
-            WriteToLog("%d: %d\n", i, g_peerFds[i].revents);
+            if (g_peerFds[i].revents != 0)
+                LogDebug(kLogPeers, "Peer %d: revents 0x%x\n", i, g_peerFds[i].revents);
             if ((g_peerFds[i].revents & POLLHUP) != 0)
             {
                 closed_peer *t = realloc(closedPeers,
@@ -233,6 +400,38 @@ CheckPeerStatus(ready_peer **readyPeersOut,
     return kSuccess;
 }
 
+// NOTE(Kevin): Blocks until a peer sent something, somebody connects or
+// timeout seconds passed. For scripts that wait for results; Frame() does
+// the actual work afterwards.
+internal void
+WaitForPeerActivity(int serverFd, double timeout)
+{
+    if (g_peerCount + 1 > g_waitFdCapacity)
+    {
+        unsigned int newCapacity = g_waitFdCapacity > 0 ? g_waitFdCapacity : 8;
+        while (newCapacity < g_peerCount + 1)
+            newCapacity *= 2;
+        struct pollfd *t = realloc(g_waitFds, sizeof(struct pollfd) * newCapacity);
+        if (!t)
+            return;
+        g_waitFds = t;
+        g_waitFdCapacity = newCapacity;
+    }
+    g_waitFds[0].fd      = serverFd;
+    g_waitFds[0].events  = POLLIN;
+    g_waitFds[0].revents = 0;
+    for (unsigned int i = 0; i < g_peerCount; ++i)
+    {
+        g_waitFds[i + 1].fd      = g_peerFds[i].fd;
+        g_waitFds[i + 1].events  = POLLIN;
+        g_waitFds[i + 1].revents = 0;
+    }
+    // NOTE(Kevin): Round up, a timeout of 0 would make the caller spin
+    int milliseconds = (timeout > 0.0) ? (int)(timeout * 1000.0) + 1 : 0;
+    if (poll(g_waitFds, (nfds_t)(g_peerCount + 1), milliseconds) == -1)
+        LogDebug(kLogPeers, "poll() in WaitForPeerActivity failed.\n");
+}
+
 internal int 
 ConnectToPeer(const char *ip, const char *port, const char *myPort, bool32 getPeerList)
 {
@@ -243,7 +442,7 @@ ConnectToPeer(const char *ip, const char *port, const char *myPort, bool32 getPe
     hints.ai_socktype   = SOCK_STREAM;
     getaddrinfo(ip, port, &hints, &res);
     
-    WriteToLog("Connecting to %s : %s\n", ip, port);
+    LogInfo(kLogPeers, "Connecting to %s : %s\n", ip, port);
     peerFd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
     if (peerFd >= 0)
     {
@@ -255,7 +454,7 @@ ConnectToPeer(const char *ip, const char *port, const char *myPort, bool32 getPe
                 UpdatePeerPort(peerId, port);
                 if (SendHello(peerFd, myPort) != kSuccess)
                 {
-                    WriteToLog("Failed to send hello message to peer %s : %s.\n", ip, port);
+                    LogWarning(kLogPeers, "Failed to send hello message to peer %s : %s.\n", ip, port);
                     close(peerFd);
                     closed_peer forceClose;
                     forceClose.fd = peerFd;
@@ -267,7 +466,7 @@ ConnectToPeer(const char *ip, const char *port, const char *myPort, bool32 getPe
                 {
                     if (SendGetPeers(peerFd) != kSuccess)
                     {
-                        WriteToLog("Failed to send getPeers message to peer %s : %s.\n", ip, port);
+                        LogWarning(kLogPeers, "Failed to send getPeers message to peer %s : %s.\n", ip, port);
                         close(peerFd);
                         closed_peer forceClose;
                         forceClose.fd = peerFd;
@@ -280,208 +479,408 @@ ConnectToPeer(const char *ip, const char *port, const char *myPort, bool32 getPe
         else
         {
             perror("Connect: ");
-            WriteToLog("Failed to connect to peer %s : %s.\n", ip, port);
+            LogWarning(kLogPeers, "Failed to connect to peer %s : %s.\n", ip, port);
             close(peerFd);
         }
     }
     else
     {
-        WriteToLog("Failed to open socket for peer connection.\n");
+        LogError(kLogPeers, "Failed to open socket for peer connection.\n");
     }
     if (peerId != -1)
-        WriteToLog("Established connection to %s: %s. Assigned id %d.\n", ip, port, peerId);
+        LogInfo(kLogPeers, "Established connection to %s: %s. Assigned id %d.\n", ip, port, peerId);
     return peerId;
 }
 
-internal int GetNumberOfRunningJobs(void);
 internal int SendJobToPeer(uint8 cookie[CookieLen], int peerFd);
-internal int TakeJob(uint8 cookie[CookieLen], job theJob, int peerId);
+internal int TakeJob(uint8 cookie[CookieLen], job theJob, int peerId, payload_region *payload);
 internal const char* CookieToTemporaryString(uint8 cookie[CookieLen]);
-internal int StoreJobResult(uint8 cookie[CookieLen], int state, double result);
+internal void RequeueOverdueJobsOfPeer(int peerFd);
+internal int StoreJobResult(uint8 cookie[CookieLen], int state, double result,
+                           const double *values, uint32 valueCount, payload_region *payload,
+                           const job_usage *usage, int peerFd);
+internal int CancelJob(uint8 cookie[CookieLen], int peerFd);
+internal void OnAggregateJob(int fd, const message *msg);
+internal void OnAggregatedResult(int fd, const message *msg);
+internal void ForgetAggregatedChunk(uint8 cookie[CookieLen]);
+internal void OnAwaitInputs(const message *msg);
+internal void OnJobInput(const message *msg);
+internal void OnForwardResult(const message *msg);
 
-internal void
-HandleMessageFromPeer(int fd, int id, const char *myPort)
+// NOTE(Kevin): Sends offers for as many waiting queries as we have free
+// slots. Returns whether one of them was the query with the given cookie.
+internal bool32
+OfferFreeSlots(uint8 queryCookie[CookieLen], const char *myPort)
 {
-    message *message;
-    int err;
-    if ((err = ReceiveMessage(fd, &message)) == kSuccess)
+    bool32 offeredQuery = 0;
+    granted_offer offers[P2PJS_MaxRunningJobs];
+    int offerCount = GrantOffers(offers, SizeofArray(offers));
+    for (int i = 0; i < offerCount; ++i)
     {
-        switch (message->type)
+        peer_info *source = &g_emitterAccounts[offers[i].accountIdx].source;
+        LogDebug(kLogJobs, "Offering to take job %s.\n", CookieToTemporaryString(offers[i].cookie));
+        // NOTE(Kevin): Offer to take the job
+        int id = CheckForPeer(source->ipaddr, source->port);
+        if (id == -1)
         {
-            case kHello:
+            LogInfo(kLogPeers, "Attempting to connect to source %s %s.\n",
+                    source->ipaddr, source->port);
+            // NOTE(Kevin): New peer
+            id = ConnectToPeer(source->ipaddr, source->port, myPort, 0);
+            if (id == -1)
             {
-                WriteToLog("Received hello message from peer %d [%s].\n",
-                            id, GetPeerIP(id));
-                UpdatePeerPort(id, message->hello.port);
-            } break;
-
-            case kGetPeers:
+                LogWarning(kLogPeers, "Failed to connect to peer %s %s\n",
+                           source->ipaddr, source->port);
+            }
+        }
+        if (id > -1)
+        {
+            int fd = g_peerFds[id].fd;
+            if (SendOfferJobResources(fd, offers[i].cookie) != kSuccess)
             {
-                WriteToLog("Received getPeers message from peer %d [%s].\n",
-                           id, GetPeerIP(id));
-                // NOTE(Kevin): Gather peer list
-                peer_info *peerList = malloc(sizeof(peer_info) * g_peerCount);
-                if (peerList)
-                {
-                    unsigned int listLength = 0;
-                    for (unsigned int i = 0; i < g_peerCount; ++i)
-                    {
-                        if (g_peerInfo[i].port[0] == '\0')
-                            continue; // NOTE(Kevin): Incomplete peer info
-                        else if (i == (unsigned int)id)
-                            continue; // NOTE(Kevin): Don't send the peers info
-                        else
-                        {
-                            strncpy(peerList[listLength].ipaddr, g_peerInfo[i].ipaddr, PeerIPLen);
-                            strncpy(peerList[listLength].port, g_peerInfo[i].port, PeerPortLen);
-                            ++listLength;
-                        }
-                    } 
-                    SendPeerList(fd, listLength, peerList);
-                    free(peerList);
-                }
-                else
-                {
-                    WriteToLog("Can not anwser getPeers message from peer %d [%s], because malloc failed.\n",
-                               id, GetPeerIP(id));
-                }
-            } break;
-            
-            case kPeerList:
+                LogWarning(kLogJobs, "Failed to send offer.\n");
+            }
+            else
             {
-                WriteToLog("Received peerList message from peer %d [%s].\n",
-                           id, GetPeerIP(id));
-                for (uint16 i = 0; i < message->peerList.numberOfPeers; ++i)
-                {
-                    WriteToLog(" * Entry %d: IP: %s, Port: %s\n",
-                               i,
-                               message->peerList.peers[i].ipaddr,
-                               message->peerList.peers[i].port);
+                SetPendingOfferFd(offers[i].cookie, fd);
+                g_peerStatus[id].offerAccount = offers[i].accountIdx;
+                TraceJob(kTraceJobOffered, offers[i].cookie, fd, 0);
+            }
+        }
+        if (queryCookie && memcmp(queryCookie, offers[i].cookie, CookieLen) == 0)
+            offeredQuery = 1;
+    }
+    return offeredQuery;
+}
 
-                    int id = CheckForPeer(message->peerList.peers[i].ipaddr,
-                                          message->peerList.peers[i].port);
-                    if (id == -1)
-                    {
-                        // NOTE(Kevin): New peer
-                        bool32 getList = rand() % 2;
-                        id = ConnectToPeer(message->peerList.peers[i].ipaddr,
-                                           message->peerList.peers[i].port,
-                                           myPort, getList);
-                        if (id == -1)
-                        {
-                            WriteToLog("Failed to connect to peer %s %s\n",
-                                       message->peerList.peers[i].ipaddr,
-                                       message->peerList.peers[i].port);
-                        }
-                    }
-                }
-            } break;
+// NOTE(Kevin): Sends heartbeats and watches for peers that have been
+// silent for too long. An unresponsive peer is not disconnected, and its
+// jobs are not re-dispatched right away, because it might just be busy
+// running a long job. Only jobs that are overdue are.
+internal void
+CheckHeartbeats(void)
+{
+    double now = GetTime();
+    if (now - g_lastHeartbeatTime < P2PJS_HeartbeatInterval)
+        return;
+    for (peer_iterator peer = GetFirstPeer(); !IsBehindLastPeer(&peer); GetNextPeer(&peer))
+    {
+        SendHeartbeat(peer.fd);
+    }
+    g_lastHeartbeatTime = now;
+    for (unsigned int i = 0; i < g_peerCount; ++i)
+    {
+        if (!g_peerStatus[i].isUnresponsive &&
+            now - g_peerStatus[i].lastSeen > P2PJS_HeartbeatTimeout)
+        {
+            LogWarning(kLogPeers, "Peer %d [%s] missed its heartbeats.\n", i, GetPeerIP(i));
+            g_peerStatus[i].isUnresponsive = 1;
+        }
+        if (g_peerStatus[i].isUnresponsive)
+            RequeueOverdueJobsOfPeer(g_peerFds[i].fd);
+    }
+}
 
-            case kQueryJobResources:
-            {
-                WriteToLog("Received queryJobResources message from peer %d [%s].\n",
-                           id, GetPeerIP(id));
-                // NOTE(Kevin): Decide if we want to take the job
+// NOTE(Kevin): Job and jobResult messages whose payload is streamed get
+// here once the payload is complete, see streaming.c
+internal void
+HandlePeerMessage(int fd, int id, const char *myPort, message *message)
+{
+    switch (message->type)
+    {
+        case kHello:
+        {
+            LogDebug(kLogPeers, "Received hello message from peer %d [%s].\n",
+                        id, GetPeerIP(id));
+            UpdatePeerPort(id, message->hello.port);
+        } break;
 
-                if (GetNumberOfRunningJobs() < P2PJS_MaxRunningJobs)
+        case kGetPeers:
+        {
+            LogDebug(kLogPeers, "Received getPeers message from peer %d [%s].\n",
+                     id, GetPeerIP(id));
+            // NOTE(Kevin): Gather peer list
+            peer_info *peerList = malloc(sizeof(peer_info) * g_peerCount);
+            if (peerList)
+            {
+                unsigned int listLength = 0;
+                for (unsigned int i = 0; i < g_peerCount; ++i)
                 {
-                    WriteToLog("Offering to take the job.\n");
-                    // NOTE(Kevin): Offer to take the job
-                    int id = CheckForPeer(message->queryJobResources.source.ipaddr,
-                                          message->queryJobResources.source.port);
-                    if (id == -1)
+                    if (g_peerInfo[i].port[0] == '\0')
+                        continue; // NOTE(Kevin): Incomplete peer info
+                    else if (i == (unsigned int)id)
+                        continue; // NOTE(Kevin): Don't send the peers info
+                    else
                     {
-                        WriteToLog("Attempting to connect to source %s %s.\n",
-                                   message->queryJobResources.source.ipaddr,
-                                   message->queryJobResources.source.port);
-                        // NOTE(Kevin): New peer
-                        id = ConnectToPeer(message->queryJobResources.source.ipaddr,
-                                           message->queryJobResources.source.port,
-                                           myPort, 0);
-                        if (id == -1)
-                        {
-                            WriteToLog("Failed to connect to peer %s %s\n",
-                                       message->queryJobResources.source.ipaddr,
-                                       message->queryJobResources.source.port);
-                        }
+                        snprintf(peerList[listLength].ipaddr, PeerIPLen, "%s", g_peerInfo[i].ipaddr);
+                        snprintf(peerList[listLength].port, PeerPortLen, "%s", g_peerInfo[i].port);
+                        ++listLength;
                     }
-                    if (id > -1)
-                    {
-                        int fd = g_peerFds[id].fd;
-                        if (SendOfferJobResources(fd, message->queryJobResources.cookie) != kSuccess)
-                        {
-                            WriteToLog("Failed to send offer.\n");
-                        }
-                    }
-                }
-                else
+                } 
+                SendPeerList(fd, listLength, peerList);
+                free(peerList);
+            }
+            else
+            {
+                LogError(kLogPeers, "Can not anwser getPeers message from peer %d [%s], because malloc failed.\n",
+                         id, GetPeerIP(id));
+            }
+        } break;
+        
+        case kPeerList:
+        {
+            LogDebug(kLogPeers, "Received peerList message from peer %d [%s].\n",
+                     id, GetPeerIP(id));
+            for (uint16 i = 0; i < message->peerList.numberOfPeers; ++i)
+            {
+                LogDebug(kLogPeers, " * Entry %d: IP: %s, Port: %s\n",
+                         i,
+                         message->peerList.peers[i].ipaddr,
+                         message->peerList.peers[i].port);
+
+                int id = CheckForPeer(message->peerList.peers[i].ipaddr,
+                                      message->peerList.peers[i].port);
+                if (id == -1)
                 {
-                    // NOTE(Kevin): Spread the message
-                    for (peer_iterator peer = GetFirstPeer();
-                         !IsBehindLastPeer(&peer);
-                         GetNextPeer(&peer))
+                    // NOTE(Kevin): New peer
+                    bool32 getList = rand() % 2;
+                    id = ConnectToPeer(message->peerList.peers[i].ipaddr,
+                                       message->peerList.peers[i].port,
+                                       myPort, getList);
+                    if (id == -1)
                     {
-                        if (peer.id == id)
-                            continue;
-                        WriteToLog("Spreading to peer %d [%s].\n",
-                                   peer.id, GetPeerIP(peer.id));
-                        SendQueryJobResources(peer.fd,
-                                              message->queryJobResources.cookie,
-                                              message->queryJobResources.source);
+                        LogWarning(kLogPeers, "Failed to connect to peer %s %s\n",
+                                   message->peerList.peers[i].ipaddr,
+                                   message->peerList.peers[i].port);
                     }
                 }
-            } break;
+            }
+        } break;
 
-            case kOfferJobResources:
+        case kQueryJobResources:
+        {
+            LogDebug(kLogPeers, "Received queryJobResources message from peer %d [%s].\n",
+                     id, GetPeerIP(id));
+            // NOTE(Kevin): Decide if we want to take the job.
+            // The query is remembered for its emitter; free slots are
+            // then handed out fairly between all emitters that wait.
+            int accountIdx = GetEmitterAccount(message->queryJobResources.source.ipaddr,
+                                               message->queryJobResources.source.port);
+            if (accountIdx != -1)
+                RememberQuery(accountIdx, message->queryJobResources.cookie, GetTime());
+            bool32 offered = OfferFreeSlots(message->queryJobResources.cookie, myPort);
+            if (!offered && ShouldSpreadQuery(message->queryJobResources.cookie))
             {
-                WriteToLog("Received offerJobResources message from peer %d [%s].\n",
-                           id, GetPeerIP(id));
-                WriteToLog("Sending job to peer %d [%s].\n", id, GetPeerIP(id)); 
-                int err;
-                if ((err = SendJobToPeer(message->offerJobResources.cookie, fd)) != kSuccess)
+                // NOTE(Kevin): Spread the message
+                for (peer_iterator peer = GetFirstPeer();
+                     !IsBehindLastPeer(&peer);
+                     GetNextPeer(&peer))
                 {
-                    WriteToLog("Failed: %s\n", ErrorToString(err));
+                    if (peer.id == id)
+                        continue;
+                    LogDebug(kLogPeers, "Spreading to peer %d [%s].\n",
+                             peer.id, GetPeerIP(peer.id));
+                    SendQueryJobResources(peer.fd,
+                                          message->queryJobResources.cookie,
+                                          message->queryJobResources.source);
                 }
-            } break;
+            }
+        } break;
 
-            case kJob:
+        case kOfferJobResources:
+        {
+            LogDebug(kLogPeers, "Received offerJobResources message from peer %d [%s].\n",
+                     id, GetPeerIP(id));
+            LogDebug(kLogJobs, "Sending job to peer %d [%s].\n", id, GetPeerIP(id)); 
+            int err = SendJobToPeer(message->offerJobResources.cookie, fd);
+            if (err == kJobNotFound)
             {
-                WriteToLog("Received job message from peer %d [%s].\n",
-                           id, GetPeerIP(id));
+                // NOTE(Kevin): Another peer was faster, or the job is done;
+                // the offer must not keep the peer's slot
+                LogDebug(kLogJobs, "Declining offer for job %s.\n",
+                         CookieToTemporaryString(message->offerJobResources.cookie));
+                SendDeclineOffer(fd, message->offerJobResources.cookie);
+            }
+            else if (err != kSuccess)
+            {
+                LogWarning(kLogJobs, "Failed: %s\n", ErrorToString(err));
+            }
+        } break;
+
+        case kDeclineOffer:
+        {
+            LogDebug(kLogPeers, "Received declineOffer message from peer %d [%s] for job %s.\n",
+                     id, GetPeerIP(id), CookieToTemporaryString(message->declineOffer.cookie));
+            // NOTE(Kevin): The emitter has no unassigned job left. The
+            // slot goes to the other emitters.
+            int accountIdx = TakePendingOffer(message->declineOffer.cookie, -1, 0);
+            if (accountIdx != -1)
+            {
+                ForgetWaitingQueries(accountIdx);
+                OfferFreeSlots(0, myPort);
+            }
+        } break;
 
-                WriteToLog("Job has cookie %s\n", CookieToTemporaryString(message->job.cookie));
-                job theJob = {
-                    .source = message->job.source,
-                    .arg    = message->job.arg,
-                };
+        case kJob:
+        {
+            LogDebug(kLogPeers, "Received job message from peer %d [%s].\n",
+                     id, GetPeerIP(id));
 
-                int err;
-                if ((err = TakeJob(message->job.cookie, theJob, id)) != kSuccess)
-                {
-                    WriteToLog("Failed to take job: %s\n", ErrorToString(err));
-                }
-            } break;
+            LogDebug(kLogJobs, "Job has cookie %s\n", CookieToTemporaryString(message->job.cookie));
+            job theJob = {
+                .source = message->job.source,
+                .arg    = message->job.arg,
+                .kind   = message->job.kind,
+            };
 
-            case kJobResult:
+            payload_region payload;
+            int err = TakeMessagePayload(message, &payload);
+            if (err == kSuccess)
+                err = TakeJob(message->job.cookie, theJob, id, &payload);
+            if (err != kSuccess)
             {
-                WriteToLog("Received jobResult message from peer %d [%s].\n",
-                           id, GetPeerIP(id));
-                WriteToLog("Result is for job %s\n",
+                LogWarning(kLogJobs, "Failed to take job: %s\n", ErrorToString(err));
+                ForgetAggregatedChunk(message->job.cookie);
+            }
+            FreePayloadRegion(&payload);
+        } break;
+
+        case kJobResult:
+        {
+            LogDebug(kLogPeers, "Received jobResult message from peer %d [%s].\n",
+                     id, GetPeerIP(id));
+            LogDebug(kLogJobs, "Result is for job %s\n",
+                     CookieToTemporaryString(message->jobResult.cookie));
+            payload_region payload;
+            if (TakeMessagePayload(message, &payload) != kSuccess)
+                LogWarning(kLogJobs, "Result of job %s lost its payload\n",
                            CookieToTemporaryString(message->jobResult.cookie));
-                StoreJobResult(message->jobResult.cookie, message->jobResult.state, message->jobResult.result);
-            } break;
+            StoreJobResult(message->jobResult.cookie, message->jobResult.state,
+                           message->jobResult.result,
+                           message->jobResult.values, message->jobResult.valueCount, &payload,
+                           &message->jobResult.usage, fd);
+            FreePayloadRegion(&payload);
+        } break;
 
-            default:
-            {
-                WriteToLog("Received message from peer %d [%s] with unkown message type 0x%x\n",
-                           id, GetPeerIP(id), message->type);
-            } break;
+        case kCancelJob:
+        {
+            LogDebug(kLogPeers, "Received cancelJob message from peer %d [%s] for job %s.\n",
+                     id, GetPeerIP(id), CookieToTemporaryString(message->cancelJob.cookie));
+            CancelJob(message->cancelJob.cookie, fd);
+            DropIncomingPayload(fd, message->cancelJob.cookie);
+        } break;
+
+        case kAggregateJob:
+        {
+            LogDebug(kLogPeers, "Received aggregateJob message from peer %d [%s] for job %s.\n",
+                     id, GetPeerIP(id), CookieToTemporaryString(message->aggregateJob.cookie));
+            OnAggregateJob(fd, message);
+        } break;
+
+        case kAggregatedResult:
+        {
+            LogDebug(kLogPeers, "Received aggregatedResult message from peer %d [%s] with %u chunks.\n",
+                     id, GetPeerIP(id), message->aggregatedResult.chunkCount);
+            OnAggregatedResult(fd, message);
+        } break;
+
+        case kAwaitInputs:
+        {
+            LogDebug(kLogPeers, "Received awaitInputs message from peer %d [%s] for job %s.\n",
+                     id, GetPeerIP(id), CookieToTemporaryString(message->awaitInputs.cookie));
+            OnAwaitInputs(message);
+        } break;
+
+        case kJobInput:
+        {
+            LogDebug(kLogPeers, "Received jobInput message from peer %d [%s] for job %s.\n",
+                     id, GetPeerIP(id), CookieToTemporaryString(message->jobInput.cookie));
+            OnJobInput(message);
+        } break;
+
+        case kForwardResult:
+        {
+            LogDebug(kLogPeers, "Received forwardResult message from peer %d [%s] for job %s.\n",
+                     id, GetPeerIP(id), CookieToTemporaryString(message->forwardResult.cookie));
+            OnForwardResult(message);
+        } break;
+
+        case kPayloadChunk:
+        {
+            LogDebug(kLogPeers, "Received payloadChunk message from peer %d [%s] for job %s.\n",
+                     id, GetPeerIP(id), CookieToTemporaryString(message->payloadChunk.cookie));
+            OnPayloadChunk(fd, id, myPort, message);
+        } break;
+
+        case kPayloadAck:
+        {
+            LogDebug(kLogPeers, "Received payloadAck message from peer %d [%s] for job %s.\n",
+                     id, GetPeerIP(id), CookieToTemporaryString(message->payloadAck.cookie));
+            OnPayloadAck(fd, message);
+        } break;
+
+        case kHeartbeat:
+        {
+            // NOTE(Kevin): Nothing to do; receiving it marked the peer as alive
+        } break;
+
+        default:
+        {
+            LogWarning(kLogPeers, "Received message from peer %d [%s] with unkown message type 0x%x\n",
+                       id, GetPeerIP(id), message->type);
+        } break;
+    }
+}
+
+internal int
+HandleMessageFromPeer(int fd, int id, const char *myPort)
+{
+    message *message;
+    int err;
+    if ((err = ReceiveMessage(fd, &message)) == kSuccess)
+    {
+        OnMessageReceived(fd, message);
+        if (IsBulkMessage(message))
+            g_bulkBytesReceived += GetMessageWireSize(message);
+        if (g_captureFile && id < (int)g_peerCount)
+        {
+            const char *payload;
+            uint32 payloadSize = GetReceivedPayload(fd, &payload);
+            CaptureFrame(fd, &g_peerInfo[id], message->type, payload, payloadSize);
+        }
+        if (!HoldStreamedMessage(fd, message))
+        {
+            HandlePeerMessage(fd, id, myPort, message);
+            FreeMessage(message);
         }
-        FreeMessage(message);
     }
     else
     {
         if (err != kWouldBlock)
-            WriteToLog("Receive message failed: %s\n", ErrorToString(err));
+            LogWarning(kLogPeers, "Receive message failed: %s\n", ErrorToString(err));
+    }
+    return err;
+}
+
+// NOTE(Kevin): Runs the decoder for a ready peer until its socket is
+// drained, so control messages behind payload chunks do not wait one
+// Frame() per recv(). Once P2PJS_ReceiveBulkBudget bytes of bulk messages
+// came in, the rest waits for the next Frame() and the other peers get
+// their turn first.
+internal int
+HandleMessagesFromPeer(int fd, int id, const char *myPort)
+{
+    g_bulkBytesReceived = 0;
+    for (int step = 0; step < P2PJS_ReceiveStepLimit; ++step)
+    {
+        int err = HandleMessageFromPeer(fd, id, myPort);
+        if (err != kSuccess && err != kWouldBlock)
+            return err;
+        if (g_bulkBytesReceived >= P2PJS_ReceiveBulkBudget)
+            break;
+        struct pollfd pollFd = { fd, POLLIN, 0 };
+        if (poll(&pollFd, 1, 0) != 1 || (pollFd.revents & POLLIN) == 0)
+            break;
     }
+    return kSuccess;
 }
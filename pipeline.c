@@ -0,0 +1,556 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "p2pjs.h"
+
+// NOTE(Kevin): Job graphs. A dependent job gets the results of its
+// upstream jobs as argument: the result of its only upstream job, or a
+// list of the results of all of them. The emitter queries for it as soon
+// as all upstream jobs run somewhere, and sends it out ahead of their
+// results with an awaitInputs message. The worker keeps it without
+// running it until every input arrived. Peers running an upstream job get
+// a forwardResult message and send their result straight to the peer
+// running the dependent job; the emitter sends every input as well when
+// it gets the upstream result, so nothing depends on the direct path.
+// Whichever copy arrives first is used.
+
+#ifndef P2PJS_InputKeepTime
+  // NOTE(Kevin): Inputs for jobs that never arrive and forwards for jobs
+  // that already finished are forgotten after this
+  #define P2PJS_InputKeepTime 60.0
+#endif
+
+// NOTE(Kevin): Emitter side, indices into g_emittedJobs
+typedef struct
+{
+    int    upstream;
+    int    downstream;
+    uint32 slot;
+    bool32 asList;
+} job_edge;
+
+// NOTE(Kevin): Worker side, the inputs of one received job. Inputs can
+// arrive before the job itself.
+typedef struct
+{
+    uint8      cookie[CookieLen];
+    // NOTE(Kevin): 0 until the awaitInputs message arrived
+    uint32     inputCount;
+    bool32     asList;
+    uint32     setCount;
+    job_input *inputs;
+    uint32     inputCapacity;
+    double     createTime;
+} job_input_set;
+
+typedef struct
+{
+    uint8     cookie[CookieLen];
+    uint8     dependent[CookieLen];
+    uint32    slot;
+    peer_info target;
+    double    createTime;
+} result_forward;
+
+global_variable job_edge       *g_jobEdges;
+global_variable unsigned int    g_jobEdgeCount;
+global_variable unsigned int    g_jobEdgeCapacity;
+
+global_variable job_input_set  *g_jobInputSets;
+global_variable unsigned int    g_jobInputSetCount;
+global_variable unsigned int    g_jobInputSetCapacity;
+
+global_variable result_forward *g_resultForwards;
+global_variable unsigned int    g_resultForwardCount;
+global_variable unsigned int    g_resultForwardCapacity;
+
+//
+// Emitter side
+//
+
+internal bool32
+IsJobDispatched(const emitted_job *job)
+{
+    return job->state != kStateQuerySent && job->state != kStateWaiting;
+}
+
+// NOTE(Kevin): Queries for a waiting job once all its upstream jobs run
+internal void
+CheckDependentJob(int index)
+{
+    emitted_job *job = &g_emittedJobs[index];
+    if (job->state != kStateWaiting)
+        return;
+    for (unsigned int i = 0; i < g_jobEdgeCount; ++i)
+    {
+        if (g_jobEdges[i].downstream == index &&
+            !IsJobDispatched(&g_emittedJobs[g_jobEdges[i].upstream]))
+            return;
+    }
+    LogInfo(kLogJobs, "Upstream jobs of %s run, querying.\n", CookieToTemporaryString(job->cookie));
+    job->state = kStateQuerySent;
+    QueryResourcesForJob(job, -1);
+}
+
+// NOTE(Kevin): ip and port other peers can connect to, 0 if unknown
+internal bool32
+GetPeerInfoOfFd(int fd, peer_info *infoOut)
+{
+    for (peer_iterator peer = GetFirstPeer(); !IsBehindLastPeer(&peer); GetNextPeer(&peer))
+    {
+        if (peer.fd == fd)
+        {
+            if (GetPeerPort(peer.id)[0] == '\0')
+                return 0;
+            memset(infoOut, 0, sizeof(*infoOut));
+            snprintf(infoOut->ipaddr, PeerIPLen, "%s", GetPeerIP(peer.id));
+            snprintf(infoOut->port, PeerPortLen, "%s", GetPeerPort(peer.id));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+internal void
+SendForwardsForEdge(const job_edge *edge, int upstreamFd, int downstreamFd)
+{
+    // NOTE(Kevin): Empty target if both jobs run on the same peer
+    peer_info target;
+    memset(&target, 0, sizeof(target));
+    if (upstreamFd != downstreamFd && !GetPeerInfoOfFd(downstreamFd, &target))
+        return;
+    if (SendForwardResult(upstreamFd, g_emittedJobs[edge->upstream].cookie,
+                          g_emittedJobs[edge->downstream].cookie, edge->slot, &target) != kSuccess)
+    {
+        LogWarning(kLogJobs, "Failed to send forwardResult message for job %s.\n",
+                   CookieToTemporaryString(g_emittedJobs[edge->upstream].cookie));
+    }
+}
+
+internal void
+SendInputForEdge(const job_edge *edge, int downstreamFd)
+{
+    const emitted_job *upstream = &g_emittedJobs[edge->upstream];
+    if (SendJobInput(downstreamFd, g_emittedJobs[edge->downstream].cookie, edge->slot,
+                     upstream->result, upstream->values, upstream->valueCount) != kSuccess)
+    {
+        LogWarning(kLogJobs, "Failed to send jobInput message for job %s.\n",
+                   CookieToTemporaryString(g_emittedJobs[edge->downstream].cookie));
+    }
+}
+
+// NOTE(Kevin): upstream are indices of emitted jobs
+internal int
+EmitDependentJob(const char *sourcePath, const int *upstream, int upstreamCount, bool32 asList,
+                 uint8 cookieOut[CookieLen])
+{
+    if (upstreamCount < 1 || upstreamCount > P2PJS_MaxJobInputs || (!asList && upstreamCount != 1))
+        return kInvalidValue;
+    for (int i = 0; i < upstreamCount; ++i)
+    {
+        if (upstream[i] < 0 || upstream[i] >= (int)g_emittedJobCount)
+            return kInvalidValue;
+    }
+    if (g_jobEdgeCount + upstreamCount > g_jobEdgeCapacity)
+    {
+        unsigned int newCapacity = (g_jobEdgeCapacity == 0) ? 8 : 2 * g_jobEdgeCapacity;
+        while (newCapacity < g_jobEdgeCount + upstreamCount)
+            newCapacity *= 2;
+        job_edge *t = realloc(g_jobEdges, sizeof(job_edge) * newCapacity);
+        if (!t)
+            return kNoMemory;
+        g_jobEdges = t;
+        g_jobEdgeCapacity = newCapacity;
+    }
+    char *source;
+    unsigned int sourceLength;
+    int err = LoadJobSource(sourcePath, &source, &sourceLength);
+    if (err != kSuccess)
+        return err;
+    if (!ReserveEmittedJobs(1))
+    {
+        free(source);
+        return kNoMemory;
+    }
+    uint8 sourceHash[CookieLen];
+    calc_sha_256(sourceHash, source, sourceLength);
+    emitted_job *job = AddEmittedJob(source, sourceHash, 0.0, kJobFlagDependent, GetTime());
+    job->state = kStateWaiting;
+    int index = (int)(job - g_emittedJobs);
+    for (int i = 0; i < upstreamCount; ++i)
+    {
+        job_edge *edge = &g_jobEdges[g_jobEdgeCount++];
+        edge->upstream   = upstream[i];
+        edge->downstream = index;
+        edge->slot       = (uint32)i;
+        edge->asList     = asList;
+        g_emittedJobs[upstream[i]].flags |= kJobFlagUpstream;
+    }
+    LogInfo(kLogJobs, "Created job %s depending on %d jobs\n",
+            CookieToTemporaryString(job->cookie), upstreamCount);
+    printf("Created new job %.6s\n", CookieToTemporaryString(job->cookie));
+    memcpy(cookieOut, job->cookie, CookieLen);
+
+    // NOTE(Kevin): An upstream job that failed fails this one as well
+    for (int i = 0; i < upstreamCount; ++i)
+    {
+        emitted_job *up = &g_emittedJobs[upstream[i]];
+        if (up->state == kStateFinished && up->resultState != kSuccess)
+        {
+            FinishEmittedJob(job, 0.0, 0, 0, 0, up->resultState, -1);
+            return kSuccess;
+        }
+    }
+    CheckDependentJob(index);
+    return kSuccess;
+}
+
+// NOTE(Kevin): Called right before the dependent job goes to peerFd
+internal void
+PrepareDependentJob(int index, int peerFd)
+{
+    uint32 inputCount = 0;
+    bool32 asList = 0;
+    for (unsigned int i = 0; i < g_jobEdgeCount; ++i)
+    {
+        if (g_jobEdges[i].downstream == index)
+        {
+            ++inputCount;
+            asList = g_jobEdges[i].asList;
+        }
+    }
+    if (SendAwaitInputs(peerFd, g_emittedJobs[index].cookie, inputCount, asList) != kSuccess)
+    {
+        LogWarning(kLogJobs, "Failed to send awaitInputs message for job %s.\n",
+                   CookieToTemporaryString(g_emittedJobs[index].cookie));
+    }
+}
+
+// NOTE(Kevin): A job of a graph went to peerFd. A dependent job gets the
+// inputs we have, the peers running its other upstream jobs learn where
+// to send theirs. An upstream job's peer learns where its dependent jobs
+// run, and waiting dependent jobs might be ready now.
+internal void
+OnGraphJobDispatched(int index, int peerFd)
+{
+    for (unsigned int i = 0; i < g_jobEdgeCount; ++i)
+    {
+        const job_edge *edge = &g_jobEdges[i];
+        if (edge->downstream == index)
+        {
+            const emitted_job *up = &g_emittedJobs[edge->upstream];
+            if (up->state == kStateFinished)
+            {
+                SendInputForEdge(edge, peerFd);
+            }
+            else
+            {
+                for (int a = 0; a < up->assigneeCount; ++a)
+                    SendForwardsForEdge(edge, up->assignees[a].fd, peerFd);
+            }
+        }
+        else if (edge->upstream == index)
+        {
+            const emitted_job *down = &g_emittedJobs[edge->downstream];
+            if (down->state == kStateWaiting)
+            {
+                CheckDependentJob(edge->downstream);
+            }
+            else if (down->state != kStateFinished)
+            {
+                for (int a = 0; a < down->assigneeCount; ++a)
+                    SendForwardsForEdge(edge, peerFd, down->assignees[a].fd);
+            }
+        }
+    }
+}
+
+internal void
+OnUpstreamJobFinished(int index)
+{
+    const emitted_job *up = &g_emittedJobs[index];
+    for (unsigned int i = 0; i < g_jobEdgeCount; ++i)
+    {
+        const job_edge *edge = &g_jobEdges[i];
+        if (edge->upstream != index)
+            continue;
+        emitted_job *down = &g_emittedJobs[edge->downstream];
+        if (down->state == kStateFinished)
+            continue;
+        if (up->resultState != kSuccess)
+        {
+            LogInfo(kLogJobs, "Upstream job of %s failed.\n", CookieToTemporaryString(down->cookie));
+            for (int a = 0; a < down->assigneeCount; ++a)
+                SendCancelJob(down->assignees[a].fd, down->cookie);
+            FinishEmittedJob(down, 0.0, 0, 0, 0, up->resultState, -1);
+            continue;
+        }
+        for (int a = 0; a < down->assigneeCount; ++a)
+            SendInputForEdge(edge, down->assignees[a].fd);
+        CheckDependentJob(edge->downstream);
+    }
+}
+
+//
+// Worker side
+//
+
+internal job_input_set *
+FindJobInputSet(uint8 cookie[CookieLen])
+{
+    for (unsigned int i = 0; i < g_jobInputSetCount; ++i)
+    {
+        if (memcmp(g_jobInputSets[i].cookie, cookie, CookieLen) == 0)
+            return &g_jobInputSets[i];
+    }
+    return 0;
+}
+
+internal job_input_set *
+GetJobInputSet(uint8 cookie[CookieLen])
+{
+    job_input_set *set = FindJobInputSet(cookie);
+    if (set)
+        return set;
+    if (g_jobInputSetCount == g_jobInputSetCapacity)
+    {
+        unsigned int newCapacity = (g_jobInputSetCapacity == 0) ? 8 : 2 * g_jobInputSetCapacity;
+        job_input_set *t = realloc(g_jobInputSets, sizeof(job_input_set) * newCapacity);
+        if (!t)
+            return 0;
+        g_jobInputSets = t;
+        g_jobInputSetCapacity = newCapacity;
+    }
+    set = &g_jobInputSets[g_jobInputSetCount++];
+    memset(set, 0, sizeof(*set));
+    memcpy(set->cookie, cookie, CookieLen);
+    set->createTime = GetTime();
+    return set;
+}
+
+internal bool32
+ReserveJobInputs(job_input_set *set, uint32 count)
+{
+    if (count <= set->inputCapacity)
+        return 1;
+    job_input *t = realloc(set->inputs, sizeof(job_input) * count);
+    if (!t)
+        return 0;
+    memset(t + set->inputCapacity, 0, sizeof(job_input) * (count - set->inputCapacity));
+    set->inputs = t;
+    set->inputCapacity = count;
+    return 1;
+}
+
+internal void
+RemoveJobInputSet(unsigned int idx)
+{
+    job_input_set *set = &g_jobInputSets[idx];
+    for (uint32 i = 0; i < set->inputCapacity; ++i)
+        free(set->inputs[i].values);
+    free(set->inputs);
+    g_jobInputSets[idx] = g_jobInputSets[g_jobInputSetCount - 1];
+    --g_jobInputSetCount;
+}
+
+internal bool32
+IsJobInputSetComplete(const job_input_set *set)
+{
+    return set->inputCount > 0 && set->setCount == set->inputCount;
+}
+
+internal void
+OnAwaitInputs(const message *msg)
+{
+    if (msg->awaitInputs.inputCount == 0 || msg->awaitInputs.inputCount > P2PJS_MaxJobInputs)
+    {
+        LogWarning(kLogJobs, "Job %s waits for %u inputs, ignoring.\n",
+                   CookieToTemporaryString((uint8*)msg->awaitInputs.cookie), msg->awaitInputs.inputCount);
+        return;
+    }
+    job_input_set *set = GetJobInputSet((uint8*)msg->awaitInputs.cookie);
+    if (!set || !ReserveJobInputs(set, msg->awaitInputs.inputCount))
+        return;
+    set->inputCount = msg->awaitInputs.inputCount;
+    set->asList     = msg->awaitInputs.asList != 0;
+}
+
+internal void
+OnJobInput(const message *msg)
+{
+    uint8 *cookie = (uint8*)msg->jobInput.cookie;
+    uint32 slot = msg->jobInput.slot;
+    if (slot >= P2PJS_MaxJobInputs)
+        return;
+    job_input_set *set = GetJobInputSet(cookie);
+    if (!set || !ReserveJobInputs(set, slot + 1))
+        return;
+    if ((set->inputCount > 0 && slot >= set->inputCount) || set->inputs[slot].isSet)
+        return;
+    job_input *input = &set->inputs[slot];
+    if (msg->jobInput.valueCount > 0)
+    {
+        input->values = malloc(sizeof(double) * msg->jobInput.valueCount);
+        if (!input->values)
+            return;
+        memcpy(input->values, msg->jobInput.values, sizeof(double) * msg->jobInput.valueCount);
+    }
+    input->isSet      = 1;
+    input->result     = msg->jobInput.result;
+    input->valueCount = msg->jobInput.valueCount;
+    ++set->setCount;
+    if (IsJobInputSetComplete(set))
+    {
+        LogDebug(kLogJobs, "All inputs of job %s arrived.\n", CookieToTemporaryString(cookie));
+        UnblockReceivedJob(cookie);
+    }
+}
+
+internal void
+OnForwardResult(const message *msg)
+{
+    if (g_resultForwardCount == g_resultForwardCapacity)
+    {
+        unsigned int newCapacity = (g_resultForwardCapacity == 0) ? 8 : 2 * g_resultForwardCapacity;
+        result_forward *t = realloc(g_resultForwards, sizeof(result_forward) * newCapacity);
+        if (!t)
+            return;
+        g_resultForwards = t;
+        g_resultForwardCapacity = newCapacity;
+    }
+    result_forward *forward = &g_resultForwards[g_resultForwardCount++];
+    memcpy(forward->cookie, msg->forwardResult.cookie, CookieLen);
+    memcpy(forward->dependent, msg->forwardResult.dependent, CookieLen);
+    forward->slot       = msg->forwardResult.slot;
+    forward->target     = msg->forwardResult.target;
+    forward->target.ipaddr[PeerIPLen - 1] = '\0';
+    forward->target.port[PeerPortLen - 1] = '\0';
+    forward->createTime = GetTime();
+}
+
+// NOTE(Kevin): Whether the job has to wait for inputs
+internal bool32
+AreJobInputsMissing(uint8 cookie[CookieLen])
+{
+    job_input_set *set = FindJobInputSet(cookie);
+    return set && set->inputCount > 0 && !IsJobInputSetComplete(set);
+}
+
+// NOTE(Kevin): Whether the job is part of a graph
+internal bool32
+HasJobInputs(uint8 cookie[CookieLen])
+{
+    return FindJobInputSet(cookie) != 0;
+}
+
+// NOTE(Kevin): Used by RunCodeInVM(), 0 for jobs that are not part of a graph
+internal const job_input *
+GetJobInputs(uint8 cookie[CookieLen], uint32 *countOut, bool32 *asListOut)
+{
+    job_input_set *set = FindJobInputSet(cookie);
+    if (!set || !IsJobInputSetComplete(set))
+        return 0;
+    *countOut  = set->inputCount;
+    *asListOut = set->asList;
+    return set->inputs;
+}
+
+internal void
+ReleaseJobInputs(uint8 cookie[CookieLen])
+{
+    for (unsigned int i = 0; i < g_jobInputSetCount; ++i)
+    {
+        if (memcmp(g_jobInputSets[i].cookie, cookie, CookieLen) == 0)
+        {
+            RemoveJobInputSet(i);
+            return;
+        }
+    }
+}
+
+// NOTE(Kevin): Sends the result of a job we ran to the peers running jobs
+// that depend on it. Failures only go to the emitter.
+internal void
+ForwardJobResult(uint8 cookie[CookieLen], int state, double result,
+                 const double *values, uint32 valueCount)
+{
+    for (unsigned int i = 0; i < g_resultForwardCount;)
+    {
+        result_forward *forward = &g_resultForwards[i];
+        if (memcmp(forward->cookie, cookie, CookieLen) != 0)
+        {
+            ++i;
+            continue;
+        }
+        if (state == kSuccess)
+        {
+            int fd = -1;
+            if (forward->target.ipaddr[0] == '\0' || IsOwnPeerInfo(&forward->target))
+            {
+                // NOTE(Kevin): The dependent job runs here as well
+                message *msg = malloc(sizeof(message) + sizeof(double) * valueCount);
+                if (msg)
+                {
+                    msg->type = kJobInput;
+                    memcpy(msg->jobInput.cookie, forward->dependent, CookieLen);
+                    msg->jobInput.slot       = forward->slot;
+                    msg->jobInput.valueCount = valueCount;
+                    msg->jobInput.result     = result;
+                    msg->jobInput.values     = (double*)(msg + 1);
+                    memcpy(msg->jobInput.values, values, sizeof(double) * valueCount);
+                    OnJobInput(msg);
+                    free(msg);
+                }
+            }
+            else if ((fd = GetAggregationPeerFd(&forward->target)) == -1 ||
+                     SendJobInput(fd, forward->dependent, forward->slot,
+                                  result, values, valueCount) != kSuccess)
+            {
+                LogInfo(kLogJobs, "Could not forward result of %s to %s %s.\n",
+                        CookieToTemporaryString(cookie), forward->target.ipaddr, forward->target.port);
+            }
+        }
+        g_resultForwards[i] = g_resultForwards[g_resultForwardCount - 1];
+        --g_resultForwardCount;
+    }
+}
+
+internal bool32
+HasReceivedJob(uint8 cookie[CookieLen])
+{
+    for (unsigned int i = 0; i < g_receivedJobCount; ++i)
+    {
+        if (memcmp(g_receivedJobs[i].cookie, cookie, CookieLen) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// NOTE(Kevin): Forgets inputs and forwards nobody claimed
+internal void
+ExpireJobInputs(void)
+{
+    double now = GetTime();
+    for (unsigned int i = 0; i < g_jobInputSetCount;)
+    {
+        // NOTE(Kevin): Sets of jobs we hold are released with the job
+        if (now - g_jobInputSets[i].createTime > P2PJS_InputKeepTime &&
+            !HasReceivedJob(g_jobInputSets[i].cookie))
+        {
+            RemoveJobInputSet(i);
+            continue;
+        }
+        ++i;
+    }
+    for (unsigned int i = 0; i < g_resultForwardCount;)
+    {
+        if (now - g_resultForwards[i].createTime > P2PJS_InputKeepTime)
+        {
+            g_resultForwards[i] = g_resultForwards[g_resultForwardCount - 1];
+            --g_resultForwardCount;
+            continue;
+        }
+        ++i;
+    }
+}
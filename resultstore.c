@@ -0,0 +1,491 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "p2pjs.h"
+
+// NOTE(Kevin): Result store. With -o the emitter appends every result a
+// worker sends it to a log file, so finished work survives a restart. The
+// file is mapped once, read-only, and never read() back: the two indexes,
+// by cookie and by the key of ComputeMemoKey(), hold file offsets, and
+// lookups hand out pointers into the mapping. On open the records are
+// checked once to rebuild the indexes; a torn record at the end (the node
+// died while writing it) is cut off.
+// New records are collected in a write buffer. Frame() writes the buffer
+// every P2PJS_ResultStoreFlushInterval seconds, so a result costs a memcpy
+// on the hot path. How often the file is synced is up to the sync mode.
+// The emitter only appends to the store, unless it is started with -R:
+// then jobs are looked up in it before they are sent, like in the result
+// cache, and a job that was run before is not run again. Sources that fail
+// IsSourcePure() are never looked up.
+
+#ifndef P2PJS_ResultStoreMapSize
+  // NOTE(Kevin): Address space reserved for the mapping, the largest file
+  // the store can grow to
+  #define P2PJS_ResultStoreMapSize ((size_t)16 << 30)
+#endif
+
+#ifndef P2PJS_ResultStoreBufferSize
+  // NOTE(Kevin): Written right away once this many bytes wait
+  #define P2PJS_ResultStoreBufferSize (256 * 1024)
+#endif
+
+#ifndef P2PJS_ResultStoreFlushInterval
+  #define P2PJS_ResultStoreFlushInterval 0.5
+#endif
+
+// Sync modes
+enum
+{
+    // NOTE(Kevin): The OS writes the file back. A crashed node loses the
+    // results of the last flush interval, a crashed machine some more.
+    kResultStoreSyncNone,
+    // NOTE(Kevin): fdatasync() after every flush
+    kResultStoreSyncFlush,
+    // NOTE(Kevin): Every result is written and synced before the next one
+    kResultStoreSyncResult,
+};
+
+#define ResultRecordAlignment 8
+
+global_variable int     g_resultStoreFd;
+global_variable uint8  *g_resultStoreMap;
+global_variable int     g_resultStoreSync;
+// NOTE(Kevin): Bytes in the file; the records behind them wait in the
+// write buffer
+global_variable uint64  g_resultStoreSize;
+global_variable uint8  *g_resultStoreBuffer;
+global_variable uint32  g_resultStoreBufferUsed;
+global_variable uint32  g_resultStoreBufferCapacity;
+global_variable double  g_resultStoreLastFlush;
+global_variable bool32  g_resultStoreIsFull;
+// NOTE(Kevin): Open addressing, record offsets, 0 is a free slot (the
+// header is at offset 0). Both have g_resultIndexCapacity slots.
+global_variable uint64 *g_resultsByCookie;
+global_variable uint64 *g_resultsByKey;
+global_variable uint32  g_resultIndexCapacity;
+global_variable uint32  g_resultRecordCount;
+// NOTE(Kevin): Set with -R
+global_variable bool32  g_resolveFromResultStore;
+
+internal bool32
+IsResultStoreOpen(void)
+{
+    return g_resultStoreMap != 0;
+}
+
+internal int
+ParseResultStoreSync(const char *mode, int *syncOut)
+{
+    if (strcmp(mode, "none") == 0)
+        *syncOut = kResultStoreSyncNone;
+    else if (strcmp(mode, "flush") == 0)
+        *syncOut = kResultStoreSyncFlush;
+    else if (strcmp(mode, "result") == 0)
+        *syncOut = kResultStoreSyncResult;
+    else
+        return kInvalidValue;
+    return kSuccess;
+}
+
+internal uint32
+GetResultRecordChecksum(const result_record *record)
+{
+    const uint8 *bytes = (const uint8*)record;
+    uint32 hash = 2166136261u;
+    for (uint32 i = offsetof(result_record, checksum) + sizeof(record->checksum); i < record->size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+internal uint32
+GetResultRecordSize(uint32 valueCount, uint32 payloadSize)
+{
+    uint64 size = sizeof(result_record) + sizeof(double) * (uint64)valueCount + payloadSize;
+    size = (size + ResultRecordAlignment - 1) & ~(uint64)(ResultRecordAlignment - 1);
+    return (size > 0xffffffffu) ? 0 : (uint32)size;
+}
+
+// NOTE(Kevin): Valid until the next FlushResultStore() if the record is
+// still in the write buffer
+internal const result_record *
+GetResultRecordAt(uint64 offset)
+{
+    if (offset < g_resultStoreSize)
+        return (const result_record*)(g_resultStoreMap + offset);
+    return (const result_record*)(g_resultStoreBuffer + (offset - g_resultStoreSize));
+}
+
+internal const double *
+GetStoredValues(const result_record *record)
+{
+    return (record->valueCount > 0) ? (const double*)(record + 1) : 0;
+}
+
+internal const uint8 *
+GetStoredPayload(const result_record *record)
+{
+    return (record->payloadSize > 0) ?
+        (const uint8*)(record + 1) + sizeof(double) * record->valueCount : 0;
+}
+
+// NOTE(Kevin): Cookies are random and keys are hashes, their first bytes
+// are as good as any hash of them
+internal uint32
+GetResultIndexSlot(const uint8 id[CookieLen])
+{
+    uint64 h;
+    memcpy(&h, id, sizeof(h));
+    return (uint32)(h ^ (h >> 32)) & (g_resultIndexCapacity - 1);
+}
+
+// NOTE(Kevin): idOffset is the offset of cookie or key in result_record.
+// A later record replaces an earlier one with the same id.
+internal void
+IndexResultRecord(uint64 *index, size_t idOffset, uint64 offset)
+{
+    const uint8 *id = (const uint8*)GetResultRecordAt(offset) + idOffset;
+    uint32 slot = GetResultIndexSlot(id);
+    while (index[slot] != 0 &&
+           memcmp((const uint8*)GetResultRecordAt(index[slot]) + idOffset, id, CookieLen) != 0)
+        slot = (slot + 1) & (g_resultIndexCapacity - 1);
+    index[slot] = offset;
+}
+
+internal uint64
+FindResultRecord(const uint64 *index, size_t idOffset, const uint8 id[CookieLen])
+{
+    if (g_resultIndexCapacity == 0)
+        return 0;
+    for (uint32 slot = GetResultIndexSlot(id); index[slot] != 0;
+         slot = (slot + 1) & (g_resultIndexCapacity - 1))
+    {
+        if (memcmp((const uint8*)GetResultRecordAt(index[slot]) + idOffset, id, CookieLen) == 0)
+            return index[slot];
+    }
+    return 0;
+}
+
+// NOTE(Kevin): Keeps both indexes at most half full
+internal bool32
+ReserveResultIndex(uint32 count)
+{
+    if (2 * (uint64)count <= g_resultIndexCapacity)
+        return 1;
+    uint32 newCapacity = (g_resultIndexCapacity == 0) ? 1024 : 2 * g_resultIndexCapacity;
+    while (2 * (uint64)count > newCapacity)
+        newCapacity *= 2;
+    uint64 *byCookie = calloc(newCapacity, sizeof(uint64));
+    uint64 *byKey    = calloc(newCapacity, sizeof(uint64));
+    if (!byCookie || !byKey)
+    {
+        free(byCookie);
+        free(byKey);
+        return 0;
+    }
+    uint64 *oldByCookie = g_resultsByCookie;
+    uint64 *oldByKey    = g_resultsByKey;
+    uint32 oldCapacity  = g_resultIndexCapacity;
+    g_resultsByCookie     = byCookie;
+    g_resultsByKey        = byKey;
+    g_resultIndexCapacity = newCapacity;
+    for (uint32 i = 0; i < oldCapacity; ++i)
+    {
+        if (oldByCookie[i] != 0)
+            IndexResultRecord(g_resultsByCookie, offsetof(result_record, cookie), oldByCookie[i]);
+        if (oldByKey[i] != 0)
+            IndexResultRecord(g_resultsByKey, offsetof(result_record, key), oldByKey[i]);
+    }
+    free(oldByCookie);
+    free(oldByKey);
+    return 1;
+}
+
+internal void
+AddResultRecordToIndexes(uint64 offset)
+{
+    const result_record *record = GetResultRecordAt(offset);
+    IndexResultRecord(g_resultsByCookie, offsetof(result_record, cookie), offset);
+    if (record->flags & kResultRecordHasKey)
+        IndexResultRecord(g_resultsByKey, offsetof(result_record, key), offset);
+    ++g_resultRecordCount;
+}
+
+internal void CloseResultStore(void);
+
+// NOTE(Kevin): Checks the records of an existing file and indexes them.
+// Returns the size of the part that holds whole records.
+internal uint64
+ScanResultStore(uint64 fileSize)
+{
+    uint64 offset = sizeof(result_store_header);
+    while (fileSize - offset >= sizeof(result_record))
+    {
+        const result_record *record = (const result_record*)(g_resultStoreMap + offset);
+        if (record->size < sizeof(result_record) || record->size % ResultRecordAlignment != 0 ||
+            record->size > fileSize - offset ||
+            GetResultRecordSize(record->valueCount, record->payloadSize) != record->size ||
+            GetResultRecordChecksum(record) != record->checksum)
+            break;
+        if (!ReserveResultIndex(g_resultRecordCount + 1))
+            break;
+        AddResultRecordToIndexes(offset);
+        offset += record->size;
+    }
+    return offset;
+}
+
+internal int
+OpenResultStore(const char *path, int sync)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd == -1)
+        return kCouldNotOpenFile;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return kSyscallFailed;
+    }
+    uint64 fileSize = (uint64)st.st_size;
+    if (fileSize == 0)
+    {
+        result_store_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, ResultStoreMagic, sizeof(header.magic));
+        header.version    = ResultStoreVersion;
+        header.recordSize = sizeof(result_record);
+        if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+        {
+            close(fd);
+            return kSyscallFailed;
+        }
+        fileSize = sizeof(header);
+    }
+    else
+    {
+        result_store_header header;
+        if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+            memcmp(header.magic, ResultStoreMagic, sizeof(header.magic)) != 0 ||
+            header.version != ResultStoreVersion || header.recordSize != sizeof(result_record))
+        {
+            close(fd);
+            return kInvalidValue;
+        }
+    }
+    if (fileSize > P2PJS_ResultStoreMapSize)
+    {
+        close(fd);
+        return kNoMemory;
+    }
+    void *map = mmap(0, P2PJS_ResultStoreMapSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        return kSyscallFailed;
+    }
+    g_resultStoreFd   = fd;
+    g_resultStoreMap  = map;
+    g_resultStoreSync = sync;
+    g_resultStoreSize = fileSize;
+    g_resultStoreLastFlush = GetTime();
+    g_resultStoreIsFull    = 0;
+
+    uint64 validSize = ScanResultStore(fileSize);
+    if (validSize < fileSize)
+    {
+        LogWarning(kLogJobs, "Result store %s ends in %llu bytes that are not a whole record, cutting them off\n",
+                   path, (unsigned long long)(fileSize - validSize));
+        if (ftruncate(fd, (off_t)validSize) == -1)
+        {
+            CloseResultStore();
+            return kSyscallFailed;
+        }
+        g_resultStoreSize = validSize;
+    }
+    LogInfo(kLogJobs, "Result store %s holds %u results\n", path, g_resultRecordCount);
+    MetricSet(&g_metricResultStoreRecords, g_resultRecordCount);
+    MetricSet(&g_metricResultStoreBytes, (int64)g_resultStoreSize);
+    return kSuccess;
+}
+
+// NOTE(Kevin): Called every frame. Writes the buffered records once
+// P2PJS_ResultStoreFlushInterval passed, or right away if force is set.
+internal void
+FlushResultStore(bool32 force)
+{
+    if (!g_resultStoreMap || g_resultStoreBufferUsed == 0)
+        return;
+    double now = GetTime();
+    if (!force && now - g_resultStoreLastFlush < P2PJS_ResultStoreFlushInterval)
+        return;
+    g_resultStoreLastFlush = now;
+    uint32 written = 0;
+    while (written < g_resultStoreBufferUsed)
+    {
+        ssize_t did = write(g_resultStoreFd, g_resultStoreBuffer + written, g_resultStoreBufferUsed - written);
+        if (did == -1 && errno == EINTR)
+            continue;
+        if (did <= 0)
+        {
+            // NOTE(Kevin): No half records in the file, the buffer is
+            // written again next time
+            LogError(kLogJobs, "Failed to write to the result store: %s\n", strerror(errno));
+            if (ftruncate(g_resultStoreFd, (off_t)g_resultStoreSize) == -1)
+                LogError(kLogJobs, "Result store ends in a torn record until the next start\n");
+            return;
+        }
+        written += (uint32)did;
+    }
+    if (g_resultStoreSync != kResultStoreSyncNone && fdatasync(g_resultStoreFd) == -1)
+        LogWarning(kLogJobs, "Failed to sync the result store: %s\n", strerror(errno));
+    g_resultStoreSize += g_resultStoreBufferUsed;
+    g_resultStoreBufferUsed = 0;
+    // NOTE(Kevin): A large payload made the buffer grow, don't keep it
+    if (g_resultStoreBufferCapacity > P2PJS_ResultStoreBufferSize)
+    {
+        free(g_resultStoreBuffer);
+        g_resultStoreBuffer = 0;
+        g_resultStoreBufferCapacity = 0;
+    }
+    MetricSet(&g_metricResultStoreBytes, (int64)g_resultStoreSize);
+    MetricObserve(&g_metricResultStoreFlush, GetTime() - now);
+}
+
+// NOTE(Kevin): key is 0 for jobs that can only be found by their cookie
+internal int
+AppendResult(const uint8 cookie[CookieLen], const uint8 *key, double arg, int state, double result,
+             const double *values, uint32 valueCount, const uint8 *payload, uint32 payloadSize)
+{
+    if (!g_resultStoreMap)
+        return kInvalidValue;
+    uint32 size = GetResultRecordSize(valueCount, payloadSize);
+    if (size == 0)
+        return kInvalidValue;
+    if (g_resultStoreSize + g_resultStoreBufferUsed + size > P2PJS_ResultStoreMapSize)
+    {
+        if (!g_resultStoreIsFull)
+            LogWarning(kLogJobs, "Result store is full, new results are not kept\n");
+        g_resultStoreIsFull = 1;
+        return kNoMemory;
+    }
+    if (g_resultStoreBufferUsed + size > g_resultStoreBufferCapacity)
+    {
+        uint32 newCapacity = (g_resultStoreBufferCapacity == 0) ?
+            P2PJS_ResultStoreBufferSize : 2 * g_resultStoreBufferCapacity;
+        while (newCapacity < g_resultStoreBufferUsed + size)
+            newCapacity *= 2;
+        uint8 *t = realloc(g_resultStoreBuffer, newCapacity);
+        if (!t)
+            return kNoMemory;
+        g_resultStoreBuffer = t;
+        g_resultStoreBufferCapacity = newCapacity;
+    }
+    if (!ReserveResultIndex(g_resultRecordCount + 1))
+        return kNoMemory;
+
+    result_record *record = (result_record*)(g_resultStoreBuffer + g_resultStoreBufferUsed);
+    memset(record, 0, size);
+    record->size = size;
+    memcpy(record->cookie, cookie, CookieLen);
+    if (key)
+    {
+        memcpy(record->key, key, CookieLen);
+        record->flags |= kResultRecordHasKey;
+    }
+    struct timespec wallClock;
+    clock_gettime(CLOCK_REALTIME, &wallClock);
+    record->arg         = arg;
+    record->result      = result;
+    record->storeTime   = (double)wallClock.tv_sec + (double)wallClock.tv_nsec * 1e-9;
+    record->state       = state;
+    record->valueCount  = valueCount;
+    record->payloadSize = payloadSize;
+    if (valueCount > 0)
+        memcpy(record + 1, values, sizeof(double) * valueCount);
+    if (payloadSize > 0)
+        memcpy((uint8*)(record + 1) + sizeof(double) * valueCount, payload, payloadSize);
+    record->checksum = GetResultRecordChecksum(record);
+
+    uint64 offset = g_resultStoreSize + g_resultStoreBufferUsed;
+    g_resultStoreBufferUsed += size;
+    AddResultRecordToIndexes(offset);
+    MetricSet(&g_metricResultStoreRecords, g_resultRecordCount);
+    if (g_resultStoreSync == kResultStoreSyncResult ||
+        g_resultStoreBufferUsed >= P2PJS_ResultStoreBufferSize)
+        FlushResultStore(1);
+    return kSuccess;
+}
+
+// NOTE(Kevin): Lookups point into the mapping and stay valid until the
+// store is closed. A record that is still buffered is written first.
+internal const result_record *
+GetMappedResultRecord(uint64 offset)
+{
+    if (offset == 0)
+        return 0;
+    if (offset >= g_resultStoreSize)
+        FlushResultStore(1);
+    if (offset >= g_resultStoreSize)
+        return 0;
+    return (const result_record*)(g_resultStoreMap + offset);
+}
+
+// NOTE(Kevin): The ByteBuffer the job with this cookie returned, 0 if it
+// returned something else
+internal const uint8 *
+GetStoredPayloadOfJob(const uint8 cookie[CookieLen], uint32 *sizeOut)
+{
+    *sizeOut = 0;
+    uint64 offset = FindResultRecord(g_resultsByCookie, offsetof(result_record, cookie), cookie);
+    if (offset == 0 || GetResultRecordAt(offset)->payloadSize == 0)
+        return 0;
+    const result_record *record = GetMappedResultRecord(offset);
+    if (!record)
+        return 0;
+    *sizeOut = record->payloadSize;
+    return GetStoredPayload(record);
+}
+
+// NOTE(Kevin): The latest result of a job with this key
+internal const result_record *
+LookupResultByKey(const uint8 key[CookieLen])
+{
+    return GetMappedResultRecord(FindResultRecord(g_resultsByKey, offsetof(result_record, key), key));
+}
+
+internal uint32
+GetStoredResultCount(void)
+{
+    return g_resultRecordCount;
+}
+
+internal void
+CloseResultStore(void)
+{
+    if (!g_resultStoreMap)
+        return;
+    FlushResultStore(1);
+    munmap(g_resultStoreMap, P2PJS_ResultStoreMapSize);
+    close(g_resultStoreFd);
+    g_resultStoreMap = 0;
+    free(g_resultStoreBuffer);
+    g_resultStoreBuffer = 0;
+    g_resultStoreBufferUsed = 0;
+    g_resultStoreBufferCapacity = 0;
+    free(g_resultsByCookie);
+    free(g_resultsByKey);
+    g_resultsByCookie = 0;
+    g_resultsByKey    = 0;
+    g_resultIndexCapacity = 0;
+    g_resultRecordCount   = 0;
+}
@@ -1,6 +1,14 @@
 #include <stdint.h>
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA_256_X86 1
+#else
+#define SHA_256_X86 0
+#endif
+
 #include "sha-256.h"
 
 #define CHUNK_SIZE 64
@@ -30,13 +38,11 @@ static const uint32_t k[] = {
 	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
 };
 
-struct buffer_state {
-	const uint8_t * p;
-	size_t len;
-	size_t total_len;
-	int single_one_delivered; /* bool */
-	int total_len_delivered; /* bool */
-};
+/*
+ * Initialize hash values:
+ * (first 32 bits of the fractional parts of the square roots of the first 8 primes 2..19):
+ */
+static const uint32_t h_init[] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
 
 static inline uint32_t right_rot(uint32_t value, unsigned int count)
 {
@@ -47,81 +53,13 @@ static inline uint32_t right_rot(uint32_t value, unsigned int count)
 	return value >> count | value << (32 - count);
 }
 
-static void init_buf_state(struct buffer_state * state, const void * input, size_t len)
-{
-	state->p = input;
-	state->len = len;
-	state->total_len = len;
-	state->single_one_delivered = 0;
-	state->total_len_delivered = 0;
-}
-
-/* Return value: bool */
-static int calc_chunk(uint8_t chunk[CHUNK_SIZE], struct buffer_state * state)
-{
-	size_t space_in_chunk;
-
-	if (state->total_len_delivered) {
-		return 0;
-	}
-
-	if (state->len >= CHUNK_SIZE) {
-		memcpy(chunk, state->p, CHUNK_SIZE);
-		state->p += CHUNK_SIZE;
-		state->len -= CHUNK_SIZE;
-		return 1;
-	}
-
-	memcpy(chunk, state->p, state->len);
-	chunk += state->len;
-	space_in_chunk = CHUNK_SIZE - state->len;
-	state->p += state->len;
-	state->len = 0;
-
-	/* If we are here, space_in_chunk is one at minimum. */
-	if (!state->single_one_delivered) {
-		*chunk++ = 0x80;
-		space_in_chunk -= 1;
-		state->single_one_delivered = 1;
-	}
-
-	/*
-	 * Now:
-	 * - either there is enough space left for the total length, and we can conclude,
-	 * - or there is too little space left, and we have to pad the rest of this chunk with zeroes.
-	 * In the latter case, we will conclude at the next invokation of this function.
-	 */
-	if (space_in_chunk >= TOTAL_LEN_LEN) {
-		const size_t left = space_in_chunk - TOTAL_LEN_LEN;
-		size_t len = state->total_len;
-		int i;
-		memset(chunk, 0x00, left);
-		chunk += left;
-
-		/* Storing of len * 8 as a big endian 64-bit without overflow. */
-		chunk[7] = (uint8_t) (len << 3);
-		len >>= 5;
-		for (i = 6; i >= 0; i--) {
-			chunk[i] = (uint8_t) len;
-			len >>= 8;
-		}
-		state->total_len_delivered = 1;
-	} else {
-		memset(chunk, 0x00, space_in_chunk);
-	}
-
-	return 1;
-}
-
 /*
- * Limitations:
- * - Since input is a pointer in RAM, the data to hash should be in RAM, which could be a problem
- *   for large data sizes.
- * - SHA algorithms theoretically operate on bit strings. However, this implementation has no support
- *   for bit string lengths that are not multiples of eight, and it really operates on arrays of bytes.
- *   In particular, the len parameter is a number of bytes.
+ * A compression function processes a number of consecutive 512-bit chunks
+ * and updates the hash value h.
  */
-void calc_sha_256(uint8_t hash[32], const void * input, size_t len)
+typedef void (*compress_fn)(uint32_t h[8], const uint8_t *data, size_t chunks);
+
+static void compress_portable(uint32_t h[8], const uint8_t *data, size_t chunks)
 {
 	/*
 	 * Note 1: All integers (expect indexes) are 32-bit unsigned integers and addition is calculated modulo 2^32.
@@ -131,33 +69,18 @@ void calc_sha_256(uint8_t hash[32], const void * input, size_t len)
 	 *     and when parsing message block data from bytes to words, for example,
 	 *     the first word of the input message "abc" after padding is 0x61626380
 	 */
+	int i;
 
-	/*
-	 * Initialize hash values:
-	 * (first 32 bits of the fractional parts of the square roots of the first 8 primes 2..19):
-	 */
-	uint32_t h[] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
-	int i, j;
-
-	/* 512-bit chunks is what we will operate on. */
-	uint8_t chunk[64];
-
-	struct buffer_state state;
-
-	init_buf_state(&state, input, len);
-
-	while (calc_chunk(chunk, &state)) {
+	while (chunks--) {
 		uint32_t ah[8];
-		
+
 		/*
 		 * create a 64-entry message schedule array w[0..63] of 32-bit words
-		 * (The initial values in w[0..63] don't matter, so many implementations zero them here)
 		 * copy chunk into first 16 words w[0..15] of the message schedule array
 		 */
 		uint32_t w[64];
-		const uint8_t *p = chunk;
+		const uint8_t *p = data;
 
-		memset(w, 0x00, sizeof w);
 		for (i = 0; i < 16; i++) {
 			w[i] = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
 				(uint32_t) p[2] << 8 | (uint32_t) p[3];
@@ -170,7 +93,7 @@ void calc_sha_256(uint8_t hash[32], const void * input, size_t len)
 			const uint32_t s1 = right_rot(w[i - 2], 17) ^ right_rot(w[i - 2], 19) ^ (w[i - 2] >> 10);
 			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
 		}
-		
+
 		/* Initialize working variables to current hash value: */
 		for (i = 0; i < 8; i++)
 			ah[i] = h[i];
@@ -197,7 +120,289 @@ void calc_sha_256(uint8_t hash[32], const void * input, size_t len)
 		/* Add the compressed chunk to the current hash value: */
 		for (i = 0; i < 8; i++)
 			h[i] += ah[i];
+
+		data += CHUNK_SIZE;
+	}
+}
+
+#if SHA_256_X86
+
+/*
+ * SHA-NI: the state is kept as ABEF/CDGH, four rounds take two sha256rnds2
+ * instructions, the message schedule is done with sha256msg1/sha256msg2.
+ */
+__attribute__((target("sha,sse4.1")))
+static void compress_shani(uint32_t h[8], const uint8_t *data, size_t chunks)
+{
+	const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, tmp, msg;
+	__m128i w[4];
+	int i;
+
+	tmp = _mm_loadu_si128((const __m128i *) &h[0]);
+	state1 = _mm_loadu_si128((const __m128i *) &h[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);            /* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1B);      /* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);      /* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);   /* CDGH */
+
+	while (chunks--) {
+		const __m128i abef_save = state0;
+		const __m128i cdgh_save = state1;
+
+		for (i = 0; i < 16; i++) {
+			if (i < 4) {
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16 * i)), byte_swap);
+			} else {
+				/*
+				 * w[i & 3] holds the words i-4, the others i-3, i-2 and i-1:
+				 * W[i] = msg2(msg1(W[i-4], W[i-3]) + (W[i-2], W[i-1])[1..4], W[i-1])
+				 */
+				__m128i x = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+				x = _mm_add_epi32(x, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+				w[i & 3] = _mm_sha256msg2_epu32(x, w[(i + 3) & 3]);
+			}
+			msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *) &k[4 * i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+		data += CHUNK_SIZE;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);         /* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xB1);      /* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);   /* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);      /* ABEF */
+	_mm_storeu_si128((__m128i *) &h[0], state0);
+	_mm_storeu_si128((__m128i *) &h[4], state1);
+}
+
+/*
+ * AVX2 multi-buffer: each of the eight 32-bit lanes of a ymm register
+ * belongs to a different message. lane_data[j] points at the current chunk
+ * of lane j; lanes with active[j] == 0 keep their state.
+ */
+#define ROTR8(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+__attribute__((target("avx2")))
+static void compress_avx2_x8(uint32_t h[8][8], const uint8_t *const lane_data[8], const int active[8])
+{
+	__m256i w[64];
+	__m256i s[8], a[8];
+	const __m256i mask = _mm256_set_epi32(active[7] ? -1 : 0, active[6] ? -1 : 0,
+					      active[5] ? -1 : 0, active[4] ? -1 : 0,
+					      active[3] ? -1 : 0, active[2] ? -1 : 0,
+					      active[1] ? -1 : 0, active[0] ? -1 : 0);
+	int i, j;
+
+	for (i = 0; i < 16; i++) {
+		uint32_t word[8];
+		for (j = 0; j < 8; j++) {
+			const uint8_t *p = lane_data[j] + 4 * i;
+			word[j] = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+				(uint32_t) p[2] << 8 | (uint32_t) p[3];
+		}
+		w[i] = _mm256_loadu_si256((const __m256i *) word);
+	}
+	for (i = 16; i < 64; i++) {
+		const __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(w[i - 15], 7), ROTR8(w[i - 15], 18)),
+						    _mm256_srli_epi32(w[i - 15], 3));
+		const __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(w[i - 2], 17), ROTR8(w[i - 2], 19)),
+						    _mm256_srli_epi32(w[i - 2], 10));
+		w[i] = _mm256_add_epi32(_mm256_add_epi32(w[i - 16], s0), _mm256_add_epi32(w[i - 7], s1));
+	}
+
+	for (i = 0; i < 8; i++) {
+		uint32_t word[8];
+		for (j = 0; j < 8; j++)
+			word[j] = h[j][i];
+		s[i] = _mm256_loadu_si256((const __m256i *) word);
+		a[i] = s[i];
+	}
+
+	for (i = 0; i < 64; i++) {
+		const __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(a[4], 6), ROTR8(a[4], 11)), ROTR8(a[4], 25));
+		const __m256i ch = _mm256_xor_si256(_mm256_and_si256(a[4], a[5]), _mm256_andnot_si256(a[4], a[6]));
+		const __m256i temp1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(a[7], s1), ch),
+						       _mm256_add_epi32(_mm256_set1_epi32((int) k[i]), w[i]));
+		const __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(a[0], 2), ROTR8(a[0], 13)), ROTR8(a[0], 22));
+		const __m256i maj = _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a[0], a[1]),
+								      _mm256_and_si256(a[0], a[2])),
+						     _mm256_and_si256(a[1], a[2]));
+		const __m256i temp2 = _mm256_add_epi32(s0, maj);
+
+		a[7] = a[6];
+		a[6] = a[5];
+		a[5] = a[4];
+		a[4] = _mm256_add_epi32(a[3], temp1);
+		a[3] = a[2];
+		a[2] = a[1];
+		a[1] = a[0];
+		a[0] = _mm256_add_epi32(temp1, temp2);
+	}
+
+	for (i = 0; i < 8; i++) {
+		uint32_t word[8];
+		const __m256i sum = _mm256_blendv_epi8(s[i], _mm256_add_epi32(s[i], a[i]), mask);
+		_mm256_storeu_si256((__m256i *) word, sum);
+		for (j = 0; j < 8; j++)
+			h[j][i] = word[j];
+	}
+}
+
+static int cpu_has_shani(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+		return 0;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ebx & (1u << 29)) != 0;
+}
+
+static int cpu_has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+static compress_fn compress = 0;
+static enum sha_256_engine engine = SHA_256_ENGINE_AUTO;
+
+static void select_engine(void)
+{
+#if SHA_256_X86
+	if (cpu_has_shani()) {
+		compress = compress_shani;
+		engine = SHA_256_ENGINE_SHANI;
+		return;
+	}
+	if (cpu_has_avx2()) {
+		/* Single buffers still use the portable code. */
+		compress = compress_portable;
+		engine = SHA_256_ENGINE_AVX2;
+		return;
+	}
+#endif
+	compress = compress_portable;
+	engine = SHA_256_ENGINE_PORTABLE;
+}
+
+int sha_256_set_engine(enum sha_256_engine wanted)
+{
+	switch (wanted) {
+	case SHA_256_ENGINE_AUTO:
+		select_engine();
+		return 1;
+	case SHA_256_ENGINE_PORTABLE:
+		compress = compress_portable;
+		engine = wanted;
+		return 1;
+#if SHA_256_X86
+	case SHA_256_ENGINE_SHANI:
+		if (!cpu_has_shani())
+			return 0;
+		compress = compress_shani;
+		engine = wanted;
+		return 1;
+	case SHA_256_ENGINE_AVX2:
+		if (!cpu_has_avx2())
+			return 0;
+		compress = compress_portable;
+		engine = wanted;
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+const char *sha_256_engine_name(void)
+{
+	if (!compress)
+		select_engine();
+	switch (engine) {
+	case SHA_256_ENGINE_SHANI:
+		return "sha-ni";
+	case SHA_256_ENGINE_AVX2:
+		return "avx2";
+	default:
+		return "portable";
+	}
+}
+
+void sha_256_init(struct Sha_256 *sha)
+{
+	if (!compress)
+		select_engine();
+	memcpy(sha->h, h_init, sizeof(h_init));
+	sha->chunk_pos = 0;
+	sha->total_len = 0;
+}
+
+void sha_256_update(struct Sha_256 *sha, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	sha->total_len += len;
+
+	if (sha->chunk_pos > 0) {
+		const size_t space = CHUNK_SIZE - sha->chunk_pos;
+		const size_t n = len < space ? len : space;
+		memcpy(sha->chunk + sha->chunk_pos, p, n);
+		sha->chunk_pos += n;
+		p += n;
+		len -= n;
+		if (sha->chunk_pos < CHUNK_SIZE)
+			return;
+		compress(sha->h, sha->chunk, 1);
+		sha->chunk_pos = 0;
+	}
+
+	/* Whole chunks are compressed straight from the input. */
+	if (len >= CHUNK_SIZE) {
+		const size_t chunks = len / CHUNK_SIZE;
+		compress(sha->h, p, chunks);
+		p += chunks * CHUNK_SIZE;
+		len -= chunks * CHUNK_SIZE;
+	}
+
+	memcpy(sha->chunk, p, len);
+	sha->chunk_pos = len;
+}
+
+/*
+ * Writes the padding (a single one bit, zeroes, and the length in bits as a
+ * big endian 64-bit number) behind the len bytes in tail. Returns the
+ * number of chunks (one or two) in tail.
+ */
+static size_t pad_tail(uint8_t tail[2 * CHUNK_SIZE], size_t len, size_t total_len)
+{
+	const size_t chunks = (len + 1 + TOTAL_LEN_LEN > CHUNK_SIZE) ? 2 : 1;
+	uint8_t *end = tail + chunks * CHUNK_SIZE;
+	int i;
+
+	tail[len] = 0x80;
+	memset(tail + len + 1, 0x00, chunks * CHUNK_SIZE - len - 1);
+
+	/* Storing of len * 8 as a big endian 64-bit without overflow. */
+	end[-1] = (uint8_t) (total_len << 3);
+	total_len >>= 5;
+	for (i = 2; i <= 8; i++) {
+		end[-i] = (uint8_t) total_len;
+		total_len >>= 8;
 	}
+	return chunks;
+}
+
+static void store_hash(uint8_t hash[32], const uint32_t h[8])
+{
+	int i, j;
 
 	/* Produce the final hash value (big-endian): */
 	for (i = 0, j = 0; i < 8; i++)
@@ -208,3 +413,92 @@ void calc_sha_256(uint8_t hash[32], const void * input, size_t len)
 		hash[j++] = (uint8_t) h[i];
 	}
 }
+
+void sha_256_final(struct Sha_256 *sha, uint8_t hash[SIZE_OF_SHA_256_HASH])
+{
+	uint8_t tail[2 * CHUNK_SIZE];
+	size_t chunks;
+
+	memcpy(tail, sha->chunk, sha->chunk_pos);
+	chunks = pad_tail(tail, sha->chunk_pos, sha->total_len);
+	compress(sha->h, tail, chunks);
+	store_hash(hash, sha->h);
+}
+
+/*
+ * Limitations:
+ * - Since input is a pointer in RAM, the data to hash should be in RAM, which could be a problem
+ *   for large data sizes; use sha_256_update() in that case.
+ * - SHA algorithms theoretically operate on bit strings. However, this implementation has no support
+ *   for bit string lengths that are not multiples of eight, and it really operates on arrays of bytes.
+ *   In particular, the len parameter is a number of bytes.
+ */
+void calc_sha_256(uint8_t hash[32], const void * input, size_t len)
+{
+	struct Sha_256 sha;
+	sha_256_init(&sha);
+	sha_256_update(&sha, input, len);
+	sha_256_final(&sha, hash);
+}
+
+#if SHA_256_X86
+static void calc_sha_256_x8(uint8_t (*hashes)[SIZE_OF_SHA_256_HASH],
+			    const void *const *inputs, const size_t *lens, size_t count)
+{
+	static const uint8_t idle_chunk[CHUNK_SIZE];
+	uint32_t h[8][8];
+	uint8_t tails[8][2 * CHUNK_SIZE];
+	size_t full[8], total[8], max_chunks = 0, c;
+	const uint8_t *lane_data[8];
+	int active[8];
+	size_t j;
+
+	for (j = 0; j < 8; j++) {
+		memcpy(h[j], h_init, sizeof(h_init));
+		if (j < count) {
+			const size_t rest = lens[j] % CHUNK_SIZE;
+			full[j] = lens[j] / CHUNK_SIZE;
+			memcpy(tails[j], (const uint8_t *) inputs[j] + full[j] * CHUNK_SIZE, rest);
+			total[j] = full[j] + pad_tail(tails[j], rest, lens[j]);
+		} else {
+			full[j] = total[j] = 0;
+		}
+		if (total[j] > max_chunks)
+			max_chunks = total[j];
+	}
+
+	for (c = 0; c < max_chunks; c++) {
+		for (j = 0; j < 8; j++) {
+			active[j] = c < total[j];
+			if (c < full[j])
+				lane_data[j] = (const uint8_t *) inputs[j] + c * CHUNK_SIZE;
+			else if (c < total[j])
+				lane_data[j] = tails[j] + (c - full[j]) * CHUNK_SIZE;
+			else
+				lane_data[j] = idle_chunk;
+		}
+		compress_avx2_x8(h, lane_data, active);
+	}
+
+	for (j = 0; j < count; j++)
+		store_hash(hashes[j], h[j]);
+}
+#endif
+
+void calc_sha_256_batch(uint8_t (*hashes)[SIZE_OF_SHA_256_HASH],
+			const void *const *inputs, const size_t *lens, size_t count)
+{
+	size_t i;
+
+	if (!compress)
+		select_engine();
+#if SHA_256_X86
+	if (engine == SHA_256_ENGINE_AVX2) {
+		for (i = 0; i < count; i += 8)
+			calc_sha_256_x8(hashes + i, inputs + i, lens + i, count - i < 8 ? count - i : 8);
+		return;
+	}
+#endif
+	for (i = 0; i < count; i++)
+		calc_sha_256(hashes[i], inputs[i], lens[i]);
+}
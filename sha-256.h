@@ -1,4 +1,52 @@
+#ifndef SHA_256_H
+#define SHA_256_H
+
 #include <stddef.h>
 #include "p2pjs.h"
 
+#define SIZE_OF_SHA_256_HASH 32
+#define SIZE_OF_SHA_256_CHUNK 64
+
+/*
+ * Incremental hashing:
+ *	struct Sha_256 sha;
+ *	sha_256_init(&sha);
+ *	sha_256_update(&sha, part1, len1);
+ *	sha_256_update(&sha, part2, len2);
+ *	sha_256_final(&sha, hash);
+ */
+struct Sha_256 {
+	uint32 h[8];
+	uint8 chunk[SIZE_OF_SHA_256_CHUNK];
+	size_t chunk_pos;
+	size_t total_len;
+};
+
+void sha_256_init(struct Sha_256 *sha);
+void sha_256_update(struct Sha_256 *sha, const void *data, size_t len);
+void sha_256_final(struct Sha_256 *sha, uint8 hash[SIZE_OF_SHA_256_HASH]);
+
 void calc_sha_256(uint8 hash[32], const void *input, size_t len);
+
+/*
+ * Hashes count independent buffers. Uses the AVX2 multi-buffer kernel
+ * (eight buffers at a time) when it is the best engine on this CPU.
+ */
+void calc_sha_256_batch(uint8 (*hashes)[SIZE_OF_SHA_256_HASH],
+			const void *const *inputs, const size_t *lens, size_t count);
+
+/*
+ * The engine is chosen at runtime from the CPU features. Forcing one is
+ * only meant for benchmarks and tests; returns 0 if the CPU lacks it.
+ */
+enum sha_256_engine {
+	SHA_256_ENGINE_AUTO,
+	SHA_256_ENGINE_PORTABLE,
+	SHA_256_ENGINE_SHANI,
+	SHA_256_ENGINE_AVX2,
+};
+
+int sha_256_set_engine(enum sha_256_engine engine);
+const char *sha_256_engine_name(void);
+
+#endif
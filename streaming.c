@@ -0,0 +1,512 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "p2pjs.h"
+
+// NOTE(Kevin): Streaming of large job and result payloads. A job or
+// jobResult message whose payload is larger than P2PJS_StreamThreshold
+// goes out without it, marked with PayloadStreamed. The payload follows in
+// payloadChunk messages of P2PJS_StreamChunkSize bytes. The same goes for
+// jobs whose source and payload together are that large; the stream then
+// carries the source followed by the payload.
+// Every connection has two lanes: small messages are sent right away, the
+// control lane, while the chunks are the bulk lane. Frame() sends a few
+// chunks of every stream per call, and never lets more than
+// P2PJS_BulkQueueLimit bytes of them wait in the send buffer of a socket,
+// so control messages get through in between instead of waiting for
+// megabytes to go out. The receiver acknowledges what arrived, and the
+// sender keeps at most P2PJS_StreamWindow bytes of a stream unacknowledged.
+// The receiver holds the job or jobResult message back until its payload
+// is complete. Payloads of at least P2PJS_SpillThreshold bytes are written
+// to an unlinked temp file mapped into memory, so the kernel can page
+// them out instead of keeping them on the heap.
+
+#ifndef P2PJS_StreamChunkSize
+  #define P2PJS_StreamChunkSize (16 << 10)
+#endif
+
+#ifndef P2PJS_StreamWindow
+  #define P2PJS_StreamWindow (1 << 20)
+#endif
+
+#ifndef P2PJS_StreamFrameBudget
+  // NOTE(Kevin): Bytes of all streams sent per Frame()
+  #define P2PJS_StreamFrameBudget (512 << 10)
+#endif
+
+#ifndef P2PJS_BulkQueueLimit
+  // NOTE(Kevin): Most bytes a control message waits behind on one socket
+  #define P2PJS_BulkQueueLimit (64 << 10)
+#endif
+
+#ifndef P2PJS_SpillThreshold
+  #define P2PJS_SpillThreshold (4 << 20)
+#endif
+
+#ifndef P2PJS_SpillDirectory
+  #define P2PJS_SpillDirectory "/tmp"
+#endif
+
+typedef struct
+{
+    int    fd;
+    uint8  cookie[CookieLen];
+    // NOTE(Kevin): The source of a job, streamed before the payload
+    const uint8 *head;
+    uint32 headSize;
+    const uint8 *bytes;
+    // NOTE(Kevin): Of head and bytes together
+    uint32 size;
+    bool32 isOwned;
+    uint32 sent;
+    uint32 acknowledged;
+} outgoing_stream;
+
+typedef struct
+{
+    int      fd;
+    uint8    cookie[CookieLen];
+    // NOTE(Kevin): The job or jobResult message the payload belongs to
+    message *header;
+    // NOTE(Kevin): The source of a job, in header
+    uint8   *head;
+    uint32   headSize;
+    payload_region region;
+    uint32   received;
+    uint32   acknowledged;
+} incoming_stream;
+
+global_variable outgoing_stream *g_outgoingStreams;
+global_variable unsigned int     g_outgoingStreamCount;
+global_variable unsigned int     g_outgoingStreamCapacity;
+global_variable unsigned int     g_streamCursor;
+
+global_variable incoming_stream *g_incomingStreams;
+global_variable unsigned int     g_incomingStreamCount;
+global_variable unsigned int     g_incomingStreamCapacity;
+
+// NOTE(Kevin): The payload of the message HandlePeerMessage() is handling
+// right now, if it was streamed
+global_variable payload_region g_streamedPayload;
+
+internal void HandlePeerMessage(int fd, int id, const char *myPort, message *message);
+internal const char* CookieToTemporaryString(uint8 cookie[CookieLen]);
+
+internal int
+AllocatePayloadRegion(payload_region *region, uint32 size)
+{
+    region->bytes    = 0;
+    region->size     = size;
+    region->isMapped = 0;
+    if (size == 0)
+        return kSuccess;
+    if (size >= P2PJS_SpillThreshold)
+    {
+        char path[] = P2PJS_SpillDirectory "/p2pjs-payload-XXXXXX";
+        int fd = mkstemp(path);
+        if (fd != -1)
+        {
+            unlink(path);
+            void *bytes = MAP_FAILED;
+            if (ftruncate(fd, size) == 0)
+                bytes = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (bytes != MAP_FAILED)
+            {
+                region->bytes    = bytes;
+                region->isMapped = 1;
+                return kSuccess;
+            }
+        }
+        LogWarning(kLogNet, "Could not spill a payload of %u bytes, keeping it in memory\n", size);
+    }
+    region->bytes = malloc(size);
+    if (!region->bytes)
+    {
+        region->size = 0;
+        return kNoMemory;
+    }
+    return kSuccess;
+}
+
+internal void
+FreePayloadRegion(payload_region *region)
+{
+    if (region->bytes)
+    {
+        if (region->isMapped)
+            munmap(region->bytes, region->size);
+        else
+            free(region->bytes);
+    }
+    region->bytes = 0;
+    region->size  = 0;
+    region->isMapped = 0;
+}
+
+// NOTE(Kevin): The region is taken over, the source is left empty
+internal void
+MovePayloadRegion(payload_region *to, payload_region *from)
+{
+    *to = *from;
+    from->bytes = 0;
+    from->size  = 0;
+    from->isMapped = 0;
+}
+
+// NOTE(Kevin): The payload of a job or jobResult message, as a region of
+// its own. Streamed payloads are taken over, inline ones are copied.
+internal int
+TakeMessagePayload(const message *msg, payload_region *regionOut)
+{
+    const uint8 *bytes;
+    uint32 size;
+    bool32 isStreamed;
+    if (msg->type == kJob)
+    {
+        bytes = msg->job.payload;
+        size  = msg->job.payloadSize;
+        isStreamed = msg->job.isPayloadStreamed;
+    }
+    else
+    {
+        assert(msg->type == kJobResult);
+        bytes = msg->jobResult.payload;
+        size  = msg->jobResult.payloadSize;
+        isStreamed = msg->jobResult.isPayloadStreamed;
+    }
+    if (isStreamed)
+    {
+        MovePayloadRegion(regionOut, &g_streamedPayload);
+        return kSuccess;
+    }
+    int err = AllocatePayloadRegion(regionOut, size);
+    if (err == kSuccess && size > 0)
+        memcpy(regionOut->bytes, bytes, size);
+    return err;
+}
+
+// NOTE(Kevin): Called after the job or jobResult message went out. Only
+// bytes is copied, if at all; head has to stay around.
+internal int
+StartPayloadStream(int fd, uint8 cookie[CookieLen], const uint8 *head, uint32 headSize,
+                   const uint8 *bytes, uint32 size, bool32 copy)
+{
+    if (g_outgoingStreamCount == g_outgoingStreamCapacity)
+    {
+        unsigned int newCapacity = (g_outgoingStreamCapacity == 0) ? 8 : 2 * g_outgoingStreamCapacity;
+        outgoing_stream *t = realloc(g_outgoingStreams, sizeof(outgoing_stream) * newCapacity);
+        if (!t)
+            return kNoMemory;
+        g_outgoingStreams = t;
+        g_outgoingStreamCapacity = newCapacity;
+    }
+    outgoing_stream *stream = &g_outgoingStreams[g_outgoingStreamCount];
+    stream->fd = fd;
+    memcpy(stream->cookie, cookie, CookieLen);
+    stream->head     = head;
+    stream->headSize = headSize;
+    stream->bytes    = bytes;
+    stream->size     = headSize + size;
+    stream->isOwned  = copy;
+    stream->sent     = 0;
+    stream->acknowledged = 0;
+    if (copy && size > 0)
+    {
+        uint8 *t = malloc(size);
+        if (!t)
+            return kNoMemory;
+        memcpy(t, bytes, size);
+        stream->bytes = t;
+    }
+    ++g_outgoingStreamCount;
+    LogDebug(kLogNet, "Streaming %u bytes of payload of %s to fd %d\n",
+             stream->size, CookieToTemporaryString(cookie), fd);
+    return kSuccess;
+}
+
+internal void
+RemoveOutgoingStream(unsigned int index)
+{
+    if (g_outgoingStreams[index].isOwned)
+        free((uint8*)g_outgoingStreams[index].bytes);
+    g_outgoingStreams[index] = g_outgoingStreams[--g_outgoingStreamCount];
+}
+
+// NOTE(Kevin): The peer will not run the job, or does not want the result
+internal void
+StopPayloadStream(int fd, uint8 cookie[CookieLen])
+{
+    for (unsigned int i = 0; i < g_outgoingStreamCount; ++i)
+    {
+        if (g_outgoingStreams[i].fd == fd &&
+            memcmp(g_outgoingStreams[i].cookie, cookie, CookieLen) == 0)
+        {
+            RemoveOutgoingStream(i);
+            return;
+        }
+    }
+}
+
+// NOTE(Kevin): Bytes sent on fd that the kernel still holds, or 0 if
+// the platform can not tell
+internal uint32
+GetUnsentByteCount(int fd)
+{
+    int count = 0;
+#if defined(TIOCOUTQ)
+    if (ioctl(fd, TIOCOUTQ, &count) == -1)
+        return 0;
+#elif defined(SO_NWRITE)
+    socklen_t length = sizeof(count);
+    if (getsockopt(fd, SOL_SOCKET, SO_NWRITE, &count, &length) == -1)
+        return 0;
+#else
+    (void)fd;
+#endif
+    return (count > 0) ? (uint32)count : 0;
+}
+
+// NOTE(Kevin): Sends one chunk per stream and round until the budget is
+// spent or every stream waits, for acknowledgements or for its socket to
+// take more bulk. Starts with another stream every time, so one stream
+// can not starve the others.
+internal void
+PumpPayloadStreams(void)
+{
+    uint32 budget = P2PJS_StreamFrameBudget;
+    bool32 didSend = 1;
+    while (budget > 0 && didSend && g_outgoingStreamCount > 0)
+    {
+        didSend = 0;
+        for (unsigned int n = 0; n < g_outgoingStreamCount && budget > 0;)
+        {
+            unsigned int i = (g_streamCursor + n) % g_outgoingStreamCount;
+            outgoing_stream *stream = &g_outgoingStreams[i];
+            uint32 inFlight = stream->sent - stream->acknowledged;
+            if (stream->sent == stream->size || inFlight >= P2PJS_StreamWindow ||
+                GetUnsentByteCount(stream->fd) >= P2PJS_BulkQueueLimit)
+            {
+                ++n;
+                continue;
+            }
+            // NOTE(Kevin): A chunk is either head or bytes, never both
+            const uint8 *bytes = (stream->sent < stream->headSize)
+                ? stream->head + stream->sent
+                : stream->bytes + (stream->sent - stream->headSize);
+            uint32 size = (stream->sent < stream->headSize)
+                ? stream->headSize - stream->sent
+                : stream->size - stream->sent;
+            if (size > P2PJS_StreamChunkSize)
+                size = P2PJS_StreamChunkSize;
+            if (size > P2PJS_StreamWindow - inFlight)
+                size = P2PJS_StreamWindow - inFlight;
+            if (SendPayloadChunk(stream->fd, stream->cookie, stream->sent, bytes, size) != kSuccess)
+            {
+                // NOTE(Kevin): The peer is gone, the stream is dropped with it
+                LogWarning(kLogNet, "Failed to send payload of %s to fd %d\n",
+                           CookieToTemporaryString(stream->cookie), stream->fd);
+                RemoveOutgoingStream(i);
+                continue;
+            }
+            stream->sent += size;
+            budget = (size < budget) ? budget - size : 0;
+            didSend = 1;
+            ++n;
+        }
+        ++g_streamCursor;
+    }
+}
+
+internal void
+OnPayloadAck(int fd, const message *msg)
+{
+    for (unsigned int i = 0; i < g_outgoingStreamCount; ++i)
+    {
+        outgoing_stream *stream = &g_outgoingStreams[i];
+        if (stream->fd != fd || memcmp(stream->cookie, msg->payloadAck.cookie, CookieLen) != 0)
+            continue;
+        if (msg->payloadAck.received == PayloadAckAbort)
+        {
+            LogInfo(kLogNet, "Peer dropped payload of %s\n", CookieToTemporaryString(stream->cookie));
+            RemoveOutgoingStream(i);
+        }
+        else if (msg->payloadAck.received <= stream->sent &&
+                 msg->payloadAck.received > stream->acknowledged)
+        {
+            stream->acknowledged = msg->payloadAck.received;
+            if (stream->acknowledged == stream->size)
+                RemoveOutgoingStream(i);
+        }
+        return;
+    }
+}
+
+internal void
+RemoveIncomingStream(unsigned int index)
+{
+    FreeMessage(g_incomingStreams[index].header);
+    FreePayloadRegion(&g_incomingStreams[index].region);
+    g_incomingStreams[index] = g_incomingStreams[--g_incomingStreamCount];
+}
+
+// NOTE(Kevin): Keeps a job or jobResult message whose payload is streamed
+// until the payload is complete. Returns 0 if the message has none.
+internal bool32
+HoldStreamedMessage(int fd, message *msg)
+{
+    uint32 size;
+    const uint8 *cookie;
+    uint8 *head = 0;
+    uint32 headSize = 0;
+    if (msg->type == kJob && msg->job.isPayloadStreamed)
+    {
+        size   = msg->job.payloadSize;
+        cookie = msg->job.cookie;
+        head     = (uint8*)msg->job.source;
+        headSize = msg->job.sourceLen;
+    }
+    else if (msg->type == kJobResult && msg->jobResult.isPayloadStreamed)
+    {
+        size   = msg->jobResult.payloadSize;
+        cookie = msg->jobResult.cookie;
+    }
+    else
+    {
+        return 0;
+    }
+    if (g_incomingStreamCount == g_incomingStreamCapacity)
+    {
+        unsigned int newCapacity = (g_incomingStreamCapacity == 0) ? 8 : 2 * g_incomingStreamCapacity;
+        incoming_stream *t = realloc(g_incomingStreams, sizeof(incoming_stream) * newCapacity);
+        if (!t)
+        {
+            // NOTE(Kevin): The chunks are refused once they arrive
+            FreeMessage(msg);
+            return 1;
+        }
+        g_incomingStreams = t;
+        g_incomingStreamCapacity = newCapacity;
+    }
+    incoming_stream *stream = &g_incomingStreams[g_incomingStreamCount];
+    if (AllocatePayloadRegion(&stream->region, size) != kSuccess)
+    {
+        FreeMessage(msg);
+        return 1;
+    }
+    stream->fd = fd;
+    memcpy(stream->cookie, cookie, CookieLen);
+    stream->header   = msg;
+    stream->head     = head;
+    stream->headSize = headSize;
+    stream->received = 0;
+    stream->acknowledged = 0;
+    ++g_incomingStreamCount;
+    return 1;
+}
+
+internal void
+OnPayloadChunk(int fd, int id, const char *myPort, const message *msg)
+{
+    incoming_stream *stream = 0;
+    unsigned int index = 0;
+    for (; index < g_incomingStreamCount; ++index)
+    {
+        if (g_incomingStreams[index].fd == fd &&
+            memcmp(g_incomingStreams[index].cookie, msg->payloadChunk.cookie, CookieLen) == 0)
+        {
+            stream = &g_incomingStreams[index];
+            break;
+        }
+    }
+    uint32 total = stream ? stream->headSize + stream->region.size : 0;
+    if (!stream ||
+        msg->payloadChunk.offset != stream->received ||
+        msg->payloadChunk.size > total - stream->received)
+    {
+        // NOTE(Kevin): Cancelled, out of memory, or the peer got confused
+        if (stream)
+            RemoveIncomingStream(index);
+        SendPayloadAck(fd, (uint8*)msg->payloadChunk.cookie, PayloadAckAbort);
+        return;
+    }
+    const uint8 *bytes = msg->payloadChunk.bytes;
+    uint32 size = msg->payloadChunk.size;
+    if (stream->received < stream->headSize)
+    {
+        uint32 headPart = stream->headSize - stream->received;
+        if (headPart > size)
+            headPart = size;
+        memcpy(stream->head + stream->received, bytes, headPart);
+        stream->received += headPart;
+        bytes += headPart;
+        size  -= headPart;
+    }
+    if (size > 0)
+    {
+        memcpy(stream->region.bytes + (stream->received - stream->headSize), bytes, size);
+        stream->received += size;
+    }
+    if (stream->received == total ||
+        stream->received - stream->acknowledged >= P2PJS_StreamWindow / 2)
+    {
+        SendPayloadAck(fd, stream->cookie, stream->received);
+        stream->acknowledged = stream->received;
+    }
+    if (stream->received < total)
+        return;
+
+    // NOTE(Kevin): Complete; handle the message as if it just arrived
+    message *header = stream->header;
+    MovePayloadRegion(&g_streamedPayload, &stream->region);
+    if (header->type == kJob)
+        header->job.payload = g_streamedPayload.bytes;
+    else
+        header->jobResult.payload = g_streamedPayload.bytes;
+    g_incomingStreams[index] = g_incomingStreams[--g_incomingStreamCount];
+    HandlePeerMessage(fd, id, myPort, header);
+    FreeMessage(header);
+    FreePayloadRegion(&g_streamedPayload);
+}
+
+// NOTE(Kevin): The emitter cancelled the job before its payload was complete
+internal void
+DropIncomingPayload(int fd, uint8 cookie[CookieLen])
+{
+    for (unsigned int i = 0; i < g_incomingStreamCount; ++i)
+    {
+        if (g_incomingStreams[i].fd == fd &&
+            memcmp(g_incomingStreams[i].cookie, cookie, CookieLen) == 0)
+        {
+            RemoveIncomingStream(i);
+            return;
+        }
+    }
+}
+
+internal void
+DropPayloadStreamsOfPeer(int peerFd)
+{
+    for (unsigned int i = 0; i < g_outgoingStreamCount;)
+    {
+        if (g_outgoingStreams[i].fd == peerFd)
+        {
+            RemoveOutgoingStream(i);
+            continue;
+        }
+        ++i;
+    }
+    for (unsigned int i = 0; i < g_incomingStreamCount;)
+    {
+        if (g_incomingStreams[i].fd == peerFd)
+        {
+            RemoveIncomingStream(i);
+            continue;
+        }
+        ++i;
+    }
+}
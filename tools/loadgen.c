@@ -0,0 +1,1025 @@
+// NOTE(Kevin): Load generator. Joins a p2pjs network as an emitter that
+// never runs jobs itself and submits jobs either at fixed rates (open
+// loop) or with a fixed number of jobs in flight (closed loop).
+//
+// Open loop: job i is due at start + i / rate. Its latency is measured
+// from that due time, not from when it was actually sent, so a cluster
+// (or a loadgen) that falls behind can not hide the queueing it causes
+// (coordinated omission). The service time, measured from sending the
+// query, is reported as well.
+// Closed loop: latencies are measured from sending; with -e the
+// histogram is corrected like HdrHistogram's recordValueWithExpectedInterval.
+//
+// Every run prints a summary line; with -o the histograms are written
+// in the HdrHistogram percentile format (.hgrm), which the usual plotting
+// tools read. Several rates (-r 10,20,50) give a curve to find the point
+// where the cluster saturates. Run the workers without -M: with a fixed
+// argument (-a) their result cache would answer instead of the VM.
+//
+// Usage: loadgen -f ip#port [-p port] [-s job.wren] [-a arg]
+//                [-r rate[,rate...] | -c jobs in flight [-e expected interval]]
+//                [-d seconds per run] [-o output prefix]
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "../p2pjs.h"
+
+#define MaxConnections 64
+#define MaxRates       32
+// NOTE(Kevin): Jobs in flight; must be a power of two
+#define JobSlotCount   (1 << 16)
+
+// NOTE(Kevin): Same as p2pjs (P2PJS_QueryRetryInterval, P2PJS_HeartbeatInterval)
+#define QueryRetryInterval 2.0
+#define HeartbeatInterval  1.0
+// NOTE(Kevin): How long to wait for outstanding jobs after a run
+#define DrainTimeout       5.0
+
+// NOTE(Kevin): Same layout as the histograms in metrics.c: values in ns,
+// exact below 16, then 16 sub-buckets per power of two
+#define HistogramSubBucketBits 4
+#define HistogramSubBuckets    (1 << HistogramSubBucketBits)
+#define HistogramMaxExponent   40
+#define HistogramBucketCount   (HistogramSubBuckets * (HistogramMaxExponent - HistogramSubBucketBits + 2))
+
+typedef struct
+{
+    uint64 buckets[HistogramBucketCount];
+    uint64 count;
+    uint64 max;
+    double sum;
+    double sumOfSquares;
+} histogram;
+
+typedef struct
+{
+    int    fd;
+    // NOTE(Kevin): As the peer reports it in its hello; empty until then
+    char   ipaddr[PeerIPLen];
+    char   port[PeerPortLen];
+    uint8 *buffer;
+    size_t length;
+    size_t capacity;
+} connection;
+
+// Job slot states
+enum
+{
+    kSlotFree,
+    kSlotQuerySent,
+    kSlotDispatched,
+};
+
+typedef struct
+{
+    uint8  cookie[CookieLen];
+    int    state;
+    double dueTime;
+    double queryTime;
+    double lastQueryTime;
+} job_slot;
+
+typedef struct
+{
+    double       rate;
+    double       offered;
+    uint64       sent;
+    uint64       completed;
+    uint64       failed;
+    uint64       incomplete;
+    double       duration;
+    histogram    latency;
+    histogram    service;
+} run_result;
+
+global_variable connection g_connections[MaxConnections];
+global_variable int        g_connectionCount;
+global_variable int        g_listenFd = -1;
+global_variable char       g_listenPort[PeerPortLen] = "2097";
+global_variable peer_info  g_source;
+
+global_variable job_slot  *g_slots;
+global_variable uint64     g_nextSequence;
+// NOTE(Kevin): No job before this one is in flight
+global_variable uint64     g_oldestSequence;
+global_variable uint64     g_inFlight;
+global_variable uint8      g_cookiePrefix[16];
+
+global_variable char      *g_jobSource;
+global_variable uint32     g_jobSourceLen;
+global_variable bool32     g_fixedArg;
+global_variable double     g_arg;
+
+global_variable run_result *g_run;
+
+internal double
+GetTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+internal int
+GetHistogramBucket(uint64 value)
+{
+    if (value < HistogramSubBuckets)
+        return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > HistogramMaxExponent)
+        return HistogramBucketCount - 1;
+    int shift = exponent - HistogramSubBucketBits;
+    int subBucket = (int)((value >> shift) - HistogramSubBuckets);
+    return HistogramSubBuckets * (shift + 1) + subBucket;
+}
+
+internal uint64
+GetHistogramBucketLimit(int bucket)
+{
+    if (bucket < HistogramSubBuckets)
+        return (uint64)bucket;
+    int shift = bucket / HistogramSubBuckets - 1;
+    uint64 subBucket = (uint64)(bucket % HistogramSubBuckets);
+    return ((HistogramSubBuckets + subBucket + 1) << shift) - 1;
+}
+
+internal void
+RecordValue(histogram *h, double seconds)
+{
+    uint64 ns = (seconds > 0.0) ? (uint64)(seconds * 1e9) : 0;
+    ++h->buckets[GetHistogramBucket(ns)];
+    ++h->count;
+    if (ns > h->max)
+        h->max = ns;
+    h->sum += seconds;
+    h->sumOfSquares += seconds * seconds;
+}
+
+// NOTE(Kevin): Adds the samples a closed-loop client would have taken,
+// had it not waited for this slow one
+internal void
+RecordCorrectedValue(histogram *h, double seconds, double expectedInterval)
+{
+    RecordValue(h, seconds);
+    if (expectedInterval <= 0.0)
+        return;
+    for (double missing = seconds - expectedInterval; missing >= expectedInterval; missing -= expectedInterval)
+        RecordValue(h, missing);
+}
+
+// NOTE(Kevin): Upper bound of the bucket that holds the given quantile, in seconds
+internal double
+GetQuantile(const histogram *h, double quantile)
+{
+    if (h->count == 0)
+        return 0.0;
+    uint64 rank = (uint64)(quantile * (double)h->count);
+    if (rank >= h->count)
+        rank = h->count - 1;
+    uint64 seen = 0;
+    for (int b = 0; b < HistogramBucketCount; ++b)
+    {
+        seen += h->buckets[b];
+        if (seen > rank)
+        {
+            uint64 limit = GetHistogramBucketLimit(b);
+            return (double)((limit < h->max) ? limit : h->max) * 1e-9;
+        }
+    }
+    return (double)h->max * 1e-9;
+}
+
+// NOTE(Kevin): HdrHistogram percentile distribution, values in milliseconds
+internal int
+WriteHistogram(const char *path, const histogram *h)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return kCouldNotOpenFile;
+    fprintf(file, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    uint64 seen = 0;
+    for (int b = 0; b < HistogramBucketCount; ++b)
+    {
+        if (h->buckets[b] == 0)
+            continue;
+        seen += h->buckets[b];
+        uint64 limit = GetHistogramBucketLimit(b);
+        double value = (double)((limit < h->max) ? limit : h->max) * 1e-6;
+        double percentile = (double)seen / (double)h->count;
+        if (seen < h->count)
+            fprintf(file, "%12.3f %2.12f %10llu %14.2f\n", value, percentile, seen, 1.0 / (1.0 - percentile));
+        else
+            fprintf(file, "%12.3f %2.12f %10llu\n", value, percentile, seen);
+    }
+    double mean = (h->count > 0) ? h->sum / (double)h->count : 0.0;
+    double variance = (h->count > 0) ? h->sumOfSquares / (double)h->count - mean * mean : 0.0;
+    double deviation = (variance > 0.0) ? sqrt(variance) : 0.0;
+    fprintf(file, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean * 1e3, deviation * 1e3);
+    fprintf(file, "#[Max     = %12.3f, Total count    = %12llu]\n", (double)h->max * 1e-6, h->count);
+    fprintf(file, "#[Buckets = %12d, SubBuckets     = %12d]\n", HistogramBucketCount, HistogramSubBuckets);
+    fclose(file);
+    return kSuccess;
+}
+
+internal int
+SendAll(int fd, const void *data, size_t length)
+{
+    const uint8 *p = data;
+    while (length > 0)
+    {
+        ssize_t did = send(fd, p, length, MSG_NOSIGNAL);
+        if (did == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return kSyscallFailed;
+        }
+        p += did;
+        length -= (size_t)did;
+    }
+    return kSuccess;
+}
+
+// NOTE(Kevin): Every message goes out in a single send(). The layouts
+// are the ones the Send* functions in messaging.c produce.
+internal int
+SendHelloMessage(int fd)
+{
+    uint8 buffer[sizeof(uint16) + PeerPortLen];
+    uint16 type = kHello;
+    memcpy(buffer, &type, sizeof(type));
+    memcpy(buffer + sizeof(type), g_listenPort, PeerPortLen);
+    return SendAll(fd, buffer, sizeof(buffer));
+}
+
+internal int
+SendTypeOnly(int fd, uint16 type)
+{
+    return SendAll(fd, &type, sizeof(type));
+}
+
+internal int
+SendEmptyPeerList(int fd)
+{
+    uint8 buffer[2 * sizeof(uint16)];
+    uint16 type = kPeerList;
+    uint16 count = 0;
+    memcpy(buffer, &type, sizeof(type));
+    memcpy(buffer + sizeof(type), &count, sizeof(count));
+    return SendAll(fd, buffer, sizeof(buffer));
+}
+
+internal int
+SendQuery(int fd, const uint8 cookie[CookieLen])
+{
+    uint8 buffer[sizeof(uint16) + CookieLen + sizeof(peer_info)];
+    uint16 type = kQueryJobResources;
+    memcpy(buffer, &type, sizeof(type));
+    memcpy(buffer + sizeof(type), cookie, CookieLen);
+    memcpy(buffer + sizeof(type) + CookieLen, &g_source, sizeof(g_source));
+    return SendAll(fd, buffer, sizeof(buffer));
+}
+
+// NOTE(Kevin): Frees the slot an offer holds on the worker
+internal int
+SendDeclineOffer(int fd, const uint8 cookie[CookieLen])
+{
+    uint8 buffer[sizeof(uint16) + CookieLen];
+    uint16 type = kDeclineOffer;
+    memcpy(buffer, &type, sizeof(type));
+    memcpy(buffer + sizeof(type), cookie, CookieLen);
+    return SendAll(fd, buffer, sizeof(buffer));
+}
+
+internal int
+SendJobMessage(int fd, const uint8 cookie[CookieLen], double arg)
+{
+    local_persist uint8 *buffer;
+    local_persist size_t bufferSize;
+    size_t size = sizeof(uint16) + 3 * sizeof(uint32) + CookieLen + sizeof(double) + g_jobSourceLen;
+    if (size > bufferSize)
+    {
+        uint8 *t = realloc(buffer, size);
+        if (!t)
+            return kNoMemory;
+        buffer = t;
+        bufferSize = size;
+    }
+    uint16 type = kJob;
+    uint32 payloadSize = 0;
+    uint32 kind = kJobKindRun;
+    uint8 *p = buffer;
+    memcpy(p, &type, sizeof(type));                     p += sizeof(type);
+    memcpy(p, &g_jobSourceLen, sizeof(g_jobSourceLen)); p += sizeof(g_jobSourceLen);
+    memcpy(p, &payloadSize, sizeof(payloadSize));       p += sizeof(payloadSize);
+    memcpy(p, cookie, CookieLen);                       p += CookieLen;
+    memcpy(p, &arg, sizeof(arg));                       p += sizeof(arg);
+    memcpy(p, &kind, sizeof(kind));                     p += sizeof(kind);
+    memcpy(p, g_jobSource, g_jobSourceLen);
+    return SendAll(fd, buffer, size);
+}
+
+internal int
+AddConnection(int fd)
+{
+    if (g_connectionCount == MaxConnections)
+    {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    connection *c = &g_connections[g_connectionCount];
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    return g_connectionCount++;
+}
+
+internal void
+RemoveConnection(int idx)
+{
+    close(g_connections[idx].fd);
+    free(g_connections[idx].buffer);
+    g_connections[idx] = g_connections[g_connectionCount - 1];
+    --g_connectionCount;
+}
+
+internal bool32
+IsConnectedTo(const char *ip, const char *port)
+{
+    for (int i = 0; i < g_connectionCount; ++i)
+    {
+        if (strcmp(g_connections[i].ipaddr, ip) == 0 && strcmp(g_connections[i].port, port) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+internal int
+ConnectTo(const char *ip, const char *port)
+{
+    struct addrinfo hints, *info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(ip, port, &hints, &info) != 0)
+        return -1;
+    int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (fd == -1 || connect(fd, info->ai_addr, info->ai_addrlen) == -1)
+    {
+        if (fd != -1)
+            close(fd);
+        freeaddrinfo(info);
+        return -1;
+    }
+    freeaddrinfo(info);
+    int idx = AddConnection(fd);
+    if (idx == -1)
+        return -1;
+    strncpy(g_connections[idx].ipaddr, ip, PeerIPLen - 1);
+    strncpy(g_connections[idx].port, port, PeerPortLen - 1);
+    if (SendHelloMessage(fd) != kSuccess)
+    {
+        RemoveConnection(idx);
+        return -1;
+    }
+    return idx;
+}
+
+internal job_slot *
+FindSlot(const uint8 cookie[CookieLen])
+{
+    uint64 sequence;
+    memcpy(&sequence, cookie + sizeof(g_cookiePrefix), sizeof(sequence));
+    job_slot *slot = &g_slots[sequence & (JobSlotCount - 1)];
+    if (slot->state == kSlotFree || memcmp(slot->cookie, cookie, CookieLen) != 0)
+        return 0;
+    return slot;
+}
+
+// NOTE(Kevin): The oldest job that waits for an offer, 0 if there is none
+internal job_slot *
+FindQueriedSlot(void)
+{
+    for (uint64 s = g_oldestSequence; s < g_nextSequence; ++s)
+    {
+        job_slot *slot = &g_slots[s & (JobSlotCount - 1)];
+        if (slot->state == kSlotQuerySent)
+            return slot;
+    }
+    return 0;
+}
+
+internal void
+QueryAllPeers(job_slot *slot)
+{
+    for (int i = 0; i < g_connectionCount; ++i)
+        SendQuery(g_connections[i].fd, slot->cookie);
+    slot->lastQueryTime = GetTime();
+}
+
+internal bool32
+SubmitJob(double dueTime)
+{
+    job_slot *slot = &g_slots[g_nextSequence & (JobSlotCount - 1)];
+    if (slot->state != kSlotFree)
+        return 0;
+    // NOTE(Kevin): The sequence number in the cookie finds the slot again
+    memcpy(slot->cookie, g_cookiePrefix, sizeof(g_cookiePrefix));
+    memcpy(slot->cookie + sizeof(g_cookiePrefix), &g_nextSequence, sizeof(g_nextSequence));
+    memset(slot->cookie + sizeof(g_cookiePrefix) + sizeof(g_nextSequence), 0,
+           CookieLen - sizeof(g_cookiePrefix) - sizeof(g_nextSequence));
+    slot->state   = kSlotQuerySent;
+    slot->dueTime = dueTime;
+    slot->queryTime = GetTime();
+    QueryAllPeers(slot);
+    ++g_nextSequence;
+    ++g_inFlight;
+    ++g_run->sent;
+    return 1;
+}
+
+internal void
+CompleteJob(job_slot *slot, int state, double expectedInterval)
+{
+    double now = GetTime();
+    if (state == kSuccess)
+        ++g_run->completed;
+    else
+        ++g_run->failed;
+    RecordCorrectedValue(&g_run->latency, now - slot->dueTime, expectedInterval);
+    RecordValue(&g_run->service, now - slot->queryTime);
+    slot->state = kSlotFree;
+    --g_inFlight;
+}
+
+// NOTE(Kevin): Size of the message at the start of the buffer, or 0 if
+// not enough of it arrived to tell
+internal size_t
+GetMessageSize(const uint8 *buffer, size_t length)
+{
+    if (length < sizeof(uint16))
+        return 0;
+    uint16 type;
+    memcpy(&type, buffer, sizeof(type));
+    size_t header = sizeof(uint16);
+    switch (type)
+    {
+        case kHello:             return header + PeerPortLen;
+        case kGetPeers:          return header;
+        case kHeartbeat:         return header;
+        case kQueryJobResources: return header + CookieLen + sizeof(peer_info);
+        case kOfferJobResources: return header + CookieLen;
+        case kCancelJob:         return header + CookieLen;
+        case kDeclineOffer:      return header + CookieLen;
+        case kAggregateJob:      return header + 2 * CookieLen + 2 * sizeof(uint32) + 2 * sizeof(peer_info);
+        case kAwaitInputs:       return header + CookieLen + 2 * sizeof(uint32);
+        case kForwardResult:     return header + 2 * CookieLen + sizeof(uint32) + sizeof(peer_info);
+        case kPayloadAck:        return header + CookieLen + sizeof(uint32);
+        case kJobInput:
+        {
+            size_t fixed = CookieLen + 2 * sizeof(uint32) + sizeof(double);
+            if (length < header + fixed)
+                return 0;
+            uint32 valueCount;
+            memcpy(&valueCount, buffer + header + CookieLen + sizeof(uint32), sizeof(valueCount));
+            return header + fixed + sizeof(double) * valueCount;
+        }
+        case kPeerList:
+        {
+            if (length < header + sizeof(uint16))
+                return 0;
+            uint16 count;
+            memcpy(&count, buffer + header, sizeof(count));
+            return header + sizeof(uint16) + sizeof(peer_info) * count;
+        }
+        case kJobResult:
+        {
+            size_t fixed = CookieLen + sizeof(int) + sizeof(double) + sizeof(job_usage);
+            if (length < header + fixed + 2 * sizeof(uint32))
+                return 0;
+            uint32 valueCount, payloadSize;
+            memcpy(&valueCount, buffer + header + fixed, sizeof(valueCount));
+            memcpy(&payloadSize, buffer + header + fixed + sizeof(uint32), sizeof(payloadSize));
+            // NOTE(Kevin): Streamed payloads come in payloadChunk messages
+            if (payloadSize & PayloadStreamed)
+                payloadSize = 0;
+            return header + fixed + 2 * sizeof(uint32) + sizeof(double) * valueCount + payloadSize;
+        }
+        case kAggregatedResult:
+        {
+            size_t fixed = CookieLen + sizeof(peer_info) + sizeof(int32);
+            if (length < header + fixed + 2 * sizeof(uint32))
+                return 0;
+            uint32 chunkCount, valueCount;
+            memcpy(&chunkCount, buffer + header + fixed, sizeof(chunkCount));
+            memcpy(&valueCount, buffer + header + fixed + sizeof(uint32), sizeof(valueCount));
+            return header + fixed + 2 * sizeof(uint32) +
+                   sizeof(uint32) * chunkCount + sizeof(double) * valueCount;
+        }
+        case kJob:
+        {
+            if (length < header + 2 * sizeof(uint32))
+                return 0;
+            uint32 sourceLen, payloadSize;
+            memcpy(&sourceLen, buffer + header, sizeof(sourceLen));
+            memcpy(&payloadSize, buffer + header + sizeof(uint32), sizeof(payloadSize));
+            // NOTE(Kevin): Streamed jobs send their source in chunks, too
+            if (payloadSize & PayloadStreamed)
+                sourceLen = payloadSize = 0;
+            return header + 3 * sizeof(uint32) + CookieLen + sizeof(double) + sourceLen + payloadSize;
+        }
+        case kPayloadChunk:
+        {
+            if (length < header + CookieLen + 2 * sizeof(uint32))
+                return 0;
+            uint32 size;
+            memcpy(&size, buffer + header + CookieLen + sizeof(uint32), sizeof(size));
+            return header + CookieLen + 2 * sizeof(uint32) + size;
+        }
+        default:
+            return (size_t)-1;
+    }
+}
+
+internal void
+HandleMessage(connection *c, const uint8 *msg, double expectedInterval)
+{
+    uint16 type;
+    memcpy(&type, msg, sizeof(type));
+    const uint8 *body = msg + sizeof(type);
+    switch (type)
+    {
+        case kHello:
+        {
+            memcpy(c->port, body, PeerPortLen);
+            c->port[PeerPortLen - 1] = '\0';
+        } break;
+
+        case kGetPeers:
+        {
+            // NOTE(Kevin): We are not a useful peer for anybody
+            SendEmptyPeerList(c->fd);
+        } break;
+
+        case kPeerList:
+        {
+            uint16 count;
+            memcpy(&count, body, sizeof(count));
+            for (uint16 i = 0; i < count; ++i)
+            {
+                peer_info info;
+                memcpy(&info, body + sizeof(count) + i * sizeof(peer_info), sizeof(info));
+                info.ipaddr[PeerIPLen - 1] = '\0';
+                info.port[PeerPortLen - 1] = '\0';
+                if (!IsConnectedTo(info.ipaddr, info.port) &&
+                    !(strcmp(info.ipaddr, g_source.ipaddr) == 0 && strcmp(info.port, g_source.port) == 0))
+                {
+                    ConnectTo(info.ipaddr, info.port);
+                }
+            }
+        } break;
+
+        case kOfferJobResources:
+        {
+            // NOTE(Kevin): Workers offer slots, not jobs. An offer for a
+            // job that is taken gets the oldest job still waiting.
+            job_slot *slot = FindSlot(body);
+            if (!slot || slot->state != kSlotQuerySent)
+                slot = FindQueriedSlot();
+            if (slot)
+            {
+                uint64 sequence;
+                memcpy(&sequence, slot->cookie + sizeof(g_cookiePrefix), sizeof(sequence));
+                double arg = g_fixedArg ? g_arg : (double)sequence;
+                if (SendJobMessage(c->fd, slot->cookie, arg) == kSuccess)
+                    slot->state = kSlotDispatched;
+            }
+            else
+            {
+                SendDeclineOffer(c->fd, body);
+            }
+        } break;
+
+        case kJobResult:
+        {
+            job_slot *slot = FindSlot(body);
+            if (slot)
+            {
+                int state;
+                memcpy(&state, body + CookieLen, sizeof(state));
+                CompleteJob(slot, state, expectedInterval);
+            }
+        } break;
+
+        default:
+            // NOTE(Kevin): Queries, jobs, heartbeats and cancels need no answer
+            break;
+    }
+}
+
+internal bool32
+ReceiveFromConnection(connection *c, double expectedInterval)
+{
+    for (;;)
+    {
+        if (c->capacity - c->length < 4096)
+        {
+            size_t newCapacity = (c->capacity == 0) ? 8192 : 2 * c->capacity;
+            uint8 *t = realloc(c->buffer, newCapacity);
+            if (!t)
+                return 0;
+            c->buffer = t;
+            c->capacity = newCapacity;
+        }
+        ssize_t did = recv(c->fd, c->buffer + c->length, c->capacity - c->length, 0);
+        if (did == 0)
+            return 0;
+        if (did == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        c->length += (size_t)did;
+
+        size_t offset = 0;
+        for (;;)
+        {
+            size_t size = GetMessageSize(c->buffer + offset, c->length - offset);
+            if (size == (size_t)-1)
+                return 0;
+            if (size == 0 || size > c->length - offset)
+                break;
+            HandleMessage(c, c->buffer + offset, expectedInterval);
+            offset += size;
+        }
+        memmove(c->buffer, c->buffer + offset, c->length - offset);
+        c->length -= offset;
+    }
+}
+
+internal void
+Poll(double timeout, double expectedInterval)
+{
+    struct pollfd fds[MaxConnections + 1];
+    int count = 0;
+    for (int i = 0; i < g_connectionCount; ++i)
+    {
+        fds[count].fd = g_connections[i].fd;
+        fds[count].events = POLLIN;
+        fds[count].revents = 0;
+        ++count;
+    }
+    fds[count].fd = g_listenFd;
+    fds[count].events = POLLIN;
+    fds[count].revents = 0;
+    int ready = poll(fds, (nfds_t)(count + 1), (int)(timeout * 1000.0));
+    if (ready <= 0)
+        return;
+    // NOTE(Kevin): Backwards, because removing swaps in the last connection
+    for (int i = count - 1; i >= 0; --i)
+    {
+        if (fds[i].revents == 0)
+            continue;
+        if (!ReceiveFromConnection(&g_connections[i], expectedInterval))
+            RemoveConnection(i);
+    }
+    if (fds[count].revents & POLLIN)
+    {
+        int fd = accept(g_listenFd, 0, 0);
+        if (fd != -1)
+            AddConnection(fd);
+    }
+}
+
+internal void
+DoHousekeeping(void)
+{
+    local_persist double lastHeartbeat;
+    double now = GetTime();
+    if (now - lastHeartbeat >= HeartbeatInterval)
+    {
+        for (int i = 0; i < g_connectionCount; ++i)
+            SendTypeOnly(g_connections[i].fd, kHeartbeat);
+        lastHeartbeat = now;
+    }
+    while (g_oldestSequence < g_nextSequence &&
+           g_slots[g_oldestSequence & (JobSlotCount - 1)].state == kSlotFree)
+        ++g_oldestSequence;
+    // NOTE(Kevin): Workers forget queries they can not serve; ask again
+    for (uint64 s = g_oldestSequence; s < g_nextSequence; ++s)
+    {
+        job_slot *slot = &g_slots[s & (JobSlotCount - 1)];
+        if (slot->state == kSlotQuerySent && now - slot->lastQueryTime >= QueryRetryInterval)
+            QueryAllPeers(slot);
+    }
+}
+
+internal void
+Run(run_result *run, unsigned int concurrency, double duration, double expectedInterval)
+{
+    g_run = run;
+    double start = GetTime();
+    double end = start + duration;
+    uint64 submitted = 0;
+    double now = start;
+    while (now < end)
+    {
+        if (concurrency > 0)
+        {
+            while (g_inFlight < concurrency && SubmitJob(GetTime()))
+                ;
+        }
+        else
+        {
+            // NOTE(Kevin): Submit everything that is due, even if we are late
+            while (start + (double)submitted / run->rate <= now &&
+                   SubmitJob(start + (double)submitted / run->rate))
+                ++submitted;
+        }
+        double nextDue = (concurrency > 0) ? end : start + (double)submitted / run->rate;
+        double timeout = nextDue - GetTime();
+        if (timeout > 0.01)
+            timeout = 0.01;
+        if (timeout < 0.0)
+            timeout = 0.0;
+        Poll(timeout, expectedInterval);
+        DoHousekeeping();
+        now = GetTime();
+    }
+    run->duration = GetTime() - start;
+    run->offered  = (double)run->sent / duration;
+
+    double drainEnd = GetTime() + DrainTimeout;
+    while (g_inFlight > 0 && GetTime() < drainEnd)
+    {
+        Poll(0.01, expectedInterval);
+        DoHousekeeping();
+    }
+    // NOTE(Kevin): Unfinished jobs count with the time we waited for them,
+    // dropping them would make an overloaded cluster look better
+    now = GetTime();
+    for (uint64 s = 0; s < JobSlotCount; ++s)
+    {
+        job_slot *slot = &g_slots[s];
+        if (slot->state == kSlotFree)
+            continue;
+        RecordValue(&run->latency, now - slot->dueTime);
+        RecordValue(&run->service, now - slot->queryTime);
+        slot->state = kSlotFree;
+        ++run->incomplete;
+    }
+    g_inFlight = 0;
+    g_oldestSequence = g_nextSequence;
+}
+
+internal void
+PrintRun(const run_result *run, unsigned int concurrency)
+{
+    char target[32];
+    if (concurrency > 0)
+        snprintf(target, sizeof(target), "%u in flight", concurrency);
+    else
+        snprintf(target, sizeof(target), "%.1f/s", run->rate);
+    printf("%-12s sent %7llu  done %7llu  failed %5llu  unfinished %5llu  %8.1f jobs/s"
+           "  latency p50 %9.3fms p90 %9.3fms p99 %9.3fms p99.9 %9.3fms max %9.3fms"
+           "  service p50 %9.3fms p99 %9.3fms\n",
+           target, run->sent, run->completed, run->failed, run->incomplete,
+           (double)(run->completed + run->failed) / run->duration,
+           GetQuantile(&run->latency, 0.5) * 1e3, GetQuantile(&run->latency, 0.9) * 1e3,
+           GetQuantile(&run->latency, 0.99) * 1e3, GetQuantile(&run->latency, 0.999) * 1e3,
+           (double)run->latency.max * 1e-6,
+           GetQuantile(&run->service, 0.5) * 1e3, GetQuantile(&run->service, 0.99) * 1e3);
+}
+
+internal int
+LoadJobSource(const char *path)
+{
+    if (!path)
+    {
+        local_persist char defaultSource[] = "class Job {\n static run(x) { x * 2 }\n}\n";
+        g_jobSource = defaultSource;
+        g_jobSourceLen = sizeof(defaultSource);
+        return kSuccess;
+    }
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return kCouldNotOpenFile;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    g_jobSource = malloc((size_t)size + 1);
+    if (!g_jobSource)
+    {
+        fclose(file);
+        return kNoMemory;
+    }
+    size_t got = fread(g_jobSource, 1, (size_t)size, file);
+    fclose(file);
+    g_jobSource[got] = '\0';
+    // NOTE(Kevin): Like SendJob, the terminating zero goes along
+    g_jobSourceLen = (uint32)got + 1;
+    return kSuccess;
+}
+
+internal int
+OpenListenSocket(const char *port)
+{
+    struct addrinfo hints, *info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+    if (getaddrinfo(0, port, &hints, &info) != 0)
+        return -1;
+    int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    int yes = 1;
+    if (fd == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1 ||
+        bind(fd, info->ai_addr, info->ai_addrlen) == -1 ||
+        listen(fd, 16) == -1)
+    {
+        if (fd != -1)
+            close(fd);
+        freeaddrinfo(info);
+        return -1;
+    }
+    freeaddrinfo(info);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+internal void
+PrintUsage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s -f ip#port [-p port] [-s job.wren] [-a arg]\n"
+            "       [-r rate[,rate...] | -c jobs in flight [-e expected interval]]\n"
+            "       [-d seconds per run] [-o output prefix]\n",
+            name);
+}
+
+int
+main(int argc, char **argv)
+{
+    char *firstPeer = 0;
+    const char *sourcePath = 0;
+    const char *outputPrefix = 0;
+    char *rateList = "10";
+    unsigned int concurrency = 0;
+    double expectedInterval = 0.0;
+    double duration = 10.0;
+
+    int option;
+    while ((option = getopt(argc, argv, "f:p:s:a:r:c:e:d:o:")) != -1)
+    {
+        switch (option)
+        {
+            case 'f': firstPeer = optarg; break;
+            case 'p':
+            {
+                strncpy(g_listenPort, optarg, PeerPortLen - 1);
+                g_listenPort[PeerPortLen - 1] = '\0';
+            } break;
+            case 's': sourcePath = optarg; break;
+            case 'a':
+            {
+                g_fixedArg = 1;
+                g_arg = atof(optarg);
+            } break;
+            case 'r': rateList = optarg; break;
+            case 'c': concurrency = (unsigned int)atoi(optarg); break;
+            case 'e': expectedInterval = atof(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'o': outputPrefix = optarg; break;
+            default:
+            {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        }
+    }
+    char *separator = firstPeer ? strchr(firstPeer, '#') : 0;
+    if (!separator || duration <= 0.0 || concurrency >= JobSlotCount)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    *separator = '\0';
+
+    double rates[MaxRates];
+    int rateCount = 0;
+    if (concurrency == 0)
+    {
+        for (char *rate = strtok(rateList, ","); rate && rateCount < MaxRates; rate = strtok(0, ","))
+        {
+            rates[rateCount] = atof(rate);
+            if (rates[rateCount] <= 0.0)
+            {
+                fprintf(stderr, "Invalid rate %s\n", rate);
+                return 1;
+            }
+            ++rateCount;
+        }
+    }
+    else
+    {
+        rateCount = 1;
+        rates[0] = 0.0;
+    }
+
+    if (LoadJobSource(sourcePath) != kSuccess)
+    {
+        fprintf(stderr, "Can not read %s\n", sourcePath);
+        return 1;
+    }
+    g_slots = calloc(JobSlotCount, sizeof(job_slot));
+    run_result *results = calloc((size_t)rateCount, sizeof(run_result));
+    if (!g_slots || !results)
+    {
+        fprintf(stderr, "Not enough memory.\n");
+        return 1;
+    }
+    FILE *random = fopen("/dev/urandom", "rb");
+    if (!random || fread(g_cookiePrefix, 1, sizeof(g_cookiePrefix), random) != sizeof(g_cookiePrefix))
+    {
+        uint64 seed = (uint64)time(0) ^ ((uint64)getpid() << 32);
+        memcpy(g_cookiePrefix, &seed, sizeof(seed));
+    }
+    if (random)
+        fclose(random);
+    signal(SIGPIPE, SIG_IGN);
+
+    g_listenFd = OpenListenSocket(g_listenPort);
+    if (g_listenFd == -1)
+    {
+        fprintf(stderr, "Can not listen on port %s\n", g_listenPort);
+        return 1;
+    }
+    int first = ConnectTo(firstPeer, separator + 1);
+    if (first == -1)
+    {
+        fprintf(stderr, "Can not connect to %s#%s\n", firstPeer, separator + 1);
+        return 1;
+    }
+    // NOTE(Kevin): Workers answer queries to the address they see us at
+    struct sockaddr_storage local;
+    socklen_t localLen = sizeof(local);
+    getsockname(g_connections[first].fd, (struct sockaddr*)&local, &localLen);
+    if (local.ss_family == AF_INET)
+        inet_ntop(AF_INET, &((struct sockaddr_in*)&local)->sin_addr, g_source.ipaddr, PeerIPLen);
+    else
+        inet_ntop(AF_INET6, &((struct sockaddr_in6*)&local)->sin6_addr, g_source.ipaddr, PeerIPLen);
+    memcpy(g_source.port, g_listenPort, PeerPortLen);
+    SendTypeOnly(g_connections[first].fd, kGetPeers);
+
+    // NOTE(Kevin): Give the peer list time to arrive
+    run_result settle;
+    memset(&settle, 0, sizeof(settle));
+    g_run = &settle;
+    for (double end = GetTime() + 1.0; GetTime() < end; )
+        Poll(0.01, 0.0);
+    printf("Connected to %d peers as %s#%s\n", g_connectionCount, g_source.ipaddr, g_source.port);
+
+    for (int r = 0; r < rateCount; ++r)
+    {
+        results[r].rate = rates[r];
+        Run(&results[r], concurrency, duration, expectedInterval);
+        PrintRun(&results[r], concurrency);
+        fflush(stdout);
+        if (outputPrefix)
+        {
+            char path[1024];
+            if (concurrency > 0)
+                snprintf(path, sizeof(path), "%s_c%u.hgrm", outputPrefix, concurrency);
+            else
+                snprintf(path, sizeof(path), "%s_%g.hgrm", outputPrefix, rates[r]);
+            if (WriteHistogram(path, &results[r].latency) != kSuccess)
+                fprintf(stderr, "Can not write %s\n", path);
+            if (concurrency > 0)
+                snprintf(path, sizeof(path), "%s_c%u_service.hgrm", outputPrefix, concurrency);
+            else
+                snprintf(path, sizeof(path), "%s_%g_service.hgrm", outputPrefix, rates[r]);
+            if (WriteHistogram(path, &results[r].service) != kSuccess)
+                fprintf(stderr, "Can not write %s\n", path);
+        }
+    }
+
+    for (int i = g_connectionCount - 1; i >= 0; --i)
+        RemoveConnection(i);
+    close(g_listenFd);
+    return 0;
+}
@@ -0,0 +1,362 @@
+// NOTE(Kevin): Replays a wire capture (p2pjs -r) into a node. This program
+// is the node: it includes p2pjs.c with the socket calls replaced and
+// feeds the recorded messages into HandleMessageFromPeer(), at the
+// recorded speed or as fast as possible. Everything the node sends is
+// dropped, jobs it takes are run. Query storms and result bursts of a
+// real cluster can be reproduced this way, e.g. under perf or valgrind.
+// Closed connections are not recorded, so they are not replayed either.
+//
+// Usage: replay [-s speed] [-l level[:subsystem,...]] [-m] capture
+//   -s  1 is the recorded speed (default), 2 twice as fast, 0 as fast as possible
+//   -m  print the metrics of the node at the end
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "../p2pjs.h"
+
+// NOTE(Kevin): Fds of the replayed peers, far away from real ones
+#define ReplayFirstFd (1 << 20)
+
+global_variable int         g_nextReplayFd = ReplayFirstFd;
+// NOTE(Kevin): The frame that is being dispatched
+global_variable const char *g_frame;
+global_variable uint32      g_frameSize;
+global_variable uint32      g_framePos;
+global_variable uint64      g_sentBytes;
+
+internal ssize_t
+ReplaySend(int fd, const void *buffer, size_t length, int flags)
+{
+    (void)fd;
+    (void)buffer;
+    (void)flags;
+    g_sentBytes += length;
+    return (ssize_t)length;
+}
+
+internal ssize_t
+ReplayRecv(int fd, void *buffer, size_t length, int flags)
+{
+    (void)fd;
+    (void)flags;
+    if (g_framePos == g_frameSize)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (length > g_frameSize - g_framePos)
+        length = g_frameSize - g_framePos;
+    memcpy(buffer, g_frame + g_framePos, length);
+    g_framePos += (uint32)length;
+    return (ssize_t)length;
+}
+
+internal int
+ReplaySocket(int domain, int type, int protocol)
+{
+    (void)domain;
+    (void)type;
+    (void)protocol;
+    return g_nextReplayFd++;
+}
+
+internal int
+ReplayConnect(int fd, const struct sockaddr *address, socklen_t addressLength)
+{
+    (void)fd;
+    (void)address;
+    (void)addressLength;
+    return 0;
+}
+
+#define send    ReplaySend
+#define recv    ReplayRecv
+#define socket  ReplaySocket
+#define connect ReplayConnect
+#define P2PJS_NoMain
+#include "../p2pjs.c"
+#undef send
+#undef recv
+#undef socket
+#undef connect
+
+typedef struct
+{
+    int recordedFd;
+    int fd;
+} replay_peer;
+
+global_variable replay_peer *g_replayPeers;
+global_variable unsigned int g_replayPeerCount;
+global_variable unsigned int g_replayPeerCapacity;
+
+internal int
+FindPeerId(int fd)
+{
+    for (unsigned int i = 0; i < g_peerCount; ++i)
+    {
+        if (g_peerFds[i].fd == fd)
+            return (int)i;
+    }
+    return -1;
+}
+
+internal replay_peer *
+FindReplayPeer(int recordedFd)
+{
+    for (unsigned int i = 0; i < g_replayPeerCount; ++i)
+    {
+        if (g_replayPeers[i].recordedFd == recordedFd)
+            return &g_replayPeers[i];
+    }
+    return 0;
+}
+
+// NOTE(Kevin): Finds or creates the peer for a recorded fd. A peer the
+// node connected to during the replay is reused.
+internal int
+MapPeer(int recordedFd, const peer_info *info)
+{
+    replay_peer *peer = FindReplayPeer(recordedFd);
+    if (peer)
+    {
+        int id = FindPeerId(peer->fd);
+        if (id != -1 && AreIPAddressesEqual(GetPeerIP(id), info->ipaddr))
+        {
+            // NOTE(Kevin): Same connection, the port is known now
+            if (GetPeerPort(id)[0] == '\0' && info->port[0] != '\0')
+                UpdatePeerPort(id, info->port);
+            return peer->fd;
+        }
+    }
+    else
+    {
+        if (g_replayPeerCount == g_replayPeerCapacity)
+        {
+            unsigned int newCapacity = g_replayPeerCapacity > 0 ? g_replayPeerCapacity * 2 : 8;
+            replay_peer *t = realloc(g_replayPeers, sizeof(replay_peer) * newCapacity);
+            if (!t)
+                return -1;
+            g_replayPeers = t;
+            g_replayPeerCapacity = newCapacity;
+        }
+        peer = &g_replayPeers[g_replayPeerCount++];
+        peer->recordedFd = recordedFd;
+    }
+
+    int id = (info->port[0] != '\0') ? CheckForPeer(info->ipaddr, info->port) : -1;
+    if (id != -1)
+    {
+        peer->fd = g_peerFds[id].fd;
+    }
+    else
+    {
+        peer->fd = g_nextReplayFd++;
+        id = AddPeer(peer->fd, info->ipaddr);
+        if (id == -1)
+            return -1;
+        if (info->port[0] != '\0')
+            UpdatePeerPort(id, info->port);
+    }
+    return peer->fd;
+}
+
+// NOTE(Kevin): What the main loop of p2pjs does besides polling sockets
+internal void
+StepNode(void)
+{
+    ExecuteNextJob();
+    OfferFreeSlots(0, g_localPort);
+    CheckHeartbeats();
+    CheckHedgedJobs();
+    RetryUnansweredQueries();
+    FlushAggregations();
+    ExpireJobInputs();
+    PumpPayloadStreams();
+    UpdateQueueMetrics();
+}
+
+internal void
+DispatchFrame(int fd, const char *frame, uint32 size)
+{
+    int id = FindPeerId(fd);
+    if (id == -1)
+        return;
+    g_frame     = frame;
+    g_frameSize = size;
+    g_framePos  = 0;
+    TouchPeer(id);
+    // NOTE(Kevin): The decoder wants to be called again after the header
+    while (g_framePos < g_frameSize)
+    {
+        int err = HandleMessageFromPeer(fd, id, g_localPort);
+        if (err != kSuccess && err != kWouldBlock)
+        {
+            LogUser(kLogMain, "Recorded frame could not be decoded: %s\n", ErrorToString(err));
+            DropMessageBuffer(fd);
+            break;
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    double speed = 1.0;
+    bool32 printMetrics = 0;
+    int option;
+    while ((option = getopt(argc, argv, "s:l:m")) != -1)
+    {
+        switch (option)
+        {
+            case 's':
+            {
+                speed = atof(optarg);
+            } break;
+            case 'l':
+            {
+                if (SetLogFilter(optarg) != kSuccess)
+                {
+                    fprintf(stderr, "Expected level[:subsystem,...]\n");
+                    return 1;
+                }
+            } break;
+            case 'm':
+            {
+                printMetrics = 1;
+            } break;
+            default:
+            {
+                fprintf(stderr, "Usage: %s [-s speed] [-l level[:subsystem,...]] [-m] capture\n", argv[0]);
+                return 1;
+            } break;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "Usage: %s [-s speed] [-l level[:subsystem,...]] [-m] capture\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[optind], "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Can not open %s.\n", argv[optind]);
+        return 1;
+    }
+    capture_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, CaptureMagic, sizeof(header.magic)) != 0 ||
+        header.version != CaptureVersion ||
+        header.recordSize != sizeof(capture_record))
+    {
+        fprintf(stderr, "%s is not a p2pjs capture of this version.\n", argv[optind]);
+        fclose(file);
+        return 1;
+    }
+    header.ipaddr[PeerIPLen - 1] = '\0';
+    header.port[PeerPortLen - 1] = '\0';
+
+    // NOTE(Kevin): Replay as the node that recorded the capture
+    g_localIp   = header.ipaddr;
+    g_localPort = header.port;
+    if (!OpenLog())
+    {
+        fprintf(stderr, "Failed to open log file.\n");
+        fclose(file);
+        return 1;
+    }
+    srand(2096);
+    InitCookieGenerator(g_localIp, g_localPort);
+
+    char *frame = 0;
+    uint32 frameCapacity = 0;
+    uint64 frameCount = 0;
+    uint64 frameBytes = 0;
+    double startTime = GetTime();
+    capture_record record;
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        if (record.size > frameCapacity)
+        {
+            uint32 newCapacity = frameCapacity > 0 ? frameCapacity : 4096;
+            while (newCapacity < record.size)
+                newCapacity *= 2;
+            char *t = realloc(frame, newCapacity);
+            if (!t)
+            {
+                fprintf(stderr, "Not enough memory.\n");
+                break;
+            }
+            frame = t;
+            frameCapacity = newCapacity;
+        }
+        if (record.size > 0 && fread(frame, record.size, 1, file) != 1)
+        {
+            fprintf(stderr, "The capture ends in the middle of a record.\n");
+            break;
+        }
+
+        if (speed > 0.0)
+        {
+            double due = startTime + (double)record.time * 1e-9 / speed;
+            for (double now = GetTime(); now < due; now = GetTime())
+            {
+                StepNode();
+                if (g_receivedJobCount == 0)
+                {
+                    double wait = due - now;
+                    struct timespec ts = { 0, (long)((wait < 0.001 ? wait : 0.001) * 1e9) };
+                    nanosleep(&ts, 0);
+                }
+            }
+        }
+
+        if (record.kind == kCapturePeer && record.size == sizeof(peer_info))
+        {
+            peer_info info;
+            memcpy(&info, frame, sizeof(info));
+            info.ipaddr[PeerIPLen - 1] = '\0';
+            info.port[PeerPortLen - 1] = '\0';
+            if (MapPeer(record.peer, &info) == -1)
+                LogUser(kLogMain, "Failed to add peer %s.\n", info.ipaddr);
+        }
+        else if (record.kind == kCaptureFrame)
+        {
+            replay_peer *peer = FindReplayPeer(record.peer);
+            if (peer)
+            {
+                DispatchFrame(peer->fd, frame, record.size);
+                ++frameCount;
+                frameBytes += record.size;
+            }
+            StepNode();
+        }
+    }
+    double replayTime = GetTime() - startTime;
+    fclose(file);
+    free(frame);
+
+    // NOTE(Kevin): Run what is still queued
+    while (g_receivedJobCount > 0)
+        StepNode();
+    double totalTime = GetTime() - startTime;
+
+    printf("Replayed %llu messages (%llu bytes) in %.3f s: %.0f messages/s, %.2f MB/s\n",
+           frameCount, frameBytes, replayTime, (double)frameCount / replayTime,
+           (double)frameBytes / replayTime / (1024.0 * 1024.0));
+    printf("Ran %lld jobs, sent %llu bytes, %.3f s in total\n",
+           (long long)MetricGet(&g_metricJobsExecuted), g_sentBytes, totalTime);
+    if (printMetrics)
+        DumpMetrics(stdout);
+    CloseLog();
+    return 0;
+}
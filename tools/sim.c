@@ -0,0 +1,1354 @@
+// NOTE(Kevin): Discrete event simulator for a p2pjs cluster. All nodes
+// live in this one process and run the real code of peer_handling.c,
+// fairshare.c and jobs.c; only the clock, the sockets and the job VM are
+// simulated. p2pjs.c puts the globals of a node into the section
+// p2pjs_node (see P2PJS_Simulation), every simulated node has a copy of
+// that section and we swap it in before the node handles an event.
+//
+// Links have a latency, an exponential jitter and a bandwidth; data on a
+// link stays in order, like on a TCP connection. Jobs do not run, a job
+// keeps its node busy for as long as its argument says (in seconds).
+// Nodes can crash (and come back with a fresh state), connections can be
+// reset. Everything is derived from the seed, so a run can be repeated
+// exactly.
+//
+// Keep in mind that p2pjs ends up with a full mesh and floods queries:
+// a job costs O(nodes^2) messages, and so does every heartbeat round.
+// With -k the nodes skip the peer lists and connect to k random nodes
+// instead; that is how thousands of nodes can be simulated.
+//
+// Usage: sim [-n nodes] [-e emitters] [-j jobs] [-r rate] [-D seconds] [-c] [-H fraction]
+//            [-k degree] [-d ms] [-J ms] [-B mbit] [-z bytes] [-F seconds] [-R seconds] [-L seconds]
+//            [-w seconds] [-i ms] [-T seconds] [-s seed] [-l level[:subsystem,...]]
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <ifaddrs.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../p2pjs.h"
+
+// NOTE(Kevin): Fds of simulated sockets, far away from real ones
+#define SimFirstFd (1 << 20)
+#define SimPort    "2096"
+// NOTE(Kevin): Node i has the address SimBaseAddress + i
+#define SimBaseAddress ((10u << 24) + 1)
+
+enum
+{
+    kSimJoin,
+    kSimLoop,
+    kSimTick,
+    kSimDeliver,
+    kSimAccept,
+    kSimHangUp,
+    kSimEmit,
+    kSimCrash,
+    kSimLinkFailure,
+};
+
+typedef struct
+{
+    double time;
+    // NOTE(Kevin): Events at the same time are handled in the order they were created
+    uint64 seq;
+    int    kind;
+    int    node;
+    uint32 incarnation;
+    int    fd;
+} sim_event;
+
+// NOTE(Kevin): Bytes that are on their way; one send() or several
+// send()s of the same instant
+typedef struct
+{
+    double sendTime;
+    double arrival;
+    uint32 size;
+} sim_chunk;
+
+typedef struct
+{
+    int    node;
+    // NOTE(Kevin): The other end of the connection, -1 if there is none
+    int    peerFd;
+    bool32 isOpen;
+    bool32 isAccepted;
+    bool32 isHungUp;
+    bool32 isReady;
+    bool32 isDeliveryScheduled;
+    double latency;
+    // NOTE(Kevin): When the link in our direction is free again
+    double linkFree;
+    // NOTE(Kevin): rx[rxStart, rxReadable) can be read, rx[rxReadable, rxEnd) is in flight
+    char  *rx;
+    uint32 rxStart;
+    uint32 rxReadable;
+    uint32 rxEnd;
+    uint32 rxCapacity;
+    sim_chunk   *chunks;
+    unsigned int chunkHead;
+    unsigned int chunkCount;
+    unsigned int chunkCapacity;
+} sim_endpoint;
+
+typedef struct
+{
+    char   ip[PeerIPLen];
+    uint8 *state;
+    uint32 incarnation;
+    bool32 isUp;
+    bool32 isEmitter;
+    bool32 isLoopScheduled;
+    double busyUntil;
+    int   *readyFds;
+    unsigned int readyCount;
+    unsigned int readyCapacity;
+    int   *acceptFds;
+    unsigned int acceptCount;
+    unsigned int acceptCapacity;
+    unsigned int jobsToEmit;
+    uint64 jobsRun;
+    double busyTime;
+} sim_node;
+
+// NOTE(Kevin): The section with the state of the current node
+extern char __start_p2pjs_node[];
+extern char __stop_p2pjs_node[];
+
+global_variable double        g_simTime;
+global_variable uint64        g_simRandomState;
+global_variable sim_event    *g_simEvents;
+global_variable unsigned int  g_simEventCount;
+global_variable unsigned int  g_simEventCapacity;
+global_variable uint64        g_simNextSeq;
+global_variable sim_node     *g_simNodes;
+global_variable int           g_simNodeCount;
+global_variable int           g_currentNode = -1;
+global_variable uint8        *g_simPristineState;
+global_variable size_t        g_simStateSize;
+global_variable sim_endpoint *g_simEndpoints;
+global_variable unsigned int  g_simEndpointCount;
+global_variable unsigned int  g_simEndpointCapacity;
+global_variable struct addrinfo    g_simAddrInfo;
+global_variable struct sockaddr_in g_simAddress;
+global_variable double        g_simLastResult;
+
+// NOTE(Kevin): Model parameters
+global_variable double g_simLatency   = 0.0002;
+global_variable double g_simJitter    = 0.00005;
+global_variable double g_simBandwidth = 1000e6;
+
+global_variable uint64 g_simConnects;
+global_variable uint64 g_simRefusedConnects;
+global_variable uint64 g_simCrashes;
+global_variable uint64 g_simRestarts;
+global_variable uint64 g_simLinkFailures;
+
+internal double
+GetTime(void)
+{
+    return g_simTime;
+}
+
+internal double
+GetWallTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// NOTE(Kevin): xorshift64*; rand() belongs to the nodes
+internal uint64
+SimRandomU64(void)
+{
+    g_simRandomState ^= g_simRandomState >> 12;
+    g_simRandomState ^= g_simRandomState << 25;
+    g_simRandomState ^= g_simRandomState >> 27;
+    return g_simRandomState * 2685821657736338717ull;
+}
+
+internal double
+SimRandom(void)
+{
+    return (double)(SimRandomU64() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+internal double
+SimExponential(double mean)
+{
+    if (mean <= 0.0)
+        return 0.0;
+    return -log(1.0 - SimRandom()) * mean;
+}
+
+internal void
+PushEvent(double time, int kind, int node, int fd)
+{
+    if (g_simEventCount == g_simEventCapacity)
+    {
+        unsigned int newCapacity = g_simEventCapacity > 0 ? g_simEventCapacity * 2 : 1024;
+        sim_event *t = realloc(g_simEvents, sizeof(sim_event) * newCapacity);
+        if (!t)
+        {
+            fprintf(stderr, "Not enough memory for the event queue.\n");
+            exit(1);
+        }
+        g_simEvents = t;
+        g_simEventCapacity = newCapacity;
+    }
+    sim_event event = { time, g_simNextSeq++, kind, node, g_simNodes[node].incarnation, fd };
+    // NOTE(Kevin): Binary min-heap on (time, seq)
+    unsigned int i = g_simEventCount++;
+    while (i > 0)
+    {
+        unsigned int parent = (i - 1) / 2;
+        sim_event *p = &g_simEvents[parent];
+        if (p->time < event.time || (p->time == event.time && p->seq < event.seq))
+            break;
+        g_simEvents[i] = *p;
+        i = parent;
+    }
+    g_simEvents[i] = event;
+}
+
+internal sim_event
+PopEvent(void)
+{
+    sim_event top  = g_simEvents[0];
+    sim_event last = g_simEvents[--g_simEventCount];
+    unsigned int i = 0;
+    for (;;)
+    {
+        unsigned int child = 2 * i + 1;
+        if (child >= g_simEventCount)
+            break;
+        sim_event *c = &g_simEvents[child];
+        if (child + 1 < g_simEventCount)
+        {
+            sim_event *d = &g_simEvents[child + 1];
+            if (d->time < c->time || (d->time == c->time && d->seq < c->seq))
+            {
+                ++child;
+                c = d;
+            }
+        }
+        if (last.time < c->time || (last.time == c->time && last.seq < c->seq))
+            break;
+        g_simEvents[i] = *c;
+        i = child;
+    }
+    if (g_simEventCount > 0)
+        g_simEvents[i] = last;
+    return top;
+}
+
+internal void
+SwitchToNode(int n)
+{
+    if (n == g_currentNode)
+        return;
+    if (g_currentNode != -1)
+        memcpy(g_simNodes[g_currentNode].state, __start_p2pjs_node, g_simStateSize);
+    memcpy(__start_p2pjs_node, g_simNodes[n].state, g_simStateSize);
+    g_currentNode = n;
+}
+
+internal sim_endpoint *
+GetEndpoint(int fd)
+{
+    if (fd < SimFirstFd || (unsigned int)(fd - SimFirstFd) >= g_simEndpointCount)
+        return 0;
+    return &g_simEndpoints[fd - SimFirstFd];
+}
+
+internal int
+NewEndpoint(int node)
+{
+    if (g_simEndpointCount == g_simEndpointCapacity)
+    {
+        unsigned int newCapacity = g_simEndpointCapacity > 0 ? g_simEndpointCapacity * 2 : 1024;
+        sim_endpoint *t = realloc(g_simEndpoints, sizeof(sim_endpoint) * newCapacity);
+        if (!t)
+            return -1;
+        g_simEndpoints = t;
+        g_simEndpointCapacity = newCapacity;
+    }
+    sim_endpoint *ep = &g_simEndpoints[g_simEndpointCount];
+    memset(ep, 0, sizeof(*ep));
+    ep->node   = node;
+    ep->peerFd = -1;
+    ep->isOpen = 1;
+    return SimFirstFd + (int)g_simEndpointCount++;
+}
+
+internal void
+AppendFd(int **fds, unsigned int *count, unsigned int *capacity, int fd)
+{
+    if (*count == *capacity)
+    {
+        unsigned int newCapacity = *capacity > 0 ? *capacity * 2 : 8;
+        int *t = realloc(*fds, sizeof(int) * newCapacity);
+        if (!t)
+            return;
+        *fds = t;
+        *capacity = newCapacity;
+    }
+    (*fds)[(*count)++] = fd;
+}
+
+internal void
+WakeNode(int n)
+{
+    sim_node *node = &g_simNodes[n];
+    if (node->isLoopScheduled || !node->isUp)
+        return;
+    node->isLoopScheduled = 1;
+    PushEvent(node->busyUntil > g_simTime ? node->busyUntil : g_simTime, kSimLoop, n, -1);
+}
+
+internal void
+MarkReady(int fd)
+{
+    sim_endpoint *ep = GetEndpoint(fd);
+    if (!ep->isAccepted || ep->isReady)
+        return;
+    sim_node *node = &g_simNodes[ep->node];
+    ep->isReady = 1;
+    AppendFd(&node->readyFds, &node->readyCount, &node->readyCapacity, fd);
+    WakeNode(ep->node);
+}
+
+internal void
+ScheduleDelivery(int fd)
+{
+    sim_endpoint *ep = GetEndpoint(fd);
+    if (ep->isDeliveryScheduled || ep->chunkHead == ep->chunkCount)
+        return;
+    ep->isDeliveryScheduled = 1;
+    PushEvent(ep->chunks[ep->chunkHead].arrival, kSimDeliver, ep->node, fd);
+}
+
+internal double
+GetLastArrival(sim_endpoint *ep)
+{
+    return (ep->chunkHead < ep->chunkCount) ? ep->chunks[ep->chunkCount - 1].arrival : 0.0;
+}
+
+// NOTE(Kevin): Forgets what is still in flight to ep and was sent after time
+internal void
+DropChunksSentAfter(sim_endpoint *ep, double time)
+{
+    while (ep->chunkCount > ep->chunkHead && ep->chunks[ep->chunkCount - 1].sendTime > time)
+    {
+        ep->rxEnd -= ep->chunks[ep->chunkCount - 1].size;
+        --ep->chunkCount;
+    }
+}
+
+internal void
+HangUpPeerOf(sim_endpoint *ep)
+{
+    sim_endpoint *peer = GetEndpoint(ep->peerFd);
+    if (!peer || !peer->isOpen || peer->isHungUp)
+        return;
+    double due = g_simTime + ep->latency;
+    double lastArrival = GetLastArrival(peer);
+    PushEvent(due > lastArrival ? due : lastArrival, kSimHangUp, peer->node, ep->peerFd);
+}
+
+internal void
+CloseEndpoint(int fd)
+{
+    sim_endpoint *ep = GetEndpoint(fd);
+    if (!ep || !ep->isOpen)
+        return;
+    ep->isOpen = 0;
+    free(ep->rx);
+    free(ep->chunks);
+    ep->rx = 0;
+    ep->chunks = 0;
+    ep->rxStart = ep->rxReadable = ep->rxEnd = ep->rxCapacity = 0;
+    ep->chunkHead = ep->chunkCount = ep->chunkCapacity = 0;
+    HangUpPeerOf(ep);
+}
+
+internal int
+SimSocket(int domain, int type, int protocol)
+{
+    (void)domain;
+    (void)type;
+    (void)protocol;
+    int fd = NewEndpoint(g_currentNode);
+    if (fd == -1)
+        errno = ENOMEM;
+    return fd;
+}
+
+internal int
+SimConnect(int fd, const struct sockaddr *address, socklen_t addressLength)
+{
+    (void)addressLength;
+    ++g_simConnects;
+    int target = -1;
+    if (address->sa_family == AF_INET)
+    {
+        uint32 a = ntohl(((const struct sockaddr_in *)address)->sin_addr.s_addr);
+        if (a >= SimBaseAddress && a - SimBaseAddress < (uint32)g_simNodeCount)
+            target = (int)(a - SimBaseAddress);
+    }
+    if (!GetEndpoint(fd) || target == -1 || !g_simNodes[target].isUp)
+    {
+        ++g_simRefusedConnects;
+        errno = ECONNREFUSED;
+        return -1;
+    }
+    int peerFd = NewEndpoint(target);
+    if (peerFd == -1)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    sim_endpoint *ep   = GetEndpoint(fd);
+    sim_endpoint *peer = GetEndpoint(peerFd);
+    ep->peerFd     = peerFd;
+    ep->isAccepted = 1;
+    ep->latency    = g_simLatency;
+    peer->peerFd   = fd;
+    peer->latency  = g_simLatency;
+    // NOTE(Kevin): connect() returns right away, the other side accepts
+    // once the handshake arrived; our data can not overtake it
+    PushEvent(g_simTime + ep->latency, kSimAccept, target, peerFd);
+    return 0;
+}
+
+internal ssize_t
+SimSend(int fd, const void *buffer, size_t length, int flags)
+{
+    (void)flags;
+    sim_endpoint *ep = GetEndpoint(fd);
+    if (!ep || !ep->isOpen)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if (ep->isHungUp || ep->peerFd == -1)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    sim_endpoint *peer = GetEndpoint(ep->peerFd);
+    // NOTE(Kevin): The other side crashed and we don't know yet; the
+    // kernel takes the data anyway
+    if (!peer->isOpen || !g_simNodes[peer->node].isUp)
+        return (ssize_t)length;
+
+    double start = (ep->linkFree > g_simTime) ? ep->linkFree : g_simTime;
+    ep->linkFree = start + (double)length * 8.0 / g_simBandwidth;
+    double arrival = ep->linkFree + ep->latency + SimExponential(g_simJitter);
+
+    if (peer->rxEnd + length > peer->rxCapacity)
+    {
+        // NOTE(Kevin): Move the unread bytes to the front first
+        if (peer->rxStart > 0)
+        {
+            memmove(peer->rx, peer->rx + peer->rxStart, peer->rxEnd - peer->rxStart);
+            peer->rxReadable -= peer->rxStart;
+            peer->rxEnd      -= peer->rxStart;
+            peer->rxStart     = 0;
+        }
+        if (peer->rxEnd + length > peer->rxCapacity)
+        {
+            uint32 newCapacity = peer->rxCapacity > 0 ? peer->rxCapacity : 256;
+            while (newCapacity < peer->rxEnd + length)
+                newCapacity *= 2;
+            char *t = realloc(peer->rx, newCapacity);
+            if (!t)
+            {
+                errno = ENOMEM;
+                return -1;
+            }
+            peer->rx = t;
+            peer->rxCapacity = newCapacity;
+        }
+    }
+    memcpy(peer->rx + peer->rxEnd, buffer, length);
+    peer->rxEnd += (uint32)length;
+
+    // NOTE(Kevin): The send()s of one message go out at the same instant
+    // and travel as one chunk
+    sim_chunk *last = (peer->chunkCount > peer->chunkHead) ? &peer->chunks[peer->chunkCount - 1] : 0;
+    if (last && last->sendTime == g_simTime)
+    {
+        if (arrival > last->arrival)
+            last->arrival = arrival;
+        last->size += (uint32)length;
+    }
+    else
+    {
+        // NOTE(Kevin): Jitter does not reorder a connection
+        if (last && arrival < last->arrival)
+            arrival = last->arrival;
+        if (peer->chunkCount == peer->chunkCapacity)
+        {
+            if (peer->chunkHead > 0)
+            {
+                memmove(peer->chunks, peer->chunks + peer->chunkHead,
+                        sizeof(sim_chunk) * (peer->chunkCount - peer->chunkHead));
+                peer->chunkCount -= peer->chunkHead;
+                peer->chunkHead = 0;
+            }
+            else
+            {
+                unsigned int newCapacity = peer->chunkCapacity > 0 ? peer->chunkCapacity * 2 : 8;
+                sim_chunk *t = realloc(peer->chunks, sizeof(sim_chunk) * newCapacity);
+                if (!t)
+                {
+                    peer->rxEnd -= (uint32)length;
+                    errno = ENOMEM;
+                    return -1;
+                }
+                peer->chunks = t;
+                peer->chunkCapacity = newCapacity;
+            }
+        }
+        sim_chunk *chunk = &peer->chunks[peer->chunkCount++];
+        chunk->sendTime = g_simTime;
+        chunk->arrival  = arrival;
+        chunk->size     = (uint32)length;
+    }
+    ScheduleDelivery(ep->peerFd);
+    return (ssize_t)length;
+}
+
+internal ssize_t
+SimRecv(int fd, void *buffer, size_t length, int flags)
+{
+    (void)flags;
+    sim_endpoint *ep = GetEndpoint(fd);
+    if (!ep || !ep->isOpen)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    uint32 readable = ep->rxReadable - ep->rxStart;
+    if (readable == 0)
+    {
+        if (ep->isHungUp)
+            return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    if (length > readable)
+        length = readable;
+    memcpy(buffer, ep->rx + ep->rxStart, length);
+    ep->rxStart += (uint32)length;
+    // NOTE(Kevin): A full mesh of a thousand nodes has two million
+    // endpoints, only the busy ones keep their buffers
+    if (ep->rxStart == ep->rxEnd)
+    {
+        free(ep->rx);
+        ep->rx = 0;
+        ep->rxStart = ep->rxReadable = ep->rxEnd = ep->rxCapacity = 0;
+    }
+    return (ssize_t)length;
+}
+
+internal int
+SimClose(int fd)
+{
+    if (fd < SimFirstFd)
+        return close(fd);
+    CloseEndpoint(fd);
+    return 0;
+}
+
+// NOTE(Kevin): ConnectToPeer() neither checks nor frees the result
+internal int
+SimGetAddrInfo(const char *node, const char *service,
+               const struct addrinfo *hints, struct addrinfo **result)
+{
+    (void)hints;
+    memset(&g_simAddress, 0, sizeof(g_simAddress));
+    memset(&g_simAddrInfo, 0, sizeof(g_simAddrInfo));
+    g_simAddress.sin_family = AF_INET;
+    g_simAddress.sin_port   = htons((uint16)atoi(service ? service : "0"));
+    int status = 0;
+    if (!node || inet_pton(AF_INET, node, &g_simAddress.sin_addr) != 1)
+        status = EAI_NONAME;
+    g_simAddrInfo.ai_family   = AF_INET;
+    g_simAddrInfo.ai_socktype = SOCK_STREAM;
+    g_simAddrInfo.ai_addr     = (struct sockaddr *)&g_simAddress;
+    g_simAddrInfo.ai_addrlen  = sizeof(g_simAddress);
+    *result = &g_simAddrInfo;
+    return status;
+}
+
+// NOTE(Kevin): Stands in for vm.c. The argument of a simulated job is
+// its run time.
+internal double
+GetLastResult(void)
+{
+    return g_simLastResult;
+}
+
+internal const double *
+GetLastValues(uint32 *countOut)
+{
+    *countOut = 0;
+    return 0;
+}
+
+internal const uint8 *
+GetLastPayload(uint32 *sizeOut)
+{
+    *sizeOut = 0;
+    return 0;
+}
+
+internal int
+RunCode(uint8 cookie[CookieLen], double arg, uint32 kind, const char *source, job_usage *usage)
+{
+    (void)cookie;
+    (void)kind;
+    (void)source;
+    sim_node *node = &g_simNodes[g_currentNode];
+    double duration = (arg > 0.0) ? arg : 0.0;
+    g_simTime += duration;
+    node->busyUntil = g_simTime;
+    node->busyTime += duration;
+    ++node->jobsRun;
+    usage->cpuTime  = duration;
+    usage->wallTime = duration;
+    usage->peakHeap = 0;
+    g_simLastResult = arg;
+    return kSuccess;
+}
+
+#define send         SimSend
+#define recv         SimRecv
+#define socket       SimSocket
+#define connect      SimConnect
+#define close        SimClose
+#define getaddrinfo  SimGetAddrInfo
+#define freeaddrinfo(A) ((void)(A))
+#define P2PJS_NoMain
+#define P2PJS_Simulation
+// NOTE(Kevin): Simulated jobs only take time; with -c they would all hit
+// the result cache
+#define P2PJS_MemoCapacity 0
+#include "../p2pjs.c"
+#undef send
+#undef recv
+#undef socket
+#undef connect
+#undef close
+#undef getaddrinfo
+#undef freeaddrinfo
+// NOTE(Kevin): Back to plain statics, the rest is simulator state
+#undef global_variable
+#define global_variable static
+
+global_variable double g_simTickInterval = 0.1;
+global_variable double g_simMTBF;
+global_variable double g_simDowntime;
+global_variable double g_simLinkMTBF;
+global_variable double g_simEmitRate = 100.0;
+global_variable double g_simJobDuration = 0.01;
+global_variable bool32 g_simConstantDuration;
+global_variable double g_simHedgedFraction;
+// NOTE(Kevin): 0 joins like p2pjs does, which ends in a full mesh
+global_variable int    g_simDegree;
+global_variable char   g_simJobPath[] = "/tmp/p2pjs_simXXXXXX";
+
+internal int
+FindPeerId(int fd)
+{
+    for (unsigned int i = 0; i < g_peerCount; ++i)
+    {
+        if (g_peerFds[i].fd == fd)
+            return (int)i;
+    }
+    return -1;
+}
+
+// NOTE(Kevin): One iteration of the main loop of p2pjs
+internal void
+RunNodeIteration(int n)
+{
+    sim_node *node = &g_simNodes[n];
+    SwitchToNode(n);
+
+    for (unsigned int i = 0; i < node->acceptCount; ++i)
+    {
+        int fd = node->acceptFds[i];
+        sim_endpoint *ep = GetEndpoint(fd);
+        if (!ep->isOpen)
+            continue;
+        if (AddPeer(fd, g_simNodes[GetEndpoint(ep->peerFd)->node].ip) == -1)
+        {
+            CloseEndpoint(fd);
+            continue;
+        }
+        ep->isAccepted = 1;
+        if (ep->rxReadable > ep->rxStart || ep->isHungUp)
+            MarkReady(fd);
+    }
+    node->acceptCount = 0;
+
+    // NOTE(Kevin): One call of the decoder per ready peer and iteration;
+    // Frame() drains real sockets further, see HandleMessagesFromPeer()
+    closed_peer *closedPeers = 0;
+    unsigned int closedPeerCount = 0;
+    unsigned int readyCount = node->readyCount;
+    unsigned int stillReady = 0;
+    for (unsigned int i = 0; i < readyCount; ++i)
+    {
+        int fd = node->readyFds[i];
+        sim_endpoint *ep = GetEndpoint(fd);
+        ep->isReady = 0;
+        if (!ep->isOpen)
+            continue;
+        int id = FindPeerId(fd);
+        if (id == -1)
+            continue;
+        TouchPeer(id);
+        int err = HandleMessageFromPeer(fd, id, g_localPort);
+        ep = GetEndpoint(fd);
+        if (err == kConnectionClosed || err == kSyscallFailed)
+        {
+            closed_peer *t = realloc(closedPeers, sizeof(closed_peer) * (closedPeerCount + 1));
+            if (t)
+            {
+                closedPeers = t;
+                closedPeers[closedPeerCount].fd = fd;
+                closedPeers[closedPeerCount].id = id;
+                closedPeers[closedPeerCount].hasIncomingData = 0;
+                ++closedPeerCount;
+            }
+        }
+        else if (ep->isOpen && (ep->rxReadable > ep->rxStart || ep->isHungUp))
+        {
+            ep->isReady = 1;
+            node->readyFds[stillReady++] = fd;
+        }
+    }
+    // NOTE(Kevin): Nothing marks fds of this node ready while it runs
+    node->readyCount = stillReady;
+
+    qsort(closedPeers, closedPeerCount, sizeof(closed_peer), CompareClosedPeers);
+    for (unsigned int i = 0; i < closedPeerCount; ++i)
+    {
+        DropMessageBuffer(closedPeers[i].fd);
+        RequeueJobsOfPeer(closedPeers[i].fd);
+        DropJobsFromPeer(closedPeers[i].fd);
+        CloseEndpoint(closedPeers[i].fd);
+    }
+    RemovePeers(closedPeers, closedPeerCount);
+    free(closedPeers);
+
+    CheckHeartbeats();
+    CheckHedgedJobs();
+    RetryUnansweredQueries();
+    FlushAggregations();
+    ExpireJobInputs();
+    PumpPayloadStreams();
+
+    uint64 jobsRun = node->jobsRun;
+    ExecuteNextJob();
+    OfferFreeSlots(0, g_localPort);
+
+    // NOTE(Kevin): Go on while there is something to do; a job that can
+    // not run right now waits for the next tick
+    if (node->readyCount > 0 || (g_receivedJobCount > 0 && node->jobsRun != jobsRun))
+        WakeNode(n);
+}
+
+internal int
+PickLiveNode(int except)
+{
+    int liveCount = 0;
+    for (int i = 0; i < g_simNodeCount; ++i)
+    {
+        if (i != except && g_simNodes[i].isUp)
+            ++liveCount;
+    }
+    if (liveCount == 0)
+        return -1;
+    int pick = (int)(SimRandom() * liveCount);
+    for (int i = 0; i < g_simNodeCount; ++i)
+    {
+        if (i != except && g_simNodes[i].isUp && pick-- == 0)
+            return i;
+    }
+    return -1;
+}
+
+internal void
+JoinNode(int n)
+{
+    sim_node *node = &g_simNodes[n];
+    SwitchToNode(n);
+    if (node->incarnation > 0)
+    {
+        // NOTE(Kevin): A restarted node remembers nothing. What the old
+        // state had on the heap is lost, like the memory of a crashed process.
+        memcpy(__start_p2pjs_node, g_simPristineState, g_simStateSize);
+        ++g_simRestarts;
+    }
+    g_localIp   = node->ip;
+    g_localPort = SimPort;
+    // NOTE(Kevin): Cookies are part of the run, they have to come from the seed
+    InitCookieGenerator(node->ip, SimPort);
+    uint64 nodeId = SimRandomU64();
+    memcpy(g_cookieGenerator.nodeId, &nodeId, sizeof(g_cookieGenerator.nodeId));
+    for (unsigned int i = 0; i < SizeofArray(g_cookieGenerator.key); ++i)
+        g_cookieGenerator.key[i] = (uint32)SimRandomU64();
+
+    node->isUp = 1;
+    node->isLoopScheduled = 0;
+    node->busyUntil = g_simTime;
+    if (g_simDegree > 0)
+    {
+        // NOTE(Kevin): A random overlay without peer lists; a node has its
+        // own connections and the ones of the nodes that joined later
+        for (int i = 0; i < g_simDegree; ++i)
+        {
+            int peer = PickLiveNode(n);
+            if (peer != -1 && CheckForPeer(g_simNodes[peer].ip, SimPort) == -1)
+                ConnectToPeer(g_simNodes[peer].ip, SimPort, SimPort, 0);
+        }
+    }
+    else
+    {
+        int firstPeer = PickLiveNode(n);
+        if (firstPeer != -1)
+            ConnectToPeer(g_simNodes[firstPeer].ip, SimPort, SimPort, 1);
+    }
+    PushEvent(g_simTime + SimRandom() * g_simTickInterval, kSimTick, n, -1);
+    if (g_simMTBF > 0.0 && !node->isEmitter)
+        PushEvent(g_simTime + SimExponential(g_simMTBF), kSimCrash, n, -1);
+}
+
+internal void
+CrashNode(int n)
+{
+    sim_node *node = &g_simNodes[n];
+    node->isUp = 0;
+    ++node->incarnation;
+    ++g_simCrashes;
+    // NOTE(Kevin): What the node sent after the crash (the result of the
+    // job it was running) never leaves it
+    for (unsigned int i = 0; i < g_simEndpointCount; ++i)
+    {
+        sim_endpoint *ep = &g_simEndpoints[i];
+        if (ep->node != n || !ep->isOpen)
+            continue;
+        sim_endpoint *peer = GetEndpoint(ep->peerFd);
+        if (peer && peer->isOpen)
+            DropChunksSentAfter(peer, g_simTime);
+        CloseEndpoint(SimFirstFd + (int)i);
+    }
+    node->readyCount  = 0;
+    node->acceptCount = 0;
+    node->busyUntil   = g_simTime;
+    if (g_simDowntime > 0.0)
+        PushEvent(g_simTime + g_simDowntime, kSimJoin, n, -1);
+}
+
+// NOTE(Kevin): Resets a random open connection; both ends see it at once
+internal void
+FailRandomLink(void)
+{
+    for (int attempt = 0; attempt < 64 && g_simEndpointCount > 0; ++attempt)
+    {
+        int fd = SimFirstFd + (int)(SimRandom() * g_simEndpointCount);
+        sim_endpoint *ep = GetEndpoint(fd);
+        sim_endpoint *peer = GetEndpoint(ep->peerFd);
+        if (!ep->isOpen || ep->isHungUp || !peer || !peer->isOpen || peer->isHungUp ||
+            !g_simNodes[ep->node].isUp || !g_simNodes[peer->node].isUp)
+            continue;
+        int peerFd = ep->peerFd;
+        ++g_simLinkFailures;
+        DropChunksSentAfter(ep, -1.0);
+        DropChunksSentAfter(peer, -1.0);
+        ep->isHungUp = 1;
+        peer->isHungUp = 1;
+        MarkReady(fd);
+        MarkReady(peerFd);
+        return;
+    }
+}
+
+internal void
+EmitJob(int n)
+{
+    sim_node *node = &g_simNodes[n];
+    if (node->jobsToEmit == 0)
+        return;
+    // NOTE(Kevin): The command waits until the node gets to its main loop
+    if (node->busyUntil > g_simTime)
+    {
+        PushEvent(node->busyUntil, kSimEmit, n, -1);
+        return;
+    }
+    SwitchToNode(n);
+    double duration = g_simConstantDuration ? g_simJobDuration : SimExponential(g_simJobDuration);
+    uint32 flags = (SimRandom() < g_simHedgedFraction) ? kJobFlagLatencySensitive : 0;
+    EmitCSourceJob(g_simJobPath, duration, g_localIp, g_localPort, flags, 0);
+    --node->jobsToEmit;
+    if (node->jobsToEmit > 0)
+    {
+        double gap = (g_simEmitRate > 0.0) ? SimExponential(1.0 / g_simEmitRate) : 0.0;
+        PushEvent(g_simTime + gap, kSimEmit, n, -1);
+    }
+    WakeNode(n);
+}
+
+internal void
+HandleEvent(sim_event *event)
+{
+    sim_node *node = &g_simNodes[event->node];
+    if (event->incarnation != node->incarnation)
+        return;
+    if (!node->isUp && event->kind != kSimJoin)
+        return;
+    switch (event->kind)
+    {
+        case kSimJoin:
+        {
+            JoinNode(event->node);
+        } break;
+        case kSimLoop:
+        {
+            node->isLoopScheduled = 0;
+            RunNodeIteration(event->node);
+        } break;
+        case kSimTick:
+        {
+            WakeNode(event->node);
+            PushEvent(g_simTime + g_simTickInterval, kSimTick, event->node, -1);
+        } break;
+        case kSimDeliver:
+        {
+            sim_endpoint *ep = GetEndpoint(event->fd);
+            ep->isDeliveryScheduled = 0;
+            if (!ep->isOpen)
+                break;
+            bool32 delivered = 0;
+            while (ep->chunkHead < ep->chunkCount && ep->chunks[ep->chunkHead].arrival <= g_simTime)
+            {
+                ep->rxReadable += ep->chunks[ep->chunkHead].size;
+                ++ep->chunkHead;
+                delivered = 1;
+            }
+            if (ep->chunkHead == ep->chunkCount)
+            {
+                free(ep->chunks);
+                ep->chunks = 0;
+                ep->chunkHead = ep->chunkCount = ep->chunkCapacity = 0;
+            }
+            ScheduleDelivery(event->fd);
+            if (delivered)
+                MarkReady(event->fd);
+        } break;
+        case kSimAccept:
+        {
+            if (GetEndpoint(event->fd)->isOpen)
+            {
+                AppendFd(&node->acceptFds, &node->acceptCount, &node->acceptCapacity, event->fd);
+                WakeNode(event->node);
+            }
+        } break;
+        case kSimHangUp:
+        {
+            sim_endpoint *ep = GetEndpoint(event->fd);
+            if (!ep->isOpen || ep->isHungUp)
+                break;
+            // NOTE(Kevin): The FIN comes after the data
+            if (ep->chunkHead < ep->chunkCount)
+            {
+                PushEvent(GetLastArrival(ep), kSimHangUp, event->node, event->fd);
+                break;
+            }
+            ep->isHungUp = 1;
+            MarkReady(event->fd);
+        } break;
+        case kSimEmit:
+        {
+            EmitJob(event->node);
+        } break;
+        case kSimCrash:
+        {
+            CrashNode(event->node);
+        } break;
+        case kSimLinkFailure:
+        {
+            FailRandomLink();
+            PushEvent(g_simTime + SimExponential(g_simLinkMTBF), kSimLinkFailure, event->node, -1);
+        } break;
+    }
+}
+
+internal double
+GetQuantile(metric *m, double quantile)
+{
+    histogram *h = m->histogram;
+    uint64 buckets[HistogramBucketCount];
+    uint64 count = 0;
+    for (int b = 0; b < HistogramBucketCount; ++b)
+    {
+        buckets[b] = atomic_load(&h->buckets[b]);
+        count += buckets[b];
+    }
+    return (double)GetHistogramQuantile(buckets, count, atomic_load(&h->max), quantile) * 1e-9;
+}
+
+internal uint64
+GetObservationCount(metric *m)
+{
+    uint64 count = 0;
+    for (int b = 0; b < HistogramBucketCount; ++b)
+        count += atomic_load(&m->histogram->buckets[b]);
+    return count;
+}
+
+internal void
+PrintLatency(FILE *out, const char *name, metric *m)
+{
+    fprintf(out, "  %-22s p50 %9.3f ms  p90 %9.3f ms  p99 %9.3f ms  max %9.3f ms\n", name,
+            GetQuantile(m, 0.5) * 1e3, GetQuantile(m, 0.9) * 1e3, GetQuantile(m, 0.99) * 1e3,
+            (double)atomic_load(&m->histogram->max) * 1e-6);
+}
+
+internal void
+PrintReport(FILE *out, int emitterCount, double wallTime, uint64 eventCount)
+{
+    int64 emitted  = MetricGet(&g_metricJobsEmitted);
+    uint64 finished = GetObservationCount(&g_metricJobLatency);
+    fprintf(out, "Simulated %d nodes (%d emitting) for %.3f s in %.3f s wall time, %llu events\n",
+            g_simNodeCount, emitterCount, g_simTime, wallTime, (unsigned long long)eventCount);
+    fprintf(out, "Jobs: %lld emitted, %llu finished, %lld requeried, %lld redispatched, %lld hedged\n",
+            (long long)emitted, (unsigned long long)finished,
+            (long long)MetricGet(&g_metricJobsRequeried), (long long)MetricGet(&g_metricJobsRedispatched),
+            (long long)MetricGet(&g_metricJobsHedged));
+
+    uint64 messages = 0;
+    uint64 bytes = 0;
+    for (int t = 0; t < kMessageTypeCount; ++t)
+    {
+        messages += (uint64)atomic_load(&g_metricMessagesSent.values[t]);
+        bytes    += (uint64)atomic_load(&g_metricBytesSent.values[t]);
+    }
+    uint64 heartbeats = (uint64)atomic_load(&g_metricMessagesSent.values[kHeartbeat]);
+    double perJob = finished > 0 ? 1.0 / (double)finished : 0.0;
+    fprintf(out, "Messages: %llu (%.1f per finished job, %.1f without heartbeats), %.1f KB per job\n",
+            (unsigned long long)messages, (double)messages * perJob,
+            (double)(messages - heartbeats) * perJob, (double)bytes * perJob / 1024.0);
+    for (int t = 0; t < kMessageTypeCount; ++t)
+    {
+        int64 count = atomic_load(&g_metricMessagesSent.values[t]);
+        if (count > 0)
+            fprintf(out, "  %-22s %12lld  %10.1f per job\n", g_messageTypeNames[t],
+                    (long long)count, (double)count * perJob);
+    }
+
+    fprintf(out, "Latency:\n");
+    PrintLatency(out, "query -> dispatch", &g_metricQueryToOffer);
+    PrintLatency(out, "dispatch -> result", &g_metricDispatchToResult);
+    PrintLatency(out, "emit -> result", &g_metricJobLatency);
+
+    // NOTE(Kevin): Load imbalance over all nodes, emitters run jobs, too
+    uint64 minJobs = (uint64)-1;
+    uint64 maxJobs = 0;
+    uint64 totalJobs = 0;
+    int idleNodes = 0;
+    for (int i = 0; i < g_simNodeCount; ++i)
+    {
+        uint64 jobs = g_simNodes[i].jobsRun;
+        totalJobs += jobs;
+        if (jobs < minJobs)
+            minJobs = jobs;
+        if (jobs > maxJobs)
+            maxJobs = jobs;
+        if (jobs == 0)
+            ++idleNodes;
+    }
+    double meanJobs = (double)totalJobs / (double)g_simNodeCount;
+    double variance = 0.0;
+    for (int i = 0; i < g_simNodeCount; ++i)
+    {
+        double d = (double)g_simNodes[i].jobsRun - meanJobs;
+        variance += d * d;
+    }
+    variance /= (double)g_simNodeCount;
+    fprintf(out, "Load: %llu jobs run, per node min %llu, mean %.2f, max %llu; max/mean %.2f, CoV %.2f, %d nodes ran none\n",
+            (unsigned long long)totalJobs, (unsigned long long)minJobs, meanJobs, (unsigned long long)maxJobs,
+            meanJobs > 0.0 ? (double)maxJobs / meanJobs : 0.0,
+            meanJobs > 0.0 ? sqrt(variance) / meanJobs : 0.0, idleNodes);
+
+    unsigned int minPeers = (unsigned int)-1;
+    unsigned int maxPeers = 0;
+    uint64 totalPeers = 0;
+    int liveNodes = 0;
+    for (int i = 0; i < g_simNodeCount; ++i)
+    {
+        if (!g_simNodes[i].isUp)
+            continue;
+        SwitchToNode(i);
+        totalPeers += g_peerCount;
+        if (g_peerCount < minPeers)
+            minPeers = g_peerCount;
+        if (g_peerCount > maxPeers)
+            maxPeers = g_peerCount;
+        ++liveNodes;
+    }
+    fprintf(out, "Overlay: %d nodes up, peers per node min %u, mean %.1f, max %u; %llu connects, %llu refused\n",
+            liveNodes, liveNodes > 0 ? minPeers : 0,
+            liveNodes > 0 ? (double)totalPeers / (double)liveNodes : 0.0, maxPeers,
+            (unsigned long long)g_simConnects, (unsigned long long)g_simRefusedConnects);
+    if (g_simMTBF > 0.0 || g_simLinkMTBF > 0.0)
+    {
+        fprintf(out, "Failures: %llu crashes, %llu restarts, %llu connection resets\n",
+                (unsigned long long)g_simCrashes, (unsigned long long)g_simRestarts,
+                (unsigned long long)g_simLinkFailures);
+    }
+}
+
+internal void
+PrintUsage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-n nodes] [-e emitters] [-j jobs] [-r rate] [-D seconds] [-c] [-H fraction]\n"
+            "          [-k degree] [-d ms] [-J ms] [-B mbit] [-z bytes] [-F seconds] [-R seconds] [-L seconds]\n"
+            "          [-w seconds] [-i ms] [-T seconds] [-s seed] [-l level[:subsystem,...]]\n",
+            name);
+}
+
+int
+main(int argc, char **argv)
+{
+    int nodeCount = 64;
+    int emitterCount = 1;
+    unsigned int jobCount = 1000;
+    unsigned int sourceSize = 256;
+    double warmup = -1.0;
+    double timeLimit = 3600.0;
+    uint64 seed = 1;
+    bool32 showLog = 0;
+    int option;
+    while ((option = getopt(argc, argv, "n:e:j:r:D:cH:k:d:J:B:z:F:R:L:w:i:T:s:l:")) != -1)
+    {
+        switch (option)
+        {
+            case 'n': nodeCount = atoi(optarg); break;
+            case 'e': emitterCount = atoi(optarg); break;
+            case 'j': jobCount = (unsigned int)atoi(optarg); break;
+            case 'r': g_simEmitRate = atof(optarg); break;
+            case 'D': g_simJobDuration = atof(optarg); break;
+            case 'c': g_simConstantDuration = 1; break;
+            case 'H': g_simHedgedFraction = atof(optarg); break;
+            case 'k': g_simDegree = atoi(optarg); break;
+            case 'd': g_simLatency = atof(optarg) * 1e-3; break;
+            case 'J': g_simJitter = atof(optarg) * 1e-3; break;
+            case 'B': g_simBandwidth = atof(optarg) * 1e6; break;
+            case 'z': sourceSize = (unsigned int)atoi(optarg); break;
+            case 'F': g_simMTBF = atof(optarg); break;
+            case 'R': g_simDowntime = atof(optarg); break;
+            case 'L': g_simLinkMTBF = atof(optarg); break;
+            case 'w': warmup = atof(optarg); break;
+            case 'i': g_simTickInterval = atof(optarg) * 1e-3; break;
+            case 'T': timeLimit = atof(optarg); break;
+            case 's': seed = strtoull(optarg, 0, 10); break;
+            case 'l':
+            {
+                if (SetLogFilter(optarg) != kSuccess)
+                {
+                    fprintf(stderr, "Expected level[:subsystem,...]\n");
+                    return 1;
+                }
+                showLog = 1;
+            } break;
+            default:
+            {
+                PrintUsage(argv[0]);
+                return 1;
+            } break;
+        }
+    }
+    if (nodeCount < 2 || emitterCount < 1 || emitterCount > nodeCount ||
+        g_simBandwidth <= 0.0 || g_simTickInterval <= 0.0 || optind != argc)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    if (!showLog)
+        g_logLevel = kLogError;
+
+    // NOTE(Kevin): All simulated jobs share one source file
+    int jobFd = mkstemp(g_simJobPath);
+    if (jobFd == -1)
+    {
+        fprintf(stderr, "Can not create %s.\n", g_simJobPath);
+        return 1;
+    }
+    FILE *jobFile = fdopen(jobFd, "w");
+    fprintf(jobFile, "// Simulated job\n");
+    for (unsigned int i = 17; i < sourceSize; ++i)
+        fputc((i % 64 == 63) ? '\n' : ' ', jobFile);
+    fclose(jobFile);
+
+    g_simRandomState = seed * 0x9e3779b97f4a7c15ull + 0x2096;
+    if (g_simRandomState == 0)
+        g_simRandomState = 0x2096;
+    srand((unsigned int)seed);
+
+    g_simStateSize = (size_t)(__stop_p2pjs_node - __start_p2pjs_node);
+    g_simPristineState = malloc(g_simStateSize);
+    g_simNodes = calloc((size_t)nodeCount, sizeof(sim_node));
+    if (!g_simPristineState || !g_simNodes)
+    {
+        fprintf(stderr, "Not enough memory.\n");
+        unlink(g_simJobPath);
+        return 1;
+    }
+    memcpy(g_simPristineState, __start_p2pjs_node, g_simStateSize);
+    g_simNodeCount = nodeCount;
+    for (int i = 0; i < nodeCount; ++i)
+    {
+        sim_node *node = &g_simNodes[i];
+        node->state = malloc(g_simStateSize);
+        if (!node->state)
+        {
+            fprintf(stderr, "Not enough memory for %d nodes.\n", nodeCount);
+            unlink(g_simJobPath);
+            return 1;
+        }
+        memcpy(node->state, g_simPristineState, g_simStateSize);
+        struct in_addr address = { htonl(SimBaseAddress + (uint32)i) };
+        inet_ntop(AF_INET, &address, node->ip, sizeof(node->ip));
+        node->isEmitter = i < emitterCount;
+        node->jobsToEmit = node->isEmitter ?
+            jobCount / (unsigned int)emitterCount + (i < (int)(jobCount % (unsigned int)emitterCount)) : 0;
+    }
+
+    // NOTE(Kevin): Nodes join one after another, through a random node
+    // that is already up; jobs start once the overlay had time to settle
+    double joinInterval = 0.005;
+    for (int i = 0; i < nodeCount; ++i)
+        PushEvent((double)i * joinInterval, kSimJoin, i, -1);
+    if (warmup < 0.0)
+        warmup = (double)nodeCount * joinInterval + 2.0;
+    for (int i = 0; i < emitterCount; ++i)
+        PushEvent(warmup + SimRandom() * 0.001, kSimEmit, i, -1);
+    if (g_simLinkMTBF > 0.0)
+        PushEvent(SimExponential(g_simLinkMTBF), kSimLinkFailure, 0, -1);
+
+    // NOTE(Kevin): The nodes print every job; the report goes to the real stdout
+    fflush(stdout);
+    int reportFd = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    FILE *report = (reportFd != -1) ? fdopen(reportFd, "w") : 0;
+    if (!report || devNull == -1)
+    {
+        fprintf(stderr, "Can not redirect stdout.\n");
+        unlink(g_simJobPath);
+        return 1;
+    }
+    dup2(devNull, STDOUT_FILENO);
+    int savedStderr = -1;
+    if (!showLog)
+    {
+        fflush(stderr);
+        savedStderr = dup(STDERR_FILENO);
+        dup2(devNull, STDERR_FILENO);
+    }
+    close(devNull);
+
+    if (!OpenLog())
+    {
+        fprintf(report, "Failed to open log file.\n");
+        unlink(g_simJobPath);
+        return 1;
+    }
+
+    double wallStart = GetWallTime();
+    uint64 eventCount = 0;
+    bool32 emittedAll = 0;
+    while (g_simEventCount > 0)
+    {
+        sim_event event = PopEvent();
+        if (event.time > timeLimit)
+            break;
+        g_simTime = event.time;
+        HandleEvent(&event);
+        ++eventCount;
+        if (event.kind == kSimEmit && !emittedAll)
+        {
+            emittedAll = 1;
+            for (int i = 0; i < emitterCount; ++i)
+                emittedAll = emittedAll && g_simNodes[i].jobsToEmit == 0;
+        }
+        if (emittedAll && MetricGet(&g_metricJobsOutstanding) == 0)
+            break;
+    }
+    double wallTime = GetWallTime() - wallStart;
+
+    CloseLog();
+    fflush(stdout);
+    if (savedStderr != -1)
+    {
+        dup2(savedStderr, STDERR_FILENO);
+        close(savedStderr);
+    }
+    unlink(g_simJobPath);
+
+    PrintReport(report, emitterCount, wallTime, eventCount);
+    if (!emittedAll || MetricGet(&g_metricJobsOutstanding) != 0)
+    {
+        fprintf(report, "Stopped at %.3f s with %lld jobs outstanding%s.\n", g_simTime,
+                (long long)MetricGet(&g_metricJobsOutstanding),
+                emittedAll ? "" : " and jobs left to emit");
+    }
+    fclose(report);
+
+    for (unsigned int i = 0; i < g_simEndpointCount; ++i)
+    {
+        free(g_simEndpoints[i].rx);
+        free(g_simEndpoints[i].chunks);
+    }
+    free(g_simEndpoints);
+    for (int i = 0; i < nodeCount; ++i)
+    {
+        free(g_simNodes[i].state);
+        free(g_simNodes[i].readyFds);
+        free(g_simNodes[i].acceptFds);
+    }
+    free(g_simNodes);
+    free(g_simPristineState);
+    free(g_simEvents);
+    return 0;
+}
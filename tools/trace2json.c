@@ -0,0 +1,328 @@
+// NOTE(Kevin): Converts the trace files of one or more nodes (p2pjs -t)
+// into a single Chrome trace, which chrome://tracing and ui.perfetto.dev
+// can open. Every node becomes a process with a network, a jobs and a vm
+// track. Jobs are connected across nodes with flow arrows:
+// dispatch (emitter) -> run (worker) -> result (emitter).
+//
+// Usage: trace2json node.trace [node.trace ...] > trace.json
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../p2pjs.h"
+
+enum
+{
+    kTrackNetwork = 1,
+    kTrackJobs    = 2,
+    kTrackVM      = 3,
+};
+
+typedef struct
+{
+    trace_header header;
+    trace_event *events;
+    uint64       eventCount;
+} trace_file;
+
+global_variable const char *g_messageNames[] =
+{
+    "Hello", "GetPeers", "PeerList", "QueryJobResources", "OfferJobResources",
+    "Job", "JobResult", "Heartbeat", "CancelJob", "AggregateJob",
+    "AggregatedResult", "AwaitInputs", "JobInput", "ForwardResult", "PayloadChunk",
+    "PayloadAck", "DeclineOffer",
+};
+
+global_variable bool32 g_firstJsonEvent = 1;
+
+internal const char *
+GetMessageName(int type)
+{
+    if (type >= 0 && type < (int)SizeofArray(g_messageNames))
+        return g_messageNames[type];
+    return "Unknown";
+}
+
+internal int
+LoadTrace(const char *path, trace_file *trace)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return kCouldNotOpenFile;
+    if (fread(&trace->header, sizeof(trace->header), 1, file) != 1 ||
+        memcmp(trace->header.magic, TraceMagic, sizeof(trace->header.magic)) != 0 ||
+        trace->header.version != TraceVersion ||
+        trace->header.eventSize != sizeof(trace_event))
+    {
+        fclose(file);
+        return kInvalidValue;
+    }
+    trace->header.ipaddr[PeerIPLen - 1] = '\0';
+    trace->header.port[PeerPortLen - 1] = '\0';
+    uint64 count = trace->header.count;
+    if (count > trace->header.capacity)
+        count = trace->header.capacity;
+    trace->events = malloc(sizeof(trace_event) * (count ? count : 1));
+    if (!trace->events)
+    {
+        fclose(file);
+        return kNoMemory;
+    }
+    // NOTE(Kevin): A node that crashed might not have written everything
+    trace->eventCount = fread(trace->events, sizeof(trace_event), count, file);
+    fclose(file);
+    return kSuccess;
+}
+
+internal uint64
+GetCookieId(const uint8 cookie[CookieLen])
+{
+    // NOTE(Kevin): The first cookie bytes are random, that is good enough as an id
+    uint64 id;
+    memcpy(&id, cookie, sizeof(id));
+    return id;
+}
+
+internal void
+BeginJsonEvent(const char *name, const char *category, char phase, double ts, int pid, int tid)
+{
+    printf("%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+           g_firstJsonEvent ? "" : ",", name, category, phase, ts, pid, tid);
+    g_firstJsonEvent = 0;
+}
+
+internal void
+WriteMetadata(int pid, int tid, const char *kind, const char *name)
+{
+    printf("%s\n{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+           g_firstJsonEvent ? "" : ",", kind, pid, tid, name);
+    g_firstJsonEvent = 0;
+}
+
+// NOTE(Kevin): Open-addressing set of the jobs that have an open async slice
+typedef struct
+{
+    uint64 *keys;
+    uint64  capacity;
+} cookie_set;
+
+internal bool32
+InsertCookie(cookie_set *set, uint64 key)
+{
+    for (uint64 i = key & (set->capacity - 1); ; i = (i + 1) & (set->capacity - 1))
+    {
+        if (set->keys[i] == key)
+            return 0;
+        if (set->keys[i] == 0)
+        {
+            set->keys[i] = key;
+            return 1;
+        }
+    }
+}
+
+internal bool32
+RemoveCookie(cookie_set *set, uint64 key)
+{
+    uint64 mask = set->capacity - 1;
+    uint64 i = key & mask;
+    while (set->keys[i] != key)
+    {
+        if (set->keys[i] == 0)
+            return 0;
+        i = (i + 1) & mask;
+    }
+    // NOTE(Kevin): Backward shift deletion keeps the probe chains intact
+    set->keys[i] = 0;
+    for (uint64 j = (i + 1) & mask; set->keys[j] != 0; j = (j + 1) & mask)
+    {
+        uint64 home = set->keys[j] & mask;
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            set->keys[i] = set->keys[j];
+            set->keys[j] = 0;
+            i = j;
+        }
+    }
+    return 1;
+}
+
+internal void
+ConvertTrace(trace_file *trace, int pid, uint64 baseTime)
+{
+    char processName[PeerIPLen + PeerPortLen + 1];
+    snprintf(processName, sizeof(processName), "%s:%s", trace->header.ipaddr, trace->header.port);
+    WriteMetadata(pid, kTrackNetwork, "process_name", processName);
+    WriteMetadata(pid, kTrackNetwork, "thread_name", "network");
+    WriteMetadata(pid, kTrackJobs, "thread_name", "jobs");
+    WriteMetadata(pid, kTrackVM, "thread_name", "vm");
+
+    cookie_set openJobs;
+    openJobs.capacity = 16;
+    while (openJobs.capacity < 2 * trace->eventCount)
+        openJobs.capacity *= 2;
+    openJobs.keys = calloc(openJobs.capacity, sizeof(uint64));
+    if (!openJobs.keys)
+    {
+        fprintf(stderr, "Not enough memory.\n");
+        exit(1);
+    }
+
+    // NOTE(Kevin): A worker runs one job at a time, so remembering the
+    // last start is enough
+    double runStart = -1.0;
+    double vmStart  = -1.0;
+    double offset   = (double)(trace->header.startTime - baseTime) * 1e-3;
+
+    for (uint64 e = 0; e < trace->eventCount; ++e)
+    {
+        trace_event *event = &trace->events[e];
+        double ts = offset + (double)event->time * 1e-3;
+        char jobName[16];
+        snprintf(jobName, sizeof(jobName), "job %02x%02x%02x",
+                 event->cookie[0], event->cookie[1], event->cookie[2]);
+        uint64 id = GetCookieId(event->cookie);
+        switch (event->type)
+        {
+            case kTraceMessageSent:
+            case kTraceMessageReceived:
+            {
+                char name[32];
+                snprintf(name, sizeof(name), "%s %s",
+                         (event->type == kTraceMessageSent) ? "send" : "recv",
+                         GetMessageName(event->messageType));
+                BeginJsonEvent(name, "net", 'i', ts, pid, kTrackNetwork);
+                printf(",\"s\":\"t\",\"args\":{\"bytes\":%u,\"fd\":%d", event->size, event->peer);
+                if (id != 0)
+                    printf(",\"job\":\"%s\"", jobName + 4);
+                printf("}}");
+            } break;
+
+            case kTraceJobQueried:
+            {
+                if (InsertCookie(&openJobs, id))
+                {
+                    BeginJsonEvent(jobName, "job", 'b', ts, pid, kTrackJobs);
+                    printf(",\"id\":\"0x%llx\"}", id);
+                }
+                else
+                {
+                    BeginJsonEvent("re-queried", "job", 'n', ts, pid, kTrackJobs);
+                    printf(",\"id\":\"0x%llx\"}", id);
+                }
+            } break;
+
+            case kTraceJobDispatched:
+            {
+                BeginJsonEvent("dispatch", "job", 'X', ts, pid, kTrackJobs);
+                printf(",\"dur\":1,\"args\":{\"job\":\"%s\",\"fd\":%d}}", jobName + 4, event->peer);
+                BeginJsonEvent("dispatch", "flow", 's', ts, pid, kTrackJobs);
+                printf(",\"id\":\"0x%llx\"}", 2 * id);
+            } break;
+
+            case kTraceJobResultDelivered:
+            {
+                BeginJsonEvent("result", "job", 'X', ts, pid, kTrackJobs);
+                printf(",\"dur\":1,\"args\":{\"job\":\"%s\",\"state\":%d,\"fd\":%d}}",
+                       jobName + 4, event->state, event->peer);
+                BeginJsonEvent("result", "flow", 'f', ts, pid, kTrackJobs);
+                printf(",\"bp\":\"e\",\"id\":\"0x%llx\"}", 2 * id + 1);
+                if (RemoveCookie(&openJobs, id))
+                {
+                    BeginJsonEvent(jobName, "job", 'e', ts, pid, kTrackJobs);
+                    printf(",\"id\":\"0x%llx\"}", id);
+                }
+            } break;
+
+            case kTraceJobOffered:
+            {
+                BeginJsonEvent("offer", "job", 'i', ts, pid, kTrackJobs);
+                printf(",\"s\":\"t\",\"args\":{\"job\":\"%s\",\"fd\":%d}}", jobName + 4, event->peer);
+            } break;
+
+            case kTraceJobStarted:
+            {
+                runStart = ts;
+            } break;
+
+            case kTraceJobFinished:
+            {
+                if (runStart < 0.0)
+                    break;
+                BeginJsonEvent("run", "job", 'X', runStart, pid, kTrackJobs);
+                printf(",\"dur\":%.3f,\"args\":{\"job\":\"%s\",\"state\":%d}}",
+                       ts - runStart, jobName + 4, event->state);
+                BeginJsonEvent("dispatch", "flow", 'f', runStart, pid, kTrackJobs);
+                printf(",\"bp\":\"e\",\"id\":\"0x%llx\"}", 2 * id);
+                BeginJsonEvent("result", "flow", 's', ts, pid, kTrackJobs);
+                printf(",\"id\":\"0x%llx\"}", 2 * id + 1);
+                runStart = -1.0;
+            } break;
+
+            case kTraceVMCreate:
+            {
+                vmStart = ts;
+            } break;
+
+            case kTraceVMDestroy:
+            {
+                if (vmStart < 0.0)
+                    break;
+                BeginJsonEvent("vm", "vm", 'X', vmStart, pid, kTrackVM);
+                printf(",\"dur\":%.3f,\"args\":{\"job\":\"%s\"}}", ts - vmStart, jobName + 4);
+                vmStart = -1.0;
+            } break;
+
+            default:
+                break;
+        }
+    }
+    free(openJobs.keys);
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s node.trace [node.trace ...] > trace.json\n", argv[0]);
+        return 1;
+    }
+    int traceCount = argc - 1;
+    trace_file *traces = calloc((size_t)traceCount, sizeof(trace_file));
+    if (!traces)
+    {
+        fprintf(stderr, "Not enough memory.\n");
+        return 1;
+    }
+    uint64 baseTime = ~0ull;
+    for (int i = 0; i < traceCount; ++i)
+    {
+        int err = LoadTrace(argv[i + 1], &traces[i]);
+        if (err != kSuccess)
+        {
+            fprintf(stderr, "Can not read trace file %s (%s).\n", argv[i + 1],
+                    (err == kInvalidValue) ? "not a p2pjs trace of this version" : "io error");
+            return 1;
+        }
+        if (traces[i].header.dropped > 0)
+        {
+            fprintf(stderr, "%s: %llu events were dropped, the trace file was full.\n",
+                    argv[i + 1], traces[i].header.dropped);
+        }
+        if (traces[i].header.startTime < baseTime)
+            baseTime = traces[i].header.startTime;
+    }
+
+    printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (int i = 0; i < traceCount; ++i)
+    {
+        ConvertTrace(&traces[i], i + 1, baseTime);
+        free(traces[i].events);
+    }
+    printf("\n]}\n");
+    free(traces);
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "p2pjs.h"
+
+// NOTE(Kevin): Binary event tracing. Every node writes fixed size
+// trace_events into a memory mapped file; tools/trace2json turns the
+// files of all nodes into one Chrome/Perfetto trace. Tracing is off
+// unless started with -t, then a trace point costs a clock_gettime and
+// a 56 byte store. All trace points are on the main thread.
+
+#ifndef P2PJS_TraceCapacity
+  // NOTE(Kevin): Events per trace file. The file is sparse until used.
+  #define P2PJS_TraceCapacity (1024 * 1024)
+#endif
+
+#define TraceFilenamePrefix "p2pjs_"
+#define TraceFilenameSuffix ".trace"
+
+global_variable trace_header *g_trace;
+global_variable trace_event  *g_traceEvents;
+global_variable int           g_traceFd = -1;
+global_variable size_t        g_traceMappedSize;
+global_variable uint64        g_traceStartTime;
+
+internal uint64
+GetTraceTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000000ull + (uint64)ts.tv_nsec;
+}
+
+internal int
+OpenTrace(const char *ip, const char *port)
+{
+    char fileName[sizeof(TraceFilenamePrefix) + PeerIPLen + PeerPortLen + sizeof(TraceFilenameSuffix)];
+    snprintf(fileName, sizeof(fileName), TraceFilenamePrefix "%s_%s" TraceFilenameSuffix, ip, port);
+    int fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return kCouldNotOpenFile;
+    size_t size = sizeof(trace_header) + sizeof(trace_event) * (size_t)P2PJS_TraceCapacity;
+    if (ftruncate(fd, (off_t)size) == -1)
+    {
+        close(fd);
+        return kSyscallFailed;
+    }
+    void *mapping = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        close(fd);
+        return kSyscallFailed;
+    }
+    trace_header *header = mapping;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, TraceMagic, sizeof(header->magic));
+    header->version   = TraceVersion;
+    header->eventSize = sizeof(trace_event);
+    header->capacity  = P2PJS_TraceCapacity;
+    snprintf(header->ipaddr, PeerIPLen, "%s", ip);
+    snprintf(header->port, PeerPortLen, "%s", port);
+
+    struct timespec wallClock;
+    clock_gettime(CLOCK_REALTIME, &wallClock);
+    g_traceStartTime  = GetTraceTime();
+    header->startTime = (uint64)wallClock.tv_sec * 1000000000ull + (uint64)wallClock.tv_nsec;
+
+    g_trace = header;
+    g_traceEvents = (trace_event *)(header + 1);
+    g_traceFd = fd;
+    g_traceMappedSize = size;
+    return kSuccess;
+}
+
+internal void
+CloseTrace(void)
+{
+    if (!g_trace)
+        return;
+    size_t usedSize = sizeof(trace_header) + sizeof(trace_event) * (size_t)g_trace->count;
+    munmap(g_trace, g_traceMappedSize);
+    // NOTE(Kevin): Cut off the unused part of the file
+    if (ftruncate(g_traceFd, (off_t)usedSize) == -1)
+        perror("Failed to truncate trace file");
+    close(g_traceFd);
+    g_trace = 0;
+    g_traceEvents = 0;
+    g_traceFd = -1;
+}
+
+internal void
+TraceEvent(int type, int messageType, int peerFd, uint32 size, int state, const uint8 *cookie)
+{
+    if (!g_trace)
+        return;
+    if (g_trace->count == g_trace->capacity)
+    {
+        // NOTE(Kevin): Keep the beginning of the run
+        ++g_trace->dropped;
+        return;
+    }
+    trace_event *event = &g_traceEvents[g_trace->count];
+    event->time        = GetTraceTime() - g_traceStartTime;
+    event->type        = (uint16)type;
+    event->messageType = (uint16)messageType;
+    event->size        = size;
+    event->peer        = peerFd;
+    event->state       = state;
+    if (cookie)
+        memcpy(event->cookie, cookie, CookieLen);
+    else
+        memset(event->cookie, 0, CookieLen);
+    ++g_trace->count;
+}
+
+#define TraceMessageSent(Fd, Type, Size, Cookie) \
+    TraceEvent(kTraceMessageSent, Type, Fd, (uint32)(Size), 0, Cookie)
+#define TraceMessageReceived(Fd, Type, Size, Cookie) \
+    TraceEvent(kTraceMessageReceived, Type, Fd, (uint32)(Size), 0, Cookie)
+#define TraceJob(Type, Cookie, PeerFd, State) \
+    TraceEvent(Type, 0, PeerFd, 0, State, Cookie)
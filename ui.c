@@ -42,7 +42,7 @@ GetNextCommand(void)
 internal void
 FreeCommand(user_command *cmd)
 {
-    if (cmd->type == kCmdJobCSource)
+    if (cmd->type == kCmdJobCSource || cmd->type == kCmdHedgedJobCSource)
     {
         free(cmd->cSource.path);
     }
@@ -73,10 +73,15 @@ UIThread(void* _threadParam)
     {
         // BAD_DESIGN(Kevin): This is super simplistic
         char command[80];
-        scanf("%s", command);
+        if (scanf("%79s", command) != 1)
+        {
+            // NOTE(Kevin): stdin is closed (e.g. /dev/null), keep running without UI
+            break;
+        }
 
-        if (strcmp(command, "job") == 0)
+        if (strcmp(command, "job") == 0 || strcmp(command, "hjob") == 0)
         {
+            bool32 isHedged = strcmp(command, "hjob") == 0;
             char path[240];
             scanf("%s", path);
             double arg;
@@ -85,7 +90,7 @@ UIThread(void* _threadParam)
             user_command *cmd = malloc(sizeof(user_command));
             if (cmd)
             {
-                cmd->type = kCmdJobCSource;
+                cmd->type = isHedged ? kCmdHedgedJobCSource : kCmdJobCSource;
                 cmd->cSource.path = malloc(strlen(path) + 1);
                 if (cmd->cSource.path)
                 {
@@ -101,6 +106,18 @@ UIThread(void* _threadParam)
             } 
             pthread_mutex_unlock(&g_commandLock);
         }
+        else if (strcmp(command, "stats") == 0)
+        {
+            pthread_mutex_lock(&g_commandLock);
+            user_command *cmd = malloc(sizeof(user_command));
+            if (cmd)
+            {
+                cmd->type = kCmdPrintJobStats;
+                cmd->next = g_userCommandList;
+                g_userCommandList = cmd;
+            } 
+            pthread_mutex_unlock(&g_commandLock);
+        }
         else if (strcmp(command, "quit") == 0)
         {
             pthread_mutex_lock(&g_commandLock);
@@ -1,44 +1,212 @@
 #include <wren.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <time.h>
 
 #include "p2pjs.h"
 
 global_variable uint8 g_currentCookie[CookieLen];
 global_variable double g_jobResult;
 
+// NOTE(Kevin): Heap of the job VM that is currently running. Only one
+// job VM exists at a time, so plain globals are enough.
+global_variable size_t g_vmHeapSize;
+global_variable size_t g_vmHeapPeak;
+
+// NOTE(Kevin): Every block of a job VM starts with its size, wren does
+// not tell us the old size when it frees or grows a block.
+typedef union
+{
+    size_t      size;
+    max_align_t alignment;
+} vm_block_header;
+
+// NOTE(Kevin): The list of numbers the last job returned, if it did
+global_variable double *g_jobValues;
+global_variable uint32  g_jobValueCount;
+global_variable uint32  g_jobValueCapacity;
+
 internal double
 GetLastResult(void)
 {
     return g_jobResult;
 }
 
+internal const double *
+GetLastValues(uint32 *countOut)
+{
+    *countOut = g_jobValueCount;
+    return g_jobValues;
+}
+
+// NOTE(Kevin): The bytes the last job returned in a ByteBuffer, if it did
+global_variable uint8  *g_jobPayload;
+global_variable uint32  g_jobPayloadSize;
+
+internal const uint8 *
+GetLastPayload(uint32 *sizeOut)
+{
+    *sizeOut = g_jobPayloadSize;
+    return g_jobPayload;
+}
+
+// NOTE(Kevin): A ByteBuffer of the buffer module. Views point into a
+// payload somebody else owns and can't be changed.
+typedef struct
+{
+    uint8  *bytes;
+    uint32  count;
+    bool32  isOwned;
+} byte_buffer;
+
 typedef struct
 {
     uint8 cookie[CookieLen];
     int isValid;
+    // NOTE(Kevin): Index among the emitted jobs, see FindEmittedJobIndex()
+    int index;
     double arg;
+    // NOTE(Kevin): Its argument are results of other jobs
+    bool32 isDependent;
 } job_data;
 
+// NOTE(Kevin): The jobs of a JobSet were emitted back to back
+typedef struct
+{
+    int isValid;
+    int firstIndex;
+    int count;
+    // NOTE(Kevin): Only recounted when some job finished since countedAt
+    int finishedCount;
+    uint64 countedAt;
+} job_set_data;
+
+#ifndef P2PJS_WaitSlice
+  // NOTE(Kevin): Longest time a waiting script sleeps in poll() before
+  // Frame() gets to run the timers (heartbeats, query retries, hedging)
+  #define P2PJS_WaitSlice 0.05
+#endif
+
 
 internal int 
 EmitCSourceJob(const char *sourcePath,
                double arg,
                const char *myIp, const char *myPort,
+               uint32 flags,
                uint8 cookieOut[CookieLen]);
-internal int IsJobFinished(uint8 cookie[CookieLen]);
-internal double GetJobResult(uint8 cookie[CookieLen]);
+internal int
+EmitCSourceJobs(const char *sourcePath,
+                const double *args, int count,
+                const char *myIp, const char *myPort,
+                uint32 flags,
+                int *firstIndexOut);
+internal int
+EmitMapReduceJobs(const char *sourcePath, const map_reduce *mapReduce,
+                  const char *myIp, const char *myPort,
+                  int *firstIndexOut, int *chunkCountOut);
+internal int EmitDependentJob(const char *sourcePath, const int *upstream, int upstreamCount,
+                             bool32 asList, uint8 cookieOut[CookieLen]);
+internal const job_input *GetJobInputs(uint8 cookie[CookieLen], uint32 *countOut, bool32 *asListOut);
+internal const uint8 *GetReceivedJobPayload(uint8 cookie[CookieLen], uint32 *sizeOut);
+internal const uint8 *GetJobPayload(int index, uint32 *sizeOut);
+internal int AttachJobPayload(int index, uint8 *payload, uint32 payloadSize);
+internal int GetRangeLength(double start, double end, double step);
+internal const char* CookieToTemporaryString(uint8 cookie[CookieLen]);
+internal int FindReducer(const char *name);
+internal int FindEmittedJobIndex(uint8 cookie[CookieLen]);
+internal int IsJobFinished(int index);
+internal bool32 IsJobResultMerged(int index);
+internal double GetJobResult(int index);
+internal const double *GetJobValues(int index, uint32 *countOut);
+internal double GetJobArgument(int index);
+internal int CountFinishedJobs(int firstIndex, int count);
+internal uint64 GetFinishedJobCount(void);
 internal int GetNumberOfOutstandingJobs(void);
+internal void WaitForPeerActivity(int serverFd, double timeout);
+internal bool32 IsResultStoreOpen(void);
+internal uint32 GetStoredResultCount(void);
+internal const result_record *LookupStoredResult(const char *sourcePath, double arg);
+internal const double *GetStoredValues(const result_record *record);
+internal const uint8 *GetStoredPayload(const result_record *record);
 
 internal void Frame(void);
 
+// NOTE(Kevin): Runs the network until some job result arrives. Returns 0
+// if the deadline (a GetTime() value, negative for none) passed first.
+// The script sleeps in poll() meanwhile instead of spinning on Frame().
+internal bool32
+WaitForJobResults(double deadline)
+{
+    uint64 finishedJobCount = GetFinishedJobCount();
+    while (GetFinishedJobCount() == finishedJobCount)
+    {
+        double timeout = P2PJS_WaitSlice;
+        if (deadline >= 0.0)
+        {
+            double left = deadline - GetTime();
+            if (left <= 0.0)
+                return 0;
+            if (left < timeout)
+                timeout = left;
+        }
+        WaitForPeerActivity(g_serverFd, timeout);
+        Frame();
+    }
+    return 1;
+}
+
+internal int *GetJobIndices(WrenVM *vm, int listSlot, int *countOut);
+
 internal void
 AllocateJob(WrenVM *vm)
 {
     job_data *job = wrenSetSlotNewForeign(vm, 0, 0, sizeof(job_data));
     const char *path = wrenGetSlotString(vm, 1);
+    job->isDependent = 0;
+    // NOTE(Kevin): Job.after_(path, upstream, asList), upstream is a list
+    // of jobs checked by the script
+    if (wrenGetSlotType(vm, 2) == WREN_TYPE_LIST)
+    {
+        bool32 asList = wrenGetSlotBool(vm, 3);
+        job->isValid     = 0;
+        job->index       = -1;
+        job->arg         = 0.0;
+        job->isDependent = 1;
+        int count;
+        int *upstream = GetJobIndices(vm, 2, &count);
+        if (upstream)
+        {
+            job->isValid = EmitDependentJob(path, upstream, count, asList, job->cookie) == kSuccess;
+            job->index = job->isValid ? FindEmittedJobIndex(job->cookie) : -1;
+            free(upstream);
+        }
+        Frame();
+        return;
+    }
     double     arg   = wrenGetSlotDouble(vm, 2);
-    job->isValid = EmitCSourceJob(path, arg, g_localIp, g_localPort, job->cookie) == kSuccess;
+    // NOTE(Kevin): Job.launch(path, arg, latencySensitive), or
+    // Job.launchData_(path, arg, data) with a ByteBuffer checked by the script
+    uint32 flags = 0;
+    byte_buffer *data = 0;
+    if (wrenGetSlotCount(vm) > 3 && wrenGetSlotType(vm, 3) == WREN_TYPE_FOREIGN)
+    {
+        data = wrenGetSlotForeign(vm, 3);
+        flags |= kJobFlagHasPayload;
+    }
+    else if (wrenGetSlotCount(vm) > 3 && wrenGetSlotBool(vm, 3))
+        flags |= kJobFlagLatencySensitive;
+    job->isValid = EmitCSourceJob(path, arg, g_localIp, g_localPort, flags, job->cookie) == kSuccess;
+    job->index = job->isValid ? FindEmittedJobIndex(job->cookie) : -1;
     job->arg = arg;
+    if (job->isValid && data && data->count > 0)
+    {
+        // NOTE(Kevin): The script may change its buffer afterwards
+        uint8 *payload = malloc(data->count);
+        if (payload)
+            memcpy(payload, data->bytes, data->count);
+        if (!payload || AttachJobPayload(job->index, payload, data->count) != kSuccess)
+            LogWarning(kLogJobs, "Job %s goes out without its data\n", CookieToTemporaryString(job->cookie));
+    }
 
     Frame();
 }
@@ -57,7 +225,7 @@ JobIsFinished(WrenVM *vm)
     job_data *job = wrenGetSlotForeign(vm, 0);
     if (job->isValid)
     {
-        wrenSetSlotBool(vm, 0, IsJobFinished(job->cookie)); 
+        wrenSetSlotBool(vm, 0, IsJobFinished(job->index));
     }
     else
     {
@@ -71,7 +239,12 @@ internal void
 JobGetArgument(WrenVM *vm)
 {
     job_data *job = wrenGetSlotForeign(vm, 0);
-    if (job->isValid)
+    if (job->isValid && job->isDependent)
+    {
+        // NOTE(Kevin): Only the worker knows it
+        wrenSetSlotNull(vm, 0);
+    }
+    else if (job->isValid)
     {
         wrenSetSlotDouble(vm, 0, job->arg); 
     }
@@ -83,13 +256,40 @@ JobGetArgument(WrenVM *vm)
     Frame();
 }
 
+// NOTE(Kevin): A number, or a list if the job returned one; uses the
+// slot after the given one
+internal void
+SetSlotJobResult(WrenVM *vm, int slot, int index)
+{
+    // NOTE(Kevin): Another chunk of the map-reduce carries this result
+    if (IsJobResultMerged(index))
+    {
+        wrenSetSlotNull(vm, slot);
+        return;
+    }
+    uint32 valueCount;
+    const double *values = GetJobValues(index, &valueCount);
+    if (!values)
+    {
+        wrenSetSlotDouble(vm, slot, GetJobResult(index));
+        return;
+    }
+    wrenEnsureSlots(vm, slot + 2);
+    wrenSetSlotNewList(vm, slot);
+    for (uint32 i = 0; i < valueCount; ++i)
+    {
+        wrenSetSlotDouble(vm, slot + 1, values[i]);
+        wrenInsertInList(vm, slot, -1, slot + 1);
+    }
+}
+
 internal void
 JobGetResult(WrenVM *vm)
 {
     job_data *job = wrenGetSlotForeign(vm, 0);
     if (job->isValid)
     {
-        wrenSetSlotDouble(vm, 0, GetJobResult(job->cookie)); 
+        SetSlotJobResult(vm, 0, job->index);
     }
     else
     {
@@ -99,6 +299,329 @@ JobGetResult(WrenVM *vm)
     Frame();
 }
 
+// NOTE(Kevin): A read-only ByteBuffer of bytes that outlive it; needs the
+// buffer module to be loaded
+internal void
+SetSlotByteBufferView(WrenVM *vm, int slot, const uint8 *bytes, uint32 count)
+{
+    wrenGetVariable(vm, "buffer", "ByteBuffer", slot);
+    byte_buffer *buffer = wrenSetSlotNewForeign(vm, slot, slot, sizeof(byte_buffer));
+    buffer->bytes   = (uint8*)bytes;
+    buffer->count   = count;
+    buffer->isOwned = 0;
+}
+
+// NOTE(Kevin): The ByteBuffer the job returned, null if it returned
+// something else
+internal void
+JobGetData(WrenVM *vm)
+{
+    job_data *job = wrenGetSlotForeign(vm, 0);
+    if (!job->isValid)
+    {
+        wrenSetSlotString(vm, 0, "Job is not valid.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    uint32 size;
+    const uint8 *payload = GetJobPayload(job->index, &size);
+    if (payload)
+        SetSlotByteBufferView(vm, 0, payload, size);
+    else
+        wrenSetSlotNull(vm, 0);
+    Frame();
+}
+
+internal void
+JobAwait(WrenVM *vm)
+{
+    job_data *job = wrenGetSlotForeign(vm, 0);
+    if (!job->isValid)
+    {
+        wrenSetSlotString(vm, 0, "Job is not valid.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    double timeout  = wrenGetSlotDouble(vm, 1);
+    double deadline = (timeout >= 0.0) ? GetTime() + timeout : -1.0;
+    Frame();
+    while (!IsJobFinished(job->index) && WaitForJobResults(deadline))
+        ;
+    wrenSetSlotBool(vm, 0, IsJobFinished(job->index));
+}
+
+// NOTE(Kevin): The Wren side made sure that the list only holds jobs.
+// Returns 0 and aborts the fiber if one of them is not valid.
+internal int *
+GetJobIndices(WrenVM *vm, int listSlot, int *countOut)
+{
+    int count = wrenGetListCount(vm, listSlot);
+    int *indices = malloc(sizeof(int) * (count > 0 ? count : 1));
+    if (!indices)
+    {
+        wrenSetSlotString(vm, 0, "Not enough memory.");
+        wrenAbortFiber(vm, 0);
+        return 0;
+    }
+    wrenEnsureSlots(vm, listSlot + 2);
+    for (int i = 0; i < count; ++i)
+    {
+        wrenGetListElement(vm, listSlot, i, listSlot + 1);
+        job_data *job = wrenGetSlotForeign(vm, listSlot + 1);
+        if (!job->isValid)
+        {
+            free(indices);
+            wrenSetSlotString(vm, 0, "Job is not valid.");
+            wrenAbortFiber(vm, 0);
+            return 0;
+        }
+        indices[i] = job->index;
+    }
+    *countOut = count;
+    return indices;
+}
+
+internal void
+JobWaitAll(WrenVM *vm)
+{
+    int count;
+    int *indices = GetJobIndices(vm, 1, &count);
+    if (!indices)
+        return;
+    Frame();
+    // NOTE(Kevin): Jobs stay finished, every job is looked at until it is
+    int next = 0;
+    for (;;)
+    {
+        while (next < count && IsJobFinished(indices[next]))
+            ++next;
+        if (next == count)
+            break;
+        WaitForJobResults(-1.0);
+    }
+    free(indices);
+    wrenSetSlotNull(vm, 0);
+}
+
+internal void
+JobWaitAny(WrenVM *vm)
+{
+    int count;
+    int *indices = GetJobIndices(vm, 1, &count);
+    if (!indices)
+        return;
+    Frame();
+    int finished = -1;
+    for (;;)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            if (IsJobFinished(indices[i]))
+            {
+                finished = i;
+                break;
+            }
+        }
+        if (finished != -1 || count == 0)
+            break;
+        WaitForJobResults(-1.0);
+    }
+    free(indices);
+    wrenSetSlotDouble(vm, 0, (double)finished);
+}
+
+// NOTE(Kevin): JobSet.launchMany_(path, args),
+// JobSet.launchRange_(path, start, end, step), the end is exclusive, or
+// JobSet.launchReduce_(path, start, end, step, reducer, low, high, bins),
+// one job per chunk of the range
+internal void
+AllocateJobSet(WrenVM *vm)
+{
+    job_set_data *set = wrenSetSlotNewForeign(vm, 0, 0, sizeof(job_set_data));
+    memset(set, 0, sizeof(*set));
+    const char *path = wrenGetSlotString(vm, 1);
+    double *args = 0;
+    int count = 0;
+    if (wrenGetSlotCount(vm) > 5)
+    {
+        map_reduce mapReduce;
+        mapReduce.start   = wrenGetSlotDouble(vm, 2);
+        mapReduce.end     = wrenGetSlotDouble(vm, 3);
+        mapReduce.step    = wrenGetSlotDouble(vm, 4);
+        mapReduce.reducer = FindReducer(wrenGetSlotString(vm, 5));
+        mapReduce.low     = wrenGetSlotDouble(vm, 6);
+        mapReduce.high    = wrenGetSlotDouble(vm, 7);
+        mapReduce.bins    = (int)wrenGetSlotDouble(vm, 8);
+        set->countedAt = GetFinishedJobCount();
+        set->isValid   = EmitMapReduceJobs(path, &mapReduce, g_localIp, g_localPort,
+                                           &set->firstIndex, &set->count) == kSuccess;
+        Frame();
+        return;
+    }
+    else if (wrenGetSlotCount(vm) > 3)
+    {
+        double start = wrenGetSlotDouble(vm, 2);
+        double end   = wrenGetSlotDouble(vm, 3);
+        double step  = wrenGetSlotDouble(vm, 4);
+        count = GetRangeLength(start, end, step);
+        if (count < 0)
+            return;
+        args = malloc(sizeof(double) * (count > 0 ? count : 1));
+        if (!args)
+            return;
+        for (int i = 0; i < count; ++i)
+            args[i] = start + i * step;
+    }
+    else
+    {
+        count = wrenGetListCount(vm, 2);
+        args = malloc(sizeof(double) * (count > 0 ? count : 1));
+        if (!args)
+            return;
+        wrenEnsureSlots(vm, 4);
+        for (int i = 0; i < count; ++i)
+        {
+            wrenGetListElement(vm, 2, i, 3);
+            if (wrenGetSlotType(vm, 3) != WREN_TYPE_NUM)
+            {
+                free(args);
+                return;
+            }
+            args[i] = wrenGetSlotDouble(vm, 3);
+        }
+    }
+    set->count     = count;
+    set->countedAt = GetFinishedJobCount();
+    set->isValid   = (count == 0) ||
+                     EmitCSourceJobs(path, args, count, g_localIp, g_localPort, 0,
+                                     &set->firstIndex) == kSuccess;
+    free(args);
+
+    Frame();
+}
+
+internal job_set_data *
+GetValidJobSet(WrenVM *vm)
+{
+    job_set_data *set = wrenGetSlotForeign(vm, 0);
+    if (!set->isValid)
+    {
+        wrenSetSlotString(vm, 0, "JobSet is not valid.");
+        wrenAbortFiber(vm, 0);
+        return 0;
+    }
+    if (set->countedAt != GetFinishedJobCount())
+    {
+        set->countedAt     = GetFinishedJobCount();
+        set->finishedCount = CountFinishedJobs(set->firstIndex, set->count);
+    }
+    return set;
+}
+
+// NOTE(Kevin): Returns -1 and aborts the fiber if the index is not valid
+internal int
+GetJobSetIndex(WrenVM *vm, job_set_data *set, int slot)
+{
+    double index = wrenGetSlotDouble(vm, slot);
+    if (index < 0.0 || index >= (double)set->count || index != (double)(int)index)
+    {
+        wrenSetSlotString(vm, 0, "Index out of bounds.");
+        wrenAbortFiber(vm, 0);
+        return -1;
+    }
+    return set->firstIndex + (int)index;
+}
+
+internal void
+JobSetGetCount(WrenVM *vm)
+{
+    job_set_data *set = GetValidJobSet(vm);
+    if (set)
+        wrenSetSlotDouble(vm, 0, (double)set->count);
+}
+
+internal void
+JobSetGetFinishedCount(WrenVM *vm)
+{
+    Frame();
+    job_set_data *set = GetValidJobSet(vm);
+    if (set)
+        wrenSetSlotDouble(vm, 0, (double)set->finishedCount);
+}
+
+internal void
+JobSetIsJobFinished(WrenVM *vm)
+{
+    Frame();
+    job_set_data *set = GetValidJobSet(vm);
+    int index = set ? GetJobSetIndex(vm, set, 1) : -1;
+    if (index != -1)
+        wrenSetSlotBool(vm, 0, IsJobFinished(index));
+}
+
+internal void
+JobSetGetResult(WrenVM *vm)
+{
+    Frame();
+    job_set_data *set = GetValidJobSet(vm);
+    int index = set ? GetJobSetIndex(vm, set, 1) : -1;
+    if (index != -1)
+        SetSlotJobResult(vm, 0, index);
+}
+
+internal void
+JobSetGetArgument(WrenVM *vm)
+{
+    job_set_data *set = GetValidJobSet(vm);
+    int index = set ? GetJobSetIndex(vm, set, 1) : -1;
+    if (index != -1)
+        wrenSetSlotDouble(vm, 0, GetJobArgument(index));
+}
+
+// NOTE(Kevin): null for jobs that are not finished yet
+internal void
+JobSetGetResults(WrenVM *vm)
+{
+    Frame();
+    job_set_data *set = GetValidJobSet(vm);
+    if (!set)
+        return;
+    int firstIndex = set->firstIndex;
+    int count      = set->count;
+    wrenEnsureSlots(vm, 3);
+    wrenSetSlotNewList(vm, 0);
+    for (int i = firstIndex; i < firstIndex + count; ++i)
+    {
+        if (IsJobFinished(i))
+            SetSlotJobResult(vm, 1, i);
+        else
+            wrenSetSlotNull(vm, 1);
+        wrenInsertInList(vm, 0, -1, 1);
+    }
+}
+
+internal void
+JobSetWait(WrenVM *vm)
+{
+    Frame();
+    job_set_data *set = GetValidJobSet(vm);
+    if (!set)
+        return;
+    int firstIndex = set->firstIndex;
+    int count      = set->count;
+    // NOTE(Kevin): Jobs stay finished, every job is looked at until it is
+    int next = firstIndex;
+    for (;;)
+    {
+        while (next < firstIndex + count && IsJobFinished(next))
+            ++next;
+        if (next == firstIndex + count)
+            break;
+        WaitForJobResults(-1.0);
+    }
+    wrenSetSlotNull(vm, 0);
+}
+
 internal void
 InterfaceGetNumberOfOutstandingJobs(WrenVM *vm)
 {
@@ -113,6 +636,207 @@ InterfaceIdle(WrenVM *vm)
     Frame();
 }
 
+internal void
+ResultsIsOpen(WrenVM *vm)
+{
+    wrenSetSlotBool(vm, 0, IsResultStoreOpen());
+}
+
+internal void
+ResultsGetCount(WrenVM *vm)
+{
+    wrenSetSlotDouble(vm, 0, (double)GetStoredResultCount());
+}
+
+// NOTE(Kevin): Results.lookup_(path, arg), checked by the script. null
+// for failed jobs.
+internal void
+ResultsLookup(WrenVM *vm)
+{
+    const result_record *record = LookupStoredResult(wrenGetSlotString(vm, 1), wrenGetSlotDouble(vm, 2));
+    if (!record || record->state != kSuccess)
+    {
+        wrenSetSlotNull(vm, 0);
+        return;
+    }
+    const double *values = GetStoredValues(record);
+    if (!values)
+    {
+        wrenSetSlotDouble(vm, 0, record->result);
+        return;
+    }
+    wrenSetSlotNewList(vm, 0);
+    for (uint32 i = 0; i < record->valueCount; ++i)
+    {
+        wrenSetSlotDouble(vm, 1, values[i]);
+        wrenInsertInList(vm, 0, -1, 1);
+    }
+}
+
+// NOTE(Kevin): Results.data_(path, arg), a view into the store's mapping
+internal void
+ResultsGetData(WrenVM *vm)
+{
+    const result_record *record = LookupStoredResult(wrenGetSlotString(vm, 1), wrenGetSlotDouble(vm, 2));
+    const uint8 *payload = (record && record->state == kSuccess) ? GetStoredPayload(record) : 0;
+    if (payload)
+        SetSlotByteBufferView(vm, 0, payload, record->payloadSize);
+    else
+        wrenSetSlotNull(vm, 0);
+}
+
+internal void
+AllocateByteBuffer(WrenVM *vm)
+{
+    byte_buffer *buffer = wrenSetSlotNewForeign(vm, 0, 0, sizeof(byte_buffer));
+    buffer->bytes   = 0;
+    buffer->count   = 0;
+    buffer->isOwned = 1;
+    if (wrenGetSlotType(vm, 1) != WREN_TYPE_NUM)
+    {
+        wrenSetSlotString(vm, 0, "Size must be a number.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    double count = wrenGetSlotDouble(vm, 1);
+    if (!(count >= 0.0 && count <= P2PJS_MaxPayloadSize) || count != (double)(uint32)count)
+    {
+        wrenSetSlotString(vm, 0, "Size must be an integer between 0 and the largest payload.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    if (count > 0.0)
+    {
+        buffer->bytes = calloc((size_t)count, 1);
+        if (!buffer->bytes)
+        {
+            wrenSetSlotString(vm, 0, "Out of memory.");
+            wrenAbortFiber(vm, 0);
+            return;
+        }
+        buffer->count = (uint32)count;
+    }
+}
+
+internal void
+FinalizeByteBuffer(void *data)
+{
+    byte_buffer *buffer = data;
+    if (buffer->isOwned)
+        free(buffer->bytes);
+}
+
+// NOTE(Kevin): Checks that slot 1 holds an index of a size-byte element
+// of the buffer in slot 0 and returns its byte offset, -1 after aborting
+internal int64
+GetByteBufferOffset(WrenVM *vm, byte_buffer *buffer, uint32 size)
+{
+    double index = (wrenGetSlotType(vm, 1) == WREN_TYPE_NUM) ? wrenGetSlotDouble(vm, 1) : -1.0;
+    if (!(index >= 0.0) || index != (double)(int64)index ||
+        (uint64)index * size + size > buffer->count)
+    {
+        wrenSetSlotString(vm, 0, "Index out of bounds.");
+        wrenAbortFiber(vm, 0);
+        return -1;
+    }
+    return (int64)index * size;
+}
+
+internal bool32
+CheckByteBufferWritable(WrenVM *vm, byte_buffer *buffer)
+{
+    if (!buffer->isOwned)
+    {
+        wrenSetSlotString(vm, 0, "ByteBuffer is read-only.");
+        wrenAbortFiber(vm, 0);
+        return 0;
+    }
+    if (wrenGetSlotType(vm, 2) != WREN_TYPE_NUM)
+    {
+        wrenSetSlotString(vm, 0, "Value must be a number.");
+        wrenAbortFiber(vm, 0);
+        return 0;
+    }
+    return 1;
+}
+
+internal void
+ByteBufferGetCount(WrenVM *vm)
+{
+    byte_buffer *buffer = wrenGetSlotForeign(vm, 0);
+    wrenSetSlotDouble(vm, 0, (double)buffer->count);
+}
+
+internal void
+ByteBufferIsReadOnly(WrenVM *vm)
+{
+    byte_buffer *buffer = wrenGetSlotForeign(vm, 0);
+    wrenSetSlotBool(vm, 0, !buffer->isOwned);
+}
+
+internal void
+ByteBufferGetByte(WrenVM *vm)
+{
+    byte_buffer *buffer = wrenGetSlotForeign(vm, 0);
+    int64 offset = GetByteBufferOffset(vm, buffer, 1);
+    if (offset >= 0)
+        wrenSetSlotDouble(vm, 0, (double)buffer->bytes[offset]);
+}
+
+internal void
+ByteBufferSetByte(WrenVM *vm)
+{
+    byte_buffer *buffer = wrenGetSlotForeign(vm, 0);
+    int64 offset = GetByteBufferOffset(vm, buffer, 1);
+    if (offset >= 0 && CheckByteBufferWritable(vm, buffer))
+    {
+        double value = wrenGetSlotDouble(vm, 2);
+        buffer->bytes[offset] = (uint8)(int64)value;
+        wrenSetSlotDouble(vm, 0, (double)buffer->bytes[offset]);
+    }
+}
+
+// NOTE(Kevin): Index counts 8-byte doubles in host byte order, the peers
+// are assumed to agree on it like everywhere else on the wire
+internal void
+ByteBufferGetFloat64(WrenVM *vm)
+{
+    byte_buffer *buffer = wrenGetSlotForeign(vm, 0);
+    int64 offset = GetByteBufferOffset(vm, buffer, sizeof(double));
+    if (offset >= 0)
+    {
+        double value;
+        memcpy(&value, buffer->bytes + offset, sizeof(double));
+        wrenSetSlotDouble(vm, 0, value);
+    }
+}
+
+internal void
+ByteBufferSetFloat64(WrenVM *vm)
+{
+    byte_buffer *buffer = wrenGetSlotForeign(vm, 0);
+    int64 offset = GetByteBufferOffset(vm, buffer, sizeof(double));
+    if (offset >= 0 && CheckByteBufferWritable(vm, buffer))
+    {
+        double value = wrenGetSlotDouble(vm, 2);
+        memcpy(buffer->bytes + offset, &value, sizeof(double));
+        wrenSetSlotDouble(vm, 0, value);
+    }
+}
+
+// NOTE(Kevin): The payload of the running job, null for the main script
+// and for jobs without one
+internal void
+PayloadGetInput(WrenVM *vm)
+{
+    uint32 size;
+    const uint8 *payload = GetReceivedJobPayload(g_currentCookie, &size);
+    if (payload)
+        SetSlotByteBufferView(vm, 0, payload, size);
+    else
+        wrenSetSlotNull(vm, 0);
+}
+
 internal char* 
 LoadModule(WrenVM *vm, const char *name)
 {
@@ -126,7 +850,7 @@ LoadModule(WrenVM *vm, const char *name)
     path = malloc(pathLen);
     if (!path)
     {
-        WriteToLog("Could not allocate memory for module path.\n");
+        LogError(kLogVM, "Could not allocate memory for module path.\n");
         return 0;
     }
     strcpy(path, "modules/");
@@ -137,7 +861,7 @@ LoadModule(WrenVM *vm, const char *name)
     if (!source)
     {
         free(path);
-        WriteToLog("Could not allocate memory for module source.\n");
+        LogError(kLogVM, "Could not allocate memory for module source.\n");
         return 0;
     }
     unsigned int sourceLength = 0;
@@ -170,13 +894,11 @@ LoadModule(WrenVM *vm, const char *name)
     return source; 
 }
 
-internal const char* CookieToTemporaryString(uint8 cookie[CookieLen]);
-
 internal void
 CodeOutput(WrenVM *vm, const char *text)
 {
     Unused(vm);
-    WriteToLog("[%s] %s", CookieToTemporaryString(g_currentCookie), text);
+    LogInfo(kLogVM, "[%s] %s", CookieToTemporaryString(g_currentCookie), text);
 }
 
 internal void
@@ -189,7 +911,7 @@ CodeError(WrenVM* vm,
     Unused(vm);
     if (type == WREN_ERROR_COMPILE)
     {
-        WriteToLog("[%s] In module %s, line %d: %s\n",
+        LogWarning(kLogVM, "[%s] In module %s, line %d: %s\n",
                 CookieToTemporaryString(g_currentCookie),
                 module,
                 line,
@@ -197,13 +919,13 @@ CodeError(WrenVM* vm,
     }
     else if (type == WREN_ERROR_RUNTIME)
     {
-        WriteToLog("[%s] Runtime error: %s\n",
+        LogWarning(kLogVM, "[%s] Runtime error: %s\n",
                 CookieToTemporaryString(g_currentCookie),
                 message);
     }
     else
     {
-        WriteToLog("   %s:%d %s\n", module, line, message);
+        LogWarning(kLogVM, "   %s:%d %s\n", module, line, message);
     }
 }
 
@@ -231,6 +953,53 @@ BindForeignMethod(WrenVM *vm,
             {
                 return JobGetArgument;
             }
+            else if (!isStatic && strcmp(signature, "data") == 0)
+            {
+                return JobGetData;
+            }
+            else if (!isStatic && strcmp(signature, "await_(_)") == 0)
+            {
+                return JobAwait;
+            }
+            else if (isStatic && strcmp(signature, "waitAll_(_)") == 0)
+            {
+                return JobWaitAll;
+            }
+            else if (isStatic && strcmp(signature, "waitAny_(_)") == 0)
+            {
+                return JobWaitAny;
+            }
+        }
+        else if (strcmp(class, "JobSet") == 0)
+        {
+            if (!isStatic && strcmp(signature, "count") == 0)
+            {
+                return JobSetGetCount;
+            }
+            else if (!isStatic && strcmp(signature, "finishedCount") == 0)
+            {
+                return JobSetGetFinishedCount;
+            }
+            else if (!isStatic && strcmp(signature, "isFinished(_)") == 0)
+            {
+                return JobSetIsJobFinished;
+            }
+            else if (!isStatic && strcmp(signature, "result(_)") == 0)
+            {
+                return JobSetGetResult;
+            }
+            else if (!isStatic && strcmp(signature, "arg(_)") == 0)
+            {
+                return JobSetGetArgument;
+            }
+            else if (!isStatic && strcmp(signature, "results") == 0)
+            {
+                return JobSetGetResults;
+            }
+            else if (!isStatic && strcmp(signature, "wait()") == 0)
+            {
+                return JobSetWait;
+            }
         }
         else if (strcmp(class, "Interface") == 0)
         {
@@ -243,16 +1012,85 @@ BindForeignMethod(WrenVM *vm,
                 return InterfaceIdle;
             }
         }
+        else if (strcmp(class, "Results") == 0)
+        {
+            if (isStatic && strcmp(signature, "isOpen") == 0)
+            {
+                return ResultsIsOpen;
+            }
+            else if (isStatic && strcmp(signature, "count") == 0)
+            {
+                return ResultsGetCount;
+            }
+            else if (isStatic && strcmp(signature, "lookup_(_,_)") == 0)
+            {
+                return ResultsLookup;
+            }
+            else if (isStatic && strcmp(signature, "data_(_,_)") == 0)
+            {
+                return ResultsGetData;
+            }
+        }
+    }
+    else if (strcmp(module, "buffer") == 0)
+    {
+        if (strcmp(class, "ByteBuffer") == 0)
+        {
+            if (!isStatic && strcmp(signature, "count") == 0)
+            {
+                return ByteBufferGetCount;
+            }
+            else if (!isStatic && strcmp(signature, "isReadOnly") == 0)
+            {
+                return ByteBufferIsReadOnly;
+            }
+            else if (!isStatic && strcmp(signature, "[_]") == 0)
+            {
+                return ByteBufferGetByte;
+            }
+            else if (!isStatic && strcmp(signature, "[_]=(_)") == 0)
+            {
+                return ByteBufferSetByte;
+            }
+            else if (!isStatic && strcmp(signature, "float64(_)") == 0)
+            {
+                return ByteBufferGetFloat64;
+            }
+            else if (!isStatic && strcmp(signature, "setFloat64(_,_)") == 0)
+            {
+                return ByteBufferSetFloat64;
+            }
+        }
+        else if (strcmp(class, "Payload") == 0)
+        {
+            if (isStatic && strcmp(signature, "input") == 0)
+            {
+                return PayloadGetInput;
+            }
+        }
     }
     return 0;
 }
 
+// NOTE(Kevin): Job VMs only get the buffer module's foreign classes
 internal WrenForeignClassMethods
-BindForeignClass(WrenVM* vm, const char* module, const char* className)
+BindJobForeignClass(WrenVM* vm, const char* module, const char* className)
 {
     Unused(vm);
     WrenForeignClassMethods methods;
     memset(&methods, 0, sizeof(methods));
+    if (strcmp(module, "buffer") == 0 && strcmp(className, "ByteBuffer") == 0)
+    {
+        methods.allocate = AllocateByteBuffer;
+        methods.finalize = FinalizeByteBuffer;
+    }
+    return methods;
+}
+
+internal WrenForeignClassMethods
+BindForeignClass(WrenVM* vm, const char* module, const char* className)
+{
+    WrenForeignClassMethods methods = BindJobForeignClass(vm, module, className);
     if (strcmp(module, "p2pjs") == 0)
     {
         if (strcmp(className, "Job") == 0)
@@ -260,46 +1098,224 @@ BindForeignClass(WrenVM* vm, const char* module, const char* className)
             methods.allocate = AllocateJob;
             methods.finalize = FinalizeJob;
         }
+        else if (strcmp(className, "JobSet") == 0)
+        {
+            methods.allocate = AllocateJobSet;
+            methods.finalize = FinalizeJob;
+        }
     }
     return methods;
 }
 
+internal void*
+ReallocateJobMemory(void *memory, size_t newSize)
+{
+    vm_block_header *block = memory ? (vm_block_header*)memory - 1 : 0;
+    if (newSize == 0)
+    {
+        if (block)
+        {
+            g_vmHeapSize -= block->size;
+            free(block);
+        }
+        return 0;
+    }
+    size_t oldSize = block ? block->size : 0;
+    vm_block_header *t = realloc(block, sizeof(vm_block_header) + newSize);
+    if (!t)
+        return 0;
+    t->size = newSize;
+    g_vmHeapSize += newSize - oldSize;
+    if (g_vmHeapSize > g_vmHeapPeak)
+        g_vmHeapPeak = g_vmHeapSize;
+    return t + 1;
+}
+
+internal double
+GetThreadCPUTime(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0.0;
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// NOTE(Kevin): The configuration of job VMs, bench/vm_bench uses it too
+internal void
+InitJobVMConfiguration(WrenConfiguration *config)
+{
+    wrenInitConfiguration(config);
+    config->reallocateFn = ReallocateJobMemory;
+    config->loadModuleFn = LoadModule;
+    config->writeFn      = CodeOutput;
+    config->errorFn      = CodeError;
+    config->bindForeignMethodFn = BindForeignMethod;
+    config->bindForeignClassFn  = BindJobForeignClass;
+}
+
+// NOTE(Kevin): Jobs return a number, or a list of numbers or a ByteBuffer
+// whose length then doubles as the result
+internal bool32
+StoreReturnValue(WrenVM *vm, uint8 cookie[CookieLen])
+{
+    WrenType type = wrenGetSlotType(vm, 0);
+    if (type == WREN_TYPE_NUM)
+    {
+        g_jobResult = wrenGetSlotDouble(vm, 0);
+        return 1;
+    }
+    if (type == WREN_TYPE_FOREIGN)
+    {
+        // NOTE(Kevin): ByteBuffer is the only foreign class a job VM can
+        // allocate. Its bytes are taken over, views are copied.
+        byte_buffer *buffer = wrenGetSlotForeign(vm, 0);
+        uint32 count = buffer->count;
+        if (buffer->isOwned)
+        {
+            g_jobPayload = buffer->bytes;
+            buffer->bytes = 0;
+            buffer->count = 0;
+        }
+        else if (count > 0)
+        {
+            g_jobPayload = malloc(count);
+            if (!g_jobPayload)
+                return 0;
+            memcpy(g_jobPayload, buffer->bytes, count);
+        }
+        g_jobPayloadSize = g_jobPayload ? count : 0;
+        g_jobResult      = (double)g_jobPayloadSize;
+        return 1;
+    }
+    if (type != WREN_TYPE_LIST)
+    {
+        LogWarning(kLogVM, "[%s] Job did not return a number, a list of numbers or a ByteBuffer\n",
+                   CookieToTemporaryString(cookie));
+        return 0;
+    }
+    int count = wrenGetListCount(vm, 0);
+    if (count > P2PJS_MaxResultValues)
+    {
+        LogWarning(kLogVM, "[%s] Job returned more than %d values\n",
+                   CookieToTemporaryString(cookie), P2PJS_MaxResultValues);
+        return 0;
+    }
+    if ((uint32)count > g_jobValueCapacity)
+    {
+        uint32 newCapacity = (g_jobValueCapacity == 0) ? 8 : 2 * g_jobValueCapacity;
+        while (newCapacity < (uint32)count)
+            newCapacity *= 2;
+        double *t = realloc(g_jobValues, sizeof(double) * newCapacity);
+        if (!t)
+            return 0;
+        g_jobValues = t;
+        g_jobValueCapacity = newCapacity;
+    }
+    wrenEnsureSlots(vm, 2);
+    for (int i = 0; i < count; ++i)
+    {
+        wrenGetListElement(vm, 0, i, 1);
+        if (wrenGetSlotType(vm, 1) != WREN_TYPE_NUM)
+        {
+            LogWarning(kLogVM, "[%s] Job returned a list that is not all numbers\n",
+                       CookieToTemporaryString(cookie));
+            return 0;
+        }
+        g_jobValues[i] = wrenGetSlotDouble(vm, 1);
+    }
+    g_jobValueCount = (uint32)count;
+    g_jobResult     = (double)count;
+    return 1;
+}
+
+// NOTE(Kevin): A number, or a list if the upstream job returned one; uses
+// the slot after the given one
+internal void
+SetSlotJobInput(WrenVM *vm, int slot, const job_input *input)
+{
+    if (input->valueCount == 0)
+    {
+        wrenSetSlotDouble(vm, slot, input->result);
+        return;
+    }
+    wrenSetSlotNewList(vm, slot);
+    for (uint32 i = 0; i < input->valueCount; ++i)
+    {
+        wrenSetSlotDouble(vm, slot + 1, input->values[i]);
+        wrenInsertInList(vm, slot, -1, slot + 1);
+    }
+}
+
+// NOTE(Kevin): The argument of a job of a job graph; uses the two slots
+// after the given one
+internal void
+SetSlotJobInputs(WrenVM *vm, int slot, const job_input *inputs, uint32 count, bool32 asList)
+{
+    wrenEnsureSlots(vm, slot + 3);
+    if (!asList)
+    {
+        SetSlotJobInput(vm, slot, &inputs[0]);
+        return;
+    }
+    wrenSetSlotNewList(vm, slot);
+    for (uint32 i = 0; i < count; ++i)
+    {
+        SetSlotJobInput(vm, slot + 1, &inputs[i]);
+        wrenInsertInList(vm, slot, -1, slot + 1);
+    }
+}
+
 internal int 
-RunCode(uint8 cookie[CookieLen], double arg, const char *source)
+RunCodeInVM(uint8 cookie[CookieLen], double arg, uint32 kind, const char *source)
 {
+    // NOTE(Kevin): Nothing of the last job may go out with this one's result
+    g_jobResult     = 0.0;
+    g_jobValueCount = 0;
+    free(g_jobPayload);
+    g_jobPayload     = 0;
+    g_jobPayloadSize = 0;
+
     WrenConfiguration config;
-    wrenInitConfiguration(&config);
-    config.loadModuleFn = LoadModule;
-    config.writeFn      = CodeOutput;
-    config.errorFn      = CodeError;
-    config.bindForeignMethodFn = BindForeignMethod;
+    InitJobVMConfiguration(&config);
 
     WrenVM *vm = wrenNewVM(&config);
+    TraceJob(kTraceVMCreate, cookie, -1, 0);
+    MetricAdd(&g_metricVMsCreated, 1);
     memcpy(g_currentCookie, cookie, CookieLen);
     WrenInterpretResult result = wrenInterpret(vm,
                                                CookieToTemporaryString(cookie), 
                                                source);
-    if (result == WREN_RESULT_COMPILE_ERROR)
-        return kCompileError;
-    else if (result == WREN_RESULT_RUNTIME_ERROR)
-        return kRuntimeError;
+    if (result != WREN_RESULT_SUCCESS)
+    {
+        wrenFreeVM(vm);
+        TraceJob(kTraceVMDestroy, cookie, -1, 0);
+        return (result == WREN_RESULT_COMPILE_ERROR) ? kCompileError : kRuntimeError;
+    }
 
     WrenHandle *runSignature = wrenMakeCallHandle(vm, "run(_)");
 
+    const char *entryClass = (kind == kJobKindReduce) ? "Reduce_" : "Job";
     wrenEnsureSlots(vm, 1);
-    wrenGetVariable(vm, CookieToTemporaryString(cookie), "Job", 0);
+    wrenGetVariable(vm, CookieToTemporaryString(cookie), entryClass, 0);
     WrenHandle *jobClass = wrenGetSlotHandle(vm, 0);
 
     wrenEnsureSlots(vm, 2);
     wrenSetSlotHandle(vm, 0, jobClass);
     wrenSetSlotDouble(vm, 1, arg);
+    uint32 inputCount;
+    bool32 asList;
+    const job_input *inputs = GetJobInputs(cookie, &inputCount, &asList);
+    if (inputs)
+        SetSlotJobInputs(vm, 1, inputs, inputCount, asList);
     result = wrenCall(vm, runSignature);
-    g_jobResult = wrenGetSlotDouble(vm, 0);
+    if (result == WREN_RESULT_SUCCESS && !StoreReturnValue(vm, cookie))
+        result = WREN_RESULT_RUNTIME_ERROR;
 
     wrenReleaseHandle(vm, jobClass);
     wrenReleaseHandle(vm, runSignature);
 
     wrenFreeVM(vm);
+    TraceJob(kTraceVMDestroy, cookie, -1, 0);
 
     if (result == WREN_RESULT_SUCCESS)
         return kSuccess;
@@ -307,11 +1323,27 @@ RunCode(uint8 cookie[CookieLen], double arg, const char *source)
         return kRuntimeError;
 }
 
+// NOTE(Kevin): Runs the job and measures what it used; the caller fills
+// in the queue time.
+internal int
+RunCode(uint8 cookie[CookieLen], double arg, uint32 kind, const char *source, job_usage *usage)
+{
+    g_vmHeapSize = 0;
+    g_vmHeapPeak = 0;
+    double startTime = GetTime();
+    double startCPUTime = GetThreadCPUTime();
+    int result = RunCodeInVM(cookie, arg, kind, source);
+    usage->cpuTime  = GetThreadCPUTime() - startCPUTime;
+    usage->wallTime = GetTime() - startTime;
+    usage->peakHeap = g_vmHeapPeak;
+    return result;
+}
+
 internal void
 ScriptOutput(WrenVM *vm, const char *text)
 {
     Unused(vm);
-    WriteToUser("%s", text);
+    LogUser(kLogVM, "%s", text);
 }
 
 internal void
@@ -324,19 +1356,19 @@ ScriptError(WrenVM* vm,
     Unused(vm);
     if (type == WREN_ERROR_COMPILE)
     {
-        WriteToUser("[main] In module %s, line %d: %s\n",
+        LogUser(kLogVM, "[main] In module %s, line %d: %s\n",
                 module,
                 line,
                 message);
     }
     else if (type == WREN_ERROR_RUNTIME)
     {
-        WriteToUser("[main] Runtime error: %s\n",
+        LogUser(kLogVM, "[main] Runtime error: %s\n",
                 message);
     }
     else
     {
-        WriteToUser("   %s:%d %s\n", module, line, message);
+        LogUser(kLogVM, "   %s:%d %s\n", module, line, message);
     }
 }
 